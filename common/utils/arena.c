@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_BLOCK (64 * 1024)
+// a reset keeps at most this many block sizes; one huge message must not
+// pin its memory for the life of the arena
+#define ARENA_MAX_RETAINED_BLOCKS 16
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static size_t align_up(size_t n) {
+    return (n + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static ArenaBlock *block_new(size_t cap) {
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->cap = cap;
+    b->used = 0;
+    return b;
+}
+
+void arena_init(Arena *a, size_t block_size) {
+    if (!a) return;
+    a->head = NULL;
+    a->block_size = block_size ? align_up(block_size) : ARENA_DEFAULT_BLOCK;
+    a->last = NULL;
+    a->last_size = 0;
+}
+
+void arena_destroy(Arena *a) {
+    if (!a) return;
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *n = b->next;
+        free(b);
+        b = n;
+    }
+    a->head = NULL;
+    a->last = NULL;
+    a->last_size = 0;
+}
+
+void arena_reset(Arena *a) {
+    if (!a || !a->head) return;
+    a->last = NULL;
+    a->last_size = 0;
+
+    size_t limit = a->block_size * ARENA_MAX_RETAINED_BLOCKS;
+    if (!a->head->next && a->head->cap <= limit) {
+        a->head->used = 0;
+        return;
+    }
+
+    // the previous message did not fit in one block: replace the chain
+    // with a single block big enough for it so the next one will, unless
+    // that is past the limit
+    size_t total = 0;
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *n = b->next;
+        total += b->cap;
+        free(b);
+        b = n;
+    }
+    a->head = block_new(total <= limit ? align_up(total) : a->block_size);
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    if (!a) return NULL;
+    size = align_up(size ? size : 1);
+
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < size) {
+        size_t cap = a->block_size;
+        if (cap < size) cap = size;
+        ArenaBlock *nb = block_new(cap);
+        if (!nb) return NULL;
+        nb->next = b;
+        a->head = nb;
+        b = nb;
+    }
+
+    void *p = b->data + b->used;
+    b->used += size;
+    a->last = p;
+    a->last_size = size;
+    return p;
+}
+
+void *arena_grow(Arena *a, void *p, size_t old_size, size_t new_size) {
+    if (!a) return NULL;
+    if (!p) return arena_alloc(a, new_size);
+    if (new_size <= old_size) return p;
+
+    ArenaBlock *b = a->head;
+    size_t aligned = align_up(new_size);
+    if (p == a->last && b && (char *)p + aligned <= b->data + b->cap) {
+        b->used = (size_t)((char *)p - b->data) + aligned;
+        a->last_size = aligned;
+        return p;
+    }
+
+    void *n = arena_alloc(a, new_size);
+    if (!n) return NULL;
+    memcpy(n, p, old_size);
+    return n;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *out = arena_alloc(a, n + 1);
+    if (!out) return NULL;
+    if (n) memcpy(out, s, n);
+    out[n] = '\0';
+    return out;
+}
+
+size_t arena_capacity(const Arena *a) {
+    size_t total = 0;
+    for (const ArenaBlock *b = a ? a->head : NULL; b; b = b->next) total += b->cap;
+    return total;
+}
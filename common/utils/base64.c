@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+#include "../../include/base64.h"
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode(char *out, const void *in, size_t len) {
+    const unsigned char *p = in;
+    char *o = out;
+    for (; len >= 3; p += 3, len -= 3) {
+        uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        *o++ = alphabet[v >> 18];
+        *o++ = alphabet[(v >> 12) & 63];
+        *o++ = alphabet[(v >> 6) & 63];
+        *o++ = alphabet[v & 63];
+    }
+    if (len > 0) {
+        uint32_t v = (uint32_t)p[0] << 16 | (len == 2 ? (uint32_t)p[1] << 8 : 0);
+        *o++ = alphabet[v >> 18];
+        *o++ = alphabet[(v >> 12) & 63];
+        *o++ = len == 2 ? alphabet[(v >> 6) & 63] : '=';
+        *o++ = '=';
+    }
+    return (size_t)(o - out);
+}
+
+static int value_of(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+long base64_decode(void *out, const char *in, size_t len) {
+    if (len % 4 != 0) return -1;
+    unsigned char *o = out;
+    for (size_t i = 0; i < len; i += 4) {
+        int last = i + 4 == len;
+        int pad = last ? (in[i + 3] == '=') + (in[i + 2] == '=') : 0;
+        int a = value_of(in[i]), b = value_of(in[i + 1]);
+        int c = pad >= 2 ? 0 : value_of(in[i + 2]);
+        int d = pad >= 1 ? 0 : value_of(in[i + 3]);
+        if (a < 0 || b < 0 || c < 0 || d < 0) return -1;
+        uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | (uint32_t)d;
+        *o++ = (unsigned char)(v >> 16);
+        if (pad < 2) *o++ = (unsigned char)(v >> 8);
+        if (pad < 1) *o++ = (unsigned char)v;
+    }
+    return (long)(o - (unsigned char *)out);
+}
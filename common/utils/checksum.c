@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "../../include/checksum.h"
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+typedef struct {
+    const char *name;
+    crc_fn update;   // on the inverted crc
+} CrcKernel;
+
+// --- table, 8 bytes per step (slicing-by-8) ---
+
+static uint32_t crc_table[8][256];
+
+static void crc_table_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t update_table(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc_table[7][v & 0xFF] ^ crc_table[6][(v >> 8) & 0xFF] ^
+              crc_table[5][(v >> 16) & 0xFF] ^ crc_table[4][(v >> 24) & 0xFF] ^
+              crc_table[3][(v >> 32) & 0xFF] ^ crc_table[2][(v >> 40) & 0xFF] ^
+              crc_table[1][(v >> 48) & 0xFF] ^ crc_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+static const CrcKernel kernel_table = { "table", update_table };
+
+#ifdef CRC32C_X86
+
+// --- SSE4.2 crc32 instruction, 8 bytes per step ---
+
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static const CrcKernel kernel_sse42 = { "sse4.2", update_sse42 };
+
+#endif
+
+static const CrcKernel *selected_kernel = NULL;
+
+static const CrcKernel *select_kernel(void) {
+    // SIMOS_CRC_KERNEL=table pins the portable kernel, for benchmarking
+    const char *force = getenv("SIMOS_CRC_KERNEL");
+    crc_table_init();
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && !(force && strcmp(force, "table") == 0)) {
+        return &kernel_sse42;
+    }
+#else
+    (void)force;
+#endif
+    return &kernel_table;
+}
+
+static const CrcKernel *crc_kernel(void) {
+    const CrcKernel *k = __atomic_load_n(&selected_kernel, __ATOMIC_ACQUIRE);
+    if (k) return k;
+    k = select_kernel();
+    __atomic_store_n(&selected_kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+const char *crc32c_kernel_name(void) {
+    return crc_kernel()->name;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    if (!buf || len == 0) return crc;
+    return ~crc_kernel()->update(~crc, buf, len);
+}
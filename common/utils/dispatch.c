@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../include/dispatch.h"
+#include "../../include/logging.h"
+
+#define TYPE_HASH_SLOTS 128
+#define TYPE_NAME_MAX 32
+
+typedef struct {
+    char name[TYPE_NAME_MAX];
+    size_t len;
+} MsgTypeEntry;
+
+// ids are indexes into type_names; type_hash maps name hashes to ids
+static MsgTypeEntry type_names[MSG_TYPE_MAX] = { { "<unknown>", 9 } };
+static int type_count = 1;
+static unsigned char type_hash[TYPE_HASH_SLOTS];
+
+static uint32_t fnv1a(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int msg_type_lookup(const char *name, size_t len) {
+    if (!name) return MSG_TYPE_UNKNOWN;
+    uint32_t slot = fnv1a(name, len) & (TYPE_HASH_SLOTS - 1);
+    for (int probe = 0; probe < TYPE_HASH_SLOTS; ++probe) {
+        int id = __atomic_load_n(&type_hash[slot], __ATOMIC_ACQUIRE);
+        if (id == 0) return MSG_TYPE_UNKNOWN;
+        if (type_names[id].len == len && memcmp(type_names[id].name, name, len) == 0) return id;
+        slot = (slot + 1) & (TYPE_HASH_SLOTS - 1);
+    }
+    return MSG_TYPE_UNKNOWN;
+}
+
+int msg_type_intern(const char *name) {
+    if (!name) return -1;
+    size_t len = strlen(name);
+    if (len == 0 || len >= TYPE_NAME_MAX) return -1;
+
+    int id = msg_type_lookup(name, len);
+    if (id != MSG_TYPE_UNKNOWN) return id;
+    if (type_count >= MSG_TYPE_MAX) {
+        log_error("msg_type_intern: type table full, cannot add '%s'", name);
+        return -1;
+    }
+
+    id = type_count++;
+    memcpy(type_names[id].name, name, len + 1);
+    type_names[id].len = len;
+
+    uint32_t slot = fnv1a(name, len) & (TYPE_HASH_SLOTS - 1);
+    while (type_hash[slot] != 0) slot = (slot + 1) & (TYPE_HASH_SLOTS - 1);
+    __atomic_store_n(&type_hash[slot], (unsigned char)id, __ATOMIC_RELEASE);
+    return id;
+}
+
+const char *msg_type_name(int id) {
+    if (id <= 0 || id >= type_count) return type_names[0].name;
+    return type_names[id].name;
+}
+
+void dispatcher_init(Dispatcher *d, const char *name) {
+    if (!d) return;
+    memset(d, 0, sizeof(*d));
+    d->name = name;
+}
+
+int dispatcher_register(Dispatcher *d, const char *type, msg_handler_fn fn, void *user) {
+    if (!d || !type || !fn) return -1;
+    int id = msg_type_intern(type);
+    if (id < 0) return -1;
+    d->slots[id].fn = fn;
+    d->slots[id].user = user;
+    return id;
+}
+
+void dispatcher_set_fallback(Dispatcher *d, msg_handler_fn fn, void *user) {
+    if (!d) return;
+    d->fallback = fn;
+    d->fallback_user = user;
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+int dispatcher_dispatch(Dispatcher *d, const char *line, size_t len, Arena *arena, void *conn) {
+    if (!d || !line) return -1;
+
+    JsonMsg m;
+    if (json_msg_parse(&m, line, len) < 0 || !json_msg_field(&m, "type")) {
+        __atomic_fetch_add(&d->malformed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    MsgContext ctx = { &m, line, len, arena, conn };
+    int id = m.type_id;
+    MsgHandlerSlot *slot = &d->slots[id];
+    if (id == MSG_TYPE_UNKNOWN || !slot->fn) {
+        __atomic_fetch_add(&d->unknown, 1, __ATOMIC_RELAXED);
+        if (d->fallback) d->fallback(&ctx, d->fallback_user);
+        if (arena) arena_reset(arena);
+        return MSG_TYPE_UNKNOWN;
+    }
+
+    unsigned long long start = now_ns();
+    slot->fn(&ctx, slot->user);
+    unsigned long long took = now_ns() - start;
+
+    __atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->bytes, (unsigned long long)len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->ns_total, took, __ATOMIC_RELAXED);
+    unsigned long long prev = __atomic_load_n(&slot->ns_max, __ATOMIC_RELAXED);
+    while (took > prev &&
+           !__atomic_compare_exchange_n(&slot->ns_max, &prev, took, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if (arena) arena_reset(arena);
+    return id;
+}
+
+void dispatcher_print_stats(const Dispatcher *d, FILE *out) {
+    if (!d || !out) return;
+    fprintf(out, "Message stats (%s):\n", d->name ? d->name : "dispatcher");
+    fprintf(out, "  %-16s %12s %14s %10s %10s\n", "type", "count", "bytes", "avg_us", "max_us");
+    for (int id = 1; id < type_count; ++id) {
+        const MsgHandlerSlot *s = &d->slots[id];
+        if (!s->fn) continue;
+        unsigned long long count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        unsigned long long ns = __atomic_load_n(&s->ns_total, __ATOMIC_RELAXED);
+        fprintf(out, "  %-16s %12llu %14llu %10.1f %10.1f\n",
+                msg_type_name(id), count,
+                __atomic_load_n(&s->bytes, __ATOMIC_RELAXED),
+                count ? (double)ns / (double)count / 1000.0 : 0.0,
+                (double)__atomic_load_n(&s->ns_max, __ATOMIC_RELAXED) / 1000.0);
+    }
+    fprintf(out, "  unknown=%llu malformed=%llu\n",
+            __atomic_load_n(&d->unknown, __ATOMIC_RELAXED),
+            __atomic_load_n(&d->malformed, __ATOMIC_RELAXED));
+}
+
+void dispatcher_merge_stats(Dispatcher *dst, const Dispatcher *src) {
+    if (!dst || !src) return;
+    for (int id = 0; id < MSG_TYPE_MAX; ++id) {
+        const MsgHandlerSlot *s = &src->slots[id];
+        MsgHandlerSlot *d = &dst->slots[id];
+        d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        d->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+        d->ns_total += __atomic_load_n(&s->ns_total, __ATOMIC_RELAXED);
+        unsigned long long max = __atomic_load_n(&s->ns_max, __ATOMIC_RELAXED);
+        if (max > d->ns_max) d->ns_max = max;
+    }
+    dst->unknown += __atomic_load_n(&src->unknown, __ATOMIC_RELAXED);
+    dst->malformed += __atomic_load_n(&src->malformed, __ATOMIC_RELAXED);
+}
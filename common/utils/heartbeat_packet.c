@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/heartbeat.h"
+
+// Encoded byte by byte, like push chunk headers, so either side's
+// endianness does not matter.
+
+static void put16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int heartbeat_encode(const Heartbeat *hb, unsigned char out[HEARTBEAT_MAX_LEN]) {
+    size_t name_len = strnlen(hb->name, sizeof(hb->name));
+    if (name_len == 0 || name_len > 255) return -1;
+    put32(out, HEARTBEAT_MAGIC);
+    put32(out + 4, hb->seq);
+    put16(out + 8, hb->load1);
+    put16(out + 10, hb->running);
+    out[12] = hb->mem_used;
+    out[13] = (unsigned char)name_len;
+    memcpy(out + HEARTBEAT_HEADER_LEN, hb->name, name_len);
+    return (int)(HEARTBEAT_HEADER_LEN + name_len);
+}
+
+int heartbeat_decode(const unsigned char *in, size_t len, Heartbeat *hb) {
+    if (len < HEARTBEAT_HEADER_LEN || get32(in) != HEARTBEAT_MAGIC) return -1;
+    size_t name_len = in[13];
+    if (name_len == 0 || len != HEARTBEAT_HEADER_LEN + name_len) return -1;
+    hb->seq = get32(in + 4);
+    hb->load1 = get16(in + 8);
+    hb->running = get16(in + 10);
+    hb->mem_used = in[12];
+    memcpy(hb->name, in + HEARTBEAT_HEADER_LEN, name_len);
+    hb->name[name_len] = '\0';
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_ESCAPE_X86 1
+#endif
+
+#include "../../include/json_escape.h"
+
+// A kernel only has to find the next interesting byte; everything between
+// two interesting bytes is copied with memcpy.
+typedef const char *(*scan_fn)(const char *p, const char *end);
+
+typedef struct {
+    const char *name;
+    scan_fn scan_escape;     // next '"', '\\' or control byte
+    scan_fn scan_backslash;  // next '\\'
+} JsonKernel;
+
+static inline int needs_escape(unsigned char c) {
+    return c == '"' || c == '\\' || c < 0x20;
+}
+
+// --- scalar (SWAR, 8 bytes per step) ---
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+static inline uint64_t swar_has_zero(uint64_t v) {
+    return (v - SWAR_ONES) & ~v & SWAR_HIGHS;
+}
+
+static inline uint64_t swar_has_less(uint64_t v, uint8_t n) {
+    return (v - SWAR_ONES * n) & ~v & SWAR_HIGHS;
+}
+
+static const char *scan_escape_scalar(const char *p, const char *end) {
+    while (end - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        if (swar_has_zero(v ^ (SWAR_ONES * '"')) |
+            swar_has_zero(v ^ (SWAR_ONES * '\\')) |
+            swar_has_less(v, 0x20)) {
+            break;
+        }
+        p += 8;
+    }
+    while (p < end && !needs_escape((unsigned char)*p)) p++;
+    return p;
+}
+
+static const char *scan_backslash_scalar(const char *p, const char *end) {
+    const char *s = memchr(p, '\\', (size_t)(end - p));
+    return s ? s : end;
+}
+
+static const JsonKernel kernel_scalar = { "scalar", scan_escape_scalar, scan_backslash_scalar };
+
+#ifdef JSON_ESCAPE_X86
+
+// --- SSE2, 16 bytes per step ---
+
+__attribute__((target("sse2")))
+static const char *scan_escape_sse2(const char *p, const char *end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        // unsigned v <= 0x1F  <=>  max(v, 0x1F) == 0x1F
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_escape_scalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char *scan_backslash_sse2(const char *p, const char *end) {
+    const __m128i bslash = _mm_set1_epi8('\\');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_backslash_scalar(p, end);
+}
+
+// --- AVX2, 32 bytes per step ---
+
+__attribute__((target("avx2")))
+static const char *scan_escape_avx2(const char *p, const char *end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctl = _mm256_set1_epi8(0x1F);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_escape_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_backslash_avx2(const char *p, const char *end) {
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bslash));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_backslash_sse2(p, end);
+}
+
+static const JsonKernel kernel_sse2 = { "sse2", scan_escape_sse2, scan_backslash_sse2 };
+static const JsonKernel kernel_avx2 = { "avx2", scan_escape_avx2, scan_backslash_avx2 };
+
+#endif
+
+static const JsonKernel *selected_kernel = NULL;
+
+static const JsonKernel *select_kernel(void) {
+    // SIMOS_JSON_KERNEL=scalar|sse2|avx2 pins a kernel, for benchmarking
+    const char *force = getenv("SIMOS_JSON_KERNEL");
+#ifdef JSON_ESCAPE_X86
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    if (force) {
+        if (strcmp(force, "avx2") == 0 && has_avx2) return &kernel_avx2;
+        if (strcmp(force, "sse2") == 0 && has_sse2) return &kernel_sse2;
+        if (strcmp(force, "scalar") == 0) return &kernel_scalar;
+    }
+    if (has_avx2) return &kernel_avx2;
+    if (has_sse2) return &kernel_sse2;
+#else
+    (void)force;
+#endif
+    return &kernel_scalar;
+}
+
+static const JsonKernel *json_kernel(void) {
+    const JsonKernel *k = __atomic_load_n(&selected_kernel, __ATOMIC_ACQUIRE);
+    if (k) return k;
+    k = select_kernel();
+    __atomic_store_n(&selected_kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+const char *json_escape_kernel_name(void) {
+    return json_kernel()->name;
+}
+
+const char *json_scan_special(const char *p, const char *end) {
+    if (!p || p >= end) return end;
+    return json_kernel()->scan_escape(p, end);
+}
+
+static size_t escape_width(unsigned char c) {
+    switch (c) {
+        case '"': case '\\': case '\n': case '\r': case '\t': case '\b': case '\f':
+            return 2;
+        default:
+            return c < 0x20 ? 6 : 1;
+    }
+}
+
+static size_t write_escape(char *o, unsigned char c) {
+    static const char hex[] = "0123456789abcdef";
+    o[0] = '\\';
+    switch (c) {
+        case '"': o[1] = '"'; return 2;
+        case '\\': o[1] = '\\'; return 2;
+        case '\n': o[1] = 'n'; return 2;
+        case '\r': o[1] = 'r'; return 2;
+        case '\t': o[1] = 't'; return 2;
+        case '\b': o[1] = 'b'; return 2;
+        case '\f': o[1] = 'f'; return 2;
+        default:
+            o[1] = 'u'; o[2] = '0'; o[3] = '0';
+            o[4] = hex[c >> 4];
+            o[5] = hex[c & 0xF];
+            return 6;
+    }
+}
+
+size_t json_escaped_len(const char *in, size_t len) {
+    if (!in) return 0;
+    const JsonKernel *k = json_kernel();
+    const char *p = in;
+    const char *end = in + len;
+    size_t n = len;
+    while ((p = k->scan_escape(p, end)) < end) {
+        n += escape_width((unsigned char)*p) - 1;
+        p++;
+    }
+    return n;
+}
+
+size_t json_escape_to(char *out, const char *in, size_t len) {
+    if (!out || !in) return 0;
+    const JsonKernel *k = json_kernel();
+    const char *p = in;
+    const char *end = in + len;
+    char *o = out;
+    while (p < end) {
+        const char *s = k->scan_escape(p, end);
+        size_t run = (size_t)(s - p);
+        memcpy(o, p, run);
+        o += run;
+        if (s == end) break;
+        o += write_escape(o, (unsigned char)*s);
+        p = s + 1;
+    }
+    return (size_t)(o - out);
+}
+
+char *json_escape(const char *in) {
+    if (!in) return strdup("");
+    size_t len = strlen(in);
+    size_t esc_len = json_escaped_len(in, len);
+    char *out = malloc(esc_len + 1);
+    if (!out) return NULL;
+    json_escape_to(out, in, len);
+    out[esc_len] = '\0';
+    return out;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static long parse_hex4(const char *p) {
+    long v = 0;
+    for (int i = 0; i < 4; ++i) {
+        int h = hex_value(p[i]);
+        if (h < 0) return -1;
+        v = (v << 4) | h;
+    }
+    return v;
+}
+
+static size_t write_utf8(char *o, unsigned long cp) {
+    if (cp < 0x80) {
+        o[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        o[0] = (char)(0xC0 | (cp >> 6));
+        o[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        o[0] = (char)(0xE0 | (cp >> 12));
+        o[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        o[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    o[0] = (char)(0xF0 | (cp >> 18));
+    o[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    o[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    o[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+size_t json_unescape_to(char *out, const char *in, size_t len) {
+    if (!out || !in) return 0;
+    const JsonKernel *k = json_kernel();
+    const char *p = in;
+    const char *end = in + len;
+    char *o = out;
+    while (p < end) {
+        const char *s = k->scan_backslash(p, end);
+        size_t run = (size_t)(s - p);
+        memcpy(o, p, run);
+        o += run;
+        if (s == end) break;
+        if (s + 1 == end) {
+            *o++ = '\\';
+            break;
+        }
+
+        char next = s[1];
+        p = s + 2;
+        switch (next) {
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'u': {
+                long cp = (end - p >= 4) ? parse_hex4(p) : -1;
+                if (cp < 0) {
+                    *o++ = 'u';
+                    break;
+                }
+                p += 4;
+                // a surrogate pair is 12 input bytes and 4 output bytes, a
+                // lone surrogate becomes U+FFFD; both fit in the input size
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    long lo = parse_hex4(p + 2);
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+                o += write_utf8(o, (unsigned long)cp);
+                break;
+            }
+            default: *o++ = next; break;
+        }
+    }
+    return (size_t)(o - out);
+}
+
+char *json_unescape(const char *in) {
+    if (!in) return strdup("");
+    size_t len = strlen(in);
+    char *out = malloc(len + 1);
+    if (!out) return strdup("");
+    size_t n = json_unescape_to(out, in, len);
+    out[n] = '\0';
+    return out;
+}
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/dispatch.h"
+#include "../../include/json_escape.h"
+#include "../../include/json_msg.h"
+
+static const char *skip_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+// p points just past the opening quote. Returns the closing quote or NULL.
+static const char *string_end(const char *p, const char *end, int *has_escapes) {
+    while (p < end) {
+        p = json_scan_special(p, end);
+        if (p >= end) return NULL;
+        if (*p == '"') return p;
+        if (*p == '\\') {
+            *has_escapes = 1;
+            p += 2;
+        } else {
+            p++;  // raw control byte, tolerated
+        }
+    }
+    return NULL;
+}
+
+// Skips a nested object or array starting at p. Returns one past its end.
+static const char *skip_nested(const char *p, const char *end) {
+    int depth = 0;
+    while (p < end) {
+        char c = *p;
+        if (c == '"') {
+            int esc = 0;
+            const char *q = string_end(p + 1, end, &esc);
+            if (!q) return NULL;
+            p = q + 1;
+            continue;
+        }
+        if (c == '{' || c == '[') depth++;
+        else if (c == '}' || c == ']') {
+            depth--;
+            if (depth == 0) return p + 1;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int json_msg_parse(JsonMsg *m, const char *line, size_t len) {
+    if (!m || !line) return -1;
+    m->count = 0;
+    m->type_id = MSG_TYPE_UNKNOWN;
+    const char *p = line;
+    const char *end = line + len;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '{') return -1;
+    p++;
+
+    while (1) {
+        p = skip_ws(p, end);
+        if (p >= end) return -1;
+        if (*p == '}') return 0;
+        if (*p != '"') return -1;
+
+        int key_esc = 0;
+        const char *key = p + 1;
+        const char *key_end = string_end(key, end, &key_esc);
+        if (!key_end) return -1;
+        p = skip_ws(key_end + 1, end);
+        if (p >= end || *p != ':') return -1;
+        p = skip_ws(p + 1, end);
+        if (p >= end) return -1;
+
+        JsonField f;
+        f.key = key;
+        f.key_len = (size_t)(key_end - key);
+        f.is_string = 0;
+        f.has_escapes = 0;
+
+        if (*p == '"') {
+            const char *v_end = string_end(p + 1, end, &f.has_escapes);
+            if (!v_end) return -1;
+            f.val = p + 1;
+            f.val_len = (size_t)(v_end - f.val);
+            f.is_string = 1;
+            p = v_end + 1;
+        } else if (*p == '{' || *p == '[') {
+            const char *v_end = skip_nested(p, end);
+            if (!v_end) return -1;
+            f.val = p;
+            f.val_len = (size_t)(v_end - p);
+            p = v_end;
+        } else {
+            const char *v = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t') p++;
+            f.val = v;
+            f.val_len = (size_t)(p - v);
+        }
+
+        if (m->count < JSON_MSG_MAX_FIELDS) m->fields[m->count++] = f;
+        if (f.is_string && !f.has_escapes && f.key_len == 4 && memcmp(key, "type", 4) == 0) {
+            m->type_id = msg_type_lookup(f.val, f.val_len);
+        }
+
+        p = skip_ws(p, end);
+        if (p >= end) return -1;
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p == '}') return 0;
+        return -1;
+    }
+}
+
+const JsonField *json_msg_field(const JsonMsg *m, const char *key) {
+    if (!m || !key) return NULL;
+    size_t klen = strlen(key);
+    for (int i = 0; i < m->count; ++i) {
+        const JsonField *f = &m->fields[i];
+        if (f->key_len == klen && memcmp(f->key, key, klen) == 0) return f;
+    }
+    return NULL;
+}
+
+char *json_msg_str(const JsonMsg *m, const char *key, Arena *a, size_t *out_len) {
+    const JsonField *f = json_msg_field(m, key);
+    if (!f || !f->is_string || !a) return NULL;
+    char *out = arena_alloc(a, f->val_len + 1);
+    if (!out) return NULL;
+    size_t n;
+    if (f->has_escapes) {
+        n = json_unescape_to(out, f->val, f->val_len);
+    } else {
+        memcpy(out, f->val, f->val_len);
+        n = f->val_len;
+    }
+    out[n] = '\0';
+    if (out_len) *out_len = n;
+    return out;
+}
+
+int json_msg_copy(const JsonMsg *m, const char *key, char *out, size_t out_size) {
+    const JsonField *f = json_msg_field(m, key);
+    if (!f || !f->is_string || !out || out_size == 0) return -1;
+    size_t n;
+    if (f->has_escapes) {
+        // unescaping never grows, so staging through a bounded prefix is safe
+        char tmp[1024];
+        size_t in_len = f->val_len < sizeof(tmp) ? f->val_len : sizeof(tmp);
+        n = json_unescape_to(tmp, f->val, in_len);
+        if (n >= out_size) n = out_size - 1;
+        memcpy(out, tmp, n);
+    } else {
+        n = f->val_len < out_size ? f->val_len : out_size - 1;
+        memcpy(out, f->val, n);
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+long json_msg_int(const JsonMsg *m, const char *key, long default_value) {
+    const JsonField *f = json_msg_field(m, key);
+    if (!f || f->val_len == 0) return default_value;
+    char buf[32];
+    size_t n = f->val_len < sizeof(buf) - 1 ? f->val_len : sizeof(buf) - 1;
+    memcpy(buf, f->val, n);
+    buf[n] = '\0';
+    char *endptr = NULL;
+    errno = 0;
+    long v = strtol(buf, &endptr, 10);
+    if (endptr == buf || errno == ERANGE) return default_value;
+    return v;
+}
+
+int json_msg_str_eq(const JsonMsg *m, const char *key, const char *literal) {
+    const JsonField *f = json_msg_field(m, key);
+    if (!f || !f->is_string || !literal) return 0;
+    size_t n = strlen(literal);
+    return !f->has_escapes && f->val_len == n && memcmp(f->val, literal, n) == 0;
+}
@@ -1,39 +1,71 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 #include "../../include/logging.h"
 
 static FILE *log_file = NULL;
+// entries hold it shared; log_reopen() takes it alone to swap the file
+static pthread_rwlock_t log_swap = PTHREAD_RWLOCK_INITIALIZER;
 
 bool log_init(const char *path) {
     log_file = fopen(path, "a");
     return log_file != NULL;
 }
 
+bool log_reopen(const char *path) {
+    FILE *next = fopen(path, "a");
+    if (!next) return false;
+    pthread_rwlock_wrlock(&log_swap);
+    FILE *old = log_file;
+    log_file = next;
+    pthread_rwlock_unlock(&log_swap);
+    if (old) fclose(old);
+    return true;
+}
+
 void log_close() {
     if (log_file) fclose(log_file);
 }
 
 void log_info(const char *fmt, ...) {
-    if (!log_file) return;
+    pthread_rwlock_rdlock(&log_swap);
+    if (!log_file) {
+        pthread_rwlock_unlock(&log_swap);
+        return;
+    }
     va_list args;
     va_start(args, fmt);
     time_t now = time(NULL);
-    fprintf(log_file, "[INFO] %s: ", ctime(&now));
+    char stamp[32];
+    // several reactor threads log at once; keep each entry in one piece
+    flockfile(log_file);
+    fprintf(log_file, "[INFO] %s: ", ctime_r(&now, stamp));
     vfprintf(log_file, fmt, args);
     fprintf(log_file, "\n");
     fflush(log_file);
+    funlockfile(log_file);
+    pthread_rwlock_unlock(&log_swap);
     va_end(args);
 }
 
 void log_error(const char *fmt, ...) {
-    if (!log_file) return;
+    pthread_rwlock_rdlock(&log_swap);
+    if (!log_file) {
+        pthread_rwlock_unlock(&log_swap);
+        return;
+    }
     va_list args;
     va_start(args, fmt);
     time_t now = time(NULL);
-    fprintf(log_file, "[ERROR] %s: ", ctime(&now));
+    char stamp[32];
+    flockfile(log_file);
+    fprintf(log_file, "[ERROR] %s: ", ctime_r(&now, stamp));
     vfprintf(log_file, fmt, args);
     fprintf(log_file, "\n");
     fflush(log_file);
+    funlockfile(log_file);
+    pthread_rwlock_unlock(&log_swap);
     va_end(args);
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include <stddef.h>
+
+#include "../../include/mpsc.h"
+
+void mpsc_init(MpscQueue *q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+void mpsc_push(MpscQueue *q, MpscNode *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    MpscNode *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+MpscNode *mpsc_pop(MpscQueue *q) {
+    MpscNode *tail = q->tail;
+    MpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    MpscNode *head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail != head) return NULL;
+
+    // tail is the last real node: park the stub behind it so it can go
+    mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+#include "../../include/transfer.h"
+
+// Chunk headers are encoded byte by byte so controller and agent agree
+// regardless of either host's endianness.
+
+static void put32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void push_header_encode(const PushChunkHeader *h, unsigned char out[PUSH_HEADER_LEN]) {
+    put32(out, h->magic);
+    put32(out + 4, h->len);
+    put32(out + 8, (uint32_t)h->offset);
+    put32(out + 12, (uint32_t)(h->offset >> 32));
+    put32(out + 16, h->crc);
+    put32(out + 20, h->flags);
+}
+
+int push_header_decode(const unsigned char in[PUSH_HEADER_LEN], PushChunkHeader *h) {
+    h->magic = get32(in);
+    h->len = get32(in + 4);
+    h->offset = (uint64_t)get32(in + 8) | (uint64_t)get32(in + 12) << 32;
+    h->crc = get32(in + 16);
+    h->flags = get32(in + 20);
+    return h->magic == PUSH_CHUNK_MAGIC && h->len <= PUSH_CHUNK_SIZE ? 0 : -1;
+}
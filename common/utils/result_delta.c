@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/checksum.h"
+#include "../../include/result_delta.h"
+
+// how far ahead a mismatch looks for the two texts to line up again
+#define RESYNC_WINDOW 16
+
+uint64_t result_delta_key(const char *cmd) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)cmd; *p; ++p) h = (h ^ *p) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+typedef struct {
+    const char *p;
+    size_t len;
+} Line;
+
+static Line *split_lines(const char *text, size_t len, size_t *count) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) n += text[i] == '\n';
+    Line *lines = malloc((n + 1) * sizeof(Line));
+    if (!lines) return NULL;
+    n = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (text[i] != '\n') continue;
+        lines[n].p = text + start;
+        lines[n++].len = i + 1 - start;
+        start = i + 1;
+    }
+    if (start < len) {
+        lines[n].p = text + start;
+        lines[n++].len = len - start;
+    }
+    *count = n;
+    return lines;
+}
+
+static int line_eq(const Line *a, const Line *b) {
+    return a->len == b->len && memcmp(a->p, b->p, a->len) == 0;
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t limit;
+    char op;            // pending operation, 0 if none
+    size_t count;       // lines to copy or skip
+    const char *ins;    // bytes to insert
+    size_t ins_len;
+    int over;
+} DeltaWriter;
+
+static void put(DeltaWriter *w, const char *data, size_t len) {
+    if (w->over || w->len + len >= w->limit) {
+        w->over = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void flush(DeltaWriter *w) {
+    char num[32];
+    if (w->op == '=' || w->op == '-') {
+        put(w, num, (size_t)snprintf(num, sizeof(num), "%c%zu\n", w->op, w->count));
+    } else if (w->op == '+') {
+        put(w, num, (size_t)snprintf(num, sizeof(num), "+%zu\n", w->ins_len));
+        put(w, w->ins, w->ins_len);
+    }
+    w->op = 0;
+    w->count = 0;
+    w->ins_len = 0;
+}
+
+static void emit(DeltaWriter *w, char op, size_t count, const Line *line) {
+    // inserted lines are adjacent in the output, so they merge into one run
+    if (w->op == op && (op != '+' || w->ins + w->ins_len == line->p)) {
+        if (op == '+') w->ins_len += line->len;
+        else w->count += count;
+        return;
+    }
+    flush(w);
+    w->op = op;
+    if (op == '+') {
+        w->ins = line->p;
+        w->ins_len = line->len;
+    } else {
+        w->count = count;
+    }
+}
+
+char *result_delta_encode(const char *base, size_t base_len, const char *out, size_t out_len, size_t limit,
+                          size_t *delta_len) {
+    size_t nb = 0, no = 0;
+    Line *b = split_lines(base, base_len, &nb);
+    Line *o = split_lines(out, out_len, &no);
+    DeltaWriter w = { 0 };
+    w.limit = limit;
+    w.buf = b && o ? malloc(limit) : NULL;
+    if (!w.buf) w.over = 1;
+
+    size_t i = 0, j = 0;
+    while (j < no && !w.over) {
+        if (i < nb && line_eq(&b[i], &o[j])) {
+            emit(&w, '=', 1, NULL);
+            i++;
+            j++;
+            continue;
+        }
+        size_t k;
+        // lines dropped from the base, or new lines put in
+        for (k = 1; k <= RESYNC_WINDOW && i + k < nb && !line_eq(&b[i + k], &o[j]); ++k) {}
+        if (k <= RESYNC_WINDOW && i + k < nb) {
+            emit(&w, '-', k, NULL);
+            i += k;
+            continue;
+        }
+        for (k = 1; k <= RESYNC_WINDOW && i < nb && j + k < no && !line_eq(&o[j + k], &b[i]); ++k) {}
+        if (k <= RESYNC_WINDOW && i < nb && j + k < no) {
+            for (size_t n = 0; n < k; ++n) emit(&w, '+', 0, &o[j + n]);
+            j += k;
+            continue;
+        }
+        // a changed line
+        emit(&w, '+', 0, &o[j]);
+        j++;
+        if (i < nb) {
+            flush(&w);
+            emit(&w, '-', 1, NULL);
+            i++;
+        }
+    }
+    if (!w.over) flush(&w);
+    free(b);
+    free(o);
+    if (w.over) {
+        free(w.buf);
+        return NULL;
+    }
+    *delta_len = w.len;
+    return w.buf;
+}
+
+// Reads the number after an operation character and its newline.
+static int read_count(const char **p, const char *end, size_t *n) {
+    *n = 0;
+    const char *q = *p;
+    while (q < end && *q >= '0' && *q <= '9') *n = *n * 10 + (size_t)(*q++ - '0');
+    if (q == *p || q >= end || *q != '\n') return -1;
+    *p = q + 1;
+    return 0;
+}
+
+char *result_delta_apply(const char *base, size_t base_len, const char *delta, size_t delta_len,
+                         size_t *out_len) {
+    // nothing comes out that was not in the base or the delta
+    char *out = malloc(base_len + delta_len + 1);
+    if (!out) return NULL;
+    size_t len = 0, at = 0;
+    const char *p = delta, *end = delta + delta_len;
+    while (p < end) {
+        char op = *p++;
+        size_t n = 0;
+        if ((op != '=' && op != '-' && op != '+') || read_count(&p, end, &n) < 0) goto bad;
+        if (op == '+') {
+            if (n > (size_t)(end - p)) goto bad;
+            memcpy(out + len, p, n);
+            len += n;
+            p += n;
+            continue;
+        }
+        size_t from = at;
+        for (; n > 0; --n) {
+            if (at >= base_len) goto bad;
+            const char *nl = memchr(base + at, '\n', base_len - at);
+            at = nl ? (size_t)(nl - base) + 1 : base_len;
+        }
+        if (op == '=') {
+            memcpy(out + len, base + from, at - from);
+            len += at - from;
+        }
+    }
+    out[len] = '\0';
+    *out_len = len;
+    return out;
+bad:
+    free(out);
+    return NULL;
+}
+
+void result_bases_init(ResultBases *b) {
+    memset(b, 0, sizeof(*b));
+}
+
+void result_bases_free(ResultBases *b) {
+    for (int i = 0; i < RESULT_BASE_SLOTS; ++i) free(b->slot[i].text);
+    result_bases_init(b);
+}
+
+const ResultBase *result_bases_find(ResultBases *b, uint64_t key) {
+    for (int i = 0; i < RESULT_BASE_SLOTS; ++i) {
+        ResultBase *s = &b->slot[i];
+        if (s->key == key && s->text && s->gen == b->gen) {
+            s->used = ++b->clock;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+void result_bases_put(ResultBases *b, uint64_t key, const char *text, size_t len) {
+    ResultBase *s = NULL;
+    for (int i = 0; i < RESULT_BASE_SLOTS && !s; ++i) {
+        if (b->slot[i].key == key && b->slot[i].text) s = &b->slot[i];
+    }
+    if (!s) {
+        s = &b->slot[0];
+        for (int i = 1; i < RESULT_BASE_SLOTS && s->text; ++i) {
+            if (!b->slot[i].text || b->slot[i].used < s->used) s = &b->slot[i];
+        }
+    }
+    free(s->text);
+    s->text = NULL;
+    if (len > RESULT_DELTA_MAX_BASE || (s->text = malloc(len + 1)) == NULL) return;
+    memcpy(s->text, text, len);
+    s->text[len] = '\0';
+    s->len = len;
+    s->key = key;
+    s->crc = crc32c(0, text, len);
+    s->used = ++b->clock;
+    s->gen = b->gen;
+}
+
+void result_bases_forget(ResultBases *b) {
+    b->gen++;
+}
@@ -0,0 +1,34 @@
+#include <fnmatch.h>
+#include <string.h>
+
+#include "../../include/selector.h"
+
+int selector_match(const char *selector, const char *name) {
+    if (!selector || !name) return 0;
+    char pattern[SELECTOR_MAX_LEN + 1];
+    const char *p = selector;
+    while (*p) {
+        const char *comma = strchr(p, ',');
+        size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        if (len > 0 && len <= SELECTOR_MAX_LEN) {
+            memcpy(pattern, p, len);
+            pattern[len] = '\0';
+            if (fnmatch(pattern, name, 0) == 0) return 1;
+        }
+        if (!comma) break;
+        p = comma + 1;
+    }
+    return 0;
+}
+
+int selector_valid(const char *selector) {
+    if (!selector || !selector[0] || strlen(selector) > SELECTOR_MAX_LEN) return 0;
+    const char *p = selector;
+    while (1) {
+        const char *comma = strchr(p, ',');
+        size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        if (len == 0) return 0;
+        if (!comma) return 1;
+        p = comma + 1;
+    }
+}
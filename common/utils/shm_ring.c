@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../include/logging.h"
+#include "../../include/shm_ring.h"
+
+#define SHM_MAGIC 0x314d4853534f4d49ULL  // "IMOSSHM1"
+#define SHM_DATA_OFFSET 4096
+#define RECORD_HDR 8
+#define RECORD_DATA 0
+#define RECORD_PAD 1
+
+// head and tail sit on their own cache lines so the two sides do not
+// bounce one line between them on every message
+struct ShmRingHeader {
+    _Alignas(64) uint64_t head;     // consumer position
+    uint32_t waiting;               // consumer is (about to be) blocked
+    _Alignas(64) uint64_t tail;     // producer position
+};
+
+typedef struct {
+    uint64_t magic;
+    uint64_t ring_size;
+    ShmRingHeader to_controller;
+    ShmRingHeader to_agent;
+} ShmRegion;
+
+typedef struct {
+    uint32_t len;
+    uint32_t kind;
+} RecordHeader;
+
+static uint64_t record_size(size_t len) {
+    // header, message and its NUL, rounded up to 8
+    return (RECORD_HDR + (uint64_t)len + 1 + 7) & ~(uint64_t)7;
+}
+
+static void ring_bind(ShmRing *r, ShmRingHeader *hdr, char *data, uint64_t size) {
+    r->hdr = hdr;
+    r->data = data;
+    r->size = size;
+    r->cur_pos = 0;
+    r->cur_len = 0;
+}
+
+static ShmChannel *channel_map(int fd, size_t map_len) {
+    void *base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        log_error("mmap of shared ring failed: %s", strerror(errno));
+        return NULL;
+    }
+    ShmChannel *ch = calloc(1, sizeof(ShmChannel));
+    if (!ch) {
+        munmap(base, map_len);
+        return NULL;
+    }
+    ch->base = base;
+    ch->map_len = map_len;
+    return ch;
+}
+
+static void channel_bind(ShmChannel *ch, uint64_t ring_size, ShmSide side) {
+    ShmRegion *region = ch->base;
+    char *to_controller = (char *)ch->base + SHM_DATA_OFFSET;
+    char *to_agent = to_controller + ring_size;
+    if (side == SHM_SIDE_CONTROLLER) {
+        ring_bind(&ch->rx, &region->to_controller, to_controller, ring_size);
+        ring_bind(&ch->tx, &region->to_agent, to_agent, ring_size);
+    } else {
+        ring_bind(&ch->rx, &region->to_agent, to_agent, ring_size);
+        ring_bind(&ch->tx, &region->to_controller, to_controller, ring_size);
+    }
+}
+
+ShmChannel *shm_channel_create(size_t ring_size, int *out_fd) {
+    if (!out_fd || ring_size < 4096 || (ring_size & (ring_size - 1)) != 0) return NULL;
+    size_t map_len = SHM_DATA_OFFSET + 2 * ring_size;
+
+    int fd = memfd_create("simos-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        log_error("memfd_create failed: %s", strerror(errno));
+        return NULL;
+    }
+    // the agent cannot shrink the region under us and fault our reads
+    if (ftruncate(fd, (off_t)map_len) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        log_error("Failed to size shared ring: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    ShmChannel *ch = channel_map(fd, map_len);
+    if (!ch) {
+        close(fd);
+        return NULL;
+    }
+    ShmRegion *region = ch->base;
+    region->magic = SHM_MAGIC;
+    region->ring_size = ring_size;
+    // a spurious doorbell is harmless; a missing one is not
+    region->to_controller.waiting = 1;
+    region->to_agent.waiting = 1;
+    channel_bind(ch, ring_size, SHM_SIDE_CONTROLLER);
+    *out_fd = fd;
+    return ch;
+}
+
+ShmChannel *shm_channel_attach(int fd, ShmSide side) {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < SHM_DATA_OFFSET) {
+        log_error("Shared ring fd is not usable");
+        return NULL;
+    }
+    ShmChannel *ch = channel_map(fd, (size_t)st.st_size);
+    if (!ch) return NULL;
+    ShmRegion *region = ch->base;
+    uint64_t ring_size = region->ring_size;
+    if (region->magic != SHM_MAGIC || ring_size < 4096 || (ring_size & (ring_size - 1)) != 0 ||
+        SHM_DATA_OFFSET + 2 * ring_size != (uint64_t)st.st_size) {
+        log_error("Shared ring has an unexpected layout");
+        shm_channel_close(ch);
+        return NULL;
+    }
+    channel_bind(ch, ring_size, side);
+    return ch;
+}
+
+void shm_channel_close(ShmChannel *ch) {
+    if (!ch) return;
+    munmap(ch->base, ch->map_len);
+    free(ch);
+}
+
+char *shm_ring_reserve(ShmRing *r, size_t len) {
+    if (!r || len > r->size / 4) return NULL;
+    uint64_t need = record_size(len);
+    uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t off = tail & (r->size - 1);
+    uint64_t to_end = r->size - off;
+    // records never wrap; the rest of the ring is skipped with a pad record
+    uint64_t pad = to_end < need ? to_end : 0;
+    if (tail + pad + need - head > r->size) return NULL;
+
+    if (pad) {
+        RecordHeader h = { (uint32_t)(pad - RECORD_HDR), RECORD_PAD };
+        memcpy(r->data + off, &h, sizeof(h));
+        tail += pad;
+        off = 0;
+    }
+    r->cur_pos = tail;
+    r->cur_len = len;
+    return r->data + off + RECORD_HDR;
+}
+
+int shm_ring_commit(ShmRing *r) {
+    uint64_t off = r->cur_pos & (r->size - 1);
+    RecordHeader h = { (uint32_t)r->cur_len, RECORD_DATA };
+    memcpy(r->data + off, &h, sizeof(h));
+    r->data[off + RECORD_HDR + r->cur_len] = '\0';
+    __atomic_store_n(&r->hdr->tail, r->cur_pos + record_size(r->cur_len), __ATOMIC_RELEASE);
+
+    // pairs with the fence in shm_ring_prepare_wait: either the consumer
+    // sees the new tail or we see its waiting flag
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->hdr->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->hdr->waiting, 0, __ATOMIC_ACQ_REL)) {
+        return 1;
+    }
+    return 0;
+}
+
+int shm_ring_write(ShmRing *r, const char *msg, size_t len) {
+    char *dst = shm_ring_reserve(r, len);
+    if (!dst) return -1;
+    memcpy(dst, msg, len);
+    return shm_ring_commit(r);
+}
+
+const char *shm_ring_peek(ShmRing *r, size_t *len, int *corrupt) {
+    if (corrupt) *corrupt = 0;
+    uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        uint64_t off = head & (r->size - 1);
+        RecordHeader h;
+        memcpy(&h, r->data + off, sizeof(h));
+        // the peer is trusted to write sane records, but a bad one must
+        // not send us outside the mapping
+        uint64_t size = h.kind == RECORD_PAD ? RECORD_HDR + (uint64_t)h.len : record_size(h.len);
+        if ((off & 7) || size > r->size - off || size > tail - head ||
+            (h.kind != RECORD_PAD && h.kind != RECORD_DATA)) {
+            if (corrupt) *corrupt = 1;
+            return NULL;
+        }
+        if (h.kind == RECORD_PAD) {
+            head += size;
+            __atomic_store_n(&r->hdr->head, head, __ATOMIC_RELEASE);
+            continue;
+        }
+        r->cur_pos = head;
+        r->cur_len = h.len;
+        *len = h.len;
+        return r->data + off + RECORD_HDR;
+    }
+    return NULL;
+}
+
+void shm_ring_consume(ShmRing *r) {
+    __atomic_store_n(&r->hdr->head, r->cur_pos + record_size(r->cur_len), __ATOMIC_RELEASE);
+}
+
+int shm_ring_prepare_wait(ShmRing *r) {
+    __atomic_store_n(&r->hdr->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE) != head) {
+        __atomic_store_n(&r->hdr->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/telemetry.h"
+
+#define FLAG_KEY 1u
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Returns the bytes read, 0 if the varint runs past end or is too long.
+static size_t get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t n = 0; n < 10 && p + n < end; ++n) {
+        r |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = r;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+int telemetry_encode(const char *name, uint32_t seq, const TelemetrySample *cur, const TelemetrySample *prev,
+                     unsigned char *out, size_t size) {
+    size_t name_len = name ? strlen(name) : 0;
+    // header, name, then at most 10 bytes per varint
+    if (name_len == 0 || name_len > 255 || size < 5 + name_len + 10 * (3 + TELEMETRY_FIELDS)) return -1;
+    for (int i = 0; i < 4; ++i) out[i] = (unsigned char)(TELEMETRY_MAGIC >> (8 * i));
+    out[4] = (unsigned char)name_len;
+    memcpy(out + 5, name, name_len);
+    size_t n = 5 + name_len;
+    n += put_varint(out + n, seq);
+    n += put_varint(out + n, prev ? 0 : FLAG_KEY);
+    if (prev) {
+        n += put_varint(out + n, zigzag((int64_t)cur->at - prev->at));
+        for (int i = 0; i < TELEMETRY_FIELDS; ++i) {
+            n += put_varint(out + n, zigzag((int64_t)cur->v[i] - prev->v[i]));
+        }
+    } else {
+        n += put_varint(out + n, cur->at);
+        for (int i = 0; i < TELEMETRY_FIELDS; ++i) n += put_varint(out + n, cur->v[i]);
+    }
+    return (int)n;
+}
+
+int telemetry_decode(const unsigned char *in, size_t len, TelemetryFrame *f) {
+    if (len < 5) return -1;
+    uint32_t magic = (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    size_t name_len = in[4];
+    if (magic != TELEMETRY_MAGIC || name_len == 0 || 5 + name_len > len) return -1;
+    memcpy(f->name, in + 5, name_len);
+    f->name[name_len] = '\0';
+
+    const unsigned char *p = in + 5 + name_len, *end = in + len;
+    uint64_t vals[3 + TELEMETRY_FIELDS];
+    for (int i = 0; i < 3 + TELEMETRY_FIELDS; ++i) {
+        size_t used = get_varint(p, end, &vals[i]);
+        if (!used) return -1;
+        p += used;
+    }
+    if (p != end) return -1;
+    f->seq = (uint32_t)vals[0];
+    f->key = (vals[1] & FLAG_KEY) != 0;
+    for (int i = 0; i < 1 + TELEMETRY_FIELDS; ++i) {
+        int64_t v = f->key ? (int64_t)vals[2 + i] : unzigzag(vals[2 + i]);
+        if (i == 0) f->at = v;
+        else f->v[i - 1] = v;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/admin.h"
+#include "../include/cli.h"
+#include "../include/ipc.h"
+#include "../include/logging.h"
+
+// A client that quit is closed once its last reply has been written, or
+// after this long if it stopped reading.
+#define ADMIN_LINGER_MS 2000
+#define ADMIN_SWEEP_MS 100
+
+typedef struct AdminConn {
+    ReactorStream *stream;
+    CliClient *client;          // NULL once the client quit
+    long long quit_ms;
+    struct AdminConn *prev;
+    struct AdminConn *next;
+} AdminConn;
+
+static Reactor *admin_reactor = NULL;
+static int admin_fd = -1;
+static char admin_path[256];
+static AdminConn *conns = NULL;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void conn_remove(AdminConn *ac) {
+    if (ac->prev) ac->prev->next = ac->next;
+    else conns = ac->next;
+    if (ac->next) ac->next->prev = ac->prev;
+    if (ac->client) cli_client_free(ac->client);
+    free(ac);
+}
+
+static void admin_on_input(ReactorStream *stream, void *ctx) {
+    AdminConn *ac = ctx;
+    size_t len = 0;
+    char *line;
+    while (ac->client && (line = ipc_reader_next_line(&stream->rx, &len)) != NULL) {
+        if (cli_execute(ac->client, line) < 0) {
+            log_info("Admin client %lu disconnected", cli_client_id(ac->client));
+            // stop routing to it, but let the replies already queued drain
+            cli_client_free(ac->client);
+            ac->client = NULL;
+            ac->quit_ms = now_ms();
+        }
+    }
+}
+
+static void admin_on_close(ReactorStream *stream, void *ctx) {
+    (void)stream;
+    AdminConn *ac = ctx;
+    if (ac->client) log_info("Admin client %lu closed", cli_client_id(ac->client));
+    conn_remove(ac);
+}
+
+static const ReactorStreamOps admin_ops = {
+    admin_on_input,
+    admin_on_close,
+    NULL,
+};
+
+static void close_quit_conns(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    long long now = now_ms();
+    AdminConn *ac = conns;
+    while (ac) {
+        AdminConn *next = ac->next;
+        if (!ac->client &&
+            (reactor_stream_pending(ac->stream) == 0 || now - ac->quit_ms >= ADMIN_LINGER_MS)) {
+            reactor_stream_close(ac->stream);
+            conn_remove(ac);
+        }
+        ac = next;
+    }
+}
+
+static void admin_on_accept(Reactor *r, int fd, void *ctx) {
+    (void)ctx;
+    AdminConn *ac = calloc(1, sizeof(AdminConn));
+    if (!ac) {
+        close(fd);
+        return;
+    }
+    ac->stream = reactor_stream_open(r, fd, &admin_ops, ac);
+    if (!ac->stream) {
+        close(fd);
+        free(ac);
+        return;
+    }
+    ac->client = cli_client_new(ac->stream);
+    if (!ac->client) {
+        reactor_stream_close(ac->stream);
+        free(ac);
+        return;
+    }
+    ac->next = conns;
+    if (conns) conns->prev = ac;
+    conns = ac;
+    log_info("Admin client %lu connected", cli_client_id(ac->client));
+}
+
+int admin_start(Reactor *front, const char *path) {
+    // the admin socket runs any command on any node: owner only
+    int fd = ipc_unix_listen(path, 0600);
+    if (fd < 0) return -1;
+    return admin_start_fd(front, fd, path);
+}
+
+int admin_start_fd(Reactor *front, int fd, const char *path) {
+    if (reactor_watch_listener(front, fd, admin_on_accept, NULL) < 0) {
+        log_error("Failed to watch admin socket %s", path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    reactor_add_tick(front, ADMIN_SWEEP_MS, close_quit_conns, NULL);
+    admin_reactor = front;
+    admin_fd = fd;
+    snprintf(admin_path, sizeof(admin_path), "%s", path);
+    return 0;
+}
+
+int admin_listen_fd(void) {
+    return admin_fd;
+}
+
+typedef struct {
+    char *client;
+    admin_handover_fn fn;
+    void *arg;
+} AdminHandover;
+
+static void conn_handed_over(int fd, const char *pending, size_t pending_len, const char *unsent,
+                             size_t unsent_len, void *ctx) {
+    AdminHandover *h = ctx;
+    h->fn(fd, h->client, pending, pending_len, unsent, unsent_len, h->arg);
+    free(h->client);
+    free(h);
+}
+
+int admin_handover(admin_handover_fn fn, void *arg) {
+    if (admin_fd < 0 || !fn) return 0;
+    reactor_unwatch_fd(admin_reactor, admin_fd);
+    close(admin_fd);
+    admin_fd = -1;
+    int started = 0;
+    AdminConn *ac = conns;
+    while (ac) {
+        AdminConn *next = ac->next;
+        // a client that already quit is only waiting for its replies to drain
+        AdminHandover *h = ac->client ? calloc(1, sizeof(AdminHandover)) : NULL;
+        if (h) {
+            h->client = cli_client_save(ac->client);
+            h->fn = fn;
+            h->arg = arg;
+        }
+        if (!h || !h->client || reactor_stream_detach(ac->stream, conn_handed_over, h) < 0) {
+            if (h) free(h->client);
+            free(h);
+            reactor_stream_close(ac->stream);
+        } else {
+            started++;
+        }
+        conn_remove(ac);
+        ac = next;
+    }
+    return started;
+}
+
+int admin_adopt(int fd, const JsonMsg *client, Arena *a, const char *unread, size_t unread_len, const char *unsent,
+                size_t unsent_len) {
+    if (!admin_reactor) {
+        close(fd);
+        return -1;
+    }
+    AdminConn *ac = calloc(1, sizeof(AdminConn));
+    if (!ac) {
+        close(fd);
+        return -1;
+    }
+    ac->stream = reactor_stream_open(admin_reactor, fd, &admin_ops, ac);
+    if (!ac->stream) {
+        close(fd);
+        free(ac);
+        return -1;
+    }
+    ac->client = cli_client_restore(ac->stream, client, a);
+    if (!ac->client) {
+        reactor_stream_close(ac->stream);
+        free(ac);
+        return -1;
+    }
+    ac->next = conns;
+    if (conns) conns->prev = ac;
+    conns = ac;
+    if (unsent_len > 0) reactor_stream_write(ac->stream, unsent, unsent_len);
+    if (unread_len > 0 && ipc_reader_feed(&ac->stream->rx, unread, unread_len) == 0) {
+        admin_on_input(ac->stream, ac);
+    }
+    log_info("Admin client %lu taken over", cli_client_id(ac->client));
+    return 0;
+}
+
+void admin_stop(void) {
+    if (admin_fd < 0) return;
+    while (conns) {
+        reactor_stream_close(conns->stream);
+        conn_remove(conns);
+    }
+    reactor_unwatch_fd(admin_reactor, admin_fd);
+    close(admin_fd);
+    unlink(admin_path);
+    admin_fd = -1;
+    admin_reactor = NULL;
+}
@@ -1,212 +1,1403 @@
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "../include/agent_schedule.h"
 #include "../include/cli.h"
+#include "../include/cluster.h"
+#include "../include/dialer.h"
+#include "../include/json_escape.h"
 #include "../include/logging.h"
 #include "../include/node_manager.h"
+#include "../include/placement.h"
+#include "../include/relay.h"
+#include "../include/requests.h"
+#include "../include/result_groups.h"
+#include "../include/scripts.h"
+#include "../include/selector.h"
+#include "../include/shard.h"
 #include "../include/shutdown.h"
+#include "../include/telemetry.h"
+#include "../include/transfer.h"
 
-static char *escape_json_string(const char *input) {
-    if (!input) return strdup("");
-    size_t len = strlen(input);
-    size_t cap = len * 2 + 1;
-    char *out = malloc(cap);
-    if (!out) return strdup("");
-
-    size_t o = 0;
-    for (size_t i = 0; i < len; ++i) {
-        char c = input[i];
-        if (c == '"' || c == '\\') {
-            if (o + 2 >= cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) break;
-                out = tmp;
-            }
-            out[o++] = '\\';
-            out[o++] = c;
-        } else if (c == '\n') {
-            if (o + 2 >= cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) break;
-                out = tmp;
-            }
-            out[o++] = '\\';
-            out[o++] = 'n';
-        } else if (c == '\r') {
-            if (o + 2 >= cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) break;
-                out = tmp;
-            }
-            out[o++] = '\\';
-            out[o++] = 'r';
-        } else if (c == '\t') {
-            if (o + 2 >= cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) break;
-                out = tmp;
-            }
-            out[o++] = '\\';
-            out[o++] = 't';
-        } else {
-            if (o + 1 >= cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) break;
-                out = tmp;
-            }
-            out[o++] = c;
-        }
-    }
-    out[o] = '\0';
-    return out;
-}
+#define CONSOLE_ID 1
+// Result output queued for a client beyond this is dropped, not buffered;
+// a client with nothing queued takes any one result, however long.
+#define CLI_MAX_BACKLOG (8 * 1024 * 1024)
+// Bytes written to the console per readiness event.
+#define CONSOLE_CHUNK 4096
+#define CLI_MAX_SUBSCRIPTIONS 16
+#define REQUEST_MAX_AGE 3600
+#define REQUEST_SWEEP_MS 60000
+// A fan-out's grouped results are summed up this often while they come in.
+#define GROUP_SUMMARY_MS 1000
+// It is shown once no result has come for this long, whether its total is
+// never known (other controllers ran it too) or some nodes are not
+// answering (their session ended, or the command still runs there).
+#define GROUP_QUIET_S 5
+
+struct CliClient {
+    unsigned long id;
+    ReactorStream *stream;      // NULL for the console
+    const CliSink *sink;        // instead of a stream, see cli_client_new_sink()
+    void *sink_ctx;
+    char request_id[REQUEST_ID_LEN];    // set while a forwarded line runs
+    char subs[CLI_MAX_SUBSCRIPTIONS][SELECTOR_MAX_LEN + 1];
+    int nsubs;
+    char watch[CLI_MAX_SUBSCRIPTIONS][REQUEST_ID_LEN];
+    int nwatch;
+    unsigned long dropped;
+    CliClient *prev;
+    CliClient *next;
+};
+
+static Reactor *front_reactor = NULL;
+static CliClient *clients = NULL;
+static CliClient *console = NULL;
+static unsigned long next_client_id = CONSOLE_ID + 1;
+
+// console output, written as stdout accepts it
+static IpcWriter console_out;
+static int console_watched = 0;
+static int stdout_flags = -1;
 
 CliArgs parse_cli_args(int argc, char **argv) {
     CliArgs args = (CliArgs){0};
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
             args.config = argv[++i];
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            args.takeover = 1;
         }
     }
     return args;
 }
 
-void parse_cli_command(const char *input_line) {
-    if (!input_line) {
-        log_info("Empty command");
+// --- output ---
+
+static void console_flush_blocking(void) {
+    while (console_out.off < console_out.len) {
+        ssize_t w = write(STDOUT_FILENO, console_out.buf + console_out.off,
+                          console_out.len - console_out.off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) {
+            usleep(1000);
+            continue;
+        }
+        if (w <= 0) break;
+        console_out.off += (size_t)w;
+    }
+    console_out.off = 0;
+    console_out.len = 0;
+}
+
+static void console_writable(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)events;
+    (void)ctx;
+    size_t pending = ipc_writer_pending(&console_out);
+    size_t n = pending < CONSOLE_CHUNK ? pending : CONSOLE_CHUNK;
+    ssize_t w = n ? write(fd, console_out.buf + console_out.off, n) : 0;
+    if (w < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        // nobody is reading any more; keep running without a console
+        console_out.off = console_out.len;
+    } else {
+        console_out.off += (size_t)w;
+    }
+    if (console_out.off == console_out.len) {
+        console_out.off = 0;
+        console_out.len = 0;
+        reactor_unwatch_fd(r, fd);
+        console_watched = 0;
+    }
+}
+
+static void console_write(const char *data, size_t len) {
+    if (ipc_writer_append(&console_out, data, len) < 0) return;
+    if (console_watched) return;
+    if (front_reactor &&
+        reactor_watch_fd(front_reactor, STDOUT_FILENO, REACTOR_WRITE, console_writable, NULL) == 0) {
+        console_watched = 1;
         return;
     }
+    // no reactor yet, or stdout is a regular file the backend cannot poll
+    console_flush_blocking();
+}
 
-    char *line = strdup(input_line);
-    if (!line) return;
+static size_t client_backlog(const CliClient *c) {
+    if (c->sink) return 0;
+    return c->stream ? reactor_stream_pending(c->stream) : ipc_writer_pending(&console_out);
+}
 
-    char *cursor = line;
-    while (*cursor && isspace((unsigned char)*cursor)) cursor++;
-    if (*cursor == '\0') {
-        log_info("Empty command");
-        free(line);
+void cli_write(CliClient *c, const char *data, size_t len) {
+    if (!c || !data || len == 0) return;
+    if (c->sink) {
+        c->sink->write(c->sink_ctx, data, len);
+    } else if (c->stream) {
+        // fails only when the send queue overflows; the reactor then
+        // closes the stream and on_close frees the client
+        if (reactor_stream_write(c->stream, data, len) < 0) c->dropped++;
+    } else {
+        console_write(data, len);
+    }
+}
+
+void cli_printf(CliClient *c, const char *fmt, ...) {
+    char stack[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(stack, sizeof(stack), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(stack)) {
+        cli_write(c, stack, (size_t)n);
         return;
     }
+    char *heap = malloc((size_t)n + 1);
+    if (!heap) return;
+    va_start(ap, fmt);
+    vsnprintf(heap, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    cli_write(c, heap, (size_t)n);
+    free(heap);
+}
 
-    char *saveptr = NULL;
-    char *verb = strtok_r(cursor, " ", &saveptr);
-    if (!verb) {
-        log_info("Empty command");
-        free(line);
+static CliClient *client_find(unsigned long id) {
+    for (CliClient *c = clients; c; c = c->next) {
+        if (c->id == id) return c;
+    }
+    return NULL;
+}
+
+void cli_write_to(unsigned long client_id, const char *data, size_t len) {
+    cli_write(client_find(client_id), data, len);
+}
+
+typedef struct {
+    unsigned long client_id;
+    size_t len;
+    char text[];
+} CliReply;
+
+static void reply_task(Reactor *r, void *arg) {
+    (void)r;
+    CliReply *m = arg;
+    CliClient *c = client_find(m->client_id);
+    if (c) cli_write(c, m->text, m->len);
+    free(m);
+}
+
+void cli_reply(unsigned long client_id, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !front_reactor) return;
+
+    CliReply *m = malloc(sizeof(CliReply) + (size_t)n + 2);
+    if (!m) return;
+    va_start(ap, fmt);
+    vsnprintf(m->text, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    m->text[n] = '\n';
+    m->text[n + 1] = '\0';
+    m->len = (size_t)n + 1;
+    m->client_id = client_id;
+    if (reactor_post(front_reactor, reply_task, m) < 0) free(m);
+}
+
+// --- clients ---
+
+static CliClient *client_new(ReactorStream *stream) {
+    CliClient *c = calloc(1, sizeof(CliClient));
+    if (!c) return NULL;
+    c->stream = stream;
+    c->id = stream ? next_client_id++ : CONSOLE_ID;
+    c->next = clients;
+    if (clients) clients->prev = c;
+    clients = c;
+    return c;
+}
+
+CliClient *cli_console(void) {
+    if (!console) {
+        console = client_new(NULL);
+        // the console sees every result, as it always has
+        if (console) {
+            snprintf(console->subs[0], sizeof(console->subs[0]), "*");
+            console->nsubs = 1;
+        }
+    }
+    return console;
+}
+
+CliClient *cli_client_new(ReactorStream *stream) {
+    return stream ? client_new(stream) : NULL;
+}
+
+CliClient *cli_client_new_sink(const CliSink *sink, void *ctx) {
+    if (!sink) return NULL;
+    CliClient *c = client_new(NULL);
+    if (!c) return NULL;
+    c->id = next_client_id++;
+    c->sink = sink;
+    c->sink_ctx = ctx;
+    return c;
+}
+
+static void grouped_forget_client(unsigned long client_id);
+
+void cli_client_free(CliClient *c) {
+    if (!c) return;
+    if (c->prev) c->prev->next = c->next;
+    else clients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    request_forget_client(c->id);
+    grouped_forget_client(c->id);
+    if (c->sink) c->sink->closed(c->sink_ctx);
+    else cluster_client_gone(c->id);
+    if (c == console) console = NULL;
+    free(c);
+}
+
+unsigned long cli_client_id(const CliClient *c) {
+    return c ? c->id : 0;
+}
+
+// Joins n entries of a list with newlines, escaped for a JSON string.
+static char *list_escaped(const char *list, int n, size_t stride) {
+    size_t len = 0;
+    for (int i = 0; i < n; ++i) len += strlen(list + (size_t)i * stride) + 1;
+    char *joined = malloc(len + 1);
+    if (!joined) return NULL;
+    char *p = joined;
+    for (int i = 0; i < n; ++i) {
+        size_t l = strlen(list + (size_t)i * stride);
+        memcpy(p, list + (size_t)i * stride, l);
+        p += l;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    char *escaped = json_escape(joined);
+    free(joined);
+    return escaped;
+}
+
+// Splits a newline-separated list back into fixed-size entries.
+static int list_parse(const char *text, char *list, int max, size_t stride) {
+    int n = 0;
+    while (text && *text && n < max) {
+        size_t l = strcspn(text, "\n");
+        if (l > 0 && l < stride) {
+            memcpy(list + (size_t)n * stride, text, l);
+            list[(size_t)n * stride + l] = '\0';
+            n++;
+        }
+        text += l;
+        if (*text) text++;
+    }
+    return n;
+}
+
+char *cli_client_save(const CliClient *c) {
+    if (!c) return NULL;
+    char *subs = list_escaped(&c->subs[0][0], c->nsubs, sizeof(c->subs[0]));
+    char *watch = list_escaped(&c->watch[0][0], c->nwatch, sizeof(c->watch[0]));
+    char *out = NULL;
+    if (subs && watch) {
+        size_t size = strlen(subs) + strlen(watch) + 96;
+        out = malloc(size);
+        if (out) {
+            snprintf(out, size, "\"client\":%lu,\"subs\":\"%s\",\"watch\":\"%s\",\"dropped\":%lu", c->id, subs,
+                     watch, c->dropped);
+        }
+    }
+    free(subs);
+    free(watch);
+    return out;
+}
+
+CliClient *cli_client_restore(ReactorStream *stream, const JsonMsg *m, Arena *a) {
+    long id = json_msg_int(m, "client", 0);
+    if (!stream || id <= CONSOLE_ID) return NULL;
+    CliClient *c = client_new(stream);
+    if (!c) return NULL;
+    c->id = (unsigned long)id;
+    if (c->id >= next_client_id) next_client_id = c->id + 1;
+    c->nsubs = list_parse(json_msg_str(m, "subs", a, NULL), &c->subs[0][0], CLI_MAX_SUBSCRIPTIONS,
+                          sizeof(c->subs[0]));
+    c->nwatch = list_parse(json_msg_str(m, "watch", a, NULL), &c->watch[0][0], CLI_MAX_SUBSCRIPTIONS,
+                           sizeof(c->watch[0]));
+    c->dropped = (unsigned long)json_msg_int(m, "dropped", 0);
+    return c;
+}
+
+unsigned long cli_next_client_id(void) {
+    return next_client_id;
+}
+
+void cli_set_next_client_id(unsigned long id) {
+    if (id > next_client_id) next_client_id = id;
+}
+
+// --- results ---
+
+// 1 if any name in a comma-separated list matches selector.
+static int nodes_match(const char *selector, const char *nodes) {
+    char name[256];
+    while (*nodes) {
+        size_t len = strcspn(nodes, ",");
+        if (len < sizeof(name)) {
+            memcpy(name, nodes, len);
+            name[len] = '\0';
+            if (selector_match(selector, name)) return 1;
+        }
+        nodes += len;
+        if (*nodes == ',') nodes++;
+    }
+    return 0;
+}
+
+static int client_wants(const CliClient *c, const NodeResult *res) {
+    for (int i = 0; i < c->nwatch; ++i) {
+        if (strcmp(c->watch[i], res->id) == 0) return 1;
+    }
+    for (int i = 0; i < c->nsubs; ++i) {
+        if (selector_match(c->subs[i], res->node)) return 1;
+        if (res->nodes && nodes_match(c->subs[i], res->nodes)) return 1;
+    }
+    return 0;
+}
+
+static char *format_result(const NodeResult *res, size_t *out_len) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (!f) return NULL;
+    // a command stopped early: what follows is only part of its output
+    char stopped[48] = "";
+    if (res->status[0]) snprintf(stopped, sizeof(stopped), ", %s, partial output", res->status);
+    if (res->count > 1) {
+        // one block for every node a relay found with this same result
+        fprintf(f, "\n[%s +%d more] command result (id=%s, exit=%d%s)\n",
+                res->node, res->count - 1, res->id[0] ? res->id : "unknown", res->exit_code, stopped);
+        fprintf(f, "nodes (%d): %s\n", res->count, res->nodes ? res->nodes : res->node);
+    } else {
+        fprintf(f, "\n[%s] command result (id=%s, exit=%d%s)\n",
+                res->node, res->id[0] ? res->id : "unknown", res->exit_code, stopped);
+    }
+    if (res->out_len > 0) {
+        fputs("stdout:\n", f);
+        fwrite(res->out, 1, res->out_len, f);
+        fputc('\n', f);
+    } else {
+        fputs("stdout: <empty>\n", f);
+    }
+    if (res->err_len > 0) {
+        fputs("stderr:\n", f);
+        fwrite(res->err, 1, res->err_len, f);
+        fputc('\n', f);
+    } else {
+        fputs("stderr: <empty>\n", f);
+    }
+    fclose(f);
+    *out_len = len;
+    return text;
+}
+
+static void deliver(CliClient *c, const char *text, size_t len) {
+    size_t backlog = client_backlog(c);
+    if (backlog > 0 && backlog + len > CLI_MAX_BACKLOG) {
+        c->dropped++;
         return;
     }
+    if (c->dropped) {
+        cli_printf(c, "\n[warning] %lu results dropped, client too slow\n", c->dropped);
+        c->dropped = 0;
+    }
+    cli_write(c, text, len);
+}
 
-    if (strcmp(verb, "nodes") == 0) {
-        NodeSession snapshot[MAX_SESSIONS];
-        int count = node_sessions_copy(snapshot, MAX_SESSIONS);
+// --- grouped results ---
 
-        printf("Connected nodes (%d):\n", count);
-        if (count == 0) {
-            printf("  <none>\n");
-        } else {
-            for (int i = 0; i < count; ++i) {
-                printf("  - %s (fd=%d, os=%s)\n",
-                       snapshot[i].meta.name[0] ? snapshot[i].meta.name : "<unnamed>",
-                       snapshot[i].fd,
-                       snapshot[i].meta.os[0] ? snapshot[i].meta.os : "unknown");
-            }
+// The results of a fan-out reach the client that ran it grouped by output
+// (result_groups.h): a summary line while they come in, then one block
+// per distinct result once all are in. Subscribers still get each one.
+typedef struct GroupedExec {
+    char id[REQUEST_ID_LEN];
+    unsigned long client_id;
+    ResultGroups groups;
+    int reported;       // nodes in the last summary
+    time_t last_result;
+    struct GroupedExec *next;
+} GroupedExec;
+
+static GroupedExec *grouped = NULL;
+
+static GroupedExec **grouped_slot(const char *id) {
+    GroupedExec **pp = &grouped;
+    while (*pp && strcmp((*pp)->id, id) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+static void grouped_begin(const char *id, unsigned long client_id) {
+    GroupedExec *ge = calloc(1, sizeof(GroupedExec));
+    if (!ge) return;
+    snprintf(ge->id, sizeof(ge->id), "%s", id);
+    ge->client_id = client_id;
+    result_groups_init(&ge->groups);
+    ge->last_result = time(NULL);
+    ge->next = grouped;
+    grouped = ge;
+}
+
+static void grouped_drop(GroupedExec **pp) {
+    GroupedExec *ge = *pp;
+    *pp = ge->next;
+    result_groups_free(&ge->groups);
+    free(ge);
+}
+
+static void grouped_forget_client(unsigned long client_id) {
+    GroupedExec **pp = &grouped;
+    while (*pp) {
+        if ((*pp)->client_id == client_id) grouped_drop(pp);
+        else pp = &(*pp)->next;
+    }
+}
+
+typedef struct {
+    const char *id;
+    FILE *f;
+} GroupPrint;
+
+static void print_group(const NodeResult *group, void *arg) {
+    GroupPrint *gp = arg;
+    NodeResult res = *group;
+    snprintf(res.id, sizeof(res.id), "%s", gp->id);
+    size_t len = 0;
+    char *text = format_result(&res, &len);
+    if (text) fwrite(text, 1, len, gp->f);
+    free(text);
+}
+
+// Shows the groups of a fan-out that is over, or has gone quiet, and
+// forgets them; results still coming after that are delivered one by one.
+static void grouped_finish(GroupedExec **pp) {
+    GroupedExec *ge = *pp;
+    CliClient *c = client_find(ge->client_id);
+    char summary[160];
+    result_groups_summary(&ge->groups, summary, sizeof(summary));
+    int expected = 0, seen = 0;
+    int open = request_progress(ge->id, &expected, &seen) == 0;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = c && ge->groups.nodes > 0 ? open_memstream(&text, &len) : NULL;
+    if (f) {
+        GroupPrint gp = { ge->id, f };
+        fprintf(f, "\nResults of %s: %s", ge->id, summary);
+        if (open && expected > seen) fprintf(f, " (%d of %d answered)", seen, expected);
+        fputc('\n', f);
+        result_groups_each(&ge->groups, print_group, &gp);
+        fclose(f);
+        deliver(c, text, len);
+        free(text);
+    }
+    grouped_drop(pp);
+}
+
+static void grouped_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    time_t now = time(NULL);
+    GroupedExec **pp = &grouped;
+    while (*pp) {
+        GroupedExec *ge = *pp;
+        int expected = 0, seen = 0;
+        int open = request_progress(ge->id, &expected, &seen) == 0;
+        if (!open || (ge->groups.nodes > 0 && now - ge->last_result >= GROUP_QUIET_S)) {
+            grouped_finish(pp);
+            continue;
         }
-        fflush(stdout);
-    } else if (strcmp(verb, "ping") == 0) {
-        char *node_name = strtok_r(NULL, " ", &saveptr);
-        if (!node_name) {
-            log_error("Usage: ping <node-name>");
-            free(line);
-            return;
+        if (ge->groups.nodes != ge->reported) {
+            char summary[160];
+            result_groups_summary(&ge->groups, summary, sizeof(summary));
+            if (expected > 0) {
+                cli_reply(ge->client_id, "Results of %s so far (%d/%d): %s", ge->id, seen, expected, summary);
+            } else {
+                cli_reply(ge->client_id, "Results of %s so far: %s", ge->id, summary);
+            }
+            ge->reported = ge->groups.nodes;
         }
+        pp = &ge->next;
+    }
+}
 
-        NodeSession *session = node_session_find_by_name(node_name);
-        if (!session) {
-            log_error("Node not found: %s", node_name);
-            free(line);
-            return;
+static void on_result(const NodeResult *res) {
+    // the text is only made for a client that takes it
+    size_t len = 0;
+    char *text = NULL;
+    unsigned long owner = request_owner(res->id);
+    GroupedExec **gpp = owner ? grouped_slot(res->id) : NULL;
+    GroupedExec *ge = gpp ? *gpp : NULL;
+    CliClient *c = clients;
+    while (c) {
+        // writing may close a stream, but the client lives until on_close
+        CliClient *next = c->next;
+        int wanted = c->id == owner ? !ge : client_wants(c, res);
+        // a peer controller wants the result itself, not its text
+        if (c->id == owner && c->sink) {
+            c->sink->result(c->sink_ctx, res);
+        } else if (wanted) {
+            if (!text) text = format_result(res, &len);
+            if (text) deliver(c, text, len);
         }
+        c = next;
+    }
+    if (ge) {
+        if (result_groups_add(&ge->groups, res) < 0) log_error("Out of memory grouping results of %s", res->id);
+        ge->last_result = time(NULL);
+    }
+    placement_result(res);
+    request_result_seen(res->id, res->count);
+    if (ge && request_owner(res->id) == 0) grouped_finish(gpp);
+    free(text);
+}
 
-        const char *ping_msg = "{\"type\":\"ping\"}";
-        if (node_session_send(session, ping_msg) < 0) {
-            log_error("Failed to send ping to %s", node_name);
-        } else {
-            session->last_seen = time(NULL);
-            log_info("Ping sent to %s", node_name);
+static void expire_requests(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    request_expire(REQUEST_MAX_AGE);
+}
+
+void cli_init(Reactor *front) {
+    front_reactor = front;
+    ipc_writer_init(&console_out);
+    stdout_flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+    if (stdout_flags >= 0) fcntl(STDOUT_FILENO, F_SETFL, stdout_flags | O_NONBLOCK);
+    cli_console();
+    node_manager_on_result(on_result);
+    reactor_add_tick(front, REQUEST_SWEEP_MS, expire_requests, NULL);
+    reactor_add_tick(front, GROUP_SUMMARY_MS, grouped_tick, NULL);
+}
+
+void cli_shutdown(void) {
+    if (console_watched && front_reactor) reactor_unwatch_fd(front_reactor, STDOUT_FILENO);
+    console_watched = 0;
+    console_flush_blocking();
+    if (stdout_flags >= 0) fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+    stdout_flags = -1;
+    while (clients) cli_client_free(clients);
+    ipc_writer_free(&console_out);
+    front_reactor = NULL;
+}
+
+// --- commands ---
+
+// " on <controller>" when this is one of several, so replies merged from
+// all of them say where each comes from.
+static const char *where(void) {
+    static char buf[300];
+    if (!cluster_enabled()) return "";
+    snprintf(buf, sizeof(buf), " on %s", cluster_self());
+    return buf;
+}
+
+// Runs the line on another controller for c instead.
+static int forward_to(CliClient *c, int peer, const char *id, const char *line) {
+    if (cluster_forward(peer, c->id, id, line) == 0) return 0;
+    cli_printf(c, "Controller %s is unreachable\n", cluster_peer_name(peer));
+    return -1;
+}
+
+// Commands for one node run on the shard that owns it.
+typedef struct {
+    char node[256];
+    char target[256];   // the node meant, when node is the relay reaching it
+    char id[64];
+    unsigned long client_id;
+    char payload[];
+} NodeCommand;
+
+static NodeCommand *node_command_new(const char *node, const char *id, unsigned long client_id,
+                                     const char *payload) {
+    size_t len = strlen(payload);
+    NodeCommand *c = malloc(sizeof(NodeCommand) + len + 1);
+    if (!c) return NULL;
+    snprintf(c->node, sizeof(c->node), "%s", node);
+    snprintf(c->target, sizeof(c->target), "%s", node);
+    snprintf(c->id, sizeof(c->id), "%s", id ? id : "");
+    c->client_id = client_id;
+    memcpy(c->payload, payload, len + 1);
+    return c;
+}
+
+static int post_node_command(NodeCommand *c, reactor_task_fn fn) {
+    if (shard_post(shard_for_name(c->node), fn, c) < 0) {
+        log_error("Failed to queue command for %s", c->node);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
+
+static void ping_task(Reactor *r, void *arg) {
+    (void)r;
+    NodeCommand *c = arg;
+    NodeSession *session = node_session_find_by_name(c->node);
+    if (!session) {
+        log_error("Node not found: %s", c->node);
+        cli_reply(c->client_id, "Node not found: %s", c->node);
+    } else if (node_session_send(session, c->payload) < 0) {
+        log_error("Failed to send ping to %s", c->node);
+        cli_reply(c->client_id, "Failed to send ping to %s", c->node);
+    } else {
+        session->last_seen = time(NULL);
+        log_info("Ping sent to %s", c->node);
+        cli_reply(c->client_id, "Ping sent to %s", c->node);
+    }
+    free(c);
+}
+
+// payload names the tier
+static void telemetry_task(Reactor *r, void *arg) {
+    (void)r;
+    NodeCommand *c = arg;
+    NodeSession *session = node_session_find_by_name(c->node);
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    if (!session) {
+        cli_reply(c->client_id, "Node not found: %s", c->node);
+    } else if (!session->telemetry) {
+        cli_reply(c->client_id, "No telemetry from %s yet", c->node);
+    } else if ((f = open_memstream(&text, &len)) != NULL) {
+        fprintf(f, "Telemetry for %s (%s): ", c->node, c->payload);
+        telemetry_series_print(session->telemetry, telemetry_tier_parse(c->payload), f);
+        fclose(f);
+        // the text ends in a newline already
+        if (len > 0) text[len - 1] = '\0';
+        cli_reply(c->client_id, "%s", text);
+        free(text);
+    }
+    free(c);
+}
+
+static void exec_task(Reactor *r, void *arg) {
+    (void)r;
+    NodeCommand *c = arg;
+    NodeSession *session = node_session_find_by_name(c->node);
+    if (!session) {
+        log_error("Node not found: %s", c->target);
+        cli_reply(c->client_id, "Node not found: %s", c->target);
+    } else if (node_session_send(session, c->payload) < 0) {
+        log_error("Failed to send exec to %s", c->target);
+        cli_reply(c->client_id, "Failed to send exec to %s", c->target);
+    } else if (strcmp(c->node, c->target) != 0) {
+        session->last_seen = time(NULL);
+        log_info("Sent command id=%s to %s via %s", c->id, c->target, c->node);
+        cli_reply(c->client_id, "Sent command id=%s to %s via %s", c->id, c->target, c->node);
+    } else {
+        session->last_seen = time(NULL);
+        log_info("Sent command id=%s to %s", c->id, c->node);
+        cli_reply(c->client_id, "Sent command id=%s to %s", c->id, c->node);
+    }
+    free(c);
+}
+
+typedef struct {
+    unsigned long client_id;
+    NodeSession *sessions[MAX_SHARDS];
+    int counts[MAX_SHARDS];
+} NodesSnapshot;
+
+static void nodes_collect(int shard, void *arg) {
+    NodesSnapshot *snap = arg;
+    int count = node_sessions_count();
+    if (count == 0) return;
+    snap->sessions[shard] = malloc((size_t)count * sizeof(NodeSession));
+    if (!snap->sessions[shard]) return;
+    snap->counts[shard] = node_sessions_copy(snap->sessions[shard], count);
+}
+
+static void nodes_print(Reactor *r, void *arg) {
+    (void)r;
+    NodesSnapshot *snap = arg;
+    CliClient *c = client_find(snap->client_id);
+    int total = 0;
+    for (int i = 0; i < MAX_SHARDS; ++i) total += snap->counts[i];
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = c ? open_memstream(&text, &len) : NULL;
+    if (f) {
+        fprintf(f, "Connected nodes%s (%d):\n", where(), total);
+        if (total == 0) {
+            fprintf(f, "  <none>\n");
         }
-    } else if (strcmp(verb, "exec") == 0) {
-        char *node_name = strtok_r(NULL, " ", &saveptr);
-        if (!node_name) {
-            log_error("Usage: exec <node-name> <command>");
-            free(line);
-            return;
+        if (relay_total() > 0) fprintf(f, "Reachable through relays: %d\n", relay_total());
+    }
+    for (int i = 0; i < MAX_SHARDS; ++i) {
+        for (int j = 0; f && j < snap->counts[i]; ++j) {
+            const NodeSession *s = &snap->sessions[i][j];
+            int below = relay_size(s->meta.name);
+            char relay_note[48] = "";
+            if (below > 0) snprintf(relay_note, sizeof(relay_note), ", relay for %d", below);
+            char hb_note[96] = "";
+            if (s->hb_at) {
+                snprintf(hb_note, sizeof(hb_note), ", load %u.%02u, mem %u%%, heartbeat %lds ago",
+                         s->load1 / 100, s->load1 % 100, s->mem_used, (long)(time(NULL) - s->hb_at));
+            }
+            fprintf(f, "  - %s (fd=%d, os=%s, shard=%d%s%s%s)\n",
+                    s->meta.name[0] ? s->meta.name : "<unnamed>",
+                    s->fd,
+                    s->meta.os[0] ? s->meta.os : "unknown",
+                    s->shard,
+                    s->shm ? ", shm" : "",
+                    relay_note,
+                    hb_note);
+            if (below > 0) relay_print_tree(f, s->meta.name, "      ");
         }
+        free(snap->sessions[i]);
+    }
+    if (f) {
+        dialer_print(f);
+        // peers answer a forwarded `nodes` with their own list
+        if (!c->sink) cluster_print(f);
+        fclose(f);
+        cli_write(c, text, len);
+        free(text);
+    }
+    free(snap);
+}
 
-        char *cmd_text = saveptr;
-        while (cmd_text && isspace((unsigned char)*cmd_text)) cmd_text++;
-        if (!cmd_text || *cmd_text == '\0') {
-            log_error("No command provided for exec");
-            free(line);
+static void print_subscriptions(CliClient *c) {
+    if (c->nsubs == 0 && c->nwatch == 0) {
+        cli_printf(c, "Subscriptions: <none> (own requests only)\n");
+        return;
+    }
+    cli_printf(c, "Subscriptions:\n");
+    for (int i = 0; i < c->nsubs; ++i) cli_printf(c, "  nodes %s\n", c->subs[i]);
+    for (int i = 0; i < c->nwatch; ++i) cli_printf(c, "  id %s\n", c->watch[i]);
+}
+
+static void subscribe(CliClient *c, char *kind, char *arg) {
+    if (strcmp(kind, "id") == 0) {
+        if (!arg || strlen(arg) >= REQUEST_ID_LEN) {
+            cli_printf(c, "Usage: subscribe id <request-id>\n");
             return;
         }
-
-        NodeSession *session = node_session_find_by_name(node_name);
-        if (!session) {
-            log_error("Node not found: %s", node_name);
-            free(line);
+        for (int i = 0; i < c->nwatch; ++i) {
+            if (strcmp(c->watch[i], arg) == 0) return;
+        }
+        if (c->nwatch == CLI_MAX_SUBSCRIPTIONS) {
+            cli_printf(c, "Too many subscriptions\n");
             return;
         }
+        snprintf(c->watch[c->nwatch++], REQUEST_ID_LEN, "%s", arg);
+        cli_printf(c, "Subscribed to id %s\n", arg);
+        return;
+    }
 
-        static unsigned int counter = 0;
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        long long timestamp_ms = (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
-        counter++;
+    // "subscribe <selector>" and "subscribe nodes <selector>"
+    const char *sel = strcmp(kind, "nodes") == 0 ? arg : kind;
+    if (!sel || !selector_valid(sel)) {
+        cli_printf(c, "Usage: subscribe [nodes] <selector> | subscribe id <request-id>\n");
+        return;
+    }
+    for (int i = 0; i < c->nsubs; ++i) {
+        if (strcmp(c->subs[i], sel) == 0) return;
+    }
+    if (c->nsubs == CLI_MAX_SUBSCRIPTIONS) {
+        cli_printf(c, "Too many subscriptions\n");
+        return;
+    }
+    snprintf(c->subs[c->nsubs++], SELECTOR_MAX_LEN + 1, "%s", sel);
+    cli_printf(c, "Subscribed to nodes %s\n", sel);
+}
 
-        char id[64];
-        snprintf(id, sizeof(id), "%lld_%u", timestamp_ms, counter);
+// Removes value from a list of n entries of size bytes each.
+static int list_remove(char *list, int *n, size_t size, const char *value) {
+    for (int i = 0; i < *n; ++i) {
+        char *entry = list + (size_t)i * size;
+        if (strcmp(entry, value) != 0) continue;
+        memmove(entry, entry + size, (size_t)(*n - i - 1) * size);
+        (*n)--;
+        return 0;
+    }
+    return -1;
+}
 
-        char *escaped_cmd = escape_json_string(cmd_text);
-        if (!escaped_cmd) {
-            log_error("Failed to allocate command buffer");
-            free(line);
-            return;
+static void unsubscribe(CliClient *c, char *kind, char *arg) {
+    if (!kind || strcmp(kind, "all") == 0) {
+        c->nsubs = 0;
+        c->nwatch = 0;
+        cli_printf(c, "Unsubscribed from everything\n");
+        return;
+    }
+    int is_id = strcmp(kind, "id") == 0;
+    const char *what = (is_id || strcmp(kind, "nodes") == 0) ? arg : kind;
+    if (!what) {
+        cli_printf(c, "Usage: unsubscribe [all | [nodes] <selector> | id <request-id>]\n");
+        return;
+    }
+    int rc = is_id ? list_remove(&c->watch[0][0], &c->nwatch, sizeof(c->watch[0]), what)
+                   : list_remove(&c->subs[0][0], &c->nsubs, sizeof(c->subs[0]), what);
+    if (rc == 0) cli_printf(c, "Unsubscribed from %s %s\n", is_id ? "id" : "nodes", what);
+    else cli_printf(c, "Not subscribed to %s\n", what);
+}
+
+static const char help_text[] =
+    "Commands:\n"
+    "  nodes                          list connected nodes\n"
+    "  ping <node>                    ping a node\n"
+    "  exec <node> <command>          run a command; its result comes back here\n"
+    "  exec <selector> <command>      run it on every matching node, relays included\n"
+    "  exec <node|selector> deadline=<s> <command>\n"
+    "                                 stop it after s seconds, keeping its output so far\n"
+    "  cancel <request-id>            stop a running exec or submitted command\n"
+    "  submit <selector> <command>    run it once, on the least busy matching node\n"
+    "  placement                      submitted jobs per node, and the queue\n"
+    "  script <selector> <file> [args]\n"
+    "                                 run a local script; nodes cache it by its hash\n"
+    "  schedule <selector> <job> every=<s> [jitter=<s>] [keep=<s>] <command>\n"
+    "                                 have nodes run a command by themselves; results\n"
+    "                                 go to the command store in batches\n"
+    "  unschedule <selector> <job|*>  stop a scheduled job\n"
+    "  telemetry <node> [raw|1m|15m]  recent cpu, load, memory, disk and network figures\n"
+    "  stats                          session and message counters\n"
+    "  push <file> <selector>:<path>  copy a local file to matching nodes\n"
+    "  transfers                      list running pushes\n"
+    "  subscribe [nodes] <selector>   also receive results from matching nodes\n"
+    "  subscribe id <request-id>      also receive results of a request\n"
+    "  unsubscribe [all | [nodes] <selector> | id <request-id>]\n"
+    "  subscriptions                  list subscriptions\n"
+    "  quit                           close this session\n"
+    "  shutdown                       stop the controller\n"
+    "Selectors are comma-separated shell globs, e.g. web*,db1\n"
+    "With several controllers, nodes, ping and exec reach the nodes of all of them;\n"
+    "script, schedule, unschedule and submit reach the direct sessions of this controller\n";
+
+// An exec for a selector: direct sessions on every shard get it as is, and
+// each relay with matching nodes below it gets one copy naming them.
+typedef struct {
+    unsigned long client_id;
+    char id[REQUEST_ID_LEN];
+    char selector[SELECTOR_MAX_LEN + 1];
+    const char *relay_payload;
+    int via_relays;
+    int peers;          // other controllers running it too
+    int counts[MAX_SHARDS];
+    char payload[];
+} ExecFanout;
+
+static void fanout_to_relay(const char *relay, int matches, void *arg) {
+    ExecFanout *f = arg;
+    if (node_manager_send_to(relay, f->relay_payload) == 0) f->via_relays += matches;
+}
+
+static void fanout_shard(int shard, void *arg) {
+    ExecFanout *f = arg;
+    f->counts[shard] = node_sessions_send_matching(f->selector, f->payload);
+}
+
+static void fanout_done(Reactor *r, void *arg) {
+    (void)r;
+    ExecFanout *f = arg;
+    int total = f->via_relays;
+    for (int i = 0; i < MAX_SHARDS; ++i) total += f->counts[i];
+    // with peers involved the total is never known here; the request
+    // stays open until it expires
+    if (total == 0) {
+        if (!f->peers) request_forget(f->id);
+        GroupedExec **gpp = grouped_slot(f->id);
+        if (!f->peers && *gpp) grouped_drop(gpp);
+        cli_reply(f->client_id, "No nodes match %s%s", f->selector, where());
+    } else {
+        if (!f->peers) request_expect(f->id, total);
+        log_info("Sent command id=%s to %d node(s)", f->id, total);
+        cli_reply(f->client_id, "Sent command id=%s to %d node(s)%s (%d through relays)", f->id, total,
+                  where(), f->via_relays);
+    }
+    free(f);
+}
+
+// Sends an exec whose body (what to run) is fields to node_name, a node or
+// a selector. line is what other controllers are given to run the same
+// command on their nodes; without one the exec reaches only the direct
+// sessions of this controller.
+static void exec_send(CliClient *c, char *node_name, const char *fields, const char *line_text) {
+    char id[REQUEST_ID_LEN];
+    if (c->request_id[0]) snprintf(id, sizeof(id), "%s", c->request_id);
+    else request_new_id(id, sizeof(id));
+
+    // a selector fans out; a single name may sit behind a relay
+    int fanout = strpbrk(node_name, "*?[,") != NULL;
+    const char *relay = fanout ? NULL : relay_route_find(node_name);
+    if (fanout && !selector_valid(node_name)) {
+        cli_printf(c, "Invalid selector: %s\n", node_name);
+        return;
+    }
+    if (relay && !line_text) {
+        cli_printf(c, "%s is reached through relay %s; scripts run on direct sessions only\n", node_name, relay);
+        return;
+    }
+
+    // or be held by another controller; lines forwarded here stay here
+    int owner = fanout || relay || c->sink ? -1 : cluster_owner(node_name);
+    char *line = NULL;
+    if ((fanout || owner >= 0) && !c->sink && cluster_enabled() && line_text) line = strdup(line_text);
+    if (owner >= 0 && !line_text) {
+        cli_printf(c, "%s is held by controller %s; run the script there\n", node_name, cluster_peer_name(owner));
+        return;
+    }
+    if (owner >= 0) {
+        request_track(id, c->id, 1);
+        if (!line || forward_to(c, owner, id, line) < 0) request_forget(id);
+        free(line);
+        return;
+    }
+
+    char *escaped_sel = json_escape(node_name);
+    if (!escaped_sel) {
+        log_error("Failed to allocate command buffer");
+        free(line);
+        return;
+    }
+
+    char payload[1024];
+    char relay_payload[1024 + 2 * SELECTOR_MAX_LEN];
+    int written = snprintf(payload, sizeof(payload), "{\"type\":\"exec\",\"id\":\"%s\",%s}", id, fields);
+    // relays run nothing themselves for "select", they forward it below
+    int relay_written = snprintf(relay_payload, sizeof(relay_payload),
+                                 "{\"type\":\"exec\",\"id\":\"%s\",%s,\"select\":\"%s\"}",
+                                 id, fields, escaped_sel);
+    free(escaped_sel);
+
+    if (written < 0 || written >= (int)sizeof(payload) || relay_written < 0 ||
+        relay_written >= (int)sizeof(relay_payload)) {
+        log_error("Command payload too large to send");
+        cli_printf(c, "Command too long\n");
+        free(line);
+        return;
+    }
+
+    if (fanout) {
+        size_t len = (size_t)written;
+        ExecFanout *f = calloc(1, sizeof(ExecFanout) + len + 1);
+        if (!f) return;
+        f->client_id = c->id;
+        snprintf(f->id, sizeof(f->id), "%s", id);
+        snprintf(f->selector, sizeof(f->selector), "%s", node_name);
+        memcpy(f->payload, payload, len + 1);
+        // the total is only known once every shard has sent its share
+        request_track(id, c->id, 0);
+        // a peer controller takes the results one by one
+        if (!c->sink) grouped_begin(id, c->id);
+        if (line) f->peers = cluster_forward_all(c->id, id, line);
+        free(line);
+        if (line_text) {
+            f->relay_payload = relay_payload;
+            relay_match(node_name, fanout_to_relay, f);
+            f->relay_payload = NULL;
+        }
+        if (shard_broadcast(fanout_shard, f, fanout_done) < 0) {
+            GroupedExec **gpp = grouped_slot(id);
+            if (!f->peers && *gpp) grouped_drop(gpp);
+            if (!f->peers) request_forget(id);
+            cli_printf(c, "Failed to queue command for %s\n", node_name);
+            free(f);
         }
+        return;
+    }
 
-        char payload[1024];
-        int written = snprintf(payload, sizeof(payload),
-                               "{\"type\":\"exec\",\"id\":\"%s\",\"cmd\":\"%s\"}",
-                               id, escaped_cmd);
-        free(escaped_cmd);
+    NodeCommand *cmd = node_command_new(relay ? relay : node_name, id, c->id, relay ? relay_payload : payload);
+    if (!cmd) return;
+    snprintf(cmd->target, sizeof(cmd->target), "%s", node_name);
+    if (request_track(id, c->id, 1) < 0) {
+        log_error("Failed to track request %s", id);
+    }
+    if (post_node_command(cmd, exec_task) < 0) {
+        request_result_seen(id, 1);
+        cli_printf(c, "Failed to queue command for %s\n", node_name);
+    }
+}
 
-        if (written < 0 || written >= (int)sizeof(payload)) {
-            log_error("Command payload too large to send");
+// exec <node|selector> [deadline=<s>] <command>
+static void exec_command(CliClient *c, char *node_name, char *cmd_text) {
+    // other controllers get the deadline as given
+    size_t line_size = strlen(node_name) + strlen(cmd_text) + 7;
+    char *line = malloc(line_size);
+    if (line) snprintf(line, line_size, "exec %s %s", node_name, cmd_text);
+    long deadline_ms = 0;
+    if (strncmp(cmd_text, "deadline=", 9) == 0) {
+        char *end = NULL;
+        double secs = strtod(cmd_text + 9, &end);
+        if (end == cmd_text + 9 || !isspace((unsigned char)*end) || secs <= 0 || secs > 86400 * 7) {
+            cli_printf(c, "Usage: exec <node|selector> [deadline=<seconds>] <command>\n");
             free(line);
             return;
         }
+        deadline_ms = (long)(secs * 1000);
+        if (deadline_ms < 1) deadline_ms = 1;
+        cmd_text = end;
+        while (isspace((unsigned char)*cmd_text)) cmd_text++;
+    }
+    char *escaped_cmd = json_escape(cmd_text);
+    size_t size = escaped_cmd ? strlen(escaped_cmd) + sizeof("\"cmd\":\"\",\"deadline_ms\":") + 24 : 0;
+    char *fields = escaped_cmd ? malloc(size) : NULL;
+    if (!fields || !line) {
+        log_error("Failed to allocate command buffer");
+    } else if (*cmd_text == '\0') {
+        cli_printf(c, "No command provided for exec\n");
+    } else {
+        int n = snprintf(fields, size, "\"cmd\":\"%s\"", escaped_cmd);
+        if (deadline_ms) snprintf(fields + n, size - (size_t)n, ",\"deadline_ms\":%ld", deadline_ms);
+        exec_send(c, node_name, fields, line);
+    }
+    free(escaped_cmd);
+    free(fields);
+    free(line);
+}
 
-        if (node_session_send(session, payload) < 0) {
-            log_error("Failed to send exec to %s", node_name);
-        } else {
-            session->last_seen = time(NULL);
-            log_info("Sent command id=%s to %s", id, node_name);
+// Runs a local script file by its hash (scripts.h).
+static void script_command(CliClient *c, char *node_name, const char *path, const char *args) {
+    char hash[SHA256_HEX_LEN + 1];
+    char why[512];
+    if (script_store_load(path, hash, why, sizeof(why)) < 0) {
+        cli_printf(c, "Cannot run script: %s\n", why);
+        return;
+    }
+    char *escaped_args = json_escape(args ? args : "");
+    size_t size = escaped_args ? strlen(escaped_args) + SHA256_HEX_LEN + 24 : 0;
+    char *fields = escaped_args ? malloc(size) : NULL;
+    if (!fields) {
+        log_error("Failed to allocate command buffer");
+    } else {
+        snprintf(fields, size, "\"script\":\"%s\",\"args\":\"%s\"", hash, escaped_args);
+        log_info("Running script %s (%.12s)", path, hash);
+        exec_send(c, node_name, fields, NULL);
+    }
+    free(escaped_args);
+    free(fields);
+}
+
+// A job definition or removal for the direct sessions matching a selector
+// (agent_schedule.h); nothing comes back but the count.
+typedef struct {
+    unsigned long client_id;
+    char selector[SELECTOR_MAX_LEN + 1];
+    char what[96];
+    int counts[MAX_SHARDS];
+    char payload[];
+} JobFanout;
+
+static void job_shard(int shard, void *arg) {
+    JobFanout *f = arg;
+    f->counts[shard] = node_sessions_send_matching(f->selector, f->payload);
+}
+
+static void job_done(Reactor *r, void *arg) {
+    (void)r;
+    JobFanout *f = arg;
+    int total = 0;
+    for (int i = 0; i < MAX_SHARDS; ++i) total += f->counts[i];
+    if (total == 0) cli_reply(f->client_id, "No nodes match %s", f->selector);
+    else cli_reply(f->client_id, "%s on %d node(s)", f->what, total);
+    free(f);
+}
+
+static void job_send(CliClient *c, const char *selector, const char *what, const char *payload) {
+    if (!selector_valid(selector)) {
+        cli_printf(c, "Invalid selector: %s\n", selector);
+        return;
+    }
+    size_t len = strlen(payload);
+    JobFanout *f = calloc(1, sizeof(JobFanout) + len + 1);
+    if (!f) return;
+    f->client_id = c->id;
+    snprintf(f->selector, sizeof(f->selector), "%s", selector);
+    snprintf(f->what, sizeof(f->what), "%s", what);
+    memcpy(f->payload, payload, len + 1);
+    if (shard_broadcast(job_shard, f, job_done) < 0) {
+        cli_printf(c, "Failed to queue the job for %s\n", selector);
+        free(f);
+    }
+}
+
+// schedule <selector> <job> every=<s> [jitter=<s>] [keep=<s>] <command>
+static void schedule_command(CliClient *c, char *selector, char *name, char *rest) {
+    double every = 0, jitter = 0;
+    long keep = AGENT_SCHEDULE_DEFAULT_KEEP_S;
+    while (rest) {
+        while (isspace((unsigned char)*rest)) rest++;
+        char *end = rest + strcspn(rest, " ");
+        if (strncmp(rest, "every=", 6) == 0) every = strtod(rest + 6, NULL);
+        else if (strncmp(rest, "jitter=", 7) == 0) jitter = strtod(rest + 7, NULL);
+        else if (strncmp(rest, "keep=", 5) == 0) keep = strtol(rest + 5, NULL, 10);
+        else break;
+        rest = end;
+    }
+    if (!name || !rest || !*rest || every * 1000 < AGENT_SCHEDULE_MIN_EVERY_MS || jitter < 0 || keep <= 0) {
+        cli_printf(c, "Usage: schedule <node|selector> <job> every=<seconds, at least %d> [jitter=<seconds>] "
+                      "[keep=<seconds>] <command>\n", AGENT_SCHEDULE_MIN_EVERY_MS / 1000);
+        return;
+    }
+    char *escaped_name = json_escape(name);
+    char *escaped_cmd = json_escape(rest);
+    size_t size = escaped_name && escaped_cmd ? strlen(escaped_name) + strlen(escaped_cmd) + 160 : 0;
+    char *payload = size ? malloc(size) : NULL;
+    if (payload) {
+        snprintf(payload, size,
+                 "{\"type\":\"schedule\",\"name\":\"%s\",\"every_ms\":%ld,\"jitter_ms\":%ld,\"keep_s\":%ld,"
+                 "\"cmd\":\"%s\"}",
+                 escaped_name, (long)(every * 1000), (long)(jitter * 1000), keep, escaped_cmd);
+        char what[96];
+        snprintf(what, sizeof(what), "Scheduled %.64s", name);
+        job_send(c, selector, what, payload);
+    } else {
+        log_error("Failed to allocate command buffer");
+    }
+    free(escaped_name);
+    free(escaped_cmd);
+    free(payload);
+}
+
+static void unschedule_command(CliClient *c, char *selector, char *name) {
+    char *escaped_name = json_escape(name);
+    char payload[256];
+    if (!escaped_name ||
+        snprintf(payload, sizeof(payload), "{\"type\":\"unschedule\",\"name\":\"%s\"}", escaped_name) >=
+            (int)sizeof(payload)) {
+        cli_printf(c, "Job name too long\n");
+    } else {
+        char what[96];
+        snprintf(what, sizeof(what), "Unscheduled %.64s", name);
+        job_send(c, selector, what, payload);
+    }
+    free(escaped_name);
+}
+
+// The nodes that got an exec are not remembered, so a cancel goes to every
+// direct session and other controller; only the ones running id act on it.
+static void cancel_command(CliClient *c, const char *id) {
+    char attempt[REQUEST_ID_LEN];
+    int submitted = placement_cancel(id, attempt, sizeof(attempt));
+    if (submitted == 1) return;
+    if (submitted == 2) id = attempt;
+    char *escaped_id = json_escape(id);
+    char payload[256];
+    if (!escaped_id ||
+        snprintf(payload, sizeof(payload), "{\"type\":\"cancel\",\"id\":\"%s\"}", escaped_id) >=
+            (int)sizeof(payload)) {
+        cli_printf(c, "Request id too long\n");
+    } else {
+        char what[96];
+        snprintf(what, sizeof(what), "Asked to cancel %.64s", id);
+        if (cluster_enabled() && !c->sink) {
+            char line[128];
+            snprintf(line, sizeof(line), "cancel %.64s", id);
+            cluster_forward_all(c->id, "", line);
         }
-    } else if (strcmp(verb, "exit") == 0 || strcmp(verb, "quit") == 0) {
-        log_info("Exit command received");
+        job_send(c, "*", what, payload);
+    }
+    free(escaped_id);
+}
+
+int cli_execute(CliClient *c, const char *input_line) {
+    if (!c) return 0;
+    if (!input_line) {
+        log_info("Empty command");
+        return 0;
+    }
+
+    char *line = strdup(input_line);
+    if (!line) return 0;
+
+    char *cursor = line;
+    while (*cursor && isspace((unsigned char)*cursor)) cursor++;
+    // tolerate CRLF from terminals like telnet
+    size_t tail = strlen(cursor);
+    while (tail > 0 && isspace((unsigned char)cursor[tail - 1])) cursor[--tail] = '\0';
+    if (*cursor == '\0') {
         free(line);
-        shutdown_gracefully();
-        return;
+        return 0;
+    }
+
+    char *saveptr = NULL;
+    char *verb = strtok_r(cursor, " ", &saveptr);
+    int rc = 0;
+
+    if (strcmp(verb, "nodes") == 0) {
+        if (!c->sink) cluster_forward_all(c->id, "", "nodes");
+        NodesSnapshot *snap = calloc(1, sizeof(NodesSnapshot));
+        if (snap) snap->client_id = c->id;
+        if (!snap || shard_broadcast(nodes_collect, snap, nodes_print) < 0) {
+            log_error("Failed to collect node list");
+            cli_printf(c, "Failed to collect node list\n");
+            free(snap);
+        }
+    } else if (strcmp(verb, "ping") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        int owner = node_name && !c->sink ? cluster_owner(node_name) : -1;
+        if (!node_name) {
+            cli_printf(c, "Usage: ping <node-name>\n");
+        } else if (owner >= 0) {
+            char fwd[300];
+            snprintf(fwd, sizeof(fwd), "ping %s", node_name);
+            forward_to(c, owner, "", fwd);
+        } else {
+            NodeCommand *cmd = node_command_new(node_name, NULL, c->id, "{\"type\":\"ping\"}");
+            if (cmd) post_node_command(cmd, ping_task);
+        }
+    } else if (strcmp(verb, "telemetry") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        char *tier = strtok_r(NULL, " ", &saveptr);
+        if (!tier) tier = "raw";
+        int owner = node_name && !c->sink ? cluster_owner(node_name) : -1;
+        if (!node_name || telemetry_tier_parse(tier) < 0) {
+            cli_printf(c, "Usage: telemetry <node-name> [raw|1m|15m]\n");
+        } else if (owner >= 0) {
+            char fwd[300];
+            snprintf(fwd, sizeof(fwd), "telemetry %s %s", node_name, tier);
+            forward_to(c, owner, "", fwd);
+        } else {
+            NodeCommand *cmd = node_command_new(node_name, NULL, c->id, tier);
+            if (cmd) post_node_command(cmd, telemetry_task);
+        }
+    } else if (strcmp(verb, "exec") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        char *cmd_text = saveptr;
+        while (cmd_text && isspace((unsigned char)*cmd_text)) cmd_text++;
+        if (!node_name) {
+            cli_printf(c, "Usage: exec <node-name> <command>\n");
+        } else if (!cmd_text || *cmd_text == '\0') {
+            cli_printf(c, "No command provided for exec\n");
+        } else {
+            exec_command(c, node_name, cmd_text);
+        }
+    } else if (strcmp(verb, "cancel") == 0) {
+        char *id = strtok_r(NULL, " ", &saveptr);
+        if (!id) cli_printf(c, "Usage: cancel <request-id>\n");
+        else cancel_command(c, id);
+    } else if (strcmp(verb, "submit") == 0) {
+        char *selector = strtok_r(NULL, " ", &saveptr);
+        char *cmd_text = saveptr;
+        while (cmd_text && isspace((unsigned char)*cmd_text)) cmd_text++;
+        if (!selector || !cmd_text || *cmd_text == '\0') {
+            cli_printf(c, "Usage: submit <selector> <command>\n");
+        } else {
+            placement_submit(c->id, selector, cmd_text);
+        }
+    } else if (strcmp(verb, "placement") == 0) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (f) {
+            placement_print(f);
+            fclose(f);
+            cli_write(c, text, len);
+            free(text);
+        }
+    } else if (strcmp(verb, "script") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        char *path = strtok_r(NULL, " ", &saveptr);
+        char *args = saveptr;
+        while (args && isspace((unsigned char)*args)) args++;
+        if (!node_name || !path) {
+            cli_printf(c, "Usage: script <node|selector> <file> [args...]\n");
+        } else {
+            script_command(c, node_name, path, args);
+        }
+    } else if (strcmp(verb, "schedule") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        char *name = strtok_r(NULL, " ", &saveptr);
+        if (!node_name || !name) {
+            cli_printf(c, "Usage: schedule <node|selector> <job> every=<seconds> [jitter=<seconds>] "
+                          "[keep=<seconds>] <command>\n");
+        } else {
+            schedule_command(c, node_name, name, saveptr);
+        }
+    } else if (strcmp(verb, "unschedule") == 0) {
+        char *node_name = strtok_r(NULL, " ", &saveptr);
+        char *name = strtok_r(NULL, " ", &saveptr);
+        if (!node_name || !name) cli_printf(c, "Usage: unschedule <node|selector> <job|*>\n");
+        else unschedule_command(c, node_name, name);
+    } else if (strcmp(verb, "stats") == 0) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (f) {
+            node_manager_print_stats(f);
+            fclose(f);
+            cli_write(c, text, len);
+            free(text);
+        }
+    } else if (strcmp(verb, "push") == 0) {
+        char *file = strtok_r(NULL, " ", &saveptr);
+        char *target = strtok_r(NULL, " ", &saveptr);
+        // selectors have no ':', so the last one starts the path
+        char *colon = target ? strrchr(target, ':') : NULL;
+        if (!file || !colon || colon == target || colon[1] == '\0') {
+            cli_printf(c, "Usage: push <file> <selector>:<path>\n");
+        } else {
+            *colon = '\0';
+            transfer_push(c->id, file, target, colon + 1);
+        }
+    } else if (strcmp(verb, "transfers") == 0) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (f) {
+            transfer_print(f);
+            fclose(f);
+            cli_write(c, text, len);
+            free(text);
+        }
+    } else if (strcmp(verb, "subscribe") == 0) {
+        char *kind = strtok_r(NULL, " ", &saveptr);
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        if (!kind) print_subscriptions(c);
+        else subscribe(c, kind, arg);
+    } else if (strcmp(verb, "unsubscribe") == 0) {
+        char *kind = strtok_r(NULL, " ", &saveptr);
+        char *arg = strtok_r(NULL, " ", &saveptr);
+        unsubscribe(c, kind, arg);
+    } else if (strcmp(verb, "subscriptions") == 0) {
+        print_subscriptions(c);
+    } else if (strcmp(verb, "help") == 0) {
+        cli_write(c, help_text, sizeof(help_text) - 1);
+    } else if (strcmp(verb, "exit") == 0 || strcmp(verb, "quit") == 0 ||
+               strcmp(verb, "shutdown") == 0) {
+        if (c->stream && strcmp(verb, "shutdown") != 0) {
+            rc = -1;
+        } else {
+            log_info("Exit command received");
+            shutdown_gracefully(front_reactor);
+        }
     } else {
         log_error("Unknown command: %s", verb);
+        cli_printf(c, "Unknown command: %s (try help)\n", verb);
     }
 
     free(line);
+    return rc;
+}
+
+int cli_execute_forwarded(CliClient *c, const char *line, const char *request_id) {
+    if (!c) return 0;
+    snprintf(c->request_id, sizeof(c->request_id), "%s", request_id ? request_id : "");
+    int rc = cli_execute(c, line);
+    c->request_id[0] = '\0';
+    return rc;
+}
+
+void parse_cli_command(const char *input_line) {
+    cli_execute(cli_console(), input_line);
 }
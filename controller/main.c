@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <signal.h>
 #include "../include/cli.h"
 #include "../include/env.h"
 #include "../include/logging.h"
@@ -13,6 +14,9 @@ int main(int argc, char **argv) {
 
     CliArgs args = parse_cli_args(argc, argv);
 
+    // a CLI client hanging up mid-reply must not kill the controller
+    signal(SIGPIPE, SIG_IGN);
+
     global_state = init_global_state();
 
     const char *config_path = args.config ? args.config : DEFAULT_CONFIG_PATH;
@@ -23,6 +27,8 @@ int main(int argc, char **argv) {
     }
 
     global_state.config = config;
+    global_state.config_path = config_path;
+    global_state.takeover = args.takeover;
 
     if (!log_init(config->log_path)) {
         fprintf(stderr, "Failed to initialize logger\n");
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/agent_heartbeat.h"
+#include "../include/agent_telemetry.h"
+#include "../include/heartbeat.h"
+#include "../include/logging.h"
+#include "../include/telemetry.h"
+
+static pthread_mutex_t hb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hb_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t hb_thread;
+static int hb_running = 0;
+static int hb_stop = 0;
+// guarded by hb_lock
+static struct sockaddr_in hb_addr;
+static int hb_have_addr = 0;
+static char hb_name[256];
+static int hb_new_target = 0;
+
+// 1-minute load and runnable tasks from /proc/loadavg, memory in use from
+// /proc/meminfo; left at 0 where they cannot be read.
+static void read_load(Heartbeat *hb) {
+    FILE *f = fopen("/proc/loadavg", "r");
+    if (f) {
+        double load1 = 0;
+        unsigned running = 0;
+        if (fscanf(f, "%lf %*f %*f %u/", &load1, &running) >= 1) {
+            hb->load1 = load1 * 100 > 65535 ? 65535 : (uint16_t)(load1 * 100);
+            hb->running = running > 65535 ? 65535 : (uint16_t)running;
+        }
+        fclose(f);
+    }
+    f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long long total = 0, avail = 0;
+        while (fgets(line, sizeof(line), f) && (!total || !avail)) {
+            sscanf(line, "MemTotal: %llu", &total);
+            sscanf(line, "MemAvailable: %llu", &avail);
+        }
+        if (total > 0 && avail <= total) hb->mem_used = (uint8_t)((total - avail) * 100 / total);
+        fclose(f);
+    }
+}
+
+static void *heartbeat_thread(void *arg) {
+    (void)arg;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Heartbeat socket failed: %s", strerror(errno));
+        return NULL;
+    }
+    uint32_t seq = 0;
+    int ticks = 0;
+    pthread_mutex_lock(&hb_lock);
+    while (!hb_stop) {
+        if (hb_have_addr) {
+            Heartbeat hb;
+            memset(&hb, 0, sizeof(hb));
+            hb.seq = ++seq;
+            snprintf(hb.name, sizeof(hb.name), "%s", hb_name);
+            struct sockaddr_in to = hb_addr;
+            // a controller new to us cannot apply deltas
+            if (hb_new_target) agent_telemetry_reset();
+            hb_new_target = 0;
+            pthread_mutex_unlock(&hb_lock);
+            read_load(&hb);
+            unsigned char buf[TELEMETRY_MAX_LEN];
+            int len = heartbeat_encode(&hb, buf);
+            // a lost datagram is simply the next one's job
+            if (len > 0) sendto(fd, buf, (size_t)len, 0, (struct sockaddr *)&to, sizeof(to));
+            // telemetry rides along every few heartbeats
+            if (ticks++ % (TELEMETRY_INTERVAL_MS / HEARTBEAT_INTERVAL_MS) == 0) {
+                len = agent_telemetry_frame(hb.name, buf, sizeof(buf));
+                if (len > 0) sendto(fd, buf, (size_t)len, 0, (struct sockaddr *)&to, sizeof(to));
+            }
+            pthread_mutex_lock(&hb_lock);
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += HEARTBEAT_INTERVAL_MS / 1000;
+        until.tv_nsec += (long)(HEARTBEAT_INTERVAL_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!hb_stop && pthread_cond_timedwait(&hb_cond, &hb_lock, &until) == 0) {
+        }
+    }
+    pthread_mutex_unlock(&hb_lock);
+    close(fd);
+    return NULL;
+}
+
+void agent_heartbeat_target(const char *name, const struct sockaddr_in *addr) {
+    pthread_mutex_lock(&hb_lock);
+    hb_have_addr = addr != NULL;
+    if (addr) {
+        hb_new_target = 1;
+        hb_addr = *addr;
+    }
+    if (name) snprintf(hb_name, sizeof(hb_name), "%s", name);
+    pthread_mutex_unlock(&hb_lock);
+    if (!addr || hb_running) return;
+    hb_stop = 0;
+    if (pthread_create(&hb_thread, NULL, heartbeat_thread, NULL) != 0) {
+        log_error("Failed to start the heartbeat thread");
+        return;
+    }
+    hb_running = 1;
+    log_info("Sending heartbeats every %d ms", HEARTBEAT_INTERVAL_MS);
+}
+
+void agent_heartbeat_stop(void) {
+    if (!hb_running) return;
+    pthread_mutex_lock(&hb_lock);
+    hb_stop = 1;
+    pthread_cond_signal(&hb_cond);
+    pthread_mutex_unlock(&hb_lock);
+    pthread_join(hb_thread, NULL);
+    hb_running = 0;
+    hb_have_addr = 0;
+}
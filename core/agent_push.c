@@ -0,0 +1,273 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../include/agent_push.h"
+#include "../include/checksum.h"
+#include "../include/ipc.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/node_agent.h"
+#include "../include/requests.h"
+#include "../include/transfer.h"
+
+#define PUSH_MAX_ACTIVE 64
+// A controller that stops sending for this long has gone; the next offer
+// resumes.
+#define PUSH_RECV_TIMEOUT_SEC 60
+
+typedef struct {
+    char id[REQUEST_ID_LEN];
+    char name[256];
+    char path[PATH_MAX];
+    char fingerprint[32];
+    uint64_t size;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int slot;           // in active_ids
+} PushOffer;
+
+// transfers with a receiver running; a repeated offer for one is ignored
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static char active_ids[PUSH_MAX_ACTIVE][REQUEST_ID_LEN];
+
+static int active_claim(const char *id) {
+    int slot = -1;
+    pthread_mutex_lock(&active_lock);
+    for (int i = 0; i < PUSH_MAX_ACTIVE; ++i) {
+        if (strcmp(active_ids[i], id) == 0) {
+            slot = -1;
+            break;
+        }
+        if (slot < 0 && active_ids[i][0] == '\0') slot = i;
+    }
+    if (slot >= 0) snprintf(active_ids[slot], REQUEST_ID_LEN, "%s", id);
+    pthread_mutex_unlock(&active_lock);
+    return slot;
+}
+
+static void active_release(int slot) {
+    pthread_mutex_lock(&active_lock);
+    active_ids[slot][0] = '\0';
+    pthread_mutex_unlock(&active_lock);
+}
+
+static int recv_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+static void send_done(int sock, const char *error, int retry) {
+    char msg[512];
+    int n;
+    if (!error) {
+        n = snprintf(msg, sizeof(msg), "{\"type\":\"push_done\",\"status\":\"ok\"}\n");
+    } else {
+        char *esc = json_escape(error);
+        n = snprintf(msg, sizeof(msg), "{\"type\":\"push_done\",\"status\":\"error\",\"error\":\"%s\",\"retry\":%d}\n",
+                     esc ? esc : "error", retry);
+        free(esc);
+    }
+    if (n > 0 && (size_t)n < sizeof(msg)) ipc_send_full(sock, msg, (size_t)n);
+}
+
+// Where to resume: the end of the last whole chunk of a partial copy of the
+// same file version, or 0 after starting a fresh one.
+static uint64_t resume_offset(const PushOffer *p, const char *part, const char *info) {
+    char want[128];
+    snprintf(want, sizeof(want), "%s %llu %d\n", p->fingerprint, (unsigned long long)p->size, PUSH_CHUNK_SIZE);
+
+    char have[128] = "";
+    FILE *f = fopen(info, "r");
+    if (f) {
+        if (!fgets(have, sizeof(have), f)) have[0] = '\0';
+        fclose(f);
+    }
+    struct stat st;
+    if (strcmp(have, want) == 0 && stat(part, &st) == 0) {
+        uint64_t len = (uint64_t)st.st_size < p->size ? (uint64_t)st.st_size : p->size;
+        return len - len % PUSH_CHUNK_SIZE;
+    }
+
+    f = fopen(info, "w");
+    if (!f) return 0;
+    fputs(want, f);
+    fclose(f);
+    return 0;
+}
+
+static int connect_back(const PushOffer *p, uint64_t offset) {
+    int sock = socket(p->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (const struct sockaddr *)&p->addr, p->addr_len) < 0) {
+        log_error("Push %s: cannot connect to controller: %s", p->id, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    struct timeval tv = { PUSH_RECV_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char hello[512];
+    int n = snprintf(hello, sizeof(hello), "{\"type\":\"data\",\"name\":\"%s\",\"transfer\":\"%s\",\"offset\":%llu}\n",
+                     p->name, p->id, (unsigned long long)offset);
+    if (n < 0 || (size_t)n >= sizeof(hello) || ipc_send_full(sock, hello, (size_t)n) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Receives chunks into fd from offset on. Returns NULL once the file is
+// complete, else why not; *retry says whether another attempt can help.
+static const char *receive_chunks(int sock, int fd, const PushOffer *p, uint64_t offset, char *buf, int *retry) {
+    *retry = 1;
+    while (1) {
+        unsigned char raw[PUSH_HEADER_LEN];
+        PushChunkHeader h;
+        if (recv_full(sock, raw, sizeof(raw)) < 0) return "connection lost";
+        if (push_header_decode(raw, &h) < 0 || h.offset != offset) return "bad chunk header";
+        if (h.len == 0) return offset == p->size ? NULL : "file ended early";
+        if (h.offset + h.len > p->size) return "chunk past end of file";
+
+        if (recv_full(sock, buf, h.len) < 0) return "connection lost";
+        if (crc32c(0, buf, h.len) != h.crc) {
+            log_error("Push %s: checksum mismatch at offset %llu", p->id, (unsigned long long)h.offset);
+            return "checksum mismatch";
+        }
+        size_t done = 0;
+        while (done < h.len) {
+            ssize_t n = pwrite(fd, buf + done, h.len - done, (off_t)(h.offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                *retry = 0;
+                return strerror(errno);
+            }
+            done += (size_t)n;
+        }
+        offset += h.len;
+    }
+}
+
+static void push_receive(const PushOffer *p) {
+    char part[PATH_MAX + 16];
+    char info[PATH_MAX + 32];
+    snprintf(part, sizeof(part), "%s.part", p->path);
+    snprintf(info, sizeof(info), "%s.part.info", p->path);
+
+    uint64_t offset = resume_offset(p, part, info);
+    int fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : 0), 0644);
+    int sock = connect_back(p, offset);
+    char *buf = malloc(PUSH_CHUNK_SIZE);
+    if (sock >= 0) {
+        const char *err = NULL;
+        int retry = 0;
+        if (fd < 0) err = strerror(errno);
+        else if (!buf) err = "out of memory";
+        else err = receive_chunks(sock, fd, p, offset, buf, &retry);
+
+        if (!err && (fsync(fd) < 0 || rename(part, p->path) < 0)) err = strerror(errno);
+        if (!err) {
+            unlink(info);
+            log_info("Push %s: wrote %s (%llu bytes)", p->id, p->path, (unsigned long long)p->size);
+        } else {
+            log_error("Push %s to %s: %s", p->id, p->path, err);
+        }
+        send_done(sock, err, retry);
+        if (err) {
+            // closing with chunks unread would reset the connection and
+            // could lose the report; wait for the controller to hang up
+            shutdown(sock, SHUT_WR);
+            char sink[4096];
+            while (recv(sock, sink, sizeof(sink), 0) > 0) {}
+        }
+        close(sock);
+    }
+    free(buf);
+    if (fd >= 0) close(fd);
+}
+
+static void *push_thread(void *arg) {
+    PushOffer *p = arg;
+    push_receive(p);
+    active_release(p->slot);
+    free(p);
+    return NULL;
+}
+
+static void on_push(const MsgContext *ctx, void *user) {
+    (void)user;
+    AgentConn *conn = ctx->conn;
+    PushOffer *p = calloc(1, sizeof(PushOffer));
+    long size = json_msg_int(ctx->msg, "size", -1);
+    if (!p || json_msg_copy(ctx->msg, "transfer", p->id, sizeof(p->id)) < 0 ||
+        json_msg_copy(ctx->msg, "path", p->path, sizeof(p->path)) < 0 ||
+        json_msg_copy(ctx->msg, "fingerprint", p->fingerprint, sizeof(p->fingerprint)) < 0 || size < 0 ||
+        json_msg_int(ctx->msg, "chunk", 0) != PUSH_CHUNK_SIZE) {
+        log_error("Invalid push offer");
+        free(p);
+        return;
+    }
+    p->size = (uint64_t)size;
+    snprintf(p->name, sizeof(p->name), "%s", conn->name ? conn->name : "");
+    // the controller says where it takes data connections; without that
+    // (a local socket) the data connection goes wherever the session goes
+    char data[64] = "";
+    json_msg_copy(ctx->msg, "data", data, sizeof(data));
+    if (data[0]) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&p->addr;
+        char *colon = strrchr(data, ':');
+        int port = colon ? atoi(colon + 1) : 0;
+        if (colon) *colon = '\0';
+        memset(&p->addr, 0, sizeof(p->addr));
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)port);
+        p->addr_len = sizeof(*in);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, data, &in->sin_addr) != 1) {
+            log_error("Push %s: bad controller data address", p->id);
+            free(p);
+            return;
+        }
+    } else {
+        p->addr_len = sizeof(p->addr);
+        if (getpeername(conn->sock, (struct sockaddr *)&p->addr, &p->addr_len) < 0) {
+            log_error("Push %s: no controller address: %s", p->id, strerror(errno));
+            free(p);
+            return;
+        }
+    }
+
+    p->slot = active_claim(p->id);
+    if (p->slot < 0) {
+        free(p);
+        return;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, push_thread, p) != 0) {
+        log_error("Push %s: cannot start receiver", p->id);
+        active_release(p->slot);
+        free(p);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void agent_push_register(Dispatcher *d) {
+    dispatcher_register(d, "push", on_push, NULL);
+}
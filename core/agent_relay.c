@@ -0,0 +1,761 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/agent_relay.h"
+#include "../include/checksum.h"
+#include "../include/ipc.h"
+#include "../include/json_escape.h"
+#include "../include/logging.h"
+#include "../include/requests.h"
+#include "../include/selector.h"
+
+// How long a relay waits for results when the request names no deadline.
+#define RELAY_RESULT_TIMEOUT_MS 60000
+// Each level below gets this much less, so inner relays report first.
+#define RELAY_HOP_MARGIN_MS 2000
+#define RELAY_MIN_TIMEOUT_MS 1000
+// Names listed with one result group; the count stays exact past this.
+#define RELAY_MAX_NODE_LIST (64 * 1024)
+
+// A node below a child, as its relay_join described it.
+typedef struct {
+    char name[256];
+    char parent[256];
+    char os[64];
+} ReachEntry;
+
+typedef struct {
+    int fd;
+    IpcReader rx;
+    IpcWriter tx;
+    int hello_done;
+    int dead;           // removed after the current poll round
+    int replaced;       // dead because it reconnected: nothing to report
+    char name[256];
+    char os[64];
+    // nodes below this child (not the child itself), from its relay_joins
+    ReachEntry *reach;
+    int nreach;
+    int reach_cap;
+} RelayChild;
+
+typedef struct ResultGroup {
+    int exit_code;
+    char status[16];        // the children's "status", "" if none
+    uint32_t hash;
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    char *nodes;
+    size_t nodes_len;
+    int count;
+    struct ResultGroup *next;
+} ResultGroup;
+
+// A child's result held unacked until the group it went into is in this
+// agent's spool.
+typedef struct HeldAck {
+    char child[256];
+    long seq;
+    struct HeldAck *next;
+} HeldAck;
+
+// A forwarded exec whose results are being collected.
+typedef struct Pending {
+    char id[REQUEST_ID_LEN];
+    long long deadline_ms;
+    long timeout_ms;
+    char **want;            // sorted names of the nodes asked
+    unsigned char *got;
+    int nwant;
+    int received;
+    ResultGroup *groups;
+    HeldAck *acks;
+    struct Pending *next;
+} Pending;
+
+typedef struct ForwardReq {
+    char id[REQUEST_ID_LEN];
+    char select[SELECTOR_MAX_LEN + 1];
+    long timeout_ms;
+    long deadline_ms;       // the command's own, relative; 0 for none
+    int cancel;             // a cancel of id rather than an exec
+    struct ForwardReq *next;
+    char cmd[];             // still JSON-escaped
+} ForwardReq;
+
+static int relay_listen_fd = -1;
+static AgentConn *upstream = NULL;
+static pthread_t relay_thread;
+static int relay_running = 0;
+static int stop_requested = 0;
+static int resync_requested = 0;
+static int wake_fds[2] = { -1, -1 };
+
+// execs handed over by the run loop
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static ForwardReq *queue_head = NULL;
+static ForwardReq *queue_tail = NULL;
+
+// relay thread only
+static RelayChild **children = NULL;
+static int nchildren = 0;
+static int children_cap = 0;
+static Pending *pendings = NULL;
+static Arena relay_arena;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void child_send(RelayChild *c, const char *msg, size_t len) {
+    if (ipc_writer_append(&c->tx, msg, len) < 0 || ipc_writer_append(&c->tx, "\n", 1) < 0) {
+        log_error("Relay: dropping message to slow child %s", c->name);
+        return;
+    }
+    ipc_writer_flush(&c->tx, c->fd);
+}
+
+static void send_route(const char *type, const char *name, const char *parent, const char *os) {
+    char msg[1024];
+    int n = snprintf(msg, sizeof(msg), "{\"type\":\"%s\",\"name\":\"%s\",\"parent\":\"%s\",\"os\":\"%s\"}", type,
+                     name, parent ? parent : "", os ? os : "");
+    if (n > 0 && (size_t)n < sizeof(msg)) node_agent_send(upstream, msg, (size_t)n);
+}
+
+// --- results ---
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 1 if name was waited for and is now marked, 0 if it had answered
+// already, -1 if it was never asked.
+static int pending_mark(Pending *p, const char *name, size_t len) {
+    char key[256];
+    if (len >= sizeof(key)) return -1;
+    memcpy(key, name, len);
+    key[len] = '\0';
+    char *k = key;
+    char **hit = bsearch(&k, p->want, (size_t)p->nwant, sizeof(char *), name_cmp);
+    if (!hit) return -1;
+    if (p->got[hit - p->want]) return 0;
+    p->got[hit - p->want] = 1;
+    return 1;
+}
+
+// The child may drop seq from its spool now.
+static void child_ack(RelayChild *c, long seq) {
+    if (seq <= 0) return;
+    char ack[64];
+    int n = snprintf(ack, sizeof(ack), "{\"type\":\"result_ack\",\"seq\":%ld}", seq);
+    child_send(c, ack, (size_t)n);
+}
+
+static void pending_hold_ack(Pending *p, const RelayChild *c, long seq) {
+    if (seq <= 0) return;
+    HeldAck *h = malloc(sizeof(HeldAck));
+    if (!h) return;
+    snprintf(h->child, sizeof(h->child), "%s", c->name);
+    h->seq = seq;
+    h->next = p->acks;
+    p->acks = h;
+}
+
+// Acks go to the child's current connection: one that reconnected since
+// still has the records in its spool.
+static void pending_send_acks(Pending *p) {
+    for (HeldAck *h = p->acks; h; h = h->next) {
+        for (int i = 0; i < nchildren; ++i) {
+            RelayChild *c = children[i];
+            if (c->hello_done && !c->dead && strcmp(c->name, h->child) == 0) {
+                child_ack(c, h->seq);
+                break;
+            }
+        }
+    }
+}
+
+static void group_add_names(ResultGroup *g, const char *names, size_t len) {
+    if (len == 0 || g->nodes_len + len + 1 > RELAY_MAX_NODE_LIST) return;
+    char *n = realloc(g->nodes, g->nodes_len + len + 2);
+    if (!n) return;
+    g->nodes = n;
+    if (g->nodes_len) g->nodes[g->nodes_len++] = ',';
+    memcpy(g->nodes + g->nodes_len, names, len);
+    g->nodes_len += len;
+    g->nodes[g->nodes_len] = '\0';
+}
+
+static void group_free(ResultGroup *g) {
+    free(g->out);
+    free(g->err);
+    free(g->nodes);
+    free(g);
+}
+
+// Sends one group upstream as a result message with count and nodes, kept
+// in the spool like this node's own results. Its spool key tells groups of
+// one request apart.
+static void send_group(const char *id, int exit_code, const char *status, const char *out, size_t out_len,
+                       const char *err, size_t err_len, const char *nodes, size_t nodes_len, int count) {
+    char head[192];
+    int n = snprintf(head, sizeof(head),
+                     "{\"type\":\"result\",\"id\":\"%s\",\"exit\":%d,%s%s%s\"count\":%d,\"nodes\":\"", id, exit_code,
+                     status[0] ? "\"status\":\"" : "", status, status[0] ? "\"," : "", count);
+    if (n < 0 || (size_t)n >= sizeof(head)) return;
+    size_t len = (size_t)n + json_escaped_len(nodes, nodes_len) + sizeof("\",\"stdout\":\"") - 1 +
+                 json_escaped_len(out, out_len) + sizeof("\",\"stderr\":\"") - 1 + json_escaped_len(err, err_len) +
+                 sizeof("\"}") - 1;
+    char *msg = malloc(len + 1);
+    if (!msg) {
+        log_error("Relay: dropping result group for %s: out of memory", id);
+        return;
+    }
+    char *o = msg;
+    memcpy(o, head, (size_t)n);
+    o += n;
+    o += json_escape_to(o, nodes, nodes_len);
+    memcpy(o, "\",\"stdout\":\"", sizeof("\",\"stdout\":\"") - 1);
+    o += sizeof("\",\"stdout\":\"") - 1;
+    o += json_escape_to(o, out, out_len);
+    memcpy(o, "\",\"stderr\":\"", sizeof("\",\"stderr\":\"") - 1);
+    o += sizeof("\",\"stderr\":\"") - 1;
+    o += json_escape_to(o, err, err_len);
+    memcpy(o, "\"}", 2);
+    o += 2;
+    char key[REQUEST_ID_LEN];
+    snprintf(key, sizeof(key), "%08x%.*s", crc32c(0, nodes, nodes_len), (int)(sizeof(key) - 9), id);
+    node_agent_send_spooled(upstream, key, msg, (size_t)(o - msg));
+    free(msg);
+}
+
+static void pending_free(Pending *p) {
+    while (p->groups) {
+        ResultGroup *g = p->groups;
+        p->groups = g->next;
+        group_free(g);
+    }
+    while (p->acks) {
+        HeldAck *h = p->acks;
+        p->acks = h->next;
+        free(h);
+    }
+    for (int i = 0; i < p->nwant; ++i) free(p->want[i]);
+    free(p->want);
+    free(p->got);
+    free(p);
+}
+
+static void pending_unlink(Pending *p) {
+    Pending **pp = &pendings;
+    while (*pp && *pp != p) pp = &(*pp)->next;
+    if (*pp) *pp = p->next;
+}
+
+// Reports every group, plus the nodes that never answered as one more.
+static void pending_flush(Pending *p) {
+    for (ResultGroup *g = p->groups; g; g = g->next) {
+        send_group(p->id, g->exit_code, g->status, g->out, g->out_len, g->err, g->err_len, g->nodes, g->nodes_len, g->count);
+    }
+    int missing = p->nwant - p->received;
+    if (missing > 0) {
+        ResultGroup lost = { 0 };
+        for (int i = 0; i < p->nwant; ++i) {
+            if (!p->got[i]) group_add_names(&lost, p->want[i], strlen(p->want[i]));
+        }
+        char why[320];
+        int n = snprintf(why, sizeof(why), "no result through relay %s within %lds",
+                         upstream->name ? upstream->name : "?", p->timeout_ms / 1000);
+        send_group(p->id, -1, "", "", 0, why, (size_t)n, lost.nodes ? lost.nodes : "", lost.nodes_len, missing);
+        free(lost.nodes);
+    }
+    pending_send_acks(p);
+    pending_unlink(p);
+    pending_free(p);
+}
+
+static void on_child_result(RelayChild *c, const JsonMsg *m, long seq) {
+    char id[REQUEST_ID_LEN];
+    if (json_msg_copy(m, "id", id, sizeof(id)) < 0) return;
+    size_t out_len = 0, err_len = 0, nodes_len = 0;
+    char *out = json_msg_str(m, "stdout", &relay_arena, &out_len);
+    char *err = json_msg_str(m, "stderr", &relay_arena, &err_len);
+    char *nodes = json_msg_str(m, "nodes", &relay_arena, &nodes_len);
+    int exit_code = (int)json_msg_int(m, "exit", -1);
+    long count = json_msg_int(m, "count", 1);
+    // timed out, cancelled or truncated below: results that differ in it
+    // are not one group
+    char status[16];
+    if (json_msg_copy(m, "status", status, sizeof(status)) < 0) status[0] = '\0';
+    if (!out) out = "";
+    if (!err) err = "";
+    if (!nodes || nodes_len == 0) {
+        nodes = c->name;
+        nodes_len = strlen(c->name);
+    }
+    if (count < 1) count = 1;
+
+    Pending *p = pendings;
+    while (p && strcmp(p->id, id) != 0) p = p->next;
+    if (!p) {
+        // late or never forwarded by us: pass it on by itself
+        send_group(id, exit_code, status, out, out_len, err, err_len, nodes, nodes_len, (int)count);
+        child_ack(c, seq);
+        return;
+    }
+
+    // a child that reconnected sends what it has not had acked again
+    int fresh = 0, again = 0;
+    for (const char *s = nodes; *s;) {
+        size_t len = strcspn(s, ",");
+        int r = pending_mark(p, s, len);
+        fresh += r == 1;
+        again += r == 0;
+        s += len;
+        if (*s == ',') s++;
+    }
+    pending_hold_ack(p, c, seq);
+    if (!fresh && again) return;
+
+    uint32_t hash = crc32c(crc32c((uint32_t)exit_code, out, out_len), err, err_len);
+    ResultGroup *g = p->groups;
+    while (g && !(g->hash == hash && g->exit_code == exit_code && strcmp(g->status, status) == 0 &&
+                  g->out_len == out_len && g->err_len == err_len && memcmp(g->out, out, out_len) == 0 &&
+                  memcmp(g->err, err, err_len) == 0)) {
+        g = g->next;
+    }
+    if (!g) {
+        g = calloc(1, sizeof(ResultGroup));
+        if (!g) return;
+        g->exit_code = exit_code;
+        memcpy(g->status, status, sizeof(status));
+        g->hash = hash;
+        g->out = malloc(out_len + 1);
+        g->err = malloc(err_len + 1);
+        if (!g->out || !g->err) {
+            group_free(g);
+            return;
+        }
+        memcpy(g->out, out, out_len + 1);
+        memcpy(g->err, err, err_len + 1);
+        g->out_len = out_len;
+        g->err_len = err_len;
+        g->next = p->groups;
+        p->groups = g;
+    }
+    g->count += (int)count;
+    group_add_names(g, nodes, nodes_len);
+    p->received += (int)count;
+    if (p->received >= p->nwant) pending_flush(p);
+}
+
+// --- forwarding ---
+
+static int pending_want(Pending *p, const char *name) {
+    char **w = realloc(p->want, (size_t)(p->nwant + 1) * sizeof(char *));
+    if (!w) return -1;
+    p->want = w;
+    p->want[p->nwant] = strdup(name);
+    if (!p->want[p->nwant]) return -1;
+    p->nwant++;
+    return 0;
+}
+
+static void relay_exec(ForwardReq *f) {
+    Pending *p = calloc(1, sizeof(Pending));
+    if (!p) return;
+    snprintf(p->id, sizeof(p->id), "%s", f->id);
+    p->timeout_ms = f->timeout_ms;
+    p->deadline_ms = now_ms() + f->timeout_ms;
+    long below_timeout = f->timeout_ms - RELAY_HOP_MARGIN_MS;
+    if (below_timeout < RELAY_MIN_TIMEOUT_MS) below_timeout = RELAY_MIN_TIMEOUT_MS;
+
+    // the command's deadline goes down with it, so a node below stops it
+    // as a direct node would
+    char deadline[40] = "";
+    if (f->deadline_ms > 0) snprintf(deadline, sizeof(deadline), ",\"deadline_ms\":%ld", f->deadline_ms);
+    char *sel = json_escape(f->select);
+    size_t cap = strlen(f->cmd) + (sel ? strlen(sel) : 0) + 256;
+    char *msg = malloc(cap);
+    if (!sel || !msg) {
+        free(sel);
+        free(msg);
+        pending_free(p);
+        return;
+    }
+    for (int i = 0; i < nchildren; ++i) {
+        RelayChild *c = children[i];
+        if (!c->hello_done) continue;
+        // the child itself runs it; the nodes below it get it forwarded
+        if (selector_match(f->select, c->name)) {
+            int n = snprintf(msg, cap, "{\"type\":\"exec\",\"id\":\"%s\",\"cmd\":\"%s\"%s}", f->id, f->cmd, deadline);
+            if (pending_want(p, c->name) == 0) child_send(c, msg, (size_t)n);
+        }
+        int below = 0;
+        for (int j = 0; j < c->nreach; ++j) {
+            if (selector_match(f->select, c->reach[j].name) && pending_want(p, c->reach[j].name) == 0) below++;
+        }
+        if (below > 0) {
+            int n = snprintf(msg, cap,
+                             "{\"type\":\"exec\",\"id\":\"%s\",\"cmd\":\"%s\",\"select\":\"%s\",\"timeout_ms\":%ld%s}",
+                             f->id, f->cmd, sel, below_timeout, deadline);
+            child_send(c, msg, (size_t)n);
+        }
+    }
+    free(sel);
+    free(msg);
+
+    if (p->nwant == 0) {
+        log_info("Relay: no node below matches %s for %s", f->select, f->id);
+        pending_free(p);
+        return;
+    }
+    p->got = calloc((size_t)p->nwant, 1);
+    if (!p->got) {
+        pending_free(p);
+        return;
+    }
+    qsort(p->want, (size_t)p->nwant, sizeof(char *), name_cmp);
+    p->next = pendings;
+    pendings = p;
+    log_info("Relay: forwarded %s to %d node(s)", f->id, p->nwant);
+}
+
+// Every child gets the cancel, as every direct session does from the
+// controller; the ones running id send their result as cancelled, and
+// relays below pass it on.
+static void relay_cancel(ForwardReq *f) {
+    char *id = json_escape(f->id);
+    char msg[REQUEST_ID_LEN * 6 + 32];
+    int n = id ? snprintf(msg, sizeof(msg), "{\"type\":\"cancel\",\"id\":\"%s\"}", id) : -1;
+    free(id);
+    if (n < 0 || (size_t)n >= sizeof(msg)) return;
+    for (int i = 0; i < nchildren; ++i) {
+        if (children[i]->hello_done && !children[i]->dead) child_send(children[i], msg, (size_t)n);
+    }
+}
+
+static void queue_forward(ForwardReq *f) {
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) queue_tail->next = f;
+    else queue_head = f;
+    queue_tail = f;
+    pthread_mutex_unlock(&queue_lock);
+    ssize_t rc = write(wake_fds[1], "x", 1);
+    (void)rc;
+}
+
+int agent_relay_forward(const JsonMsg *m, Arena *a) {
+    (void)a;
+    if (!__atomic_load_n(&relay_running, __ATOMIC_ACQUIRE)) return -1;
+    const JsonField *cmd = json_msg_field(m, "cmd");
+    if (!cmd || !cmd->is_string) return -1;
+    ForwardReq *f = calloc(1, sizeof(ForwardReq) + cmd->val_len + 1);
+    if (!f) return -1;
+    memcpy(f->cmd, cmd->val, cmd->val_len);
+    if (json_msg_copy(m, "id", f->id, sizeof(f->id)) < 0 || json_msg_copy(m, "select", f->select, sizeof(f->select)) < 0) {
+        free(f);
+        return -1;
+    }
+    f->deadline_ms = json_msg_int(m, "deadline_ms", 0);
+    if (f->deadline_ms < 0) f->deadline_ms = 0;
+    // results of a command with a deadline are waited for that much longer
+    f->timeout_ms = json_msg_int(m, "timeout_ms", RELAY_RESULT_TIMEOUT_MS + f->deadline_ms);
+    if (f->timeout_ms < RELAY_MIN_TIMEOUT_MS) f->timeout_ms = RELAY_MIN_TIMEOUT_MS;
+    queue_forward(f);
+    return 0;
+}
+
+int agent_relay_cancel(const char *id) {
+    if (!__atomic_load_n(&relay_running, __ATOMIC_ACQUIRE)) return -1;
+    ForwardReq *f = calloc(1, sizeof(ForwardReq) + 1);
+    if (!f) return -1;
+    snprintf(f->id, sizeof(f->id), "%s", id);
+    f->cancel = 1;
+    queue_forward(f);
+    return 0;
+}
+
+// --- children ---
+
+static void child_reach_add(RelayChild *c, const JsonMsg *m) {
+    ReachEntry e = { 0 };
+    if (json_msg_copy(m, "name", e.name, sizeof(e.name)) < 0) return;
+    json_msg_copy(m, "parent", e.parent, sizeof(e.parent));
+    json_msg_copy(m, "os", e.os, sizeof(e.os));
+    for (int i = 0; i < c->nreach; ++i) {
+        if (strcmp(c->reach[i].name, e.name) == 0) {
+            c->reach[i] = e;
+            return;
+        }
+    }
+    if (c->nreach == c->reach_cap) {
+        int cap = c->reach_cap ? c->reach_cap * 2 : 16;
+        ReachEntry *r = realloc(c->reach, (size_t)cap * sizeof(*r));
+        if (!r) return;
+        c->reach = r;
+        c->reach_cap = cap;
+    }
+    c->reach[c->nreach++] = e;
+}
+
+static void child_reach_remove(RelayChild *c, const char *name) {
+    for (int i = 0; i < c->nreach; ++i) {
+        if (strcmp(c->reach[i].name, name) == 0) {
+            c->reach[i] = c->reach[--c->nreach];
+            return;
+        }
+    }
+}
+
+static void child_remove(int idx, int report) {
+    RelayChild *c = children[idx];
+    if (report && c->hello_done) {
+        for (int i = 0; i < c->nreach; ++i) send_route("relay_leave", c->reach[i].name, NULL, NULL);
+        send_route("relay_leave", c->name, NULL, NULL);
+        log_info("Relay: child %s left", c->name);
+    }
+    close(c->fd);
+    ipc_reader_free(&c->rx);
+    ipc_writer_free(&c->tx);
+    free(c->reach);
+    free(c);
+    children[idx] = children[--nchildren];
+}
+
+static void on_child_hello(RelayChild *c, const JsonMsg *m) {
+    if (json_msg_copy(m, "name", c->name, sizeof(c->name)) < 0 || !c->name[0]) return;
+    json_msg_copy(m, "os", c->os, sizeof(c->os));
+    // a child reconnecting replaces its old connection
+    for (int i = 0; i < nchildren; ++i) {
+        RelayChild *old = children[i];
+        if (old != c && old->hello_done && !old->dead && strcmp(old->name, c->name) == 0) {
+            old->dead = 1;
+            old->replaced = 1;
+        }
+    }
+    c->hello_done = 1;
+    static const char ack[] = "{\"type\":\"ack\",\"status\":\"ok\"}";
+    child_send(c, ack, sizeof(ack) - 1);
+    send_route("relay_join", c->name, upstream->name, c->os);
+    log_info("Relay: child %s joined", c->name);
+}
+
+static void child_message(RelayChild *c, const char *line, size_t len) {
+    JsonMsg m;
+    if (json_msg_parse(&m, line, len) < 0) return;
+    if (!c->hello_done) {
+        if (json_msg_str_eq(&m, "type", "hello")) on_child_hello(c, &m);
+        return;
+    }
+    char name[256];
+    if (json_msg_str_eq(&m, "type", "result")) {
+        // acked once its group is in our spool, not before
+        on_child_result(c, &m, json_msg_int(&m, "seq", 0));
+    } else if (json_msg_str_eq(&m, "type", "relay_join")) {
+        // a relay below us: its nodes are reached through this child
+        child_reach_add(c, &m);
+        node_agent_send(upstream, line, len);
+    } else if (json_msg_str_eq(&m, "type", "relay_leave")) {
+        if (json_msg_copy(&m, "name", name, sizeof(name)) == 0) child_reach_remove(c, name);
+        node_agent_send(upstream, line, len);
+    } else if (json_msg_str_eq(&m, "type", "shm_request")) {
+        static const char declined[] = "{\"type\":\"shm_declined\"}";
+        child_send(c, declined, sizeof(declined) - 1);
+    }
+}
+
+// Returns -1 when the child is gone.
+static int child_input(RelayChild *c) {
+    ssize_t n = ipc_reader_fill(&c->rx, c->fd);
+    if (n == -2) return 0;
+    size_t len = 0;
+    char *line;
+    while ((line = ipc_reader_next_line(&c->rx, &len)) != NULL) {
+        if (len > 0) child_message(c, line, len);
+        arena_reset(&relay_arena);
+    }
+    return n <= 0 ? -1 : 0;
+}
+
+static void child_accept(void) {
+    int fd = accept4(relay_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    if (nchildren == children_cap) {
+        int cap = children_cap ? children_cap * 2 : 32;
+        RelayChild **cs = realloc(children, (size_t)cap * sizeof(RelayChild *));
+        if (!cs) {
+            close(fd);
+            return;
+        }
+        children = cs;
+        children_cap = cap;
+    }
+    RelayChild *c = calloc(1, sizeof(RelayChild));
+    if (!c) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    ipc_reader_init(&c->rx);
+    ipc_writer_init(&c->tx);
+    children[nchildren++] = c;
+}
+
+// Reports every node below again, to a controller the agent moved to.
+static void resync_routes(void) {
+    for (int i = 0; i < nchildren; ++i) {
+        RelayChild *c = children[i];
+        if (!c->hello_done || c->dead) continue;
+        send_route("relay_join", c->name, upstream->name, c->os);
+        for (int j = 0; j < c->nreach; ++j) {
+            send_route("relay_join", c->reach[j].name, c->reach[j].parent, c->reach[j].os);
+        }
+    }
+}
+
+// --- thread ---
+
+static void take_forwards(void) {
+    char drain[64];
+    while (read(wake_fds[0], drain, sizeof(drain)) > 0) {}
+    if (__atomic_exchange_n(&resync_requested, 0, __ATOMIC_ACQ_REL)) resync_routes();
+    pthread_mutex_lock(&queue_lock);
+    ForwardReq *f = queue_head;
+    queue_head = queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    while (f) {
+        ForwardReq *next = f->next;
+        if (f->cancel) relay_cancel(f);
+        else relay_exec(f);
+        free(f);
+        f = next;
+    }
+}
+
+static int expire_pendings(void) {
+    long long now = now_ms();
+    long long next = now + 1000;
+    Pending *p = pendings;
+    while (p) {
+        Pending *after = p->next;
+        if (p->deadline_ms <= now) pending_flush(p);
+        else if (p->deadline_ms < next) next = p->deadline_ms;
+        p = after;
+    }
+    return (int)(next - now);
+}
+
+static void *relay_main(void *arg) {
+    (void)arg;
+    struct pollfd *pfds = NULL;
+    int pfds_cap = 0;
+    while (!__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE)) {
+        int n = nchildren + 2;
+        if (n > pfds_cap) {
+            struct pollfd *p = realloc(pfds, (size_t)n * 2 * sizeof(struct pollfd));
+            if (!p) break;
+            pfds = p;
+            pfds_cap = n * 2;
+        }
+        pfds[0] = (struct pollfd){ wake_fds[0], POLLIN, 0 };
+        pfds[1] = (struct pollfd){ relay_listen_fd, POLLIN, 0 };
+        for (int i = 0; i < nchildren; ++i) {
+            short ev = POLLIN;
+            if (ipc_writer_pending(&children[i]->tx) > 0) ev |= POLLOUT;
+            pfds[i + 2] = (struct pollfd){ children[i]->fd, ev, 0 };
+        }
+        int timeout = expire_pendings();
+        if (poll(pfds, (nfds_t)n, timeout) < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < n - 2; ++i) {
+            short re = pfds[i + 2].revents;
+            RelayChild *c = children[i];
+            if (!re || c->dead) continue;
+            if (re & POLLOUT) c->dead = ipc_writer_flush(&c->tx, c->fd) < 0;
+            if (!c->dead && (re & (POLLIN | POLLHUP | POLLERR))) c->dead = child_input(c) < 0;
+        }
+        for (int i = nchildren - 1; i >= 0; --i) {
+            if (children[i]->dead) child_remove(i, !children[i]->replaced);
+        }
+        if (pfds[1].revents & POLLIN) child_accept();
+        if (pfds[0].revents & POLLIN) take_forwards();
+    }
+    free(pfds);
+    return NULL;
+}
+
+int agent_relay_enable(int listen_fd) {
+    if (listen_fd < 0) return -1;
+    relay_listen_fd = listen_fd;
+    return 0;
+}
+
+int agent_relay_start(AgentConn *up) {
+    if (relay_listen_fd < 0 || relay_running) return 0;
+    if (pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("Relay: pipe failed: %s", strerror(errno));
+        return -1;
+    }
+    upstream = up;
+    arena_init(&relay_arena, 64 * 1024);
+    __atomic_store_n(&stop_requested, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&relay_thread, NULL, relay_main, NULL) != 0) {
+        log_error("Relay: cannot start thread");
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+        arena_destroy(&relay_arena);
+        return -1;
+    }
+    __atomic_store_n(&relay_running, 1, __ATOMIC_RELEASE);
+    log_info("Relaying for child agents (fd=%d)", relay_listen_fd);
+    return 0;
+}
+
+void agent_relay_resync(void) {
+    if (!relay_running) return;
+    __atomic_store_n(&resync_requested, 1, __ATOMIC_RELEASE);
+    ssize_t rc = write(wake_fds[1], "x", 1);
+    (void)rc;
+}
+
+void agent_relay_stop(void) {
+    if (!relay_running) return;
+    __atomic_store_n(&relay_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stop_requested, 1, __ATOMIC_RELEASE);
+    ssize_t rc = write(wake_fds[1], "x", 1);
+    (void)rc;
+    pthread_join(relay_thread, NULL);
+
+    // children reconnect to whatever relay or controller is up next
+    while (nchildren > 0) child_remove(nchildren - 1, 0);
+    while (pendings) {
+        Pending *p = pendings;
+        pendings = p->next;
+        pending_free(p);
+    }
+    while (queue_head) {
+        ForwardReq *f = queue_head;
+        queue_head = f->next;
+        free(f);
+    }
+    queue_tail = NULL;
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
+    arena_destroy(&relay_arena);
+    upstream = NULL;
+}
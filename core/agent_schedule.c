@@ -0,0 +1,441 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../include/agent_schedule.h"
+#include "../include/arena.h"
+#include "../include/base64.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+
+typedef struct {
+    int used;
+    unsigned gen;           // bumped on every (re)definition
+    char name[64];
+    char *cmd;
+    long every_ms;
+    long jitter_ms;
+    long keep_s;
+    // place on the wheel
+    int slot;
+    long rounds;            // turns of the wheel left before it is due
+    int next;               // next job in the slot, or -1
+} Job;
+
+// One finished run, as the JSON line it is uploaded as.
+typedef struct Row {
+    struct Row *next;
+    long long done_ms;
+    long long expires_ms;
+    size_t len;
+    char line[];
+} Row;
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sched_thread;
+static int sched_running = 0;
+static int sched_stop = 0;
+static AgentConn *sched_conn = NULL;
+// guarded by sched_lock
+static Job jobs[AGENT_SCHEDULE_MAX_JOBS];
+static int wheel[AGENT_SCHEDULE_WHEEL_SLOTS];
+static int wheel_pos = 0;
+static Row *rows_head = NULL, *rows_tail = NULL;
+static size_t rows_bytes = 0;
+static int rows_count = 0;
+static char *inflight = NULL;       // the batch waiting for its ack
+static size_t inflight_len = 0;
+static uint64_t inflight_seq = 0;
+static int inflight_unsent = 0;
+static uint64_t batch_seq = 0;
+static unsigned int jitter_seed = 0;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_unlink(int j) {
+    int *p = &wheel[jobs[j].slot];
+    while (*p >= 0 && *p != j) p = &jobs[*p].next;
+    if (*p == j) *p = jobs[j].next;
+    jobs[j].slot = -1;
+}
+
+// Puts job j on the wheel, its next run every_ms plus some jitter away.
+static void wheel_insert(int j) {
+    long delay = jobs[j].every_ms;
+    if (jobs[j].jitter_ms > 0) delay += rand_r(&jitter_seed) % (jobs[j].jitter_ms + 1);
+    long ticks = (delay + AGENT_SCHEDULE_TICK_MS - 1) / AGENT_SCHEDULE_TICK_MS;
+    if (ticks < 1) ticks = 1;
+    jobs[j].slot = (int)((wheel_pos + ticks) % AGENT_SCHEDULE_WHEEL_SLOTS);
+    jobs[j].rounds = (ticks - 1) / AGENT_SCHEDULE_WHEEL_SLOTS;
+    jobs[j].next = wheel[jobs[j].slot];
+    wheel[jobs[j].slot] = j;
+}
+
+static void job_drop(int j) {
+    if (jobs[j].slot >= 0) wheel_unlink(j);
+    free(jobs[j].cmd);
+    jobs[j].cmd = NULL;
+    jobs[j].used = 0;
+    jobs[j].gen++;
+}
+
+static void row_append(Row *r) {
+    r->next = NULL;
+    if (rows_tail) rows_tail->next = r;
+    else rows_head = r;
+    rows_tail = r;
+    rows_bytes += r->len + 1;
+    rows_count++;
+    // with no controller for a long time the oldest results go first
+    while (rows_bytes > AGENT_SCHEDULE_MAX_PENDING && rows_head != r) {
+        Row *old = rows_head;
+        rows_head = old->next;
+        rows_bytes -= old->len + 1;
+        rows_count--;
+        free(old);
+    }
+}
+
+static void rows_prune(long long now) {
+    Row **p = &rows_head;
+    rows_tail = NULL;
+    while (*p) {
+        Row *r = *p;
+        if (r->expires_ms <= now) {
+            *p = r->next;
+            rows_bytes -= r->len + 1;
+            rows_count--;
+            free(r);
+            continue;
+        }
+        rows_tail = r;
+        p = &r->next;
+    }
+}
+
+static Row *row_build(const Job *job, const char *cmd, const CommandOutput *res, long long now) {
+    size_t out_len = res->out_len, err_len = res->err_len;
+    if (out_len > AGENT_SCHEDULE_MAX_OUTPUT) out_len = AGENT_SCHEDULE_MAX_OUTPUT;
+    if (err_len > AGENT_SCHEDULE_MAX_OUTPUT - out_len) err_len = AGENT_SCHEDULE_MAX_OUTPUT - out_len;
+    char *name = json_escape(job->name);
+    char *escaped_cmd = json_escape(cmd);
+    if (!name || !escaped_cmd) {
+        free(name);
+        free(escaped_cmd);
+        return NULL;
+    }
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "\",\"at\":%lld,\"exit\":%d,\"out\":\"", (long long)time(NULL),
+                            res->exit_code);
+    size_t size = sizeof("{\"job\":\"\",\"cmd\":\"\"}") + strlen(name) + strlen(escaped_cmd) + (size_t)head_len +
+                  json_escaped_len(res->out, out_len) + json_escaped_len(res->err, err_len);
+    Row *r = malloc(sizeof(Row) + size);
+    if (r) {
+        // stderr follows stdout, as with 2>&1
+        char *o = r->line;
+        o += sprintf(o, "{\"job\":\"%s\",\"cmd\":\"%s%s", name, escaped_cmd, head);
+        o += json_escape_to(o, res->out, out_len);
+        o += json_escape_to(o, res->err, err_len);
+        o += sprintf(o, "\"}");
+        r->len = (size_t)(o - r->line);
+        r->done_ms = now;
+        r->expires_ms = now + job->keep_s * 1000;
+    }
+    free(name);
+    free(escaped_cmd);
+    return r;
+}
+
+// Takes rows off the front into one deflated batch message. Called with
+// sched_lock held; NULL if nothing could be built, the rows then wait.
+static char *batch_build(size_t *msg_len, uint64_t *seq) {
+    size_t raw = 0;
+    int count = 0;
+    for (Row *r = rows_head; r && (count == 0 || raw + r->len + 1 <= AGENT_SCHEDULE_BATCH_MAX); r = r->next) {
+        raw += r->len + 1;
+        count++;
+    }
+    char *text = malloc(raw);
+    uLongf packed_len = compressBound(raw);
+    unsigned char *packed = malloc(packed_len);
+    char *msg = NULL;
+    if (text && packed) {
+        size_t off = 0;
+        for (Row *r = rows_head; off < raw; r = r->next) {
+            memcpy(text + off, r->line, r->len);
+            off += r->len;
+            text[off++] = '\n';
+        }
+        if (compress2(packed, &packed_len, (const Bytef *)text, raw, Z_DEFAULT_COMPRESSION) == Z_OK) {
+            msg = malloc(BASE64_ENCODED_LEN(packed_len) + 160);
+        }
+    }
+    if (msg) {
+        // the id stays unique across agent restarts, for the controller's dedup
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        *seq = ++batch_seq;
+        int n = sprintf(msg, "{\"type\":\"sched_batch\",\"id\":\"sched-%lld-%llu\",\"seq\":%llu,\"count\":%d,"
+                        "\"raw\":%zu,\"data\":\"",
+                        (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, (unsigned long long)*seq,
+                        (unsigned long long)*seq, count, raw);
+        size_t len = (size_t)n + base64_encode(msg + n, packed, packed_len);
+        memcpy(msg + len, "\"}", 3);
+        *msg_len = len + 2;
+        for (int i = 0; i < count; ++i) {
+            Row *r = rows_head;
+            rows_head = r->next;
+            rows_bytes -= r->len + 1;
+            rows_count--;
+            free(r);
+        }
+        if (!rows_head) rows_tail = NULL;
+    }
+    free(text);
+    free(packed);
+    return msg;
+}
+
+// Sends the batch in flight again if asked to, or builds the next one once
+// enough rows or old enough ones are waiting. Called with sched_lock held,
+// which is dropped while sending.
+static void batch_flush(long long now) {
+    if (!inflight && rows_head &&
+        (rows_bytes >= AGENT_SCHEDULE_BATCH_BYTES || now - rows_head->done_ms >= AGENT_SCHEDULE_BATCH_MS)) {
+        pthread_mutex_lock(&sched_conn->send_lock);
+        int connected = sched_conn->sock >= 0;
+        pthread_mutex_unlock(&sched_conn->send_lock);
+        // without a controller rows wait, so retention can still apply
+        if (!connected) return;
+        int count = rows_count;
+        inflight = batch_build(&inflight_len, &inflight_seq);
+        if (!inflight) {
+            log_error("Cannot build a batch of %d scheduled result(s)", count);
+            return;
+        }
+        inflight_unsent = 1;
+    }
+    if (!inflight || !inflight_unsent) return;
+    inflight_unsent = 0;
+    // the ack is handled on the run loop thread, which frees the batch
+    char *msg = malloc(inflight_len);
+    size_t len = inflight_len;
+    if (!msg) {
+        inflight_unsent = 1;
+        return;
+    }
+    memcpy(msg, inflight, len);
+    pthread_mutex_unlock(&sched_lock);
+    node_agent_send(sched_conn, msg, len);
+    free(msg);
+    pthread_mutex_lock(&sched_lock);
+}
+
+static void *schedule_thread(void *arg) {
+    (void)arg;
+    Arena arena;
+    arena_init(&arena, 64 * 1024);
+    long long next_tick = now_ms() + AGENT_SCHEDULE_TICK_MS;
+    pthread_mutex_lock(&sched_lock);
+    while (!sched_stop) {
+        long long now = now_ms();
+        if (now < next_tick) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            long long wait_ns = (next_tick - now) * 1000000LL + until.tv_nsec;
+            until.tv_sec += (time_t)(wait_ns / 1000000000LL);
+            until.tv_nsec = (long)(wait_ns % 1000000000LL);
+            pthread_cond_timedwait(&sched_cond, &sched_lock, &until);
+            // woken early: a new schedule, an ack or a resync
+            batch_flush(now_ms());
+            continue;
+        }
+        // jobs run one at a time; ticks missed meanwhile are caught up
+        next_tick += AGENT_SCHEDULE_TICK_MS;
+        wheel_pos = (wheel_pos + 1) % AGENT_SCHEDULE_WHEEL_SLOTS;
+        int due[AGENT_SCHEDULE_MAX_JOBS];
+        unsigned due_gen[AGENT_SCHEDULE_MAX_JOBS];
+        int ndue = 0;
+        for (int *p = &wheel[wheel_pos]; *p >= 0;) {
+            int j = *p;
+            if (jobs[j].rounds-- > 0) {
+                p = &jobs[j].next;
+                continue;
+            }
+            *p = jobs[j].next;
+            jobs[j].slot = -1;
+            due_gen[ndue] = jobs[j].gen;
+            due[ndue++] = j;
+        }
+        for (int i = 0; i < ndue && !sched_stop; ++i) {
+            int j = due[i];
+            // dropped or redefined while an earlier job ran
+            if (!jobs[j].used || jobs[j].gen != due_gen[i]) continue;
+            Job job = jobs[j];
+            char *cmd = strdup(job.cmd);
+            if (!cmd) {
+                wheel_insert(j);
+                continue;
+            }
+            pthread_mutex_unlock(&sched_lock);
+            CommandOutput res;
+            execute_system_command_fork(cmd, &arena, &res);
+            long long done = now_ms();
+            Row *r = row_build(&job, cmd, &res, done);
+            arena_reset(&arena);
+            pthread_mutex_lock(&sched_lock);
+            if (r) row_append(r);
+            // redefined or dropped while it ran: the new definition is on
+            // the wheel already
+            if (jobs[j].used && jobs[j].gen == job.gen) wheel_insert(j);
+            free(cmd);
+        }
+        rows_prune(now_ms());
+        batch_flush(now_ms());
+    }
+    pthread_mutex_unlock(&sched_lock);
+    arena_destroy(&arena);
+    return NULL;
+}
+
+static int job_find(const char *name) {
+    for (int j = 0; j < AGENT_SCHEDULE_MAX_JOBS; ++j) {
+        if (jobs[j].used && strcmp(jobs[j].name, name) == 0) return j;
+    }
+    return -1;
+}
+
+static void on_schedule(const MsgContext *ctx, void *user) {
+    (void)user;
+    char name[64];
+    char *cmd = json_msg_str(ctx->msg, "cmd", ctx->arena, NULL);
+    long every_ms = json_msg_int(ctx->msg, "every_ms", 0);
+    long jitter_ms = json_msg_int(ctx->msg, "jitter_ms", 0);
+    long keep_s = json_msg_int(ctx->msg, "keep_s", AGENT_SCHEDULE_DEFAULT_KEEP_S);
+    if (json_msg_copy(ctx->msg, "name", name, sizeof(name)) < 0 || !name[0] || strcmp(name, "*") == 0 || !cmd ||
+        !cmd[0]) {
+        log_error("schedule without a name or a command");
+        return;
+    }
+    if (every_ms < AGENT_SCHEDULE_MIN_EVERY_MS) every_ms = AGENT_SCHEDULE_MIN_EVERY_MS;
+    if (jitter_ms < 0) jitter_ms = 0;
+    if (keep_s <= 0) keep_s = AGENT_SCHEDULE_DEFAULT_KEEP_S;
+    char *copy = strdup(cmd);
+    if (!copy) return;
+
+    pthread_mutex_lock(&sched_lock);
+    int j = job_find(name);
+    if (j >= 0) job_drop(j);
+    for (j = 0; j < AGENT_SCHEDULE_MAX_JOBS && jobs[j].used; ++j) {
+    }
+    if (j == AGENT_SCHEDULE_MAX_JOBS) {
+        pthread_mutex_unlock(&sched_lock);
+        free(copy);
+        log_error("No room for job %s: %d jobs scheduled", name, AGENT_SCHEDULE_MAX_JOBS);
+        return;
+    }
+    jobs[j].used = 1;
+    snprintf(jobs[j].name, sizeof(jobs[j].name), "%s", name);
+    jobs[j].cmd = copy;
+    jobs[j].every_ms = every_ms;
+    jobs[j].jitter_ms = jitter_ms;
+    jobs[j].keep_s = keep_s;
+    wheel_insert(j);
+    pthread_mutex_unlock(&sched_lock);
+    log_info("Scheduled job %s every %ld ms (+%ld ms jitter)", name, every_ms, jitter_ms);
+}
+
+static void on_unschedule(const MsgContext *ctx, void *user) {
+    (void)user;
+    char name[64];
+    if (json_msg_copy(ctx->msg, "name", name, sizeof(name)) < 0) return;
+    int dropped = 0;
+    pthread_mutex_lock(&sched_lock);
+    for (int j = 0; j < AGENT_SCHEDULE_MAX_JOBS; ++j) {
+        if (!jobs[j].used || (strcmp(name, "*") != 0 && strcmp(jobs[j].name, name) != 0)) continue;
+        job_drop(j);
+        dropped++;
+    }
+    pthread_mutex_unlock(&sched_lock);
+    log_info("Unscheduled %d job(s) matching %s", dropped, name);
+}
+
+static void on_sched_ack(const MsgContext *ctx, void *user) {
+    (void)user;
+    long seq = json_msg_int(ctx->msg, "seq", 0);
+    pthread_mutex_lock(&sched_lock);
+    if (inflight && seq > 0 && (uint64_t)seq == inflight_seq) {
+        free(inflight);
+        inflight = NULL;
+        inflight_len = 0;
+        // more may be waiting already
+        pthread_cond_signal(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void agent_schedule_register(Dispatcher *d) {
+    dispatcher_register(d, "schedule", on_schedule, NULL);
+    dispatcher_register(d, "unschedule", on_unschedule, NULL);
+    dispatcher_register(d, "sched_ack", on_sched_ack, NULL);
+}
+
+void agent_schedule_start(AgentConn *conn) {
+    if (sched_running) return;
+    pthread_mutex_lock(&sched_lock);
+    for (int i = 0; i < AGENT_SCHEDULE_WHEEL_SLOTS; ++i) wheel[i] = -1;
+    for (int j = 0; j < AGENT_SCHEDULE_MAX_JOBS; ++j) jobs[j].slot = -1;
+    jitter_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    sched_conn = conn;
+    sched_stop = 0;
+    pthread_mutex_unlock(&sched_lock);
+    if (pthread_create(&sched_thread, NULL, schedule_thread, NULL) != 0) {
+        log_error("Failed to start the job scheduler thread");
+        return;
+    }
+    sched_running = 1;
+}
+
+void agent_schedule_stop(void) {
+    if (!sched_running) return;
+    pthread_mutex_lock(&sched_lock);
+    sched_stop = 1;
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+    pthread_join(sched_thread, NULL);
+    sched_running = 0;
+    for (int j = 0; j < AGENT_SCHEDULE_MAX_JOBS; ++j) {
+        if (jobs[j].used) job_drop(j);
+    }
+    while (rows_head) {
+        Row *r = rows_head;
+        rows_head = r->next;
+        free(r);
+    }
+    rows_tail = NULL;
+    rows_bytes = 0;
+    rows_count = 0;
+    free(inflight);
+    inflight = NULL;
+    sched_conn = NULL;
+}
+
+void agent_schedule_resync(void) {
+    pthread_mutex_lock(&sched_lock);
+    if (inflight) {
+        inflight_unsent = 1;
+        pthread_cond_signal(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
@@ -0,0 +1,133 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/agent_scripts.h"
+#include "../include/checksum.h"
+#include "../include/logging.h"
+
+static char cache_dir[256];
+
+typedef struct {
+    char name[SHA256_HEX_LEN + 1];
+    off_t size;
+    time_t used;
+} CachedScript;
+
+static int valid_hash(const char *hash) {
+    size_t n = 0;
+    for (; hash[n]; ++n) {
+        if (!((hash[n] >= '0' && hash[n] <= '9') || (hash[n] >= 'a' && hash[n] <= 'f'))) return 0;
+    }
+    return n == SHA256_HEX_LEN;
+}
+
+static int script_path(const char *hash, char *path, size_t path_size) {
+    if (!cache_dir[0] || !valid_hash(hash)) return -1;
+    int n = snprintf(path, path_size, "%s/%s", cache_dir, hash);
+    return n < 0 || (size_t)n >= path_size ? -1 : 0;
+}
+
+static int by_use(const void *a, const void *b) {
+    const CachedScript *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Deletes the least recently used scripts until one of incoming bytes fits.
+static void make_room(off_t incoming) {
+    DIR *d = opendir(cache_dir);
+    if (!d) return;
+    CachedScript *all = NULL;
+    int n = 0, cap = 0;
+    off_t total = incoming;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char path[512];
+        struct stat st;
+        if (!valid_hash(e->d_name) || snprintf(path, sizeof(path), "%s/%s", cache_dir, e->d_name) >= (int)sizeof(path) ||
+            stat(path, &st) < 0) {
+            continue;
+        }
+        if (n == cap) {
+            int ncap = cap ? cap * 2 : 64;
+            CachedScript *grown = realloc(all, (size_t)ncap * sizeof(*all));
+            if (!grown) break;
+            all = grown;
+            cap = ncap;
+        }
+        memcpy(all[n].name, e->d_name, SHA256_HEX_LEN + 1);
+        all[n].size = st.st_size;
+        all[n].used = st.st_mtime;
+        total += st.st_size;
+        n++;
+    }
+    closedir(d);
+
+    qsort(all, (size_t)n, sizeof(*all), by_use);
+    for (int i = 0; i < n && (total > AGENT_SCRIPT_CACHE_MAX_BYTES || n - i >= AGENT_SCRIPT_CACHE_MAX_FILES); ++i) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, all[i].name);
+        if (unlink(path) == 0) {
+            total -= all[i].size;
+            log_info("Evicted script %.12s from the cache", all[i].name);
+        }
+    }
+    free(all);
+}
+
+int agent_scripts_open(const char *dir) {
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir ? dir : "");
+    if (!cache_dir[0]) return -1;
+    if (mkdir(cache_dir, 0700) < 0 && errno != EEXIST) {
+        log_error("Cannot create script cache %s: %s", cache_dir, strerror(errno));
+        cache_dir[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+int agent_scripts_lookup(const char *hash, char *path, size_t path_size) {
+    if (script_path(hash, path, path_size) < 0 || access(path, R_OK) < 0) return -1;
+    // the mtime orders the cache
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 0;
+}
+
+int agent_scripts_store(const char *hash, const char *body, size_t len, char *path, size_t path_size) {
+    char actual[SHA256_HEX_LEN + 1];
+    sha256_hex(body, len, actual);
+    if (strcmp(actual, hash) != 0) {
+        log_error("Script body does not match its hash %.12s", hash);
+        return -1;
+    }
+    if (script_path(hash, path, path_size) < 0) return -1;
+    make_room((off_t)len);
+
+    // written aside and renamed, so a crash never leaves half a script
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", cache_dir, hash);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Cannot write script cache %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, body + done, len - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += (size_t)w;
+    }
+    if (close(fd) < 0 || done < len || rename(tmp, path) < 0) {
+        log_error("Cannot write script cache %s: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    log_info("Cached script %.12s (%zu bytes)", hash, len);
+    return 0;
+}
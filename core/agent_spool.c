@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/agent_spool.h"
+#include "../include/logging.h"
+#include "../include/requests.h"
+
+#define SPOOL_MAGIC 0x53504f4f4c303031ULL    // "SPOOL001"
+#define SPOOL_PENDING 1
+#define SPOOL_ACKED 2
+
+typedef struct {
+    uint64_t magic;
+    uint64_t head;      // first record not trimmed yet
+    uint64_t tail;      // end of the last committed record
+    uint64_t next_seq;
+} SpoolHeader;
+
+typedef struct {
+    uint32_t len;       // message bytes after this header
+    uint32_t state;
+    uint64_t seq;
+    char id[REQUEST_ID_LEN];
+} SpoolRecord;
+
+#define SPOOL_DATA ((uint64_t)sizeof(SpoolHeader))
+
+static int spool_fd = -1;
+static char *base = NULL;
+static size_t map_len = 0;
+static uint64_t reserved_at = 0;    // offset of the open reservation, 0 if none
+static int pending = 0;
+
+static SpoolHeader *hdr(void) {
+    return (SpoolHeader *)base;
+}
+
+static uint64_t record_size(uint64_t len) {
+    return (sizeof(SpoolRecord) + len + 7) & ~(uint64_t)7;
+}
+
+static SpoolRecord *record_at(uint64_t off) {
+    return (SpoolRecord *)(base + off);
+}
+
+static int spool_map(size_t len) {
+    if (base) munmap(base, map_len);
+    base = NULL;
+    if (ftruncate(spool_fd, (off_t)len) < 0) return -1;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, spool_fd, 0);
+    if (p == MAP_FAILED) return -1;
+    base = p;
+    map_len = len;
+    return 0;
+}
+
+// Walks the committed records; a crash can only leave a torn record past
+// tail, but a damaged file is cut back to its last sound record.
+static void spool_check(void) {
+    SpoolHeader *h = hdr();
+    if (h->head < SPOOL_DATA || h->head > h->tail || h->tail > map_len) {
+        h->head = h->tail = SPOOL_DATA;
+    }
+    pending = 0;
+    uint64_t off = h->head;
+    while (off < h->tail) {
+        SpoolRecord *r = record_at(off);
+        uint64_t size = record_size(r->len);
+        if (off + size > h->tail || (r->state != SPOOL_PENDING && r->state != SPOOL_ACKED)) {
+            log_error("Result spool damaged at offset %llu, dropping the rest", (unsigned long long)off);
+            h->tail = off;
+            break;
+        }
+        if (r->state == SPOOL_PENDING) pending++;
+        if (r->seq >= h->next_seq) h->next_seq = r->seq + 1;
+        off += size;
+    }
+}
+
+int agent_spool_open(const char *path) {
+    if (spool_fd >= 0) agent_spool_close();
+    if (!path || !path[0]) return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Cannot open result spool %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    spool_fd = fd;
+    size_t len = (size_t)st.st_size;
+    int fresh = len < SPOOL_DATA || len > AGENT_SPOOL_MAX;
+    if (fresh) len = AGENT_SPOOL_INITIAL;
+    if (spool_map(len) < 0) {
+        log_error("Cannot map result spool %s: %s", path, strerror(errno));
+        close(fd);
+        spool_fd = -1;
+        return -1;
+    }
+    SpoolHeader *h = hdr();
+    if (fresh || h->magic != SPOOL_MAGIC) {
+        memset(h, 0, sizeof(*h));
+        h->magic = SPOOL_MAGIC;
+        h->head = h->tail = SPOOL_DATA;
+        h->next_seq = 1;
+    }
+    spool_check();
+    if (pending > 0) log_info("Result spool %s holds %d unacknowledged result(s)", path, pending);
+    return 0;
+}
+
+void agent_spool_close(void) {
+    if (base) munmap(base, map_len);
+    base = NULL;
+    map_len = 0;
+    if (spool_fd >= 0) close(spool_fd);
+    spool_fd = -1;
+    reserved_at = 0;
+    pending = 0;
+}
+
+// Makes room for need more bytes at tail: starts over when everything is
+// acked, moves the live records to the front when most of the file is
+// trimmed, and grows the file as a last resort.
+static int spool_make_room(uint64_t need) {
+    SpoolHeader *h = hdr();
+    if (h->head == h->tail) h->head = h->tail = SPOOL_DATA;
+    if (h->tail + need <= map_len) return 0;
+    uint64_t live = h->tail - h->head;
+    if (h->head > SPOOL_DATA && SPOOL_DATA + live + need <= map_len) {
+        memmove(base + SPOOL_DATA, base + h->head, live);
+        h->head = SPOOL_DATA;
+        h->tail = SPOOL_DATA + live;
+        return 0;
+    }
+    size_t len = map_len;
+    while (len < h->tail + need) len *= 2;
+    if (len > AGENT_SPOOL_MAX || spool_map(len) < 0) return -1;
+    return 0;
+}
+
+char *agent_spool_reserve(const char *id, size_t len, uint64_t *seq) {
+    if (!base || !id) return NULL;
+    uint64_t size = record_size(len);
+    if (spool_make_room(size) < 0) {
+        log_error("Result spool is full; result %s is not kept", id);
+        return NULL;
+    }
+    SpoolHeader *h = hdr();
+    SpoolRecord *r = record_at(h->tail);
+    memset(r, 0, sizeof(*r));
+    r->len = (uint32_t)len;
+    r->seq = h->next_seq;
+    snprintf(r->id, sizeof(r->id), "%s", id);
+    reserved_at = h->tail;
+    if (seq) *seq = r->seq;
+    return (char *)(r + 1);
+}
+
+void agent_spool_commit(size_t len) {
+    if (!base || !reserved_at) return;
+    SpoolHeader *h = hdr();
+    SpoolRecord *r = record_at(reserved_at);
+    if (len < r->len) r->len = (uint32_t)len;
+    r->state = SPOOL_PENDING;
+    h->next_seq = r->seq + 1;
+    h->tail = reserved_at + record_size(r->len);
+    reserved_at = 0;
+    pending++;
+}
+
+static void spool_trim(void) {
+    SpoolHeader *h = hdr();
+    while (h->head < h->tail && record_at(h->head)->state == SPOOL_ACKED) {
+        h->head += record_size(record_at(h->head)->len);
+    }
+}
+
+void agent_spool_ack(uint64_t seq) {
+    if (!base) return;
+    SpoolHeader *h = hdr();
+    // acks mostly come in order, so the record is usually the first one
+    for (uint64_t off = h->head; off < h->tail; off += record_size(record_at(off)->len)) {
+        SpoolRecord *r = record_at(off);
+        if (r->seq != seq) continue;
+        if (r->state == SPOOL_PENDING) pending--;
+        r->state = SPOOL_ACKED;
+        break;
+    }
+    spool_trim();
+}
+
+static uint64_t id_hash(const char *id) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)id; *p; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+int agent_spool_replay(size_t max_len, void (*fn)(const char *msg, size_t len, void *arg), void *arg) {
+    if (!base || !fn || pending == 0) return 0;
+    SpoolHeader *h = hdr();
+    // ids already sent in this pass, open addressing at half load
+    size_t slots = 16;
+    while (slots < (size_t)pending * 2) slots *= 2;
+    uint64_t *seen = calloc(slots, sizeof(uint64_t));
+    if (!seen) return 0;
+    int sent = 0;
+    for (uint64_t off = h->head; off < h->tail; off += record_size(record_at(off)->len)) {
+        SpoolRecord *r = record_at(off);
+        if (r->state != SPOOL_PENDING) continue;
+        if (r->len > max_len) {
+            log_error("Dropping spooled result %s: %zu bytes, more than the controller takes", r->id, (size_t)r->len);
+            r->state = SPOOL_ACKED;
+            pending--;
+            continue;
+        }
+        uint64_t key = id_hash(r->id);
+        size_t slot = key & (slots - 1);
+        while (seen[slot] && seen[slot] != key) slot = (slot + 1) & (slots - 1);
+        if (seen[slot]) {
+            // a request runs once per node; an earlier record answers it
+            r->state = SPOOL_ACKED;
+            pending--;
+            continue;
+        }
+        seen[slot] = key;
+        fn((const char *)(r + 1), r->len, arg);
+        sent++;
+    }
+    free(seen);
+    spool_trim();
+    return sent;
+}
+
+int agent_spool_resend(uint64_t seq, void (*fn)(const char *msg, size_t len, void *arg), void *arg) {
+    if (!base || !fn) return -1;
+    SpoolHeader *h = hdr();
+    for (uint64_t off = h->head; off < h->tail; off += record_size(record_at(off)->len)) {
+        SpoolRecord *r = record_at(off);
+        if (r->seq != seq) continue;
+        if (r->state != SPOOL_PENDING) return -1;
+        fn((const char *)(r + 1), r->len, arg);
+        return 0;
+    }
+    return -1;
+}
+
+int agent_spool_pending(void) {
+    return pending;
+}
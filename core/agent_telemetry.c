@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+#include "../include/agent_telemetry.h"
+#include "../include/telemetry.h"
+
+// counters the rates are computed from
+static unsigned long long prev_busy = 0, prev_total = 0;
+static unsigned long long prev_rx = 0, prev_tx = 0;
+static struct timespec prev_when;
+static int have_counters = 0;
+
+static TelemetrySample prev_sample;
+static uint32_t seq = 0;
+static int since_key = 0;
+
+static void read_cpu(unsigned long long *busy, unsigned long long *total) {
+    *busy = *total = 0;
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f) return;
+    unsigned long long v[8] = { 0 };
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+               &v[7]) >= 4) {
+        for (int i = 0; i < 8; ++i) *total += v[i];
+        // idle and iowait
+        *busy = *total - v[3] - v[4];
+    }
+    fclose(f);
+}
+
+static void read_net(unsigned long long *rx, unsigned long long *tx) {
+    *rx = *tx = 0;
+    FILE *f = fopen("/proc/net/dev", "r");
+    if (!f) return;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (!colon) continue;
+        *colon = '\0';
+        char *ifname = line;
+        while (*ifname == ' ') ifname++;
+        if (strcmp(ifname, "lo") == 0) continue;
+        unsigned long long r = 0, t = 0;
+        if (sscanf(colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &r, &t) == 2) {
+            *rx += r;
+            *tx += t;
+        }
+    }
+    fclose(f);
+}
+
+static void sample(TelemetrySample *s) {
+    memset(s, 0, sizeof(*s));
+    s->at = (uint32_t)time(NULL);
+
+    FILE *f = fopen("/proc/loadavg", "r");
+    if (f) {
+        double load1 = 0;
+        unsigned running = 0;
+        if (fscanf(f, "%lf %*f %*f %u/", &load1, &running) >= 1) {
+            s->v[TM_LOAD1] = (uint32_t)(load1 * 100);
+            s->v[TM_RUNNING] = running;
+        }
+        fclose(f);
+    }
+
+    f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long long total = 0, avail = 0;
+        while (fgets(line, sizeof(line), f) && (!total || !avail)) {
+            sscanf(line, "MemTotal: %llu", &total);
+            sscanf(line, "MemAvailable: %llu", &avail);
+        }
+        s->v[TM_MEM_TOTAL] = (uint32_t)(total / 1024);
+        s->v[TM_MEM_USED] = avail <= total ? (uint32_t)((total - avail) / 1024) : 0;
+        fclose(f);
+    }
+
+    struct statvfs vfs;
+    if (statvfs("/", &vfs) == 0) {
+        unsigned long long unit = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+        s->v[TM_DISK_TOTAL] = (uint32_t)(vfs.f_blocks * unit / (1024 * 1024));
+        s->v[TM_DISK_USED] = (uint32_t)((vfs.f_blocks - vfs.f_bfree) * unit / (1024 * 1024));
+    }
+
+    unsigned long long busy, total, rx, tx;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    read_cpu(&busy, &total);
+    read_net(&rx, &tx);
+    if (have_counters) {
+        if (total > prev_total && busy >= prev_busy) {
+            s->v[TM_CPU] = (uint32_t)((busy - prev_busy) * 1000 / (total - prev_total));
+        }
+        double secs = (double)(now.tv_sec - prev_when.tv_sec) + (now.tv_nsec - prev_when.tv_nsec) / 1e9;
+        if (secs > 0 && rx >= prev_rx && tx >= prev_tx) {
+            s->v[TM_NET_RX] = (uint32_t)((rx - prev_rx) / 1024 / secs);
+            s->v[TM_NET_TX] = (uint32_t)((tx - prev_tx) / 1024 / secs);
+        }
+    }
+    prev_busy = busy;
+    prev_total = total;
+    prev_rx = rx;
+    prev_tx = tx;
+    prev_when = now;
+    have_counters = 1;
+}
+
+int agent_telemetry_frame(const char *name, unsigned char *out, size_t size) {
+    TelemetrySample cur;
+    sample(&cur);
+    int key = seq == 0 || since_key >= TELEMETRY_KEYFRAME_EVERY - 1;
+    int n = telemetry_encode(name, ++seq, &cur, key ? NULL : &prev_sample, out, size);
+    if (n < 0) return -1;
+    since_key = key ? 0 : since_key + 1;
+    prev_sample = cur;
+    return n;
+}
+
+void agent_telemetry_reset(void) {
+    since_key = TELEMETRY_KEYFRAME_EVERY;
+}
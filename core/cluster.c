@@ -0,0 +1,743 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/arena.h"
+#include "../include/checksum.h"
+#include "../include/cli.h"
+#include "../include/cluster.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/requests.h"
+#include "../include/shard.h"
+
+#define CLUSTER_TICK_MS 500
+// Between attempts to reach a peer that is down.
+#define CLUSTER_RETRY_MS 2000
+// A peer that has not proved the secret by then is dropped.
+#define CLUSTER_AUTH_TIMEOUT_MS 5000
+#define CLUSTER_NONCE_LEN 16
+#define CLUSTER_NONCE_HEX (2 * CLUSTER_NONCE_LEN)
+
+typedef struct {
+    uint64_t hash;
+    int controller;
+} RingPoint;
+
+// A configured controller, with our link to it unless it is this one.
+typedef struct {
+    char name[256];
+    char host[64];
+    int port;
+    int connecting_fd;          // non-blocking connect in progress, or -1
+    ReactorStream *stream;      // connected
+    int up;                     // the peer acked our hello
+    int proved;                 // the peer answered our nonce with the secret
+    char nonce[CLUSTER_NONCE_HEX + 1];
+    int logged_down;
+    long long next_dial_ms;
+} Controller;
+
+typedef struct PeerIn PeerIn;
+
+// Stands in for a client of another controller whose lines it forwarded.
+typedef struct PeerClient {
+    unsigned long remote_id;
+    CliClient *client;
+    PeerIn *link;
+    struct PeerClient *next;
+} PeerClient;
+
+// A link another controller dialed to us.
+struct PeerIn {
+    ReactorStream *stream;
+    char name[256];
+    char nonce[CLUSTER_NONCE_HEX + 1];
+    int authed;                 // answered our challenge; until then only "auth" is read
+    long long opened_ms;
+    PeerClient *clients;
+    struct PeerIn *prev;
+    struct PeerIn *next;
+};
+
+static Reactor *cluster_reactor = NULL;
+static Controller *ctrls = NULL;
+static int nctrls = 0;
+static int self_idx = -1;
+static RingPoint *ring = NULL;
+static int nring = 0;
+static PeerIn *peers_in = NULL;
+static Arena link_arena;
+static char secret[256];
+
+static void peer_in_remove(PeerIn *in);
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// --- link authentication ---
+//
+// Both ends send a fresh nonce and prove the secret by answering the
+// other's with HMAC-SHA256(secret, "<role> <nonce> <their name>"). The
+// role differs per direction, so an answer cannot be sent back as one.
+
+static int make_nonce(char out[CLUSTER_NONCE_HEX + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char raw[CLUSTER_NONCE_LEN];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) return -1;
+    for (int i = 0; i < CLUSTER_NONCE_LEN; ++i) {
+        out[2 * i] = digits[raw[i] >> 4];
+        out[2 * i + 1] = digits[raw[i] & 0xF];
+    }
+    out[CLUSTER_NONCE_HEX] = '\0';
+    return 0;
+}
+
+static int link_mac(const char *role, const char *nonce, const char *name, char out[SHA256_HEX_LEN + 1]) {
+    char text[400];
+    int n = snprintf(text, sizeof(text), "%s %s %s", role, nonce, name);
+    if (n < 0 || (size_t)n >= sizeof(text)) return -1;
+    return hmac_sha256_hex(secret, strlen(secret), text, (size_t)n, out);
+}
+
+// Compares every byte whatever the first difference, so the time taken
+// says nothing about how much of a guess was right.
+static int mac_ok(const JsonMsg *m, const char *role, const char *nonce, const char *name) {
+    char want[SHA256_HEX_LEN + 1];
+    char got[SHA256_HEX_LEN + 2] = "";
+    if (link_mac(role, nonce, name, want) < 0 || json_msg_copy(m, "mac", got, sizeof(got)) < 0 ||
+        strlen(got) != SHA256_HEX_LEN) {
+        return 0;
+    }
+    unsigned char diff = 0;
+    for (int i = 0; i < SHA256_HEX_LEN; ++i) diff |= (unsigned char)(want[i] ^ got[i]);
+    return diff == 0;
+}
+
+// FNV-1a with a final mix, so the points of one controller, whose keys
+// differ only in the last bytes, spread over the whole ring.
+static uint64_t ring_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const RingPoint *x = a;
+    const RingPoint *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->controller - y->controller;
+}
+
+static int ring_build(void) {
+    ring = malloc((size_t)nctrls * CLUSTER_VNODES * sizeof(RingPoint));
+    if (!ring) return -1;
+    nring = 0;
+    for (int i = 0; i < nctrls; ++i) {
+        for (int v = 0; v < CLUSTER_VNODES; ++v) {
+            char key[300];
+            int n = snprintf(key, sizeof(key), "%s#%d", ctrls[i].name, v);
+            ring[nring].hash = ring_hash(key, (size_t)n);
+            ring[nring].controller = i;
+            nring++;
+        }
+    }
+    qsort(ring, (size_t)nring, sizeof(RingPoint), point_cmp);
+    return 0;
+}
+
+int cluster_enabled(void) {
+    return nctrls > 1 && self_idx >= 0;
+}
+
+const char *cluster_self(void) {
+    return self_idx >= 0 ? ctrls[self_idx].name : "";
+}
+
+const char *cluster_peer_name(int peer) {
+    return peer >= 0 && peer < nctrls ? ctrls[peer].name : "";
+}
+
+// The first ring point at or after name's hash.
+static int ring_start(const char *name) {
+    uint64_t h = ring_hash(name, strlen(name));
+    int lo = 0, hi = nring;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo % nring;
+}
+
+int cluster_owner(const char *name) {
+    if (!cluster_enabled() || !name) return -1;
+    int lo = ring_start(name);
+    // the first controller clockwise that can take the node
+    for (int i = 0; i < nring; ++i) {
+        int c = ring[(lo + i) % nring].controller;
+        if (c == self_idx) return -1;
+        if (ctrls[c].up) return c;
+    }
+    return -1;
+}
+
+int cluster_redirect(const char *name, char *msg, size_t size) {
+    int owner = cluster_owner(name);
+    if (owner < 0) return 0;
+    int n = snprintf(msg, size, "{\"type\":\"redirect\",\"controller\":\"%s\",\"address\":\"%s:%d\"}\n",
+                     ctrls[owner].name, ctrls[owner].host, ctrls[owner].port);
+    return n > 0 && (size_t)n < size ? n : 0;
+}
+
+// --- links we dial ---
+
+// Sessions that came here while their controller was away go back to it
+// once it is up again.
+typedef struct {
+    int controller;
+    char msg[512];
+    int moved[MAX_SHARDS];
+} Rebalance;
+
+// Runs on the shards: the ring never changes after cluster_init().
+static int ring_owned_by(const char *name, void *arg) {
+    const Rebalance *rb = arg;
+    return ring[ring_start(name)].controller == rb->controller;
+}
+
+static void rebalance_shard(int shard, void *arg) {
+    Rebalance *rb = arg;
+    rb->moved[shard] = node_sessions_send_if(ring_owned_by, rb, rb->msg);
+}
+
+static void rebalance_done(Reactor *r, void *arg) {
+    (void)r;
+    Rebalance *rb = arg;
+    int moved = 0;
+    for (int i = 0; i < MAX_SHARDS; ++i) moved += rb->moved[i];
+    if (moved > 0) log_info("Redirected %d session(s) to controller %s", moved, cluster_peer_name(rb->controller));
+    free(rb);
+}
+
+static void rebalance_to(int controller) {
+    Rebalance *rb = calloc(1, sizeof(Rebalance));
+    if (!rb) return;
+    rb->controller = controller;
+    snprintf(rb->msg, sizeof(rb->msg), "{\"type\":\"redirect\",\"controller\":\"%s\",\"address\":\"%s:%d\"}",
+             ctrls[controller].name, ctrls[controller].host, ctrls[controller].port);
+    if (shard_broadcast(rebalance_shard, rb, rebalance_done) < 0) free(rb);
+}
+
+static void link_write(ReactorStream *s, const char *msg, size_t len) {
+    if (s) reactor_stream_write(s, msg, len);
+}
+
+static void link_down(Controller *c);
+
+static void out_on_input(ReactorStream *stream, void *ctx) {
+    Controller *c = ctx;
+    size_t len = 0;
+    char *line;
+    while (!stream->closed && (line = ipc_reader_next_line(&stream->rx, &len)) != NULL) {
+        JsonMsg m;
+        if (json_msg_parse(&m, line, len) < 0) continue;
+        arena_reset(&link_arena);
+        if (json_msg_str_eq(&m, "type", "challenge")) {
+            char theirs[CLUSTER_NONCE_HEX + 1] = "";
+            char mac[SHA256_HEX_LEN + 1];
+            json_msg_copy(&m, "nonce", theirs, sizeof(theirs));
+            if (!mac_ok(&m, "accept", c->nonce, c->name) || strlen(theirs) != CLUSTER_NONCE_HEX ||
+                link_mac("dial", theirs, cluster_self(), mac) < 0) {
+                log_error("Controller %s at %s:%d does not know the cluster secret", c->name, c->host, c->port);
+                reactor_stream_close(stream);
+                link_down(c);
+                return;
+            }
+            c->proved = 1;
+            // a peer forwards an agent's chunked result as one line, so an
+            // authenticated link takes lines as long as reassembly allows
+            stream->rx.max = MAX_CHUNKED_MSG_LEN;
+            char auth[128];
+            int n = snprintf(auth, sizeof(auth), "{\"type\":\"auth\",\"mac\":\"%s\"}\n", mac);
+            link_write(stream, auth, (size_t)n);
+        } else if (!c->proved) {
+            // nothing counts before the peer has proved the secret
+            continue;
+        } else if (json_msg_str_eq(&m, "type", "ack")) {
+            c->up = 1;
+            c->logged_down = 0;
+            log_info("Linked to controller %s", c->name);
+            rebalance_to((int)(c - ctrls));
+        } else if (!c->up) {
+            continue;
+        } else if (json_msg_str_eq(&m, "type", "out")) {
+            size_t text_len = 0;
+            char *text = json_msg_str(&m, "text", &link_arena, &text_len);
+            long client = json_msg_int(&m, "client", 0);
+            if (text && client > 0) cli_write_to((unsigned long)client, text, text_len);
+        } else if (json_msg_str_eq(&m, "type", "result")) {
+            NodeResult *res = node_result_from_msg(&m, &link_arena, c->name);
+            if (res) node_manager_deliver_result(res);
+            free(res);
+        }
+    }
+}
+
+static void link_down(Controller *c) {
+    if (c->up || !c->logged_down) log_error("Lost link to controller %s", c->name);
+    c->stream = NULL;
+    c->up = 0;
+    c->proved = 0;
+    c->logged_down = 1;
+    c->next_dial_ms = now_ms() + CLUSTER_RETRY_MS;
+}
+
+static void out_on_close(ReactorStream *stream, void *ctx) {
+    (void)stream;
+    link_down(ctx);
+}
+
+static const ReactorStreamOps out_ops = {
+    out_on_input,
+    out_on_close,
+    NULL,
+};
+
+static void link_open(Controller *c, int fd) {
+    c->stream = reactor_stream_open(cluster_reactor, fd, &out_ops, c);
+    if (!c->stream) {
+        close(fd);
+        link_down(c);
+        return;
+    }
+    if (make_nonce(c->nonce) < 0) {
+        reactor_stream_close(c->stream);
+        link_down(c);
+        return;
+    }
+    char hello[400];
+    int n = snprintf(hello, sizeof(hello), "{\"type\":\"peer\",\"name\":\"%s\",\"nonce\":\"%s\"}\n", cluster_self(),
+                     c->nonce);
+    link_write(c->stream, hello, (size_t)n);
+}
+
+static void dial_failed(Controller *c, int err) {
+    if (!c->logged_down) {
+        log_error("Cannot reach controller %s at %s:%d: %s", c->name, c->host, c->port, strerror(err));
+        c->logged_down = 1;
+    }
+    c->next_dial_ms = now_ms() + CLUSTER_RETRY_MS;
+}
+
+static void dial_ready(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)events;
+    Controller *c = ctx;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+    reactor_unwatch_fd(r, fd);
+    c->connecting_fd = -1;
+    if (err) {
+        close(fd);
+        dial_failed(c, err);
+        return;
+    }
+    link_open(c, fd);
+}
+
+// Connects without blocking the front reactor; a peer that is down must
+// not stall the CLI.
+static void dial(Controller *c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)c->port);
+    if (inet_pton(AF_INET, c->host, &addr.sin_addr) != 1) {
+        dial_failed(c, EINVAL);
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        dial_failed(c, errno);
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        link_open(c, fd);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        int err = errno;
+        close(fd);
+        dial_failed(c, err);
+        return;
+    }
+    if (reactor_watch_fd(cluster_reactor, fd, REACTOR_WRITE, dial_ready, c) < 0) {
+        close(fd);
+        dial_failed(c, EIO);
+        return;
+    }
+    c->connecting_fd = fd;
+}
+
+static void cluster_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    long long now = now_ms();
+    for (int i = 0; i < nctrls; ++i) {
+        Controller *c = &ctrls[i];
+        if (i == self_idx || c->stream || c->connecting_fd >= 0 || now < c->next_dial_ms) continue;
+        dial(c);
+    }
+    PeerIn *in = peers_in;
+    while (in) {
+        PeerIn *next = in->next;
+        if (!in->authed && now - in->opened_ms >= CLUSTER_AUTH_TIMEOUT_MS) {
+            log_error("Refused link from controller '%s': no answer to the challenge", in->name);
+            reactor_stream_close(in->stream);
+            peer_in_remove(in);
+        }
+        in = next;
+    }
+}
+
+int cluster_forward(int peer, unsigned long client_id, const char *request_id, const char *line) {
+    if (peer < 0 || peer >= nctrls || !ctrls[peer].up) return -1;
+    char head[160];
+    int n = snprintf(head, sizeof(head), "{\"type\":\"cli\",\"client\":%lu,\"id\":\"%s\",\"line\":\"",
+                     client_id, request_id ? request_id : "");
+    if (n < 0 || (size_t)n >= sizeof(head)) return -1;
+    size_t line_len = strlen(line);
+    size_t total = (size_t)n + json_escaped_len(line, line_len) + 3;
+    char *msg = malloc(total);
+    if (!msg) return -1;
+    memcpy(msg, head, (size_t)n);
+    size_t off = (size_t)n + json_escape_to(msg + n, line, line_len);
+    memcpy(msg + off, "\"}\n", 3);
+    int rc = reactor_stream_write(ctrls[peer].stream, msg, total);
+    free(msg);
+    return rc;
+}
+
+int cluster_forward_all(unsigned long client_id, const char *request_id, const char *line) {
+    int reached = 0;
+    for (int i = 0; i < nctrls; ++i) {
+        if (i != self_idx && cluster_forward(i, client_id, request_id, line) == 0) reached++;
+    }
+    return reached;
+}
+
+void cluster_client_gone(unsigned long client_id) {
+    char msg[64];
+    int n = snprintf(msg, sizeof(msg), "{\"type\":\"bye\",\"client\":%lu}\n", client_id);
+    for (int i = 0; i < nctrls; ++i) {
+        if (i != self_idx && ctrls[i].up) link_write(ctrls[i].stream, msg, (size_t)n);
+    }
+}
+
+// --- links peers dialed to us ---
+
+static void peer_client_write(void *ctx, const char *data, size_t len) {
+    PeerClient *pc = ctx;
+    char head[64];
+    int n = snprintf(head, sizeof(head), "{\"type\":\"out\",\"client\":%lu,\"text\":\"", pc->remote_id);
+    size_t total = (size_t)n + json_escaped_len(data, len) + 3;
+    char *msg = malloc(total);
+    if (!msg) return;
+    memcpy(msg, head, (size_t)n);
+    size_t off = (size_t)n + json_escape_to(msg + n, data, len);
+    memcpy(msg + off, "\"}\n", 3);
+    link_write(pc->link->stream, msg, total);
+    free(msg);
+}
+
+// The result goes back as the agent would have sent it; the other
+// controller routes it to its client and subscribers.
+static void peer_client_result(void *ctx, const NodeResult *res) {
+    PeerClient *pc = ctx;
+    const char *nodes = res->nodes ? res->nodes : res->node;
+    size_t nodes_len = strlen(nodes);
+    char head[200];
+    char status[40] = "";
+    if (res->status[0]) snprintf(status, sizeof(status), "\"status\":\"%s\",", res->status);
+    int n = snprintf(head, sizeof(head), "{\"type\":\"result\",\"id\":\"%s\",\"exit\":%d,%s\"count\":%d,\"nodes\":\"",
+                     res->id, res->exit_code, status, res->count);
+    if (n < 0 || (size_t)n >= sizeof(head)) return;
+    static const char out_key[] = "\",\"stdout\":\"";
+    static const char err_key[] = "\",\"stderr\":\"";
+    size_t total = (size_t)n + json_escaped_len(nodes, nodes_len) + sizeof(out_key) - 1 +
+                   json_escaped_len(res->out, res->out_len) + sizeof(err_key) - 1 +
+                   json_escaped_len(res->err, res->err_len) + 3;
+    char *msg = malloc(total);
+    if (!msg) return;
+    char *o = msg;
+    memcpy(o, head, (size_t)n);
+    o += n;
+    o += json_escape_to(o, nodes, nodes_len);
+    memcpy(o, out_key, sizeof(out_key) - 1);
+    o += sizeof(out_key) - 1;
+    o += json_escape_to(o, res->out, res->out_len);
+    memcpy(o, err_key, sizeof(err_key) - 1);
+    o += sizeof(err_key) - 1;
+    o += json_escape_to(o, res->err, res->err_len);
+    memcpy(o, "\"}\n", 3);
+    link_write(pc->link->stream, msg, total);
+    free(msg);
+}
+
+static void peer_client_unlink(PeerClient *pc) {
+    PeerClient **pp = &pc->link->clients;
+    while (*pp && *pp != pc) pp = &(*pp)->next;
+    if (*pp) *pp = pc->next;
+    free(pc);
+}
+
+// The CLI dropped the client, e.g. on shutdown.
+static void peer_client_closed(void *ctx) {
+    peer_client_unlink(ctx);
+}
+
+static const CliSink peer_sink = {
+    peer_client_write,
+    peer_client_result,
+    peer_client_closed,
+};
+
+static PeerClient *peer_client_get(PeerIn *in, unsigned long remote_id) {
+    for (PeerClient *pc = in->clients; pc; pc = pc->next) {
+        if (pc->remote_id == remote_id) return pc;
+    }
+    PeerClient *pc = calloc(1, sizeof(PeerClient));
+    if (!pc) return NULL;
+    pc->remote_id = remote_id;
+    pc->link = in;
+    pc->client = cli_client_new_sink(&peer_sink, pc);
+    if (!pc->client) {
+        free(pc);
+        return NULL;
+    }
+    pc->next = in->clients;
+    in->clients = pc;
+    return pc;
+}
+
+static void peer_client_drop(PeerIn *in, unsigned long remote_id) {
+    for (PeerClient *pc = in->clients; pc; pc = pc->next) {
+        if (pc->remote_id == remote_id) {
+            cli_client_free(pc->client);    // unlinks pc through peer_client_closed
+            return;
+        }
+    }
+}
+
+// Peers only send the verbs they route; anything else is refused.
+static int forwardable(const char *line) {
+    size_t verb = strcspn(line, " ");
+    return (verb == 4 && strncmp(line, "ping", 4) == 0) || (verb == 4 && strncmp(line, "exec", 4) == 0) ||
+           (verb == 5 && strncmp(line, "nodes", 5) == 0);
+}
+
+static void in_on_input(ReactorStream *stream, void *ctx) {
+    PeerIn *in = ctx;
+    size_t len = 0;
+    char *line;
+    while (!stream->closed && (line = ipc_reader_next_line(&stream->rx, &len)) != NULL) {
+        JsonMsg m;
+        if (json_msg_parse(&m, line, len) < 0) continue;
+        arena_reset(&link_arena);
+        if (!in->authed) {
+            if (!json_msg_str_eq(&m, "type", "auth") || !mac_ok(&m, "dial", in->nonce, in->name)) {
+                log_error("Refused link from controller '%s': it does not know the cluster secret", in->name);
+                reactor_stream_close(stream);
+                peer_in_remove(in);
+                return;
+            }
+            in->authed = 1;
+            stream->rx.max = MAX_CHUNKED_MSG_LEN;
+            static const char ack[] = "{\"type\":\"ack\",\"status\":\"ok\"}\n";
+            reactor_stream_write(stream, ack, sizeof(ack) - 1);
+            log_info("Controller %s linked", in->name);
+            continue;
+        }
+        long client = json_msg_int(&m, "client", 0);
+        if (client <= 0) continue;
+        if (json_msg_str_eq(&m, "type", "bye")) {
+            peer_client_drop(in, (unsigned long)client);
+            continue;
+        }
+        if (!json_msg_str_eq(&m, "type", "cli")) continue;
+        char id[REQUEST_ID_LEN] = "";
+        json_msg_copy(&m, "id", id, sizeof(id));
+        char *cmd = json_msg_str(&m, "line", &link_arena, NULL);
+        PeerClient *pc = cmd ? peer_client_get(in, (unsigned long)client) : NULL;
+        if (!pc) continue;
+        if (!forwardable(cmd)) {
+            cli_printf(pc->client, "Not run on controller %s: %s\n", cluster_self(), cmd);
+            continue;
+        }
+        cli_execute_forwarded(pc->client, cmd, id);
+    }
+}
+
+static void peer_in_remove(PeerIn *in) {
+    while (in->clients) cli_client_free(in->clients->client);
+    if (in->prev) in->prev->next = in->next;
+    else peers_in = in->next;
+    if (in->next) in->next->prev = in->prev;
+    free(in);
+}
+
+static void in_on_close(ReactorStream *stream, void *ctx) {
+    (void)stream;
+    PeerIn *in = ctx;
+    if (in->authed) log_info("Controller %s disconnected", in->name);
+    peer_in_remove(in);
+}
+
+static const ReactorStreamOps in_ops = {
+    in_on_input,
+    in_on_close,
+    NULL,
+};
+
+int cluster_accept(ReactorStream *stream, const char *line, size_t len) {
+    JsonMsg m;
+    if (json_msg_parse(&m, line, len) < 0 || !json_msg_str_eq(&m, "type", "peer")) return 0;
+
+    char name[256] = "";
+    char theirs[CLUSTER_NONCE_HEX + 2] = "";
+    json_msg_copy(&m, "name", name, sizeof(name));
+    json_msg_copy(&m, "nonce", theirs, sizeof(theirs));
+    int known = 0;
+    for (int i = 0; cluster_enabled() && i < nctrls; ++i) {
+        if (i != self_idx && strcmp(ctrls[i].name, name) == 0) known = 1;
+    }
+    PeerIn *in = known && strlen(theirs) == CLUSTER_NONCE_HEX ? calloc(1, sizeof(PeerIn)) : NULL;
+    char mac[SHA256_HEX_LEN + 1];
+    if (!in || make_nonce(in->nonce) < 0 || link_mac("accept", theirs, cluster_self(), mac) < 0) {
+        if (known) log_error("Refused link from controller '%s': bad peer hello", name);
+        else log_error("Refused link from controller '%s': not in the controllers list", name);
+        free(in);
+        reactor_stream_close(stream);
+        return 1;
+    }
+    in->stream = stream;
+    snprintf(in->name, sizeof(in->name), "%s", name);
+    in->opened_ms = now_ms();
+    in->next = peers_in;
+    if (peers_in) peers_in->prev = in;
+    peers_in = in;
+
+    // the stream stays on the front reactor; only its handler changes
+    stream->ops = &in_ops;
+    stream->ctx = in;
+    char challenge[256];
+    int n = snprintf(challenge, sizeof(challenge), "{\"type\":\"challenge\",\"nonce\":\"%s\",\"mac\":\"%s\"}\n",
+                     in->nonce, mac);
+    reactor_stream_write(stream, challenge, (size_t)n);
+    if (!stream->closed) in_on_input(stream, in);
+    return 1;
+}
+
+void cluster_print(FILE *out) {
+    if (!cluster_enabled()) return;
+    fprintf(out, "Controllers (%d):\n", nctrls);
+    for (int i = 0; i < nctrls; ++i) {
+        const Controller *c = &ctrls[i];
+        const char *state = i == self_idx ? "this controller"
+                            : c->up       ? "up"
+                            : c->stream || c->connecting_fd >= 0 ? "connecting"
+                                                                 : "down";
+        fprintf(out, "  - %s (%s:%d, %s)\n", c->name, c->host, c->port, state);
+    }
+}
+
+int cluster_init(Reactor *front, const Config *cfg) {
+    cluster_reactor = front;
+    if (!cfg || cfg->controller_count < 2) return 0;
+
+    ctrls = calloc((size_t)cfg->controller_count, sizeof(Controller));
+    if (!ctrls) return -1;
+    for (int i = 0; i < cfg->controller_count; ++i) {
+        const Node *n = &cfg->controllers[i];
+        Controller *c = &ctrls[nctrls];
+        const char *colon = strrchr(n->address, ':');
+        if (!n->name[0] || !colon || colon == n->address || atoi(colon + 1) <= 0 ||
+            (size_t)(colon - n->address) >= sizeof(c->host)) {
+            log_error("Ignoring controller '%s': address must be host:port", n->name);
+            continue;
+        }
+        snprintf(c->name, sizeof(c->name), "%s", n->name);
+        snprintf(c->host, sizeof(c->host), "%.*s", (int)(colon - n->address), n->address);
+        c->port = atoi(colon + 1);
+        c->connecting_fd = -1;
+        if (strcmp(c->name, cfg->controller_name) == 0) self_idx = nctrls;
+        nctrls++;
+    }
+    if (self_idx < 0) {
+        log_error("controller_name '%s' is not in the controllers list; running alone", cfg->controller_name);
+        cluster_shutdown();
+        return -1;
+    }
+    if (!cfg->cluster_secret[0]) {
+        log_error("cluster_secret is not set; running alone");
+        cluster_shutdown();
+        return -1;
+    }
+    snprintf(secret, sizeof(secret), "%s", cfg->cluster_secret);
+    if (nctrls < 2 || ring_build() < 0) {
+        cluster_shutdown();
+        return nctrls < 2 ? 0 : -1;
+    }
+    arena_init(&link_arena, 64 * 1024);
+    for (int i = 0; i < nctrls; ++i) {
+        if (i != self_idx) dial(&ctrls[i]);
+    }
+    reactor_add_tick(front, CLUSTER_TICK_MS, cluster_tick, NULL);
+    log_info("Controller %s is one of %d, %d ring points each", cluster_self(), nctrls, CLUSTER_VNODES);
+    return 0;
+}
+
+void cluster_shutdown(void) {
+    while (peers_in) {
+        reactor_stream_close(peers_in->stream);
+        peer_in_remove(peers_in);
+    }
+    for (int i = 0; i < nctrls; ++i) {
+        Controller *c = &ctrls[i];
+        if (c->connecting_fd >= 0) {
+            reactor_unwatch_fd(cluster_reactor, c->connecting_fd);
+            close(c->connecting_fd);
+        }
+        if (c->stream) reactor_stream_close(c->stream);
+    }
+    if (ring) arena_destroy(&link_arena);
+    free(ctrls);
+    free(ring);
+    ctrls = NULL;
+    ring = NULL;
+    nctrls = 0;
+    nring = 0;
+    self_idx = -1;
+    memset(secret, 0, sizeof(secret));
+}
@@ -34,14 +34,17 @@ Config* config_load(const char *path) {
     char key[256] = {0};
     int node_index = -1;
     bool in_nodes_seq = false;
+    // "nodes" and "controllers" are both lists of name/address/os entries
+    Node **seq_nodes = NULL;
+    int *seq_count = NULL;
+    int seq_cap = 0;
 
     while (1) {
         if (!yaml_parser_parse(&parser, &event)) {
             fprintf(stderr, "YAML parsing error\n");
             yaml_parser_delete(&parser);
             fclose(fh);
-            if (cfg->nodes) free(cfg->nodes);
-            free(cfg);
+            config_free(cfg);
             return NULL;
         }
 
@@ -57,23 +60,36 @@ Config* config_load(const char *path) {
                             strncpy(cfg->log_path, (char *)event.data.scalar.value, sizeof(cfg->log_path) - 1);
                         else if (strcmp(key, "listen_port") == 0)
                             cfg->listen_port = atoi((char *)event.data.scalar.value);
-                    } else {
-                        if (node_index < 0) {
-                            node_index = 0; 
-                            cfg->node_count = 1;
-                        }
-
-                        if (node_index >= MAX_NODES) {
-                            fprintf(stderr, "Error: too many nodes defined (max %d)\n", MAX_NODES);
-                            break;
-                        }
-
+                        else if (strcmp(key, "reactor_threads") == 0)
+                            cfg->reactor_threads = atoi((char *)event.data.scalar.value);
+                        else if (strcmp(key, "io_backend") == 0)
+                            strncpy(cfg->io_backend, (char *)event.data.scalar.value, sizeof(cfg->io_backend) - 1);
+                        else if (strcmp(key, "admin_socket") == 0)
+                            strncpy(cfg->admin_socket, (char *)event.data.scalar.value, sizeof(cfg->admin_socket) - 1);
+                        else if (strcmp(key, "local_socket") == 0)
+                            strncpy(cfg->local_socket, (char *)event.data.scalar.value, sizeof(cfg->local_socket) - 1);
+                        else if (strcmp(key, "upgrade_socket") == 0)
+                            strncpy(cfg->upgrade_socket, (char *)event.data.scalar.value, sizeof(cfg->upgrade_socket) - 1);
+                        else if (strcmp(key, "heartbeat_port") == 0)
+                            cfg->heartbeat_port = atoi((char *)event.data.scalar.value);
+                        else if (strcmp(key, "push_bandwidth_mbps") == 0)
+                            cfg->push_bandwidth_mbps = atoi((char *)event.data.scalar.value);
+                        else if (strcmp(key, "push_parallel") == 0)
+                            cfg->push_parallel = atoi((char *)event.data.scalar.value);
+                        else if (strcmp(key, "dial_nodes") == 0)
+                            cfg->dial_nodes = atoi((char *)event.data.scalar.value);
+                        else if (strcmp(key, "controller_name") == 0)
+                            strncpy(cfg->controller_name, (char *)event.data.scalar.value, sizeof(cfg->controller_name) - 1);
+                        else if (strcmp(key, "cluster_secret") == 0)
+                            strncpy(cfg->cluster_secret, (char *)event.data.scalar.value, sizeof(cfg->cluster_secret) - 1);
+                    } else if (node_index >= 0) {
+                        Node *entry = &(*seq_nodes)[node_index];
                         if (strcmp(key, "name") == 0)
-                            strncpy(cfg->nodes[node_index].name, (char *)event.data.scalar.value, sizeof(cfg->nodes[node_index].name) - 1);
+                            strncpy(entry->name, (char *)event.data.scalar.value, sizeof(entry->name) - 1);
                         else if (strcmp(key, "address") == 0)
-                            strncpy(cfg->nodes[node_index].address, (char *)event.data.scalar.value, sizeof(cfg->nodes[node_index].address) - 1);
+                            strncpy(entry->address, (char *)event.data.scalar.value, sizeof(entry->address) - 1);
                         else if (strcmp(key, "os") == 0)
-                            strncpy(cfg->nodes[node_index].os, (char *)event.data.scalar.value, sizeof(cfg->nodes[node_index].os) - 1);
+                            strncpy(entry->os, (char *)event.data.scalar.value, sizeof(entry->os) - 1);
                     }
 
                     key[0] = '\0';
@@ -81,30 +97,41 @@ Config* config_load(const char *path) {
                 break;
 
             case YAML_SEQUENCE_START_EVENT:
-                if (strcmp(key, "nodes") == 0) {
+                if (strcmp(key, "nodes") == 0 || strcmp(key, "controllers") == 0) {
+                    bool controllers = strcmp(key, "controllers") == 0;
+                    seq_nodes = controllers ? &cfg->controllers : &cfg->nodes;
+                    seq_count = controllers ? &cfg->controller_count : &cfg->node_count;
                     in_nodes_seq = true;
                     node_index = -1;
                     key[0] = '\0';
-                    cfg->nodes = calloc(MAX_NODES, sizeof(Node));
-                    if (!cfg->nodes) {
-                        fprintf(stderr, "Memory allocation failed for nodes array\n");
-                        yaml_parser_delete(&parser);
-                        fclose(fh);
-                        free(cfg);
-                        return NULL;
-                    }
+                    free(*seq_nodes);
+                    *seq_nodes = NULL;
+                    *seq_count = 0;
+                    seq_cap = 0;
                 }
                 break;
 
             case YAML_MAPPING_START_EVENT:
                 if (in_nodes_seq) {
                     node_index++;
-                    if (node_index >= MAX_NODES) {
-                        fprintf(stderr, "Warning: too many nodes defined (max %d)\n", MAX_NODES);
-                        node_index = MAX_NODES - 1;
+                    // the list grows by doubling; thousands of nodes are normal
+                    if (node_index >= seq_cap) {
+                        int cap = seq_cap ? seq_cap * 2 : CONFIG_NODES_INITIAL;
+                        Node *grown = realloc(*seq_nodes, (size_t)cap * sizeof(Node));
+                        if (!grown) {
+                            fprintf(stderr, "Memory allocation failed for %d %s\n", cap,
+                                    seq_nodes == &cfg->controllers ? "controllers" : "nodes");
+                            yaml_event_delete(&event);
+                            yaml_parser_delete(&parser);
+                            fclose(fh);
+                            config_free(cfg);
+                            return NULL;
+                        }
+                        memset(grown + seq_cap, 0, (size_t)(cap - seq_cap) * sizeof(Node));
+                        *seq_nodes = grown;
+                        seq_cap = cap;
                     }
-                    cfg->node_count = node_index + 1;
-                    printf("Parsing node #%d...\n", node_index + 1);
+                    *seq_count = node_index + 1;
                 }
                 break;
 
@@ -135,5 +162,6 @@ void config_free(Config *cfg) {
         free(cfg->nodes);
         cfg->nodes = NULL;
     }
+    free(cfg->controllers);
     free(cfg);
 }
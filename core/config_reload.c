@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "../include/config_reload.h"
+#include "../include/dialer.h"
+#include "../include/logging.h"
+#include "../include/transfer.h"
+
+static Reactor *watch_reactor = NULL;
+static GlobalState *watch_state = NULL;
+static int watch_fd = -1;
+static char watch_path[PATH_MAX];
+static const char *watch_name = NULL;   // the file's name within its directory
+static long long changed_ms = 0;        // last change not read yet, 0 = none
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// A setting only a restart applies: reported, and left at its running value
+// so the live config says what is in effect.
+static void keep_str(const char *what, char *next, const char *live, size_t size) {
+    if (strcmp(next, live) == 0) return;
+    log_info("Config: %s changed to \"%s\"; takes effect after a restart", what, next);
+    snprintf(next, size, "%s", live);
+}
+
+static void keep_int(const char *what, int *next, int live) {
+    if (*next == live) return;
+    log_info("Config: %s changed to %d; takes effect after a restart", what, *next);
+    *next = live;
+}
+
+static int same_node(const Node *a, const Node *b) {
+    return strcmp(a->name, b->name) == 0 && strcmp(a->address, b->address) == 0 && strcmp(a->os, b->os) == 0;
+}
+
+static int same_list(const Node *a, int na, const Node *b, int nb) {
+    if (na != nb) return 0;
+    for (int i = 0; i < na; ++i) {
+        if (!same_node(&a[i], &b[i])) return 0;
+    }
+    return 1;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp((*(const Node *const *)a)->name, (*(const Node *const *)b)->name);
+}
+
+static const Node **sorted_by_name(const Node *nodes, int count) {
+    const Node **v = malloc((size_t)(count > 0 ? count : 1) * sizeof(*v));
+    if (!v) return NULL;
+    for (int i = 0; i < count; ++i) v[i] = &nodes[i];
+    qsort(v, (size_t)count, sizeof(*v), by_name);
+    return v;
+}
+
+// Logs how the nodes list changed, by name; a few thousand entries are
+// compared sorted rather than pairwise. Returns the number of entries
+// added, removed or changed.
+static int diff_nodes(const Config *live, const Config *next) {
+    if (same_list(live->nodes, live->node_count, next->nodes, next->node_count)) return 0;
+    const Node **a = sorted_by_name(live->nodes, live->node_count);
+    const Node **b = sorted_by_name(next->nodes, next->node_count);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        log_info("Config: nodes list changed (%d -> %d entries)", live->node_count, next->node_count);
+        return 1;
+    }
+    int added = 0, removed = 0, changed = 0;
+    int i = 0, j = 0;
+    while (i < live->node_count || j < next->node_count) {
+        int cmp = i == live->node_count ? 1 : j == next->node_count ? -1 : strcmp(a[i]->name, b[j]->name);
+        if (cmp < 0) {
+            if (added + removed + changed < CONFIG_RELOAD_LOG_NODES) log_info("Config: node %s removed", a[i]->name);
+            removed++;
+            i++;
+        } else if (cmp > 0) {
+            if (added + removed + changed < CONFIG_RELOAD_LOG_NODES) {
+                log_info("Config: node %s added (%s)", b[j]->name, b[j]->address);
+            }
+            added++;
+            j++;
+        } else {
+            if (!same_node(a[i], b[j])) {
+                if (added + removed + changed < CONFIG_RELOAD_LOG_NODES) {
+                    log_info("Config: node %s now at %s (%s)", b[j]->name, b[j]->address, b[j]->os);
+                }
+                changed++;
+            }
+            i++;
+            j++;
+        }
+    }
+    free(a);
+    free(b);
+    log_info("Config: nodes list now has %d entries: %d added, %d removed, %d changed", next->node_count, added,
+             removed, changed);
+    return added + removed + changed;
+}
+
+// Brings the running controller in line with next, or makes next say what
+// is still running. Returns the number of changes applied.
+static int apply(Config *live, Config *next) {
+    int changes = 0;
+    keep_str("db_path", next->db_path, live->db_path, sizeof(next->db_path));
+    keep_str("io_backend", next->io_backend, live->io_backend, sizeof(next->io_backend));
+    keep_str("admin_socket", next->admin_socket, live->admin_socket, sizeof(next->admin_socket));
+    keep_str("local_socket", next->local_socket, live->local_socket, sizeof(next->local_socket));
+    keep_str("upgrade_socket", next->upgrade_socket, live->upgrade_socket, sizeof(next->upgrade_socket));
+    keep_str("controller_name", next->controller_name, live->controller_name, sizeof(next->controller_name));
+    if (strcmp(next->cluster_secret, live->cluster_secret) != 0) {
+        // not keep_str(): the secret stays out of the log
+        log_info("Config: cluster_secret changed; takes effect after a restart");
+        snprintf(next->cluster_secret, sizeof(next->cluster_secret), "%s", live->cluster_secret);
+    }
+    keep_int("listen_port", &next->listen_port, live->listen_port);
+    keep_int("reactor_threads", &next->reactor_threads, live->reactor_threads);
+    keep_int("heartbeat_port", &next->heartbeat_port, live->heartbeat_port);
+    if (!same_list(live->controllers, live->controller_count, next->controllers, next->controller_count)) {
+        log_info("Config: controllers changed; takes effect after a restart");
+        // the running list moves over to next; live is freed with the file's
+        Node *ctrls = next->controllers;
+        int nctrls = next->controller_count;
+        next->controllers = live->controllers;
+        next->controller_count = live->controller_count;
+        live->controllers = ctrls;
+        live->controller_count = nctrls;
+    }
+
+    if (strcmp(next->log_path, live->log_path) != 0) {
+        if (next->log_path[0] && log_reopen(next->log_path)) {
+            log_info("Config: logging to %s (was %s)", next->log_path, live->log_path);
+            changes++;
+        } else {
+            log_error("Config: cannot log to \"%s\", staying with %s", next->log_path, live->log_path);
+            snprintf(next->log_path, sizeof(next->log_path), "%s", live->log_path);
+        }
+    }
+    if (next->push_parallel != live->push_parallel || next->push_bandwidth_mbps != live->push_bandwidth_mbps) {
+        transfer_configure(next);
+        log_info("Config: pushes now %d nodes at once, %d Mbit/s cap (0 = none)", next->push_parallel,
+                 next->push_bandwidth_mbps);
+        changes++;
+    }
+    int moved = diff_nodes(live, next);
+    if (next->dial_nodes != live->dial_nodes) {
+        log_info("Config: dialing configured nodes %s", next->dial_nodes ? "on" : "off");
+        moved++;
+    }
+    if (moved) dialer_configure(next);
+    return changes + moved;
+}
+
+static void reload(void) {
+    Config *next = config_load(watch_path);
+    if (!next) {
+        log_error("Config: %s did not load; keeping the running config", watch_path);
+        return;
+    }
+    Config *live = watch_state->config;
+    int changes = apply(live, next);
+    __atomic_store_n(&watch_state->config, next, __ATOMIC_RELEASE);
+    config_free(live);
+    if (changes) log_info("Config: reloaded %s, %d change(s) applied", watch_path, changes);
+    else log_info("Config: reloaded %s, nothing to apply", watch_path);
+}
+
+static void on_events(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)r;
+    (void)events;
+    (void)ctx;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) log_error("Config watch read failed: %s", strerror(errno));
+            return;
+        }
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, watch_name) == 0) changed_ms = now_ms();
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+static void settle_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    if (!watch_state || !changed_ms || now_ms() - changed_ms < CONFIG_RELOAD_SETTLE_MS) return;
+    changed_ms = 0;
+    reload();
+}
+
+int config_reload_start(Reactor *front, GlobalState *state) {
+    if (!front || !state || !state->config || !state->config_path) return 0;
+    if (snprintf(watch_path, sizeof(watch_path), "%s", state->config_path) >= (int)sizeof(watch_path)) return -1;
+    char dir[PATH_MAX];
+    char *slash = strrchr(watch_path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", slash == watch_path ? 1 : (int)(slash - watch_path), watch_path);
+        watch_name = slash + 1;
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+        watch_name = watch_path;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        log_error("Config watch failed: %s", strerror(errno));
+        return -1;
+    }
+    // the directory, not the file: a rename over the file replaces its inode
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        log_error("Config watch on %s failed: %s", dir, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (reactor_watch_fd(front, fd, REACTOR_READ, on_events, NULL) < 0) {
+        close(fd);
+        return -1;
+    }
+    watch_reactor = front;
+    watch_state = state;
+    watch_fd = fd;
+    changed_ms = 0;
+    reactor_add_tick(front, CONFIG_RELOAD_SETTLE_MS / 2, settle_tick, NULL);
+    log_info("Watching %s for config changes", watch_path);
+    return 0;
+}
+
+void config_reload_stop(void) {
+    if (watch_fd < 0) return;
+    reactor_unwatch_fd(watch_reactor, watch_fd);
+    close(watch_fd);
+    watch_fd = -1;
+    watch_reactor = NULL;
+    watch_state = NULL;
+    watch_name = NULL;
+    changed_ms = 0;
+}
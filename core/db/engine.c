@@ -2,57 +2,203 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <stdbool.h>
 
+#include "../../include/db.h"
+#include "../../include/json_escape.h"
+#include "../../include/logging.h"
+
+// Formatted rows waiting for the writer, in the order they were stored.
+typedef struct DbBlock {
+    struct DbBlock *next;
+    size_t len;
+    char text[];
+} DbBlock;
+
 static char g_db_path[256];
+static pthread_t g_writer;
+static int g_writer_running = 0;
+// guards everything below
+static pthread_mutex_t g_db_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_db_cond = PTHREAD_COND_INITIALIZER;
+static DbBlock *g_head = NULL;
+static DbBlock *g_tail = NULL;
+static size_t g_queued = 0;
+static int g_stop = 0;
+
+// The file stays open on the writer thread; each wakeup writes whatever
+// has queued up and flushes once.
+static void *db_writer(void *arg) {
+    FILE *f = arg;
+    pthread_mutex_lock(&g_db_lock);
+    for (;;) {
+        while (!g_head && !g_stop) pthread_cond_wait(&g_db_cond, &g_db_lock);
+        DbBlock *b = g_head;
+        g_head = g_tail = NULL;
+        g_queued = 0;
+        int stop = g_stop;
+        pthread_mutex_unlock(&g_db_lock);
+
+        int rows_lost = 0;
+        while (b) {
+            DbBlock *next = b->next;
+            if (fwrite(b->text, 1, b->len, f) < b->len) rows_lost = 1;
+            free(b);
+            b = next;
+        }
+        if (fflush(f) != 0) rows_lost = 1;
+        if (rows_lost) log_error("Failed to write command store %s", g_db_path);
+        if (stop) break;
+        pthread_mutex_lock(&g_db_lock);
+    }
+    fclose(f);
+    return NULL;
+}
 
 bool db_init(const char *db_path) {
     struct stat st;
 
-    strncpy(g_db_path, db_path, sizeof(g_db_path) - 1);
-    g_db_path[sizeof(g_db_path) - 1] = '\0';
+    snprintf(g_db_path, sizeof(g_db_path), "%s", db_path);
 
     if (stat(db_path, &st) != 0) {
         FILE *f = fopen(db_path, "w");
         if (!f) {
             perror("Failed to create DB file");
+            g_db_path[0] = '\0';
             return false;
         }
         fprintf(f, "# SimOS command database\n");
         fclose(f);
     }
 
-    FILE *test = fopen(db_path, "a+");
-    if (!test) {
+    FILE *f = fopen(db_path, "a");
+    if (!f) {
         perror("Failed to open DB file for read/write");
+        g_db_path[0] = '\0';
         return false;
     }
-    fclose(test);
-
+    g_stop = 0;
+    if (pthread_create(&g_writer, NULL, db_writer, f) != 0) {
+        log_error("Cannot start the command store writer");
+        fclose(f);
+        g_db_path[0] = '\0';
+        return false;
+    }
+    g_writer_running = 1;
     return true;
 }
 
-bool db_store_command(const char *node_name, const char *command, const char *result) {
-    FILE *f = fopen(g_db_path, "a");
-    if (!f) {
-        perror("Failed to open DB file for writing");
-        return false;
-    }
+void db_shutdown(void) {
+    if (!g_writer_running) return;
+    pthread_mutex_lock(&g_db_lock);
+    g_stop = 1;
+    pthread_cond_signal(&g_db_cond);
+    pthread_mutex_unlock(&g_db_lock);
+    pthread_join(g_writer, NULL);
+    g_writer_running = 0;
+}
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", t);
+// Hands text to the writer. Returns -1 if there is none or it is too far
+// behind; the rows are dropped then.
+static int db_post(const char *text, size_t len) {
+    if (!g_writer_running) return -1;
+    DbBlock *b = malloc(sizeof(DbBlock) + len);
+    if (!b) return -1;
+    b->next = NULL;
+    b->len = len;
+    memcpy(b->text, text, len);
+    pthread_mutex_lock(&g_db_lock);
+    if (g_queued + len > DB_MAX_QUEUED) {
+        pthread_mutex_unlock(&g_db_lock);
+        free(b);
+        log_error("Command store writer is behind; dropping %zu bytes of rows", len);
+        return -1;
+    }
+    if (g_tail) g_tail->next = b;
+    else g_head = b;
+    g_tail = b;
+    g_queued += len;
+    pthread_cond_signal(&g_db_cond);
+    pthread_mutex_unlock(&g_db_lock);
+    return 0;
+}
 
-    fprintf(f, "[%s] node=%s command=\"%s\" result=\"%s\"\n",
-            timestamp, node_name, command, result);
+static void db_timestamp(time_t at, char *out, size_t size) {
+    struct tm tm;
+    localtime_r(&at, &tm);
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
 
-    fclose(f);
+// Writes s to f JSON-escaped, so a row stays on one line and its fields
+// cannot be forged by what a node sends.
+static bool put_escaped(FILE *f, const char *s, size_t len) {
+    size_t esc_len = json_escaped_len(s, len);
+    char *esc = malloc(esc_len + 1);
+    if (!esc) return false;
+    json_escape_to(esc, s, len);
+    fwrite(esc, 1, esc_len, f);
+    free(esc);
     return true;
 }
 
-void db_list_commands() {
+bool db_store_command(const char *node_name, const char *command, const char *result) {
+    char timestamp[64];
+    db_timestamp(time(NULL), timestamp, sizeof(timestamp));
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *mem = open_memstream(&text, &text_len);
+    if (!mem) return false;
+    fprintf(mem, "[%s] node=\"", timestamp);
+    bool ok = put_escaped(mem, node_name, strlen(node_name));
+    fputs("\" command=\"", mem);
+    ok = ok && put_escaped(mem, command, strlen(command));
+    fputs("\" result=\"", mem);
+    ok = ok && put_escaped(mem, result, strlen(result));
+    fputs("\"\n", mem);
+    fclose(mem);
+    ok = ok && db_post(text, text_len) == 0;
+    free(text);
+    return ok;
+}
+
+int db_store_batch(const char *node_name, const DbRow *rows, int count) {
+    if (!g_db_path[0] || count <= 0) return -1;
+    // the whole batch is formatted here and reaches the file in one piece
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *mem = open_memstream(&text, &text_len);
+    if (!mem) return -1;
+    int stored = 0;
+    for (int i = 0; i < count; ++i) {
+        const DbRow *r = &rows[i];
+        char timestamp[64];
+        db_timestamp(r->at, timestamp, sizeof(timestamp));
+        long start = ftell(mem);
+        fprintf(mem, "[%s] node=\"", timestamp);
+        bool ok = put_escaped(mem, node_name, strlen(node_name));
+        fputs("\" job=\"", mem);
+        ok = ok && put_escaped(mem, r->job, strlen(r->job));
+        fputs("\" command=\"", mem);
+        ok = ok && put_escaped(mem, r->command, strlen(r->command));
+        fprintf(mem, "\" exit=%d result=\"", r->exit_code);
+        ok = ok && put_escaped(mem, r->out, r->out_len);
+        fputs("\"\n", mem);
+        if (ok) {
+            stored++;
+        } else if (start >= 0) {
+            // a row that could not be escaped whole is left out
+            fseek(mem, start, SEEK_SET);
+        }
+    }
+    fclose(mem);
+    int rc = stored > 0 && db_post(text, text_len) < 0 ? -1 : stored;
+    free(text);
+    return rc;
+}
+
+void db_list_commands(void) {
     FILE *f = fopen(g_db_path, "r");
     if (!f) {
         perror("Failed to open DB file for reading");
@@ -67,4 +213,4 @@ void db_list_commands() {
     printf("\n-----------------------\n");
 
     fclose(f);
-}
\ No newline at end of file
+}
@@ -0,0 +1,425 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/cluster.h"
+#include "../include/dialer.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/shard.h"
+
+#define DIAL_BUCKETS 1024
+
+typedef enum {
+    DIAL_WAITING,       // until next_dial_ms
+    DIAL_CONNECTING,    // connect() in flight on fd
+    DIAL_HELLO,         // connected, the hello path has the fd
+    DIAL_UP,            // a session for the node exists
+    DIAL_ELSEWHERE,     // another controller owns the node
+} DialState;
+
+typedef struct DialTarget {
+    char name[256];
+    char host[64];
+    int port;
+    DialState state;
+    int fd;
+    int attempts;           // failed in a row
+    long wait_ms;           // last backoff
+    long long deadline_ms;  // of the connect or the hello
+    long long next_dial_ms;
+    char error[64];         // why the last attempt failed
+    int claimed;            // taken into the new list by dialer_configure()
+    struct DialTarget *next;    // in its bucket
+} DialTarget;
+
+// Names the shards are asked about before dialing starts: nodes that have
+// a session already (after a takeover, or that dialed in) are not dialed.
+typedef struct {
+    int count;
+    char (*names)[256];
+    unsigned char *found;
+} Seed;
+
+static Reactor *dial_reactor = NULL;
+static reactor_accept_cb dial_adopt = NULL;
+static int enabled = 0;
+static DialTarget **targets = NULL;
+static int ntargets = 0;
+static DialTarget *buckets[DIAL_BUCKETS];
+static int connecting = 0;
+static int max_connecting = DIALER_MAX_CONNECTING;
+static int cursor = 0;      // where the next tick starts dialing
+static int seeding = 0;    // shard lookups in flight
+static int tick_added = 0;
+static unsigned int seed = 0;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static DialTarget *target_find(const char *name) {
+    for (DialTarget *t = buckets[name_hash(name) % DIAL_BUCKETS]; t; t = t->next) {
+        if (strcmp(t->name, name) == 0) return t;
+    }
+    return NULL;
+}
+
+// Closes a connect in flight; one the hello path has is not ours to close.
+static void target_abort(DialTarget *t) {
+    if (t->state == DIAL_CONNECTING && t->fd >= 0) {
+        reactor_unwatch_fd(dial_reactor, t->fd);
+        close(t->fd);
+        connecting--;
+    }
+    t->fd = -1;
+}
+
+static void dial_failed(DialTarget *t, const char *why) {
+    if (!t->attempts) log_error("Cannot reach node %s at %s:%d: %s", t->name, t->host, t->port, why);
+    t->attempts++;
+    snprintf(t->error, sizeof(t->error), "%s", why);
+    // decorrelated jitter: a controller's whole list does not retry in step
+    long hi = t->wait_ms ? t->wait_ms * 3 : DIALER_BACKOFF_BASE_MS;
+    t->wait_ms = DIALER_BACKOFF_BASE_MS + rand_r(&seed) % (hi - DIALER_BACKOFF_BASE_MS + 1);
+    if (t->wait_ms > DIALER_BACKOFF_CAP_MS) t->wait_ms = DIALER_BACKOFF_CAP_MS;
+    t->state = DIAL_WAITING;
+    t->next_dial_ms = now_ms() + t->wait_ms;
+}
+
+// Connected: from here the fd goes the way of an accepted one, and the
+// hello says whose session it is.
+static void dial_connected(DialTarget *t, int fd) {
+    t->state = DIAL_HELLO;
+    t->fd = -1;
+    t->deadline_ms = now_ms() + DIALER_HELLO_TIMEOUT_MS;
+    dial_adopt(dial_reactor, fd, NULL);
+}
+
+static void dial_ready(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)events;
+    DialTarget *t = ctx;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+    reactor_unwatch_fd(r, fd);
+    connecting--;
+    t->fd = -1;
+    if (err) {
+        close(fd);
+        dial_failed(t, strerror(err));
+        return;
+    }
+    dial_connected(t, fd);
+}
+
+static void dial(DialTarget *t) {
+    if (cluster_owner(t->name) >= 0) {
+        // looked at again in a while: the owner may go down
+        t->state = DIAL_ELSEWHERE;
+        t->next_dial_ms = now_ms() + DIALER_BACKOFF_BASE_MS;
+        return;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)t->port);
+    if (inet_pton(AF_INET, t->host, &addr.sin_addr) != 1) {
+        dial_failed(t, "not an IPv4 address");
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        dial_failed(t, strerror(errno));
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        dial_connected(t, fd);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        int err = errno;
+        close(fd);
+        dial_failed(t, strerror(err));
+        return;
+    }
+    if (reactor_watch_fd(dial_reactor, fd, REACTOR_WRITE, dial_ready, t) < 0) {
+        close(fd);
+        dial_failed(t, "cannot watch the socket");
+        return;
+    }
+    t->state = DIAL_CONNECTING;
+    t->fd = fd;
+    t->deadline_ms = now_ms() + DIALER_CONNECT_TIMEOUT_MS;
+    connecting++;
+}
+
+static void dialer_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    if (!enabled || seeding || ntargets == 0) return;
+    long long now = now_ms();
+    if (cursor >= ntargets) cursor = 0;
+    int stop = -1;
+    for (int k = 0; k < ntargets; ++k) {
+        int i = (cursor + k) % ntargets;
+        DialTarget *t = targets[i];
+        if (t->state == DIAL_CONNECTING && now >= t->deadline_ms) {
+            target_abort(t);
+            dial_failed(t, "connect timed out");
+        } else if (t->state == DIAL_HELLO && now >= t->deadline_ms) {
+            dial_failed(t, "no hello");
+        } else if ((t->state == DIAL_WAITING || t->state == DIAL_ELSEWHERE) && now >= t->next_dial_ms) {
+            if (connecting >= max_connecting) {
+                // the rest wait for a free slot; the next tick starts here
+                if (stop < 0) stop = i;
+                continue;
+            }
+            dial(t);
+        }
+    }
+    cursor = stop >= 0 ? stop : 0;
+}
+
+static void node_gone(const char *name) {
+    DialTarget *t = target_find(name);
+    if (!t || t->state != DIAL_UP) return;
+    // after a short wait, so an agent that dials in itself gets there first
+    t->state = DIAL_WAITING;
+    t->wait_ms = 0;
+    t->next_dial_ms = now_ms() + DIALER_BACKOFF_BASE_MS;
+}
+
+// --- which nodes have sessions already ---
+
+static void seed_collect(int shard, void *arg) {
+    Seed *s = arg;
+    for (int i = 0; i < s->count; ++i) {
+        if (shard_for_name(s->names[i]) != shard) continue;
+        NodeSession *sess = node_session_find_by_name(s->names[i]);
+        if (sess && sess->connected) s->found[i] = 1;
+    }
+}
+
+static void seed_done(Reactor *r, void *arg) {
+    (void)r;
+    Seed *s = arg;
+    int up = 0;
+    for (int i = 0; i < s->count; ++i) {
+        DialTarget *t = s->found[i] ? target_find(s->names[i]) : NULL;
+        if (t && t->state == DIAL_WAITING) {
+            t->state = DIAL_UP;
+            up++;
+        }
+    }
+    if (up) log_info("%d configured node(s) already connected", up);
+    free(s->names);
+    free(s->found);
+    free(s);
+    seeding--;
+}
+
+// Asks the shards about every node not dialed yet; the tick waits for it.
+static void seed_start(void) {
+    Seed *s = calloc(1, sizeof(Seed));
+    if (s) {
+        s->names = malloc((size_t)(ntargets > 0 ? ntargets : 1) * sizeof(*s->names));
+        s->found = calloc((size_t)(ntargets > 0 ? ntargets : 1), 1);
+    }
+    if (!s || !s->names || !s->found) {
+        if (s) {
+            free(s->names);
+            free(s->found);
+        }
+        free(s);
+        return;
+    }
+    for (int i = 0; i < ntargets; ++i) {
+        if (targets[i]->state != DIAL_WAITING || targets[i]->attempts) continue;
+        memcpy(s->names[s->count++], targets[i]->name, sizeof(s->names[0]));
+    }
+    seeding++;
+    if (shard_broadcast(seed_collect, s, seed_done) < 0) {
+        free(s->names);
+        free(s->found);
+        free(s);
+        seeding--;
+    }
+}
+
+// --- the list ---
+
+// host or host:port. Returns -1 if address is neither.
+static int split_address(const char *address, char *host, size_t host_size, int *port) {
+    const char *colon = strrchr(address, ':');
+    size_t len = colon ? (size_t)(colon - address) : strlen(address);
+    if (len == 0 || len >= host_size) return -1;
+    *port = colon ? atoi(colon + 1) : DEFAULT_NODE_PORT;
+    if (*port <= 0 || *port > 65535) return -1;
+    snprintf(host, host_size, "%.*s", (int)len, address);
+    return 0;
+}
+
+static void targets_clear(void) {
+    for (int i = 0; i < ntargets; ++i) {
+        target_abort(targets[i]);
+        free(targets[i]);
+    }
+    free(targets);
+    targets = NULL;
+    ntargets = 0;
+    memset(buckets, 0, sizeof(buckets));
+    cursor = 0;
+}
+
+void dialer_configure(const Config *cfg) {
+    if (!dial_reactor) return;
+    if (!cfg->dial_nodes) {
+        if (enabled) log_info("Stopped dialing configured nodes");
+        targets_clear();
+        enabled = 0;
+        return;
+    }
+    DialTarget **list = malloc((size_t)(cfg->node_count > 0 ? cfg->node_count : 1) * sizeof(*list));
+    if (!list) {
+        log_error("Out of memory for %d configured nodes", cfg->node_count);
+        return;
+    }
+    int n = 0, kept = 0;
+    for (int i = 0; i < cfg->node_count; ++i) {
+        const Node *node = &cfg->nodes[i];
+        char host[64];
+        int port = 0;
+        if (!node->name[0] || split_address(node->address, host, sizeof(host), &port) < 0) {
+            log_error("Not dialing node '%s': address must be host or host:port", node->name);
+            continue;
+        }
+        // a node still at the same address keeps what we know of it
+        DialTarget *t = target_find(node->name);
+        if (t && !t->claimed && strcmp(t->host, host) == 0 && t->port == port) {
+            t->claimed = 1;
+            kept++;
+        } else {
+            t = calloc(1, sizeof(DialTarget));
+            if (!t) continue;
+            snprintf(t->name, sizeof(t->name), "%s", node->name);
+            snprintf(t->host, sizeof(t->host), "%s", host);
+            t->port = port;
+            t->state = DIAL_WAITING;
+            t->fd = -1;
+            t->claimed = 1;
+        }
+        list[n++] = t;
+    }
+    // entries of the old list not carried over go
+    for (int i = 0; i < ntargets; ++i) {
+        if (targets[i]->claimed) continue;
+        target_abort(targets[i]);
+        free(targets[i]);
+    }
+    free(targets);
+    memset(buckets, 0, sizeof(buckets));
+    int listed = n;
+    n = 0;
+    for (int i = 0; i < listed; ++i) {
+        DialTarget *t = list[i];
+        if (target_find(t->name)) {
+            // listed twice: the first entry counts
+            target_abort(t);
+            free(t);
+            continue;
+        }
+        unsigned long b = name_hash(t->name) % DIAL_BUCKETS;
+        t->claimed = 0;
+        t->next = buckets[b];
+        buckets[b] = t;
+        list[n++] = t;
+    }
+    targets = list;
+    ntargets = n;
+    cursor = 0;
+    if (!enabled) log_info("Dialing %d configured node(s), up to %d at once", n, max_connecting);
+    else if (n - kept) log_info("Dialing %d newly configured node(s)", n - kept);
+    enabled = 1;
+    seed_start();
+}
+
+int dialer_init(Reactor *front, const Config *cfg, reactor_accept_cb adopt) {
+    dial_reactor = front;
+    dial_adopt = adopt;
+    seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 4 < (rlim_t)DIALER_MAX_CONNECTING) {
+        max_connecting = rl.rlim_cur / 4 > 0 ? (int)(rl.rlim_cur / 4) : 1;
+    }
+    node_manager_on_session_end(node_gone);
+    if (!tick_added && reactor_add_tick(front, DIALER_TICK_MS, dialer_tick, NULL) < 0) return -1;
+    tick_added = 1;
+    dialer_configure(cfg);
+    return 0;
+}
+
+void dialer_shutdown(void) {
+    targets_clear();
+    enabled = 0;
+    seeding = 0;
+    connecting = 0;
+    dial_reactor = NULL;
+    dial_adopt = NULL;
+}
+
+void dialer_session_up(const char *name) {
+    DialTarget *t = enabled ? target_find(name) : NULL;
+    if (!t) return;
+    if (t->attempts) log_info("Configured node %s reached after %d failed attempt(s)", t->name, t->attempts);
+    target_abort(t);
+    t->state = DIAL_UP;
+    t->attempts = 0;
+    t->wait_ms = 0;
+    t->error[0] = '\0';
+}
+
+void dialer_print(FILE *out) {
+    if (!enabled) return;
+    int up = 0, trying = 0, down = 0, elsewhere = 0;
+    for (int i = 0; i < ntargets; ++i) {
+        const DialTarget *t = targets[i];
+        if (t->state == DIAL_UP) up++;
+        else if (t->state == DIAL_ELSEWHERE) elsewhere++;
+        else if (t->attempts) down++;
+        else trying++;
+    }
+    fprintf(out, "Configured nodes (%d): %d connected, %d connecting, %d unreachable", ntargets, up, trying, down);
+    if (elsewhere) fprintf(out, ", %d on other controllers", elsewhere);
+    fprintf(out, "\n");
+    if (!down) return;
+    fprintf(out, "Configured but unreachable (%d):\n", down);
+    long long now = now_ms();
+    for (int i = 0; i < ntargets; ++i) {
+        const DialTarget *t = targets[i];
+        if (t->state == DIAL_UP || t->state == DIAL_ELSEWHERE || !t->attempts) continue;
+        fprintf(out, "  - %s (%s:%d, %s, %d attempt%s", t->name, t->host, t->port, t->error, t->attempts,
+                t->attempts == 1 ? "" : "s");
+        if (t->state == DIAL_WAITING) {
+            long long in = t->next_dial_ms > now ? (t->next_dial_ms - now + 999) / 1000 : 0;
+            fprintf(out, ", next in %llds)\n", in);
+        } else {
+            fprintf(out, ", trying again)\n");
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/heartbeat.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/shard.h"
+#include "../include/telemetry.h"
+
+// recvmmsg() rounds per wakeup, so a flood cannot hold the front reactor
+#define HEARTBEAT_ROUNDS 16
+
+// Heartbeats and telemetry frames for one shard, applied there in one
+// task each.
+typedef struct {
+    int count;
+    Heartbeat hb[HEARTBEAT_BATCH];
+} HeartbeatBatch;
+
+typedef struct {
+    int count;
+    TelemetryFrame tf[HEARTBEAT_BATCH];
+} TelemetryBatch;
+
+static Reactor *hb_reactor = NULL;
+static int hb_fd = -1;
+static int hb_port = 0;
+static HeartbeatBatch *batches[MAX_SHARDS];
+static TelemetryBatch *tbatches[MAX_SHARDS];
+static unsigned char bufs[HEARTBEAT_BATCH][TELEMETRY_MAX_LEN];
+static struct iovec iovs[HEARTBEAT_BATCH];
+static struct mmsghdr msgs[HEARTBEAT_BATCH];
+static unsigned long dropped = 0;
+
+static void apply_task(Reactor *r, void *arg) {
+    (void)r;
+    HeartbeatBatch *b = arg;
+    node_sessions_heartbeat(b->hb, b->count);
+    free(b);
+}
+
+static void telemetry_task(Reactor *r, void *arg) {
+    (void)r;
+    TelemetryBatch *b = arg;
+    node_sessions_telemetry(b->tf, b->count);
+    free(b);
+}
+
+static void flush_batch(int shard) {
+    HeartbeatBatch *b = batches[shard];
+    batches[shard] = NULL;
+    if (b && shard_post(shard, apply_task, b) < 0) free(b);
+}
+
+static void flush_telemetry(int shard) {
+    TelemetryBatch *b = tbatches[shard];
+    tbatches[shard] = NULL;
+    if (b && shard_post(shard, telemetry_task, b) < 0) free(b);
+}
+
+static void add_telemetry(const unsigned char *buf, size_t len, int shards) {
+    TelemetryFrame tf;
+    if (telemetry_decode(buf, len, &tf) < 0) {
+        dropped++;
+        return;
+    }
+    int shard = shard_for_name(tf.name);
+    if (shard < 0 || shard >= shards) return;
+    if (!tbatches[shard]) {
+        tbatches[shard] = malloc(sizeof(TelemetryBatch));
+        if (!tbatches[shard]) return;
+        tbatches[shard]->count = 0;
+    }
+    TelemetryBatch *b = tbatches[shard];
+    b->tf[b->count++] = tf;
+    if (b->count == HEARTBEAT_BATCH) flush_telemetry(shard);
+}
+
+static void on_readable(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)r;
+    (void)events;
+    (void)ctx;
+    int shards = shard_count();
+    for (int round = 0; round < HEARTBEAT_ROUNDS; ++round) {
+        for (int i = 0; i < HEARTBEAT_BATCH; ++i) {
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fd, msgs, HEARTBEAT_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("Heartbeat recvmmsg failed: %s", strerror(errno));
+            }
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            Heartbeat hb;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                dropped++;
+                continue;
+            }
+            const unsigned char *m = bufs[i];
+            if (msgs[i].msg_len >= 4 &&
+                ((uint32_t)m[0] | (uint32_t)m[1] << 8 | (uint32_t)m[2] << 16 | (uint32_t)m[3] << 24) ==
+                    TELEMETRY_MAGIC) {
+                add_telemetry(bufs[i], msgs[i].msg_len, shards);
+                continue;
+            }
+            if (heartbeat_decode(bufs[i], msgs[i].msg_len, &hb) < 0) {
+                dropped++;
+                continue;
+            }
+            int shard = shard_for_name(hb.name);
+            if (shard < 0 || shard >= shards) continue;
+            if (!batches[shard]) {
+                batches[shard] = malloc(sizeof(HeartbeatBatch));
+                if (!batches[shard]) continue;
+                batches[shard]->count = 0;
+            }
+            HeartbeatBatch *b = batches[shard];
+            b->hb[b->count++] = hb;
+            if (b->count == HEARTBEAT_BATCH) flush_batch(shard);
+        }
+        if (n < HEARTBEAT_BATCH) break;
+    }
+    for (int i = 0; i < shards && i < MAX_SHARDS; ++i) {
+        flush_batch(i);
+        flush_telemetry(i);
+    }
+}
+
+int heartbeat_start(Reactor *front, const Config *cfg) {
+    if (!front || !cfg || cfg->heartbeat_port <= 0) return 0;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Heartbeat socket failed: %s", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)cfg->heartbeat_port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("Heartbeat bind to port %d failed: %s", cfg->heartbeat_port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < HEARTBEAT_BATCH; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = sizeof(bufs[i]);
+    }
+    if (reactor_watch_fd(front, fd, REACTOR_READ, on_readable, NULL) < 0) {
+        close(fd);
+        return -1;
+    }
+    hb_reactor = front;
+    hb_fd = fd;
+    hb_port = cfg->heartbeat_port;
+    log_info("Receiving heartbeats on UDP port %d", hb_port);
+    return 0;
+}
+
+void heartbeat_stop(void) {
+    if (hb_fd < 0) return;
+    reactor_unwatch_fd(hb_reactor, hb_fd);
+    close(hb_fd);
+    if (dropped > 0) log_info("Dropped %lu malformed heartbeat(s)", dropped);
+    hb_fd = -1;
+    hb_port = 0;
+    hb_reactor = NULL;
+    dropped = 0;
+}
+
+int heartbeat_port(void) {
+    return hb_port;
+}
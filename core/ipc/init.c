@@ -6,9 +6,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/uio.h>
 
 #include "../../include/ipc.h"
 #include "../../include/logging.h"
@@ -65,6 +68,13 @@ int ipc_server_start(GlobalState *state) {
     return listen_fd;
 }
 
+int ipc_server_adopt(int fd) {
+    if (fd < 0) return -1;
+    listen_fd = fd;
+    log_info("IPC server taken over (fd=%d)", listen_fd);
+    return listen_fd;
+}
+
 int ipc_server_stop(void) {
     if (listen_fd >= 0) {
         close(listen_fd);
@@ -74,9 +84,39 @@ int ipc_server_stop(void) {
     return 0;
 }
 
+int ipc_unix_listen(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("ipc_unix_listen: bad socket path");
+        return -1;
+    }
+    int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd < 0) {
+        log_error("socket(AF_UNIX) failed: %s", strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // a socket file left behind by a previous run would make bind fail
+    unlink(path);
+    // the mode is set before listen(), so nobody connects while it is wider
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path, mode) < 0 ||
+        listen(sfd, SOMAXCONN) < 0) {
+        log_error("Cannot listen on %s: %s", path, strerror(errno));
+        close(sfd);
+        return -1;
+    }
+    int flags = fcntl(sfd, F_GETFL, 0);
+    if (flags >= 0) fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
+    log_info("Listening on %s (fd=%d)", path, sfd);
+    return sfd;
+}
+
 int ipc_accept_connection(int listen_fd_local) {
     if (listen_fd_local < 0) return -1;
-    struct sockaddr_in claddr;
+    struct sockaddr_storage claddr;
     socklen_t cllen = sizeof(claddr);
     int cfd = accept(listen_fd_local, (struct sockaddr *)&claddr, &cllen);
     if (cfd < 0) {
@@ -89,43 +129,143 @@ int ipc_accept_connection(int listen_fd_local) {
     int flags = fcntl(cfd, F_GETFL, 0);
     if (flags >= 0) fcntl(cfd, F_SETFL, flags | O_NONBLOCK);
 
-    char addrbuf[INET_ADDRSTRLEN] = {0};
-    inet_ntop(AF_INET, &claddr.sin_addr, addrbuf, sizeof(addrbuf));
+    char addrbuf[INET_ADDRSTRLEN] = "local";
+    if (claddr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&claddr)->sin_addr, addrbuf, sizeof(addrbuf));
+    }
     log_info("Accepted connection from %s fd=%d", addrbuf, cfd);
     return cfd;
 }
 
 ssize_t ipc_send_full(int fd, const char *buf, size_t len) {
     if (fd < 0 || !buf) return -1;
-    size_t total = 0;
     int has_nl = (len > 0 && buf[len-1] == '\n');
     size_t send_len = len + (has_nl ? 0 : 1);
-    char *tmp = NULL;
-    if (!has_nl) {
-        tmp = malloc(send_len + 1);
-        if (!tmp) return -1;
-        memcpy(tmp, buf, len);
-        tmp[len] = '\n';
-        tmp[len+1] = '\0';
-    }
 
-    const char *p = has_nl ? buf : tmp;
+    // the terminating newline goes out as a second iovec instead of
+    // copying the message into a bigger buffer
+    char nl = '\n';
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = &nl;
+    iov[1].iov_len = has_nl ? 0 : 1;
 
+    size_t total = 0;
     while (total < send_len) {
-        ssize_t s = send(fd, p + total, send_len - total, 0);
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        struct iovec rest[2];
+        int n = 0;
+        size_t skip = total;
+        for (int i = 0; i < 2; ++i) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            rest[n].iov_base = (char *)iov[i].iov_base + skip;
+            rest[n].iov_len = iov[i].iov_len - skip;
+            skip = 0;
+            n++;
+        }
+        mh.msg_iov = rest;
+        mh.msg_iovlen = (size_t)n;
+
+        ssize_t s = sendmsg(fd, &mh, MSG_NOSIGNAL);
         if (s < 0) {
             if (errno == EINTR) continue;
-            if (tmp) free(tmp);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd p;
+                p.fd = fd; p.events = POLLOUT;
+                poll(&p, 1, 1000);
+                continue;
+            }
             log_error("send() failed fd=%d: %s", fd, strerror(errno));
             return -1;
         }
         total += (size_t)s;
     }
 
-    if (tmp) free(tmp);
     return (ssize_t)total;
 }
 
+int ipc_send_fd(int sock, const char *buf, size_t len, int pass_fd) {
+    if (pass_fd < 0) return -1;
+    return ipc_send_fds(sock, buf, len, &pass_fd, 1);
+}
+
+int ipc_send_fds(int sock, const char *buf, size_t len, const int *fds, int nfds) {
+    if (sock < 0 || !buf || len == 0 || nfds < 0 || nfds > IPC_MAX_PASS_FDS) return -1;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(IPC_MAX_PASS_FDS * sizeof(int))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, (size_t)nfds * sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    // the fds travel with the first byte; a short write is not retried
+    // here because the socket is usually non-blocking and owned by a reactor
+    if (sent != (ssize_t)len) {
+        log_error("Failed to pass fd over fd=%d: %s", sock, sent < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+int ipc_recv_fds(int sock, char *buf, size_t len, int *fds, int max_fds) {
+    if (sock < 0 || !buf || len == 0) return -1;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(IPC_MAX_PASS_FDS * sizeof(int))];
+    } ctrl;
+    int nfds = 0;
+    size_t got = 0;
+    while (got < len) {
+        struct iovec iov = { buf + got, len - got };
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = sizeof(ctrl.buf);
+        ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            for (int i = 0; i < nfds; ++i) close(fds[i]);
+            return -1;
+        }
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; ++i) {
+                int received;
+                memcpy(&received, CMSG_DATA(c) + (size_t)i * sizeof(int), sizeof(int));
+                if (fds && nfds < max_fds) fds[nfds++] = received;
+                else close(received);
+            }
+        }
+        got += (size_t)n;
+    }
+    return nfds;
+}
+
 char *ipc_recv_line(int fd, int timeout_ms) {
     if (fd < 0) return NULL;
 
@@ -179,3 +319,199 @@ char *ipc_recv_line(int fd, int timeout_ms) {
     buf[len] = '\0';
     return buf;
 }
+
+void ipc_reader_init(IpcReader *r) {
+    if (!r) return;
+    r->buf = NULL;
+    r->cap = 0;
+    r->start = 0;
+    r->end = 0;
+    r->scanned = 0;
+    r->max = MAX_MSG_LEN;
+}
+
+void ipc_reader_free(IpcReader *r) {
+    if (!r) return;
+    free(r->buf);
+    ipc_reader_init(r);
+}
+
+static int reader_reserve(IpcReader *r, size_t extra) {
+    if (r->start > 0) {
+        size_t pending = r->end - r->start;
+        if (pending) memmove(r->buf, r->buf + r->start, pending);
+        r->end = pending;
+        r->start = 0;
+    }
+    if (r->end + extra + 1 <= r->cap) return 0;
+    size_t max = r->max ? r->max : MAX_MSG_LEN;
+    if (r->end + extra + 1 > max + 1) return -1;
+    size_t cap = r->cap ? r->cap : 16 * 1024;
+    while (cap < r->end + extra + 1) cap *= 2;
+    if (cap > max + 1) cap = max + 1;
+    char *n = realloc(r->buf, cap);
+    if (!n) return -1;
+    r->buf = n;
+    r->cap = cap;
+    return 0;
+}
+
+ssize_t ipc_reader_fill(IpcReader *r, int fd) {
+    if (!r || fd < 0) return -1;
+
+    if (reader_reserve(r, 4096) < 0 && r->cap - r->end <= 1) {
+        log_error("Message on fd=%d exceeds %zu bytes, dropping connection", fd, r->max);
+        return -1;
+    }
+
+    // keep one byte spare so next_line can always NUL-terminate
+    while (1) {
+        // read() rather than recv() so the console's stdin works too
+        ssize_t got = read(fd, r->buf + r->end, r->cap - r->end - 1);
+        if (got > 0) {
+            r->end += (size_t)got;
+            return got;
+        }
+        if (got == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+        return -1;
+    }
+}
+
+ssize_t ipc_reader_fill_fd(IpcReader *r, int fd, int *passed_fd) {
+    if (!r || fd < 0) return -1;
+
+    if (reader_reserve(r, 4096) < 0 && r->cap - r->end <= 1) {
+        log_error("Message on fd=%d exceeds %zu bytes, dropping connection", fd, r->max);
+        return -1;
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct iovec iov = { r->buf + r->end, r->cap - r->end - 1 };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    while (1) {
+        ssize_t got = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            return -1;
+        }
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            int received;
+            memcpy(&received, CMSG_DATA(c), sizeof(int));
+            // keep the first fd the caller has not collected yet
+            if (passed_fd && *passed_fd < 0) *passed_fd = received;
+            else close(received);
+        }
+        r->end += (size_t)got;
+        return got;
+    }
+}
+
+int ipc_reader_feed(IpcReader *r, const char *data, size_t len) {
+    if (!r || !data) return -1;
+    if (reader_reserve(r, len) < 0) return -1;
+    memcpy(r->buf + r->end, data, len);
+    r->end += len;
+    return 0;
+}
+
+const char *ipc_reader_pending(const IpcReader *r, size_t *out_len) {
+    if (out_len) *out_len = r ? r->end - r->start : 0;
+    if (!r || !r->buf) return NULL;
+    return r->buf + r->start;
+}
+
+char *ipc_reader_next_line(IpcReader *r, size_t *out_len) {
+    if (!r || r->start + r->scanned >= r->end) return NULL;
+    char *from = r->buf + r->start + r->scanned;
+    char *nl = memchr(from, '\n', r->end - (r->start + r->scanned));
+    if (!nl) {
+        r->scanned = r->end - r->start;
+        return NULL;
+    }
+    char *line = r->buf + r->start;
+    size_t len = (size_t)(nl - line);
+    *nl = '\0';
+    if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+    r->start = (size_t)(nl - r->buf) + 1;
+    r->scanned = 0;
+    if (r->start == r->end) {
+        r->start = 0;
+        r->end = 0;
+    }
+    if (out_len) *out_len = len;
+    return line;
+}
+
+void ipc_writer_init(IpcWriter *w) {
+    if (!w) return;
+    w->buf = NULL;
+    w->cap = 0;
+    w->off = 0;
+    w->len = 0;
+}
+
+void ipc_writer_free(IpcWriter *w) {
+    if (!w) return;
+    free(w->buf);
+    ipc_writer_init(w);
+}
+
+size_t ipc_writer_pending(const IpcWriter *w) {
+    return w ? w->len - w->off : 0;
+}
+
+int ipc_writer_append(IpcWriter *w, const char *data, size_t len) {
+    if (!w || !data) return -1;
+    if (w->off == w->len) {
+        w->off = 0;
+        w->len = 0;
+    }
+    if (w->len - w->off + len > IPC_MAX_PENDING) return -1;
+    if (w->len + len > w->cap) {
+        if (w->off > 0) {
+            memmove(w->buf, w->buf + w->off, w->len - w->off);
+            w->len -= w->off;
+            w->off = 0;
+        }
+        if (w->len + len > w->cap) {
+            size_t cap = w->cap ? w->cap : 4096;
+            while (cap < w->len + len) cap *= 2;
+            char *n = realloc(w->buf, cap);
+            if (!n) return -1;
+            w->buf = n;
+            w->cap = cap;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+}
+
+int ipc_writer_flush(IpcWriter *w, int fd) {
+    if (!w || fd < 0) return -1;
+    while (w->off < w->len) {
+        ssize_t s = send(fd, w->buf + w->off, w->len - w->off, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        w->off += (size_t)s;
+    }
+    w->off = 0;
+    w->len = 0;
+    return 1;
+}
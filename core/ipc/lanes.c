@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/lanes.h"
+
+struct LaneMsg {
+    struct LaneMsg *next;
+    uint32_t id;
+    size_t len;
+    size_t off;         // bytes handed out already
+    char data[];
+};
+
+static const int lane_weights[LANE_COUNT] = LANE_WEIGHTS;
+
+static const char *const control_types[] = {
+    "ping", "pong", "ack", "result_ack", "shm_request", "shm_ready", "shm_declined",
+    "redirect", "relay_join", "relay_leave", "cancel", NULL,
+};
+
+Lane lane_classify(const char *msg, size_t len) {
+    if (len > LANE_CHUNK) return LANE_BULK;
+    // every message starts with its type
+    static const char key[] = "{\"type\":\"";
+    if (len < sizeof(key) || memcmp(msg, key, sizeof(key) - 1) != 0) return LANE_INTERACTIVE;
+    const char *type = msg + sizeof(key) - 1;
+    const char *end = memchr(type, '"', len - (sizeof(key) - 1));
+    if (!end) return LANE_INTERACTIVE;
+    size_t type_len = (size_t)(end - type);
+    for (int i = 0; control_types[i]; ++i) {
+        if (strlen(control_types[i]) == type_len && memcmp(control_types[i], type, type_len) == 0) {
+            return LANE_CONTROL;
+        }
+    }
+    return LANE_INTERACTIVE;
+}
+
+void lane_queue_init(LaneQueue *q) {
+    memset(q, 0, sizeof(*q));
+    for (int i = 0; i < LANE_COUNT; ++i) q->credit[i] = lane_weights[i];
+}
+
+void lane_queue_clear(LaneQueue *q) {
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        while (q->head[i]) {
+            LaneMsg *m = q->head[i];
+            q->head[i] = m->next;
+            free(m);
+        }
+        q->tail[i] = NULL;
+        q->credit[i] = lane_weights[i];
+    }
+    q->bytes = 0;
+}
+
+int lane_queue_push(LaneQueue *q, Lane lane, const char *msg, size_t len) {
+    if ((unsigned)lane >= LANE_COUNT) lane = LANE_INTERACTIVE;
+    if (len > 0 && msg[len - 1] == '\n') len--;
+    LaneMsg *m = malloc(sizeof(LaneMsg) + len);
+    if (!m) return -1;
+    m->next = NULL;
+    m->id = q->next_id++;
+    m->len = len;
+    m->off = 0;
+    memcpy(m->data, msg, len);
+    if (q->tail[lane]) q->tail[lane]->next = m;
+    else q->head[lane] = m;
+    q->tail[lane] = m;
+    q->bytes += len;
+    return 0;
+}
+
+int lane_queue_empty(const LaneQueue *q) {
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        if (q->head[i]) return 0;
+    }
+    return 1;
+}
+
+int lane_queue_peek(LaneQueue *q, int chunked, LaneUnit *u) {
+    if (lane_queue_empty(q)) return 0;
+    int lane = -1;
+    for (int pass = 0; pass < 2 && lane < 0; ++pass) {
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            if (q->head[i] && q->credit[i] > 0) {
+                lane = i;
+                break;
+            }
+        }
+        // every lane with something queued spent its share: next round
+        if (lane < 0) {
+            for (int i = 0; i < LANE_COUNT; ++i) q->credit[i] = lane_weights[i];
+        }
+    }
+    LaneMsg *m = q->head[lane];
+    u->lane = (Lane)lane;
+    u->body = m->data + m->off;
+    u->body_len = m->len - m->off;
+    u->head_len = 0;
+    if (chunked && (m->off > 0 || m->len > LANE_CHUNK)) {
+        int last = u->body_len <= LANE_CHUNK;
+        if (!last) u->body_len = LANE_CHUNK;
+        u->head_len = (size_t)snprintf(u->head, sizeof(u->head), "@%x%c", (unsigned)m->id, last ? '.' : '+');
+    }
+    return 1;
+}
+
+void lane_queue_consume(LaneQueue *q, const LaneUnit *u) {
+    LaneMsg *m = q->head[u->lane];
+    if (!m) return;
+    m->off += u->body_len;
+    q->bytes -= u->body_len;
+    q->credit[u->lane]--;
+    if (m->off < m->len) return;
+    q->head[u->lane] = m->next;
+    if (!m->next) q->tail[u->lane] = NULL;
+    free(m);
+}
+
+void lane_reassembly_init(LaneReassembly *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+void lane_reassembly_free(LaneReassembly *r) {
+    for (int i = 0; i < LANE_COUNT; ++i) free(r->slot[i].buf);
+    free(r->done);
+    lane_reassembly_init(r);
+}
+
+int lane_reassembly_feed(LaneReassembly *r, char *line, size_t len, size_t max_len, char **msg,
+                         size_t *msg_len) {
+    if (len == 0 || line[0] != '@') {
+        *msg = line;
+        *msg_len = len;
+        return 1;
+    }
+    char *end = NULL;
+    unsigned long id = strtoul(line + 1, &end, 16);
+    if (end == line + 1 || (*end != '+' && *end != '.')) return -1;
+    int last = *end == '.';
+    const char *piece = end + 1;
+    size_t piece_len = len - (size_t)(piece - line);
+
+    int free_slot = -1, s = -1;
+    for (int i = 0; i < LANE_COUNT && s < 0; ++i) {
+        if (r->slot[i].used && r->slot[i].id == (uint32_t)id) s = i;
+        else if (!r->slot[i].used && free_slot < 0) free_slot = i;
+    }
+    if (s < 0) {
+        // a sender has at most one unfinished message per lane
+        if (free_slot < 0) return -1;
+        s = free_slot;
+        r->slot[s].used = 1;
+        r->slot[s].id = (uint32_t)id;
+        r->slot[s].len = 0;
+    }
+    if (r->slot[s].len + piece_len > max_len) {
+        r->slot[s].used = 0;
+        return -1;
+    }
+    if (r->slot[s].len + piece_len + 1 > r->slot[s].cap) {
+        size_t cap = r->slot[s].cap ? r->slot[s].cap : LANE_CHUNK * 2;
+        while (cap < r->slot[s].len + piece_len + 1) cap *= 2;
+        char *buf = realloc(r->slot[s].buf, cap);
+        if (!buf) return -1;
+        r->slot[s].buf = buf;
+        r->slot[s].cap = cap;
+    }
+    memcpy(r->slot[s].buf + r->slot[s].len, piece, piece_len);
+    r->slot[s].len += piece_len;
+    if (!last) return 0;
+
+    // the finished buffer leaves the slot; the slot grows a new one
+    free(r->done);
+    r->done = r->slot[s].buf;
+    r->done[r->slot[s].len] = '\0';
+    *msg = r->done;
+    *msg_len = r->slot[s].len;
+    r->slot[s].buf = NULL;
+    r->slot[s].cap = 0;
+    r->slot[s].len = 0;
+    r->slot[s].used = 0;
+    return 1;
+}
+
+char *lane_reassembly_save(const LaneReassembly *r, size_t *len) {
+    size_t total = 0;
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        if (r->slot[i].used) total += 16 + r->slot[i].len;
+    }
+    *len = 0;
+    if (total == 0) return NULL;
+    char *out = malloc(total);
+    if (!out) return NULL;
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        if (!r->slot[i].used) continue;
+        *len += (size_t)snprintf(out + *len, 16, "@%x+", (unsigned)r->slot[i].id);
+        memcpy(out + *len, r->slot[i].buf, r->slot[i].len);
+        *len += r->slot[i].len;
+        out[(*len)++] = '\n';
+    }
+    return out;
+}
@@ -3,49 +3,246 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <poll.h>
+#include <time.h>
 
 #include "../include/loop.h"
+#include "../include/admin.h"
 #include "../include/logging.h"
 #include "../include/ipc.h"
 #include "../include/node_manager.h"
 #include "../include/cli.h"
+#include "../include/cluster.h"
+#include "../include/codec.h"
+#include "../include/config_reload.h"
+#include "../include/db.h"
+#include "../include/dialer.h"
 #include "../include/env.h"
+#include "../include/heartbeat.h"
+#include "../include/placement.h"
+#include "../include/reactor.h"
+#include "../include/relay.h"
+#include "../include/schedule.h"
+#include "../include/scripts.h"
+#include "../include/shard.h"
+#include "../include/shm_session.h"
+#include "../include/transfer.h"
+#include "../include/upgrade.h"
+
+#define HELLO_TIMEOUT_MS 2000
+#define HELLO_SWEEP_MS 250
+
+// A connection that has been accepted but has not sent its hello yet. The
+// front reactor holds it until the hello names the node, then hands the fd
+// to the shard that owns that name.
+typedef struct PendingConn {
+    ReactorStream *stream;
+    long long accepted_ms;
+    int redirected;     // closed once the redirect has gone out
+    struct PendingConn *prev;
+    struct PendingConn *next;
+} PendingConn;
+
+static PendingConn *pending_conns = NULL;
+// console input; a whole read is split into lines, not one byte at a time
+static IpcReader stdin_rx;
+static Reactor *front_reactor = NULL;
+static int server_fd = -1;
+static int local_fd = -1;
 
 GlobalState init_global_state(void) {
     GlobalState state;
     state.config = NULL;
+    state.config_path = NULL;
+    state.takeover = 0;
     return state;
 }
 
-static char *read_stdin_line(void) {
-    size_t cap = 512;
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void pending_remove(PendingConn *pc) {
+    if (pc->prev) pc->prev->next = pc->next;
+    else pending_conns = pc->next;
+    if (pc->next) pc->next->prev = pc->prev;
+    free(pc);
+}
+
+static void hello_handoff(int fd, const char *pending, size_t pending_len, const char *unsent, size_t unsent_len,
+                          void *ctx) {
+    Node *meta = ctx;
+    // anything after the hello already belongs to the session, and an ack
+    // the socket did not take yet goes out from there
+    if (shard_adopt(shard_for_name(meta->name), fd, meta, pending, pending_len, unsent, unsent_len) < 0) {
+        log_error("Failed to hand %s to its shard", meta->name);
+    } else {
+        dialer_session_up(meta->name);
+    }
+    free(meta);
+}
+
+// Queues the hello ack on the stream; nothing here waits for the socket.
+static void hello_ack(ReactorStream *stream, const Node *meta) {
+    char ack[192];
+    size_t ack_len = (size_t)snprintf(ack, sizeof(ack), "{\"type\":\"ack\",\"status\":\"ok\"");
+    if (heartbeat_port() > 0) {
+        ack_len += (size_t)snprintf(ack + ack_len, sizeof(ack) - ack_len, ",\"heartbeat_port\":%d", heartbeat_port());
+    }
+    // the agent may cut long messages into chunks (lanes.h)
+    if (meta->lanes) ack_len += (size_t)snprintf(ack + ack_len, sizeof(ack) - ack_len, ",\"lanes\":1");
+    // and send long output compressed (codec.h)
+    if (meta->codec) {
+        ack_len += (size_t)snprintf(ack + ack_len, sizeof(ack) - ack_len, ",\"codec\":\"%s\"", CODEC_NAME);
+    }
+    // spooled results may come as deltas from the last output (result_delta.h)
+    ack_len += (size_t)snprintf(ack + ack_len, sizeof(ack) - ack_len, ",\"deltas\":1");
+    ack_len += (size_t)snprintf(ack + ack_len, sizeof(ack) - ack_len, "}\n");
+    reactor_stream_write(stream, ack, ack_len);
+}
+
+static void hello_on_input(ReactorStream *stream, void *ctx) {
+    PendingConn *pc = ctx;
+    if (pc->redirected) return;
     size_t len = 0;
-    char *buf = malloc(cap);
-    if (!buf) return NULL;
-    while (1) {
-        ssize_t r = read(STDIN_FILENO, buf + len, 1);
-        if (r <= 0) {
-            if (len == 0) { free(buf); return NULL; }
-            break;
+    char *hello = ipc_reader_next_line(&stream->rx, &len);
+    if (!hello) return;
+    // a push data connection, not a node session
+    if (transfer_accept(stream, hello, len)) {
+        pending_remove(pc);
+        return;
+    }
+    // another controller linking up
+    if (cluster_accept(stream, hello, len)) {
+        pending_remove(pc);
+        return;
+    }
+
+    Node *meta = calloc(1, sizeof(Node));
+    if (!meta || parse_hello_message(hello, meta) != 0) {
+        log_error("Invalid hello message: %s", hello);
+        free(meta);
+        reactor_stream_close(stream);
+        pending_remove(pc);
+        return;
+    }
+
+    char reply[512];
+    int n = cluster_redirect(meta->name, reply, sizeof(reply));
+    if (n > 0) {
+        // another controller owns this node; the agent reconnects there
+        log_info("Redirecting %s: %.*s", meta->name, n - 1, reply);
+        free(meta);
+        if (reactor_stream_write(stream, reply, (size_t)n) < 0 || reactor_stream_pending(stream) == 0) {
+            reactor_stream_close(stream);
+            pending_remove(pc);
+        } else {
+            pc->redirected = 1;
         }
-        if (buf[len] == '\n') {
-            buf[len] = '\0';
-            return buf;
+        return;
+    }
+
+    hello_ack(stream, meta);
+    if (reactor_stream_detach(stream, hello_handoff, meta) < 0) {
+        free(meta);
+        reactor_stream_close(stream);
+    }
+    pending_remove(pc);
+}
+
+static void hello_on_close(ReactorStream *stream, void *ctx) {
+    (void)stream;
+    PendingConn *pc = ctx;
+    if (!pc->redirected) log_error("Connection closed before hello");
+    pending_remove(pc);
+}
+
+static void hello_on_drain(ReactorStream *stream, void *ctx) {
+    PendingConn *pc = ctx;
+    if (!pc->redirected) return;
+    reactor_stream_close(stream);
+    pending_remove(pc);
+}
+
+static const ReactorStreamOps hello_ops = {
+    hello_on_input,
+    hello_on_close,
+    hello_on_drain,
+};
+
+static void expire_hellos(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    long long now = now_ms();
+    PendingConn *pc = pending_conns;
+    while (pc) {
+        PendingConn *next = pc->next;
+        if (now - pc->accepted_ms >= HELLO_TIMEOUT_MS) {
+            reactor_stream_close(pc->stream);
+            pending_remove(pc);
+            log_error("No hello from new connection, closed");
         }
-        len++;
-        if (len + 1 >= cap) {
-            cap *= 2;
-            char *n = realloc(buf, cap);
-            if (!n) { free(buf); return NULL; }
-            buf = n;
+        pc = next;
+    }
+}
+
+static void on_accept(Reactor *r, int cfd, void *ctx) {
+    (void)ctx;
+    PendingConn *pc = calloc(1, sizeof(PendingConn));
+    if (!pc) {
+        close(cfd);
+        return;
+    }
+    pc->stream = reactor_stream_open(r, cfd, &hello_ops, pc);
+    if (!pc->stream) {
+        close(cfd);
+        free(pc);
+        return;
+    }
+    pc->accepted_ms = now_ms();
+    pc->next = pending_conns;
+    if (pending_conns) pending_conns->prev = pc;
+    pending_conns = pc;
+}
+
+static void on_stdin(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)events;
+    (void)ctx;
+    ssize_t n = ipc_reader_fill(&stdin_rx, fd);
+    if (n == -2) return;
+    size_t len = 0;
+    char *line;
+    while ((line = ipc_reader_next_line(&stdin_rx, &len)) != NULL) {
+        parse_cli_command(line);
+    }
+    if (n <= 0) {
+        // a last line without a newline still counts
+        const char *rest = ipc_reader_pending(&stdin_rx, &len);
+        if (n == 0 && len > 0) {
+            char *tail = strndup(rest, len);
+            if (tail) parse_cli_command(tail);
+            free(tail);
         }
+        log_info("stdin closed, shutting down");
+        reactor_unwatch_fd(r, STDIN_FILENO);
+        reactor_stop(r);
     }
-    buf[len] = '\0';
-    return buf;
 }
 
-void handle_node_message(int fd, const char *msg, GlobalState *state);
+// A new binary is taking over: stop accepting nodes, it gets the listeners.
+static void upgrade_pause(void) {
+    reactor_unwatch_fd(front_reactor, server_fd);
+    if (local_fd >= 0) reactor_unwatch_fd(front_reactor, local_fd);
+}
+
+static int upgrade_idle(void) {
+    return pending_conns == NULL;
+}
+
+static void upgrade_done(void) {
+    reactor_stop(front_reactor);
+}
 
 void run_event_loop(GlobalState *state) {
     if (!state || !state->config) {
@@ -53,97 +250,110 @@ void run_event_loop(GlobalState *state) {
         return;
     }
 
-    node_sessions_init();
-
-    int server_fd = ipc_server_start(state);
-    if (server_fd < 0) {
-        log_error("Failed to start IPC server");
+    ReactorBackend backend = reactor_backend_parse(state->config->io_backend);
+    Reactor *front = reactor_create(backend);
+    if (!front) {
+        log_error("Failed to create front reactor");
         return;
     }
 
-    const int MAX_PFDS = 2 + MAX_SESSIONS + 5;
-    struct pollfd *pfds = calloc(MAX_PFDS, sizeof(struct pollfd));
-    if (!pfds) {
-        log_error("malloc pfds failed");
-        ipc_server_stop();
+    // results reach the CLI through the front reactor
+    cli_init(front);
+    placement_init(front);
+    // message types of their own, before the shards copy the handlers
+    relay_init();
+    schedule_init();
+    script_store_init();
+    shm_session_init();
+    if (shards_start(state, state->config->reactor_threads, backend, front) < 0) {
+        log_error("Failed to start reactor shards");
+        placement_shutdown();
+        cli_shutdown();
+        reactor_destroy(front);
         return;
     }
 
-    while (1) {
-        int nfds = 0;
-        pfds[nfds].fd = STDIN_FILENO;
-        pfds[nfds].events = POLLIN;
-        pfds[nfds].revents = 0;
-        nfds++;
+    // a new binary picks up the listeners and connections of the old one
+    UpgradeListeners inherited = { -1, -1 };
+    if (state->takeover && upgrade_takeover(front, state->config, &inherited) < 0) {
+        log_error("Takeover incomplete, starting with what was handed over");
+    }
 
-        pfds[nfds].fd = server_fd;
-        pfds[nfds].events = POLLIN;
-        pfds[nfds].revents = 0;
-        nfds++;
+    server_fd = inherited.tcp_fd >= 0 ? ipc_server_adopt(inherited.tcp_fd) : ipc_server_start(state);
+    if (server_fd < 0) {
+        log_error("Failed to start IPC server");
+        if (inherited.local_fd >= 0) close(inherited.local_fd);
+        admin_stop();
+        shards_stop();
+        relay_routes_clear();
+        placement_shutdown();
+        cli_shutdown();
+        reactor_destroy(front);
+        return;
+    }
+    front_reactor = front;
 
-        int filled = node_sessions_fill_pollfds(&pfds[nfds], MAX_PFDS - nfds);
-        nfds += filled;
+    // agents on this host can skip TCP; the hello and hand-off are the same
+    local_fd = inherited.local_fd;
+    // open to agents running as any user, like the TCP port
+    if (local_fd < 0 && state->config->local_socket[0]) {
+        local_fd = ipc_unix_listen(state->config->local_socket, 0666);
+    }
+    if (local_fd >= 0) reactor_watch_listener(front, local_fd, on_accept, NULL);
+    if (state->config->admin_socket[0] && admin_listen_fd() < 0 &&
+        admin_start(front, state->config->admin_socket) < 0) {
+        log_error("Admin socket disabled");
+    }
 
-        int timeout_ms = 1000;
-        int rc = poll(pfds, nfds, timeout_ms);
-        if (rc < 0) {
-            if (errno == EINTR) continue;
-            log_error("poll() error: %s", strerror(errno));
-            break;
-        }
+    // results of the jobs agents run by themselves land here
+    if (state->config->db_path[0] && !db_init(state->config->db_path)) {
+        log_error("Command store %s unavailable; scheduled results are dropped", state->config->db_path);
+    }
+    transfer_init(front, state->config);
+    cluster_init(front, state->config);
+    // after the cluster: nodes another controller owns are not dialed
+    if (dialer_init(front, state->config, on_accept) < 0) log_error("Dialing configured nodes disabled");
+    if (heartbeat_start(front, state->config) < 0) log_error("Heartbeats disabled");
+    if (config_reload_start(front, state) < 0) log_error("Config reload disabled");
+    ipc_reader_init(&stdin_rx);
+    reactor_watch_fd(front, STDIN_FILENO, REACTOR_READ, on_stdin, NULL);
+    reactor_watch_listener(front, server_fd, on_accept, NULL);
+    reactor_add_tick(front, HELLO_SWEEP_MS, expire_hellos, NULL);
+    UpgradeHooks hooks = { { server_fd, local_fd }, upgrade_pause, upgrade_idle, upgrade_done };
+    if (upgrade_init(front, state->config, &hooks) < 0) log_error("Upgrade socket disabled");
 
-        int idx = 0;
-        if (pfds[idx].revents & POLLIN) {
-            char *line = read_stdin_line();
-            if (line) {
-                parse_cli_command(line);
-                free(line);
-            } else {
-                log_info("stdin closed, shutting down");
-                break;
-            }
-        }
-        idx++;
-
-        if (pfds[idx].revents & POLLIN) {
-            int cfd = ipc_accept_connection(server_fd);
-            if (cfd >= 0) {
-                char *hello = ipc_recv_line(cfd, 2000);
-                if (!hello) {
-                    close(cfd);
-                    log_error("No hello from new connection, closed");
-                } else {
-                    Node meta = {0};
-                    if (parse_hello_message(hello, &meta) == 0) {
-                        node_session_add(&meta, cfd);
-                    } else {
-                        log_error("Invalid hello message: %s", hello);
-                        close(cfd);
-                    }
-                    free(hello);
-                }
-            }
-        }
-        idx++;
-
-        for (int p = idx; p < nfds; ++p) {
-            if (pfds[p].revents & (POLLIN | POLLPRI)) {
-                int fd = pfds[p].fd;
-                char *msg = ipc_recv_line(fd, 0);
-                if (!msg) {
-                    node_session_remove_by_fd(fd);
-                } else {
-                    handle_node_message(fd, msg, state);
-                    free(msg);
-                }
-            } else if (pfds[p].revents & (POLLHUP | POLLERR | POLLNVAL)) {
-                node_session_remove_by_fd(pfds[p].fd);
-            }
-        }
+    log_info("Front reactor running on %s", reactor_backend_name(front));
+    reactor_run(front);
 
+    while (pending_conns) {
+        reactor_stream_close(pending_conns->stream);
+        pending_remove(pending_conns);
     }
-
-    free(pfds);
-    node_sessions_cleanup();
+    upgrade_shutdown();
+    config_reload_stop();
+    heartbeat_stop();
+    transfer_shutdown();
+    placement_shutdown();
+    dialer_shutdown();
+    cluster_shutdown();
+    admin_stop();
+    if (local_fd >= 0) {
+        reactor_unwatch_fd(front, local_fd);
+        close(local_fd);
+        // after a hand-over the socket file is the new binary's
+        if (!upgrade_handed_over()) unlink(state->config->local_socket);
+        local_fd = -1;
+    }
+    shards_stop();
+    // after the shards: they store what scheduled jobs send
+    db_shutdown();
+    relay_routes_clear();
+    script_store_clear();
+    cli_shutdown();
+    ipc_reader_free(&stdin_rx);
+    reactor_unwatch_fd(front, server_fd);
+    reactor_destroy(front);
+    front_reactor = NULL;
     ipc_server_stop();
-}
\ No newline at end of file
+    server_fd = -1;
+}
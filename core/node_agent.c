@@ -2,16 +2,50 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../include/logging.h"
+#include "../include/agent_heartbeat.h"
+#include "../include/agent_push.h"
+#include "../include/agent_relay.h"
+#include "../include/agent_schedule.h"
+#include "../include/agent_scripts.h"
+#include "../include/agent_spool.h"
 #include "../include/ipc.h"
+#include "../include/arena.h"
+#include "../include/checksum.h"
+#include "../include/codec.h"
+#include "../include/dispatch.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/lanes.h"
+#include "../include/node_agent.h"
+#include "../include/node_manager.h"
+#include "../include/result_delta.h"
+#include "../include/shm_ring.h"
+
+// Where this agent last reached a controller: host:port, or the path of a
+// local socket. The run loop comes back here after losing the session.
+static char agent_home[256];
+static int agent_home_unix = 0;
+// set when controllers dial this agent (node_agent_await()); it then waits
+// here again instead of dialing out, for the same controllers
+static int agent_listen_fd = -1;
+static char agent_await_from[NODE_AGENT_MAX_CONTROLLERS * INET_ADDRSTRLEN];
+static char spool_path[256];
+static int spool_configured = 0;
+static char scripts_dir[256];
+static int scripts_configured = 0;
 
 int node_agent_connect(const char *controller_host, int controller_port) {
     if (!controller_host || controller_port <= 0) {
@@ -49,19 +83,73 @@ int node_agent_connect(const char *controller_host, int controller_port) {
     }
 
     log_info("Connected to controller %s:%d (fd=%d)", controller_host, controller_port, sock);
+    snprintf(agent_home, sizeof(agent_home), "%s:%d", controller_host, controller_port);
+    agent_home_unix = 0;
     return sock;
 }
 
-int node_agent_register(int sock, const char *node_name, const char *osstr) {
+int node_agent_connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("node_agent_connect_unix: invalid socket path");
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        log_error("socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("connect to %s failed: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    log_info("Connected to controller at %s (fd=%d)", path, sock);
+    snprintf(agent_home, sizeof(agent_home), "%s", path);
+    agent_home_unix = 1;
+    return sock;
+}
+
+// The os this agent registered with, for registering again elsewhere.
+static char agent_os[64] = "unknown";
+// UDP port the controller takes heartbeats on, from its ack; 0 if none
+static int agent_hb_port = 0;
+// whether the controller takes long messages in chunks (lanes.h)
+static int agent_chunked = 0;
+// whether it takes results as deltas (result_delta.h), and the last output
+// of each command sent to it
+static int agent_deltas = 0;
+static ResultBases agent_bases;
+// held by exec threads and the loop around the spool and agent_bases;
+// taken before send_lock
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+// whether it takes long output compressed (codec.h), and how fast the
+// socket has been taking big writes, in bytes per second (send_lock)
+static int agent_codec = 0;
+static double agent_link_rate = 0;
+
+// Sends the hello and waits for the reply. Returns 0 when registered, 1
+// with the new controller's host:port in redirect when this one says the
+// node belongs elsewhere, -1 on error.
+static int register_hello(int sock, const char *node_name, const char *osstr, char *redirect,
+                          size_t redirect_size) {
     if (sock < 0 || !node_name) {
         log_error("node_agent_register: invalid args");
         return -1;
     }
 
+    if (osstr && osstr != agent_os) snprintf(agent_os, sizeof(agent_os), "%s", osstr);
     char hello[1024];
     int n = snprintf(hello, sizeof(hello),
-                     "{\"type\":\"hello\",\"name\":\"%s\",\"os\":\"%s\",\"address\":\"%s\"}\n",
-                     node_name, osstr ? osstr : "unknown", "127.0.0.1");
+                     "{\"type\":\"hello\",\"name\":\"%s\",\"os\":\"%s\",\"address\":\"%s\",\"lanes\":1,"
+                     "\"codecs\":\"%s\"}\n",
+                     node_name, osstr ? osstr : "unknown", "127.0.0.1", CODEC_NAME);
     if (n < 0 || (size_t)n >= sizeof(hello)) {
         log_error("hello message truncated");
         return -1;
@@ -78,7 +166,20 @@ int node_agent_register(int sock, const char *node_name, const char *osstr) {
         return 0;
     }
 
-    if (strstr(reply, "\"type\":\"ack\"") && strstr(reply, "\"status\":\"ok\"")) {
+    JsonMsg m;
+    int parsed = json_msg_parse(&m, reply, strlen(reply)) == 0;
+    if (parsed && json_msg_str_eq(&m, "type", "redirect")) {
+        int rc = json_msg_copy(&m, "address", redirect, redirect_size) == 0 ? 1 : -1;
+        log_info("Controller redirects %s: %s", node_name, reply);
+        free(reply);
+        return rc;
+    }
+
+    if (parsed && json_msg_str_eq(&m, "type", "ack") && json_msg_str_eq(&m, "status", "ok")) {
+        agent_hb_port = (int)json_msg_int(&m, "heartbeat_port", 0);
+        agent_chunked = json_msg_int(&m, "lanes", 0) == 1;
+        agent_deltas = json_msg_int(&m, "deltas", 0) == 1;
+        agent_codec = json_msg_str_eq(&m, "codec", CODEC_NAME);
         free(reply);
         log_info("Registration acknowledged by controller");
         return 0;
@@ -89,28 +190,217 @@ int node_agent_register(int sock, const char *node_name, const char *osstr) {
     return 0;
 }
 
+int node_agent_register(int sock, const char *node_name, const char *osstr) {
+    char redirect[256];
+    int rc = register_hello(sock, node_name, osstr, redirect, sizeof(redirect));
+    if (rc == 1) {
+        log_error("%s belongs to the controller at %s; use node_agent_join()", node_name, redirect);
+        return -1;
+    }
+    return rc;
+}
+
+// Splits host:port. Returns -1 if address is not one.
+static int split_address(const char *address, char *host, size_t host_size, int *port) {
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || (size_t)(colon - address) >= host_size || atoi(colon + 1) <= 0) return -1;
+    snprintf(host, host_size, "%.*s", (int)(colon - address), address);
+    *port = atoi(colon + 1);
+    return 0;
+}
 
-char *execute_system_command_fork(const char *cmd, int *out_exitcode, char **out_stderr) {
-    if (!cmd) {
-        if (out_exitcode) *out_exitcode = 127;
-        if (out_stderr) *out_stderr = strdup("");
-        return strdup("");
+int node_agent_join(const char *controller_host, int controller_port, const char *node_name,
+                    const char *osstr) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", controller_host ? controller_host : "");
+    int port = controller_port;
+    for (int hop = 0; hop <= NODE_AGENT_MAX_REDIRECTS; ++hop) {
+        int sock = node_agent_connect(host, port);
+        if (sock < 0) return -1;
+        char redirect[256];
+        int rc = register_hello(sock, node_name, osstr, redirect, sizeof(redirect));
+        if (rc == 0) return sock;
+        close(sock);
+        if (rc < 0 || split_address(redirect, host, sizeof(host), &port) < 0) return -1;
+    }
+    log_error("Too many redirects registering %s", node_name);
+    return -1;
+}
+
+// Whether the IPv4 address peer is in the comma-separated list.
+static int await_allowed(const char *list, const struct in_addr *peer) {
+    char buf[sizeof(agent_await_from)];
+    snprintf(buf, sizeof(buf), "%s", list);
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        struct in_addr a;
+        if (inet_pton(AF_INET, tok, &a) == 1 && a.s_addr == peer->s_addr) return 1;
+    }
+    return 0;
+}
+
+int node_agent_await(int listen_fd, const char *controllers, const char *node_name, const char *osstr) {
+    if (listen_fd < 0 || !node_name || !controllers || !controllers[0] ||
+        strlen(controllers) >= sizeof(agent_await_from)) {
+        log_error("node_agent_await: invalid args");
+        return -1;
+    }
+    if (controllers != agent_await_from) snprintf(agent_await_from, sizeof(agent_await_from), "%s", controllers);
+    agent_listen_fd = listen_fd;
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int sock = accept(listen_fd, (struct sockaddr *)&peer, &peer_len);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            log_error("accept() failed: %s", strerror(errno));
+            return -1;
+        }
+        char host[INET_ADDRSTRLEN] = "?";
+        int ipv4 = peer_len >= sizeof(peer) && peer.sin_family == AF_INET;
+        if (ipv4) inet_ntop(AF_INET, &peer.sin_addr, host, sizeof(host));
+        if (!ipv4 || !await_allowed(agent_await_from, &peer.sin_addr)) {
+            log_error("Refused connection from %s:%d: not a controller of this node", host,
+                      ipv4 ? ntohs(peer.sin_port) : 0);
+            close(sock);
+            continue;
+        }
+        log_info("Controller %s:%d connected (fd=%d)", host, ntohs(peer.sin_port), sock);
+        char redirect[256];
+        int rc = register_hello(sock, node_name, osstr, redirect, sizeof(redirect));
+        if (rc == 0) {
+            snprintf(agent_home, sizeof(agent_home), "%s:%d", host, ntohs(peer.sin_port));
+            agent_home_unix = 0;
+            return sock;
+        }
+        close(sock);
+        char to[256];
+        int port = 0;
+        if (rc == 1 && split_address(redirect, to, sizeof(to), &port) == 0) {
+            sock = node_agent_join(to, port, node_name, osstr);
+            if (sock >= 0) return sock;
+        }
+        // one that went away before it heard the hello: wait for the next
+    }
+}
+
+
+// One output of a command, read as it comes.
+typedef struct {
+    int fd;             // -1 once it is closed
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t dropped;     // read past NODE_AGENT_MAX_OUTPUT
+} Capture;
+
+static void capture_init(Capture *c, int fd, Arena *arena, size_t initial) {
+    c->fd = fd;
+    c->len = 0;
+    c->dropped = 0;
+    c->buf = arena_alloc(arena, initial);
+    c->cap = c->buf ? initial : 0;
+    if (c->buf) c->buf[0] = '\0';
+}
+
+// Reads what is there; closes the fd at its end.
+static void capture_read(Capture *c, Arena *arena) {
+    ssize_t r = -1;
+    while (c->buf) {
+        // a full buffer still drains the pipe, or the command would block
+        char sink[4096];
+        int full = c->len + 1 >= c->cap;
+        r = full ? read(c->fd, sink, sizeof(sink)) : read(c->fd, c->buf + c->len, c->cap - c->len - 1);
+        if (r <= 0) break;
+        if (full) {
+            c->dropped += (size_t)r;
+            continue;
+        }
+        c->len += (size_t)r;
+        if (c->len + 256 >= c->cap && c->cap < NODE_AGENT_MAX_OUTPUT) {
+            char *n = arena_grow(arena, c->buf, c->cap, c->cap * 2);
+            if (n) {
+                c->buf = n;
+                c->cap *= 2;
+            }
+        }
+    }
+    if (c->buf) c->buf[c->len] = '\0';
+    if (!c->buf || r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void command_failed(CommandOutput *res, Arena *arena, const char *why) {
+    res->exit_code = 127;
+    res->status = EXEC_FINISHED;
+    res->dropped = 0;
+    res->out = arena_strndup(arena, "", 0);
+    res->out_len = 0;
+    res->err_len = strlen(why);
+    res->err = arena_strndup(arena, why, res->err_len);
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int execute_system_command_fork(const char *cmd, Arena *arena, CommandOutput *res) {
+    return execute_command_bounded(cmd, arena, res, NULL);
+}
+
+// How far stopping a command has got.
+typedef struct {
+    ExecStatus stop;
+    long long stop_at;
+    int killed;
+} ExecStopping;
+
+// Sends the group SIGTERM once the deadline passes or ctl says stop, and
+// SIGKILL if that was not enough. Returns 1 once the command is not worth
+// waiting for any longer.
+static int exec_enforce(pid_t pid, ExecControl *ctl, ExecStopping *st) {
+    if (!ctl) return 0;
+    long long now = monotonic_ms();
+    if (st->stop == EXEC_FINISHED) {
+        st->stop = (ExecStatus)__atomic_load_n(&ctl->stop, __ATOMIC_ACQUIRE);
+        if (st->stop == EXEC_FINISHED && ctl->deadline_ms && now >= ctl->deadline_ms) st->stop = EXEC_TIMED_OUT;
+        if (st->stop != EXEC_FINISHED) {
+            kill(-pid, SIGTERM);
+            st->stop_at = now;
+        }
+        return 0;
+    }
+    if (!st->killed && now - st->stop_at >= NODE_AGENT_KILL_GRACE_MS) {
+        kill(-pid, SIGKILL);
+        st->killed = 1;
+    }
+    return st->killed && now - st->stop_at >= 2 * NODE_AGENT_KILL_GRACE_MS;
+}
+
+// Runs cmd through /bin/sh in a process group of its own and captures
+// stdout/stderr into the arena.
+int execute_command_bounded(const char *cmd, Arena *arena, CommandOutput *res, ExecControl *ctl) {
+    if (!cmd || !arena || !res) {
+        if (res) command_failed(res, arena, "");
+        return -1;
     }
 
     int outpipe[2];
     int errpipe[2];
     if (pipe(outpipe) != 0) {
         log_error("pipe(out) failed: %s", strerror(errno));
-        if (out_exitcode) *out_exitcode = 127;
-        if (out_stderr) *out_stderr = strdup("pipe failed");
-        return strdup("");
+        command_failed(res, arena, "pipe failed");
+        return -1;
     }
     if (pipe(errpipe) != 0) {
         close(outpipe[0]); close(outpipe[1]);
         log_error("pipe(err) failed: %s", strerror(errno));
-        if (out_exitcode) *out_exitcode = 127;
-        if (out_stderr) *out_stderr = strdup("pipe failed");
-        return strdup("");
+        command_failed(res, arena, "pipe failed");
+        return -1;
     }
 
     pid_t pid = fork();
@@ -118,12 +408,13 @@ char *execute_system_command_fork(const char *cmd, int *out_exitcode, char **out
         close(outpipe[0]); close(outpipe[1]);
         close(errpipe[0]); close(errpipe[1]);
         log_error("fork() failed: %s", strerror(errno));
-        if (out_exitcode) *out_exitcode = 127;
-        if (out_stderr) *out_stderr = strdup("fork failed");
-        return strdup("");
+        command_failed(res, arena, "fork failed");
+        return -1;
     }
 
     if (pid == 0) {
+        // its own group, so a stop reaches everything it started
+        setpgid(0, 0);
         close(outpipe[0]);
         close(errpipe[0]);
 
@@ -136,112 +427,798 @@ char *execute_system_command_fork(const char *cmd, int *out_exitcode, char **out
         execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
 
         _exit(127);
+    }
+    // both sides set it, so it holds before either goes on
+    setpgid(pid, pid);
+
+    close(outpipe[1]);
+    close(errpipe[1]);
+    fcntl(outpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(errpipe[0], F_SETFL, O_NONBLOCK);
+
+    // both outputs at once: a command filling one pipe while the other is
+    // read would never finish
+    Capture cap[2];
+    capture_init(&cap[0], outpipe[0], arena, 4096);
+    capture_init(&cap[1], errpipe[0], arena, 1024);
+    ExecStopping st = { EXEC_FINISHED, 0, 0 };
+    int reaped = 0, status = 0;
+    // past SIGKILL, whatever still holds the pipes is outside the group
+    while ((cap[0].fd >= 0 || cap[1].fd >= 0) && !exec_enforce(pid, ctl, &st)) {
+        struct pollfd pfd[2];
+        int n = 0;
+        for (int i = 0; i < 2; ++i) {
+            if (cap[i].fd < 0) continue;
+            pfd[n].fd = cap[i].fd;
+            pfd[n].events = POLLIN;
+            pfd[n].revents = 0;
+            n++;
+        }
+        if (poll(pfd, (nfds_t)n, ctl ? NODE_AGENT_EXEC_TICK_MS : -1) < 0 && errno != EINTR) break;
+        for (int i = 0; i < 2; ++i) {
+            if (cap[i].fd >= 0) capture_read(&cap[i], arena);
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (cap[i].fd >= 0) close(cap[i].fd);
+    }
+    res->out = cap[0].buf ? cap[0].buf : "";
+    res->out_len = cap[0].buf ? cap[0].len : 0;
+    res->err = cap[1].buf ? cap[1].buf : "";
+    res->err_len = cap[1].buf ? cap[1].len : 0;
+    res->dropped = cap[0].dropped + cap[1].dropped;
+
+    // a command that closed its output may still be running; it has
+    // until its deadline like any other
+    while (!reaped) {
+        pid_t w = waitpid(pid, &status, ctl ? WNOHANG : 0);
+        if (w == pid) reaped = 1;
+        else if (w < 0 && errno != EINTR) break;
+        else if (w == 0 && exec_enforce(pid, ctl, &st)) break;
+        else if (w == 0) usleep(NODE_AGENT_EXEC_TICK_MS * 1000);
+    }
+    res->status = st.stop;
+    if (!reaped) {
+        log_error("Command pid %d did not die; leaving it behind", (int)pid);
+        res->exit_code = -1;
+    } else if (WIFEXITED(status)) {
+        res->exit_code = WEXITSTATUS(status);
+    } else if (st.stop != EXEC_FINISHED && WIFSIGNALED(status)) {
+        res->exit_code = 128 + WTERMSIG(status);
     } else {
-        close(outpipe[1]);
-        close(errpipe[1]);
+        res->exit_code = 127;
+    }
+    return 0;
+}
 
-        size_t out_cap = 4096;
-        size_t out_len = 0;
-        char *out_buf = malloc(out_cap);
-        if (!out_buf) {
-            out_buf = strdup("");
-        } else {
-            ssize_t r;
-            while ((r = read(outpipe[0], out_buf + out_len, out_cap - out_len - 1)) > 0) {
-                out_len += (size_t)r;
-                if (out_len + 256 >= out_cap) {
-                    out_cap *= 2;
-                    char *n = realloc(out_buf, out_cap);
-                    if (!n) break;
-                    out_buf = n;
-                }
+// room for the fields before the output; an id escapes to at most six
+// bytes a byte
+#define RESULT_HEAD_LEN (6 * NODE_AGENT_MAX_ID + 256)
+
+// Result messages are sized up front and both outputs escaped straight
+// into the destination: an arena buffer, or the shared ring itself.
+// out_field names the output and opens its string: "stdout":" or, for a
+// delta, its key fields ending in "delta":".
+// The id goes in escaped; head_size must allow RESULT_HEAD_LEN.
+static size_t result_message_len(const char *id, uint64_t seq, const CommandOutput *res, const char *out_field,
+                                 char *head, size_t head_size, size_t *head_len) {
+    // a command stopped early says so; its output is what it wrote by then
+    static const char *const status_fields[] = {
+        [EXEC_FINISHED] = "",
+        [EXEC_TIMED_OUT] = "\"status\":\"timeout\",",
+        [EXEC_CANCELLED] = "\"status\":\"cancelled\",",
+    };
+    // one that ran to its end but lost output says that instead
+    const char *status = res->status == EXEC_FINISHED && res->dropped ? "\"status\":\"truncated\","
+                                                                      : status_fields[res->status];
+    static const char start[] = "{\"type\":\"result\",\"id\":\"";
+    size_t n = sizeof(start) - 1;
+    memcpy(head, start, n);
+    n += json_escape_to(head + n, id, strlen(id));
+    n += (size_t)snprintf(head + n, head_size - n, "\",\"seq\":%llu,\"exit\":%d,%s%s", (unsigned long long)seq,
+                          res->exit_code, status, out_field);
+    *head_len = n;
+    return n + json_escaped_len(res->out, res->out_len) + (sizeof("\",\"stderr\":\"") - 1) +
+           json_escaped_len(res->err, res->err_len) + (sizeof("\"}") - 1);
+}
+
+static void write_result_message(char *o, const char *head, size_t head_len, const CommandOutput *res) {
+    static const char mid[] = "\",\"stderr\":\"";
+    static const char tail[] = "\"}";
+    memcpy(o, head, head_len); o += head_len;
+    o += json_escape_to(o, res->out, res->out_len);
+    memcpy(o, mid, sizeof(mid) - 1); o += sizeof(mid) - 1;
+    o += json_escape_to(o, res->err, res->err_len);
+    memcpy(o, tail, sizeof(tail) - 1);
+}
+
+// Called with send_lock held after a write of len bytes that started at
+// start. Only big writes tell anything about the link: they fill the
+// socket buffer and wait for it to drain.
+static void link_note(size_t len, const struct timespec *start) {
+    if (len < LANE_CHUNK / 2) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+    if (secs < 1e-6) secs = 1e-6;
+    double rate = (double)len / secs;
+    agent_link_rate = agent_link_rate > 0 ? agent_link_rate * 0.8 + rate * 0.2 : rate;
+}
+
+static void agent_doorbell(AgentConn *conn) {
+    ipc_send_full(conn->sock, "\n", 1);
+}
+
+// Messages for the socket that could not go out at once, by lane; a
+// writer thread sends them one unit at a time so that a long result does
+// not hold up the pongs and acks behind it. Lock order: send_lock, then
+// lanes_lock.
+static LaneQueue agent_lanes;
+static pthread_mutex_t lanes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lanes_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t lanes_thread;
+static int lanes_running = 0;
+static int lanes_stop = 0;
+
+static void *lanes_writer(void *arg) {
+    AgentConn *conn = arg;
+    while (1) {
+        pthread_mutex_lock(&lanes_lock);
+        while (!lanes_stop && lane_queue_empty(&agent_lanes)) pthread_cond_wait(&lanes_cond, &lanes_lock);
+        int stop = lanes_stop;
+        pthread_mutex_unlock(&lanes_lock);
+        if (stop) break;
+
+        LaneUnit u;
+        pthread_mutex_lock(&conn->send_lock);
+        pthread_mutex_lock(&lanes_lock);
+        int have = lane_queue_peek(&agent_lanes, agent_chunked, &u);
+        pthread_mutex_unlock(&lanes_lock);
+        if (have) {
+            // a message the socket loses here is still in the spool
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (conn->sock >= 0 && u.head_len == 0) {
+                ipc_send_full(conn->sock, u.body, u.body_len);
+            } else if (conn->sock >= 0) {
+                // a chunk line goes out in one piece
+                static char line[sizeof(u.head) + LANE_CHUNK];
+                memcpy(line, u.head, u.head_len);
+                memcpy(line + u.head_len, u.body, u.body_len);
+                ipc_send_full(conn->sock, line, u.head_len + u.body_len);
             }
-            out_buf[out_len] = '\0';
+            link_note(u.head_len + u.body_len, &start);
+            pthread_mutex_lock(&lanes_lock);
+            lane_queue_consume(&agent_lanes, &u);
+            pthread_mutex_unlock(&lanes_lock);
         }
-        close(outpipe[0]);
+        pthread_mutex_unlock(&conn->send_lock);
+    }
+    return NULL;
+}
 
-        size_t err_cap = 1024;
-        size_t err_len = 0;
-        char *err_buf = malloc(err_cap);
-        if (!err_buf) {
-            err_buf = strdup("");
-        } else {
-            ssize_t r;
-            while ((r = read(errpipe[0], err_buf + err_len, err_cap - err_len - 1)) > 0) {
-                err_len += (size_t)r;
-                if (err_len + 256 >= err_cap) {
-                    err_cap *= 2;
-                    char *n = realloc(err_buf, err_cap);
-                    if (!n) break;
-                    err_buf = n;
-                }
-            }
-            err_buf[err_len] = '\0';
+static void lanes_start(AgentConn *conn) {
+    lane_queue_init(&agent_lanes);
+    lanes_stop = 0;
+    if (pthread_create(&lanes_thread, NULL, lanes_writer, conn) != 0) {
+        log_error("Cannot start the lane writer; long results go out whole");
+        return;
+    }
+    lanes_running = 1;
+}
+
+static void lanes_finish(void) {
+    if (!lanes_running) return;
+    pthread_mutex_lock(&lanes_lock);
+    lanes_stop = 1;
+    pthread_cond_signal(&lanes_cond);
+    pthread_mutex_unlock(&lanes_lock);
+    pthread_join(lanes_thread, NULL);
+    lanes_running = 0;
+    lane_queue_clear(&agent_lanes);
+}
+
+// Called with send_lock held.
+static void send_on_socket(AgentConn *conn, const char *msg, size_t len) {
+    pthread_mutex_lock(&lanes_lock);
+    if (!lanes_running || (lane_queue_empty(&agent_lanes) && len <= LANE_CHUNK)) {
+        pthread_mutex_unlock(&lanes_lock);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ipc_send_full(conn->sock, msg, len);
+        ipc_send_full(conn->sock, "\n", 1);
+        link_note(len, &start);
+        return;
+    }
+    if (lane_queue_push(&agent_lanes, lane_classify(msg, len), msg, len) < 0) {
+        log_error("Cannot queue a %zu-byte message", len);
+    }
+    pthread_cond_signal(&lanes_cond);
+    pthread_mutex_unlock(&lanes_lock);
+}
+
+void node_agent_send(AgentConn *conn, const char *msg, size_t len) {
+    if (len > 0 && msg[len - 1] == '\n') len--;
+    pthread_mutex_lock(&conn->send_lock);
+    int rc = conn->shm ? shm_ring_write(&conn->shm->tx, msg, len) : -1;
+    if (rc == 1) agent_doorbell(conn);
+    if (rc < 0) send_on_socket(conn, msg, len);
+    pthread_mutex_unlock(&conn->send_lock);
+}
+
+void node_agent_send_spooled(AgentConn *conn, const char *key, const char *msg, size_t len) {
+    pthread_mutex_lock(&results_lock);
+    uint64_t seq = 0;
+    char *spooled = len > 1 ? agent_spool_reserve(key, len + 32, &seq) : NULL;
+    if (spooled) {
+        // {"seq":N, then the fields of msg
+        int n = snprintf(spooled, 32, "{\"seq\":%llu,", (unsigned long long)seq);
+        memcpy(spooled + n, msg + 1, len - 1);
+        agent_spool_commit((size_t)n + len - 1);
+        node_agent_send(conn, spooled, (size_t)n + len - 1);
+    }
+    pthread_mutex_unlock(&results_lock);
+    if (!spooled) node_agent_send(conn, msg, len);
+}
+
+// Sends res as a delta from the last output of the same command, if the
+// controller has that and the delta is shorter than limit. Returns -1
+// otherwise.
+static int send_result_delta(AgentConn *conn, Arena *arena, const char *id, uint64_t seq, uint64_t key,
+                             const CommandOutput *res, size_t limit) {
+    const ResultBase *base = result_bases_find(&agent_bases, key);
+    if (!base) return -1;
+    size_t delta_len = 0;
+    char *delta = result_delta_encode(base->text, base->len, res->out, res->out_len, limit, &delta_len);
+    if (!delta) return -1;
+    char out_field[128];
+    snprintf(out_field, sizeof(out_field), "\"key\":\"%016llx\",\"base\":\"%08x\",\"crc\":\"%08x\",\"delta\":\"",
+             (unsigned long long)key, base->crc, crc32c(0, res->out, res->out_len));
+    CommandOutput d = *res;
+    d.out = delta;
+    d.out_len = delta_len;
+    char head[RESULT_HEAD_LEN];
+    size_t head_len = 0;
+    size_t len = result_message_len(id, seq, &d, out_field, head, sizeof(head), &head_len);
+    char *msg = arena_alloc(arena, len);
+    if (msg) {
+        write_result_message(msg, head, head_len, &d);
+        node_agent_send(conn, msg, len);
+    }
+    free(delta);
+    return msg ? 0 : -1;
+}
+
+// 1 if the session runs over a local socket, where compressing costs
+// more than it saves.
+static int session_is_local(const AgentConn *conn) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    return conn->shm || (getsockname(conn->sock, (struct sockaddr *)&addr, &addr_len) == 0 &&
+                         addr.ss_family == AF_UNIX);
+}
+
+// The command running the cached script an exec names (scripts.h). Returns
+// 1 if the script is not cached and the controller was asked for it, -1 if
+// the body it sent does not match or cannot be cached.
+static int script_command(const MsgContext *ctx, const char *id, char **cmd) {
+    char hash[SHA256_HEX_LEN + 1];
+    char path[512];
+    size_t args_len = 0, body_len = 0;
+    if (json_msg_copy(ctx->msg, "script", hash, sizeof(hash)) < 0) return -1;
+    char *args = json_msg_str(ctx->msg, "args", ctx->arena, &args_len);
+    char *body = json_msg_str(ctx->msg, "body", ctx->arena, &body_len);
+    if (body) {
+        if (agent_scripts_store(hash, body, body_len, path, sizeof(path)) < 0) return -1;
+    } else if (agent_scripts_lookup(hash, path, sizeof(path)) < 0) {
+        char *escaped_args = json_escape(args ? args : "");
+        size_t size = strlen(id) + (escaped_args ? strlen(escaped_args) : 0) + SHA256_HEX_LEN + 64;
+        char *miss = arena_alloc(ctx->arena, size);
+        if (miss && escaped_args) {
+            int n = snprintf(miss, size, "{\"type\":\"script_miss\",\"id\":\"%s\",\"script\":\"%s\",\"args\":\"%s\"}",
+                             id, hash, escaped_args);
+            node_agent_send(ctx->conn, miss, (size_t)n);
         }
-        close(errpipe[0]);
+        free(escaped_args);
+        return 1;
+    }
+    size_t size = strlen(path) + args_len + 16;
+    *cmd = arena_alloc(ctx->arena, size);
+    if (!*cmd) return -1;
+    snprintf(*cmd, size, "/bin/sh '%s' %s", path, args ? args : "");
+    return 0;
+}
+
+// The longest message the controller takes from this agent.
+static size_t result_limit(void) {
+    return agent_chunked ? MAX_CHUNKED_MSG_LEN : MAX_MSG_LEN;
+}
 
-        int status = 0;
-        waitpid(pid, &status, 0);
-        if (out_exitcode) {
-            if (WIFEXITED(status)) *out_exitcode = WEXITSTATUS(status);
-            else *out_exitcode = 127;
+// The longest prefix of s whose escaped form fits in room, not ending
+// inside a UTF-8 sequence.
+static size_t prefix_fitting(const char *s, size_t len, size_t room) {
+    // escaping never shortens, so the answer is at most room
+    size_t lo = 0, hi = len < room ? len : room;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (json_escaped_len(s, mid) <= room) lo = mid;
+        else hi = mid - 1;
+    }
+    while (lo > 0 && lo < len && ((unsigned char)s[lo] & 0xC0) == 0x80) lo--;
+    return lo;
+}
+
+// Cuts res so its result message stays under limit: stderr keeps up to a
+// quarter of the room, stdout the rest. A message the controller cannot
+// take would end the session, and come back from the spool every time.
+static void fit_result(CommandOutput *res, size_t limit) {
+    // head, seq, key and length fields, closing quotes
+    size_t room = limit - 1024;
+    size_t out_esc = json_escaped_len(res->out, res->out_len);
+    size_t err_esc = json_escaped_len(res->err, res->err_len);
+    if (out_esc + err_esc <= room) return;
+    size_t err_keep = prefix_fitting(res->err, res->err_len, err_esc < room / 4 ? err_esc : room / 4);
+    size_t out_keep = prefix_fitting(res->out, res->out_len, room - json_escaped_len(res->err, err_keep));
+    res->dropped += (res->out_len - out_keep) + (res->err_len - err_keep);
+    res->out_len = out_keep;
+    res->err_len = err_keep;
+}
+
+// Sends the result of the exec id, which ran cmd (NULL if it never ran).
+static void send_exec_result(AgentConn *conn, Arena *arena, const char *id, const char *cmd,
+                             const CommandOutput *full) {
+    CommandOutput fitted = *full;
+    fit_result(&fitted, result_limit());
+    const CommandOutput *res = &fitted;
+    if (res->dropped) log_info("Result of %s truncated, %zu bytes of output left out", id, res->dropped);
+    // the controller keeps the last output of a command to take deltas on
+    uint64_t key = agent_deltas && cmd ? result_delta_key(cmd) : 0;
+    char key_field[40] = "";
+    if (key) snprintf(key_field, sizeof(key_field), "\"key\":\"%016llx\",", (unsigned long long)key);
+    char out_field[128];
+    snprintf(out_field, sizeof(out_field), "%s\"stdout\":\"", key_field);
+    // long output crosses a network link compressed; what goes out and
+    // into the spool is sent, the bases keep the text itself
+    CommandOutput sent = *res;
+    size_t delta_limit = res->out_len / 2 + 1;
+    char *packed = NULL;
+    if (agent_codec && res->out_len >= CODEC_MIN_LEN && res->out_len <= CODEC_MAX_RAW && !session_is_local(conn)) {
+        pthread_mutex_lock(&conn->send_lock);
+        int level = codec_level(agent_link_rate);
+        pthread_mutex_unlock(&conn->send_lock);
+        size_t packed_len = 0;
+        packed = codec_pack(res->out, res->out_len, level, &packed_len);
+        if (packed && packed_len < res->out_len) {
+            snprintf(out_field, sizeof(out_field), "%s\"stdout_len\":%zu,\"stdout_z\":\"", key_field, res->out_len);
+            sent.out = packed;
+            sent.out_len = packed_len;
+            if (packed_len < delta_limit) delta_limit = packed_len;
         }
+    }
 
-        if (out_stderr) *out_stderr = err_buf;
-        else free(err_buf);
-
-        if (!out_buf) return strdup("");
-        return out_buf;
-    }
-}
-
-static char *escape_json_string(const char *in) {
-    if (!in) return strdup("");
-    size_t len = strlen(in);
-    size_t cap = len * 2 + 16;
-    char *out = malloc(cap);
-    if (!out) return strdup("");
-    size_t o = 0;
-    for (size_t i = 0; i < len; ++i) {
-        char c = in[i];
-        if (c == '"') {
-            if (o + 2 >= cap) { cap *= 2; out = realloc(out, cap); if (!out) return strdup(""); }
-            out[o++] = '\\'; out[o++] = '"';
-        } else if (c == '\\') {
-            if (o + 2 >= cap) { cap *= 2; out = realloc(out, cap); if (!out) return strdup(""); }
-            out[o++] = '\\'; out[o++] = '\\';
-        } else if (c == '\n') {
-            if (o + 2 >= cap) { cap *= 2; out = realloc(out, cap); if (!out) return strdup(""); }
-            out[o++] = '\\'; out[o++] = 'n';
-        } else {
-            if (o + 1 >= cap) { cap *= 2; out = realloc(out, cap); if (!out) return strdup(""); }
-            out[o++] = c;
+    // kept in the spool until the controller acks it; the controller may
+    // be gone by now, or go away before the message is out. Results go out
+    // in the order their bases are taken.
+    pthread_mutex_lock(&results_lock);
+    char head[RESULT_HEAD_LEN];
+    size_t head_len = 0;
+    uint64_t seq = 0;
+    size_t resp_len = result_message_len(id, 0, &sent, out_field, head, sizeof(head), &head_len);
+    // the sequence number is only known once there is room; allow its digits
+    char *spooled = agent_spool_reserve(id, resp_len + 20, &seq);
+    if (spooled) {
+        resp_len = result_message_len(id, seq, &sent, out_field, head, sizeof(head), &head_len);
+        write_result_message(spooled, head, head_len, &sent);
+        agent_spool_commit(resp_len);
+        // the spool keeps the whole result for a controller that lacks the base
+        if (!key || send_result_delta(conn, arena, id, seq, key, res, delta_limit) < 0) {
+            node_agent_send(conn, spooled, resp_len);
+        }
+        if (key) result_bases_put(&agent_bases, key, res->out, res->out_len);
+        pthread_mutex_unlock(&results_lock);
+        free(packed);
+        return;
+    }
+    if (key) result_bases_put(&agent_bases, key, res->out, res->out_len);
+
+    pthread_mutex_lock(&conn->send_lock);
+    char *dst = conn->shm ? shm_ring_reserve(&conn->shm->tx, resp_len) : NULL;
+    if (dst) {
+        // escaped straight into shared memory: the only copy of the output
+        write_result_message(dst, head, head_len, &sent);
+        if (shm_ring_commit(&conn->shm->tx) == 1) agent_doorbell(conn);
+        pthread_mutex_unlock(&conn->send_lock);
+        pthread_mutex_unlock(&results_lock);
+        free(packed);
+        return;
+    }
+
+    char *resp = arena_alloc(arena, resp_len);
+    if (resp) {
+        write_result_message(resp, head, head_len, &sent);
+        send_on_socket(conn, resp, resp_len);
+    } else {
+        log_error("Failed to allocate response buffer");
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    pthread_mutex_unlock(&results_lock);
+    free(packed);
+}
+
+// --- execs ---
+
+typedef struct ExecRun {
+    struct ExecRun *next;
+    AgentConn *conn;
+    char id[NODE_AGENT_MAX_ID + 1];
+    ExecControl ctl;
+    char cmd[];
+} ExecRun;
+
+static ExecRun *execs = NULL;
+static int exec_count = 0;
+static pthread_mutex_t execs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t execs_cond = PTHREAD_COND_INITIALIZER;
+
+static void *exec_thread(void *arg) {
+    ExecRun *run = arg;
+    Arena arena;
+    arena_init(&arena, 64 * 1024);
+    CommandOutput res;
+    execute_command_bounded(run->cmd, &arena, &res, &run->ctl);
+    if (res.status != EXEC_FINISHED) {
+        log_info("Command %s %s after %zu bytes of output", run->id,
+                 res.status == EXEC_TIMED_OUT ? "timed out" : "cancelled", res.out_len + res.err_len);
+    }
+    send_exec_result(run->conn, &arena, run->id, run->cmd, &res);
+    arena_destroy(&arena);
+
+    pthread_mutex_lock(&execs_lock);
+    for (ExecRun **p = &execs; *p; p = &(*p)->next) {
+        if (*p == run) {
+            *p = run->next;
+            break;
         }
     }
-    out[o] = '\0';
-    return out;
+    exec_count--;
+    pthread_cond_broadcast(&execs_cond);
+    pthread_mutex_unlock(&execs_lock);
+    free(run);
+    return NULL;
+}
+
+// Starts cmd on a thread of its own; deadline_ms is relative, 0 for none.
+static void exec_start(AgentConn *conn, const char *id, const char *cmd, long deadline_ms) {
+    size_t len = strlen(cmd);
+    ExecRun *run = calloc(1, sizeof(ExecRun) + len + 1);
+    if (!run) {
+        log_error("Out of memory starting exec %s", id);
+        return;
+    }
+    run->conn = conn;
+    snprintf(run->id, sizeof(run->id), "%s", id);
+    run->ctl.deadline_ms = deadline_ms > 0 ? monotonic_ms() + deadline_ms : 0;
+    memcpy(run->cmd, cmd, len + 1);
+
+    pthread_mutex_lock(&execs_lock);
+    while (exec_count >= NODE_AGENT_MAX_EXECS) pthread_cond_wait(&execs_cond, &execs_lock);
+    run->next = execs;
+    execs = run;
+    exec_count++;
+    pthread_mutex_unlock(&execs_lock);
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&t, &attr, exec_thread, run);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        log_error("No thread for exec %s (%s); running it in the loop", id, strerror(rc));
+        exec_thread(run);
+    }
+}
+
+// Stops every exec with id. Returns how many there were.
+static int exec_stop(const char *id, ExecStatus why) {
+    int n = 0;
+    pthread_mutex_lock(&execs_lock);
+    for (ExecRun *run = execs; run; run = run->next) {
+        if (id && strcmp(run->id, id) != 0) continue;
+        __atomic_store_n(&run->ctl.stop, (int)why, __ATOMIC_RELEASE);
+        n++;
+    }
+    pthread_mutex_unlock(&execs_lock);
+    return n;
+}
+
+// Stops all execs and waits for their threads, which send through conn.
+static void exec_finish_all(void) {
+    exec_stop(NULL, EXEC_CANCELLED);
+    pthread_mutex_lock(&execs_lock);
+    while (exec_count > 0) pthread_cond_wait(&execs_cond, &execs_lock);
+    pthread_mutex_unlock(&execs_lock);
+}
+
+static void on_exec(const MsgContext *ctx, void *user) {
+    (void)user;
+    AgentConn *conn = ctx->conn;
+    size_t id_len = 0;
+    char *id = json_msg_str(ctx->msg, "id", ctx->arena, &id_len);
+    int script = json_msg_field(ctx->msg, "script") != NULL;
+    char *cmd = script ? NULL : json_msg_str(ctx->msg, "cmd", ctx->arena, NULL);
+    if (!id || (!cmd && !script)) {
+        log_error("exec missing id or cmd");
+        return;
+    }
+    if (id_len > NODE_AGENT_MAX_ID) {
+        log_error("exec id of %zu bytes refused, the limit is %d", id_len, NODE_AGENT_MAX_ID);
+        return;
+    }
+    // addressed to nodes below this one, not to it
+    if (json_msg_field(ctx->msg, "select")) {
+        if (agent_relay_forward(ctx->msg, ctx->arena) < 0) log_error("exec %s for other nodes, not a relay", id);
+        return;
+    }
+
+    int rc = script ? script_command(ctx, id, &cmd) : 0;
+    if (rc == 1) return;
+    if (rc < 0) {
+        CommandOutput res;
+        command_failed(&res, ctx->arena, "script does not match its hash or cannot be cached");
+        send_exec_result(conn, ctx->arena, id, NULL, &res);
+        return;
+    }
+    exec_start(conn, id, cmd, json_msg_int(ctx->msg, "deadline_ms", 0));
+}
+
+// Stops a running exec; its result goes out as it would on a deadline.
+static void on_cancel(const MsgContext *ctx, void *user) {
+    (void)user;
+    size_t id_len = 0;
+    char *id = json_msg_str(ctx->msg, "id", ctx->arena, &id_len);
+    if (!id) {
+        log_error("cancel without an id");
+        return;
+    }
+    // a cut id could match another request's
+    if (id_len > NODE_AGENT_MAX_ID) {
+        log_error("cancel id of %zu bytes refused, the limit is %d", id_len, NODE_AGENT_MAX_ID);
+        return;
+    }
+    int n = exec_stop(id, EXEC_CANCELLED);
+    if (n > 0) log_info("Cancelling %d command(s) of %s", n, id);
+    // nodes below a relay may run it too
+    agent_relay_cancel(id);
+}
+
+static void on_ping(const MsgContext *ctx, void *user) {
+    (void)user;
+    AgentConn *conn = ctx->conn;
+    static const char pong[] = "{\"type\":\"pong\"}";
+    node_agent_send(conn, pong, sizeof(pong) - 1);
+}
+
+static void on_shm_ready(const MsgContext *ctx, void *user) {
+    (void)user;
+    AgentConn *conn = ctx->conn;
+    if (conn->passed_fd < 0) {
+        log_error("shm_ready without a shared memory fd");
+        return;
+    }
+    pthread_mutex_lock(&conn->send_lock);
+    if (!conn->shm) conn->shm = shm_channel_attach(conn->passed_fd, SHM_SIDE_AGENT);
+    pthread_mutex_unlock(&conn->send_lock);
+    close(conn->passed_fd);
+    conn->passed_fd = -1;
+    if (conn->shm) log_info("Using shared-memory rings to the controller");
+}
+
+static void on_shm_declined(const MsgContext *ctx, void *user) {
+    (void)ctx;
+    (void)user;
+    log_info("Controller declined shared-memory rings; staying on the socket");
+}
+
+// The controller hands this node to another one; the run loop moves the
+// session once the current batch of messages is handled.
+static void on_redirect(const MsgContext *ctx, void *user) {
+    (void)user;
+    AgentConn *conn = ctx->conn;
+    if (json_msg_copy(ctx->msg, "address", conn->redirect, sizeof(conn->redirect)) < 0) {
+        conn->redirect[0] = '\0';
+        log_error("Redirect without an address");
+    }
+}
+
+static void on_unknown(const MsgContext *ctx, void *user) {
+    (void)user;
+    const JsonField *type = json_msg_field(ctx->msg, "type");
+    log_info("Unknown message type from controller: %.*s", (int)type->val_len, type->val);
+}
+
+// The controller has the result; its spool record can go.
+static void on_result_ack(const MsgContext *ctx, void *user) {
+    (void)user;
+    long seq = json_msg_int(ctx->msg, "seq", 0);
+    if (seq <= 0) return;
+    pthread_mutex_lock(&results_lock);
+    agent_spool_ack((uint64_t)seq);
+    pthread_mutex_unlock(&results_lock);
+}
+
+// The controller could not rebuild a delta; the spool has the whole result.
+static void send_spooled(const char *msg, size_t len, void *arg);
+
+static void on_result_resend(const MsgContext *ctx, void *user) {
+    (void)user;
+    long seq = json_msg_int(ctx->msg, "seq", 0);
+    pthread_mutex_lock(&results_lock);
+    int rc = seq > 0 ? agent_spool_resend((uint64_t)seq, send_spooled, ctx->conn) : -1;
+    pthread_mutex_unlock(&results_lock);
+    if (rc < 0) {
+        log_error("Controller asked for result seq %ld, which is no longer spooled", seq);
+    }
+}
+
+static Dispatcher agent_dispatcher;
+static int agent_dispatcher_ready = 0;
+
+Dispatcher *node_agent_dispatcher(void) {
+    if (!agent_dispatcher_ready) {
+        dispatcher_init(&agent_dispatcher, "agent");
+        dispatcher_register(&agent_dispatcher, "exec", on_exec, NULL);
+        dispatcher_register(&agent_dispatcher, "cancel", on_cancel, NULL);
+        dispatcher_register(&agent_dispatcher, "ping", on_ping, NULL);
+        dispatcher_register(&agent_dispatcher, "shm_ready", on_shm_ready, NULL);
+        dispatcher_register(&agent_dispatcher, "shm_declined", on_shm_declined, NULL);
+        dispatcher_register(&agent_dispatcher, "redirect", on_redirect, NULL);
+        dispatcher_register(&agent_dispatcher, "result_ack", on_result_ack, NULL);
+        dispatcher_register(&agent_dispatcher, "result_resend", on_result_resend, NULL);
+        agent_push_register(&agent_dispatcher);
+        agent_schedule_register(&agent_dispatcher);
+        dispatcher_set_fallback(&agent_dispatcher, on_unknown, NULL);
+        agent_dispatcher_ready = 1;
+    }
+    return &agent_dispatcher;
+}
+
+// Registers with the controller conn->redirect names and swaps the session
+// over to it. Returns -1 if that fails.
+static int agent_rejoin(AgentConn *conn, IpcReader *rx) {
+    char host[256];
+    int port = 0;
+    int rc = split_address(conn->redirect, host, sizeof(host), &port);
+    conn->redirect[0] = '\0';
+    int sock = rc == 0 ? node_agent_join(host, port, conn->name, agent_os) : -1;
+    if (sock < 0) {
+        log_error("Could not move to the controller the session was redirected to");
+        return -1;
+    }
+    pthread_mutex_lock(&conn->send_lock);
+    close(conn->sock);
+    conn->sock = sock;
+    shm_channel_close(conn->shm);
+    conn->shm = NULL;
+    pthread_mutex_lock(&lanes_lock);
+    lane_queue_clear(&agent_lanes);
+    pthread_mutex_unlock(&lanes_lock);
+    pthread_mutex_unlock(&conn->send_lock);
+    // nothing more comes from the old controller
+    ipc_reader_free(rx);
+    ipc_reader_init(rx);
+    agent_relay_resync();
+    log_info("Session moved to %s:%d (fd=%d)", host, port, sock);
+    return 0;
+}
+
+void node_agent_set_spool(const char *path) {
+    snprintf(spool_path, sizeof(spool_path), "%s", path ? path : "");
+    spool_configured = 1;
+}
+
+void node_agent_set_script_cache(const char *dir) {
+    snprintf(scripts_dir, sizeof(scripts_dir), "%s", dir ? dir : "");
+    scripts_configured = 1;
+}
+
+static void send_spooled(const char *msg, size_t len, void *arg) {
+    node_agent_send(arg, msg, len);
+}
+
+// What every session starts with: a controller on the same host can take
+// results through shared memory, and results it never acked go out again.
+static void agent_session_start(AgentConn *conn) {
+    // a new controller, or one that has lost the bases of earlier results
+    pthread_mutex_lock(&results_lock);
+    result_bases_forget(&agent_bases);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(conn->sock, (struct sockaddr *)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX) {
+        static const char req[] = "{\"type\":\"shm_request\"}\n";
+        ipc_send_full(conn->sock, req, sizeof(req) - 1);
+    }
+    int sent = agent_spool_replay(result_limit(), send_spooled, conn);
+    pthread_mutex_unlock(&results_lock);
+    if (sent > 0) log_info("Sent %d spooled result(s) again", sent);
+    agent_schedule_resync();
+
+    // heartbeats go to the same host, or this one for a local socket
+    struct sockaddr_in hb_addr;
+    memset(&hb_addr, 0, sizeof(hb_addr));
+    hb_addr.sin_family = AF_INET;
+    hb_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_len = sizeof(addr);
+    if (getpeername(conn->sock, (struct sockaddr *)&addr, &addr_len) == 0 && addr.ss_family == AF_INET) {
+        hb_addr.sin_addr = ((struct sockaddr_in *)&addr)->sin_addr;
+    }
+    hb_addr.sin_port = htons((uint16_t)agent_hb_port);
+    agent_heartbeat_target(conn->name, agent_hb_port > 0 ? &hb_addr : NULL);
 }
 
-static char *json_get_str(const char *json, const char *key) {
-    if (!json || !key) return NULL;
-    char needle[128];
-    snprintf(needle, sizeof(needle), "\"%s\"", key);
-    char *pos = strstr(json, needle);
-    if (!pos) return NULL;
-    char *colon = strchr(pos, ':');
-    if (!colon) return NULL;
-    char *firstq = strchr(colon, '\"');
-    if (!firstq) return NULL;
-    char *secondq = strchr(firstq + 1, '\"');
-    if (!secondq) return NULL;
-    size_t n = (size_t)(secondq - (firstq + 1));
-    char *out = malloc(n + 1);
-    if (!out) return NULL;
-    memcpy(out, firstq + 1, n);
-    out[n] = '\0';
-    return out;
+// Dials agent_home and registers there again, or waits for a controller to
+// dial in if that is how this agent is reached.
+static int agent_dial_home(const char *node_name) {
+    if (agent_listen_fd >= 0) return node_agent_await(agent_listen_fd, agent_await_from, node_name, agent_os);
+    if (!agent_home_unix) {
+        char host[256];
+        int port = 0;
+        if (split_address(agent_home, host, sizeof(host), &port) < 0) return -1;
+        return node_agent_join(host, port, node_name, agent_os);
+    }
+    int sock = node_agent_connect_unix(agent_home);
+    if (sock >= 0 && node_agent_register(sock, node_name, agent_os) < 0) {
+        close(sock);
+        sock = -1;
+    }
+    return sock;
 }
 
+// The controller went away: drops the session and dials the last
+// controller until it answers, waiting a decorrelated-jitter backoff
+// between attempts so a restarted controller is not hit by every agent at
+// once. Results finished meanwhile wait in the spool.
+static void agent_reconnect(AgentConn *conn, IpcReader *rx) {
+    agent_heartbeat_target(NULL, NULL);
+    pthread_mutex_lock(&conn->send_lock);
+    close(conn->sock);
+    conn->sock = -1;
+    shm_channel_close(conn->shm);
+    conn->shm = NULL;
+    // half-sent messages mean nothing to the next controller
+    pthread_mutex_lock(&lanes_lock);
+    lane_queue_clear(&agent_lanes);
+    pthread_mutex_unlock(&lanes_lock);
+    pthread_mutex_unlock(&conn->send_lock);
+    if (conn->passed_fd >= 0) close(conn->passed_fd);
+    conn->passed_fd = -1;
+    ipc_reader_free(rx);
+    ipc_reader_init(rx);
+
+    unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    long wait_ms = NODE_AGENT_BACKOFF_BASE_MS;
+    int sock = -1;
+    for (int attempt = 1; sock < 0; ++attempt) {
+        // a controller that dials in is waited for at once
+        if (agent_listen_fd < 0 || attempt > 1) {
+            long hi = wait_ms * 3;
+            wait_ms = NODE_AGENT_BACKOFF_BASE_MS + rand_r(&seed) % (hi - NODE_AGENT_BACKOFF_BASE_MS + 1);
+            if (wait_ms > NODE_AGENT_BACKOFF_CAP_MS) wait_ms = NODE_AGENT_BACKOFF_CAP_MS;
+            log_info("Reconnecting to %s in %ld ms (attempt %d)", agent_home, wait_ms, attempt);
+            usleep((useconds_t)wait_ms * 1000);
+        } else {
+            log_info("Waiting for a controller to connect");
+        }
+        sock = agent_dial_home(conn->name);
+    }
+
+    pthread_mutex_lock(&conn->send_lock);
+    conn->sock = sock;
+    pthread_mutex_unlock(&conn->send_lock);
+    agent_relay_resync();
+    agent_session_start(conn);
+    log_info("Session to %s restored (fd=%d)", agent_home, sock);
+}
 
 void node_agent_run_loop(int sock, const char *node_name) {
     if (sock < 0) {
@@ -251,72 +1228,91 @@ void node_agent_run_loop(int sock, const char *node_name) {
 
     log_info("Node agent [%s] entering run loop (fd=%d)", node_name ? node_name : "<anon>", sock);
 
+    Dispatcher *d = node_agent_dispatcher();
+    AgentConn conn = { sock, node_name, NULL, -1, PTHREAD_MUTEX_INITIALIZER, "" };
+    IpcReader rx;
+    ipc_reader_init(&rx);
+    LaneReassembly chunks;
+    lane_reassembly_init(&chunks);
+    // per-request scratch: ids, command text, captured output and the
+    // response all live here and are dropped together after each message
+    Arena req_arena;
+    arena_init(&req_arena, 64 * 1024);
+
+    if (!spool_configured) {
+        snprintf(spool_path, sizeof(spool_path), "./simos-%s.spool", node_name ? node_name : "agent");
+    }
+    agent_spool_open(spool_path);
+    if (!scripts_configured) {
+        snprintf(scripts_dir, sizeof(scripts_dir), "./simos-%s.scripts", node_name ? node_name : "agent");
+    }
+    agent_scripts_open(scripts_dir);
+    lanes_start(&conn);
+    agent_schedule_start(&conn);
+    agent_session_start(&conn);
+    agent_relay_start(&conn);
+
     while (1) {
-        char *msg = ipc_recv_line(sock, -1);
-        if (!msg) {
-            log_info("Controller closed connection or recv error; exiting run loop");
-            break;
+        if (conn.redirect[0]) {
+            if (agent_rejoin(&conn, &rx) < 0) break;
+            lane_reassembly_free(&chunks);
+            agent_session_start(&conn);
+            sock = conn.sock;
+        }
+        if (conn.shm) {
+            size_t len = 0;
+            int corrupt = 0;
+            const char *msg;
+            while (!conn.redirect[0] && (msg = shm_ring_peek(&conn.shm->rx, &len, &corrupt)) != NULL) {
+                if (len > 0 && dispatcher_dispatch(d, msg, len, &req_arena, &conn) < 0) {
+                    log_error("Malformed message (no type): %s", msg);
+                }
+                shm_ring_consume(&conn.shm->rx);
+            }
+            if (corrupt) {
+                log_error("Corrupt shared ring; exiting run loop");
+                break;
+            }
+            if (conn.redirect[0]) continue;
+            // block on the socket only once the controller will ring it
+            if (!shm_ring_prepare_wait(&conn.shm->rx)) continue;
         }
 
-        char *type = json_get_str(msg, "type");
-        if (!type) {
-            log_error("Malformed message (no type): %s", msg);
-            free(msg);
+        ssize_t r = ipc_reader_fill_fd(&rx, sock, &conn.passed_fd);
+        if (r == 0 || r == -1) {
+            log_info("Controller closed connection or recv error");
+            agent_reconnect(&conn, &rx);
+            lane_reassembly_free(&chunks);
+            sock = conn.sock;
             continue;
         }
 
-        if (strcmp(type, "exec") == 0) {
-            char *id = json_get_str(msg, "id");
-            char *cmd = json_get_str(msg, "cmd");
-            if (!id || !cmd) {
-                log_error("exec missing id or cmd");
-                free(id); free(cmd); free(type); free(msg);
-                continue;
+        size_t len = 0;
+        char *msg;
+        while (!conn.redirect[0] && (msg = ipc_reader_next_line(&rx, &len)) != NULL) {
+            if (len == 0) continue;
+            int whole = lane_reassembly_feed(&chunks, msg, len, MAX_MSG_LEN, &msg, &len);
+            if (whole < 0) log_error("Dropped a malformed or oversized chunked message");
+            if (whole <= 0) continue;
+            if (dispatcher_dispatch(d, msg, len, &req_arena, &conn) < 0) {
+                log_error("Malformed message (no type): %s", msg);
             }
-
-            int exitcode = -1;
-            char *stderr_out = NULL;
-            char *stdout_out = execute_system_command_fork(cmd, &exitcode, &stderr_out);
-            if (!stdout_out) stdout_out = strdup("");
-
-            char *esc_out = escape_json_string(stdout_out);
-            char *esc_err = escape_json_string(stderr_out ? stderr_out : "");
-
-            size_t resp_cap = strlen(esc_out) + strlen(esc_err) + strlen(id) + 256;
-            char *resp = malloc(resp_cap);
-            if (resp) {
-                snprintf(resp, resp_cap,
-                         "{\"type\":\"result\",\"id\":\"%s\",\"exit\":%d,\"stdout\":\"%s\",\"stderr\":\"%s\"}\n",
-                         id, exitcode, esc_out, esc_err);
-                ipc_send_full(sock, resp, strlen(resp));
-                free(resp);
-            } else {
-                log_error("Failed to allocate response buffer");
-            }
-
-            free(esc_out);
-            free(esc_err);
-            free(stdout_out);
-            if (stderr_out) free(stderr_out);
-            free(id);
-            free(cmd);
-            free(type);
-            free(msg);
-            continue;
-        } else if (strcmp(type, "ping") == 0) {
-            const char *pong = "{\"type\":\"pong\"}\n";
-            ipc_send_full(sock, pong, strlen(pong));
-            free(type);
-            free(msg);
-            continue;
-        } else {
-            log_info("Unknown message type from controller: %s", type);
-            free(type);
-            free(msg);
-            continue;
         }
     }
 
-    close(sock);
+    // the relay and exec threads send through conn until they are stopped
+    exec_finish_all();
+    agent_relay_stop();
+    agent_schedule_stop();
+    agent_heartbeat_stop();
+    lanes_finish();
+    lane_reassembly_free(&chunks);
+    shm_channel_close(conn.shm);
+    if (conn.passed_fd >= 0) close(conn.passed_fd);
+    arena_destroy(&req_arena);
+    ipc_reader_free(&rx);
+    close(conn.sock);
+    agent_spool_close();
+    result_bases_free(&agent_bases);
     log_info("Node agent run loop exiting");
-}
\ No newline at end of file
+}
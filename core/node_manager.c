@@ -2,24 +2,79 @@
 #include "../include/logging.h"
 #include "../include/node_manager.h"
 #include "../include/ipc.h"
+#include "../include/arena.h"
+#include "../include/checksum.h"
+#include "../include/codec.h"
+#include "../include/dispatch.h"
+#include "../include/json_msg.h"
+#include "../include/reactor.h"
+#include "../include/relay.h"
+#include "../include/selector.h"
+#include "../include/shard.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 
-#include <poll.h>
 #include <time.h>
 
-// static session store
-static NodeSession sessions[MAX_SESSIONS];
-static int sessions_init = 0;
+// Every reactor shard owns one SessionTable and is the only thread that
+// touches it, so session lookups and updates take no locks. The functions
+// below operate on the calling thread's table.
+#define NAME_INDEX_SLOTS (MAX_SESSIONS * 2)
+#define NAME_INDEX_EMPTY (-1)
+#define NAME_INDEX_TOMBSTONE (-2)
+// ring messages handled per turn before other sessions get the shard back
+#define SHM_DRAIN_BUDGET 256
+// spooled results recently seen, to drop the ones an agent sends again
+// after its ack got lost; direct-mapped, so only a recent window
+#define RESULT_DEDUP_SLOTS 4096
+
+typedef struct {
+    NodeSession *sessions;
+    int *name_index;
+    int *free_slots;
+    int free_top;
+    int active;
+    int tombstones;
+    // scratch memory for the message being handled, reset after each one
+    Arena msg_arena;
+    Dispatcher dispatcher;
+    uint64_t result_seen[RESULT_DEDUP_SLOTS];
+} SessionTable;
+
+static __thread SessionTable *tls_table = NULL;
+static SessionTable *shard_tables[MAX_SHARDS];
+
+// template the shards copy their dispatcher from
+static Dispatcher node_dispatcher;
+static int node_dispatcher_ready = 0;
+
+static node_result_fn result_sink = NULL;
+// front thread only, so one registered after the shards start is safe
+static node_gone_fn gone_sinks[NODE_MANAGER_MAX_GONE_SINKS];
+static int gone_sink_count = 0;
+
+static void register_node_handlers(void);
+static void session_on_input(ReactorStream *stream, void *ctx);
+static void session_on_close(ReactorStream *stream, void *ctx);
+static void session_drain_shm(NodeSession *s);
+static void heartbeat_sweep(Reactor *r, void *arg);
+
+static void session_on_drain(ReactorStream *stream, void *ctx);
+static int session_pump(NodeSession *s, size_t high_water);
+
+static const ReactorStreamOps session_ops = {
+    session_on_input,
+    session_on_close,
+    session_on_drain,
+};
 
 static void node_session_touch(NodeSession *session) {
     if (session) {
@@ -27,271 +82,780 @@ static void node_session_touch(NodeSession *session) {
     }
 }
 
-void node_sessions_init(void) {
-    if (sessions_init) return;
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void name_index_rebuild(SessionTable *t) {
+    for (int i = 0; i < NAME_INDEX_SLOTS; ++i) t->name_index[i] = NAME_INDEX_EMPTY;
+    t->tombstones = 0;
     for (int i = 0; i < MAX_SESSIONS; ++i) {
-        sessions[i].fd = -1;
-        sessions[i].connected = 0;
-        sessions[i].last_seen = 0;
-        memset(&sessions[i].meta, 0, sizeof(Node));
+        if (!t->sessions[i].connected) continue;
+        uint32_t slot = name_hash(t->sessions[i].meta.name) % NAME_INDEX_SLOTS;
+        while (t->name_index[slot] != NAME_INDEX_EMPTY) slot = (slot + 1) % NAME_INDEX_SLOTS;
+        t->name_index[slot] = i;
     }
-    sessions_init = 1;
 }
 
-static NodeSession *find_free_slot(void) {
+static int name_index_find(SessionTable *t, const char *name, uint32_t *out_slot) {
+    uint32_t slot = name_hash(name) % NAME_INDEX_SLOTS;
+    for (int probe = 0; probe < NAME_INDEX_SLOTS; ++probe) {
+        int idx = t->name_index[slot];
+        if (idx == NAME_INDEX_EMPTY) break;
+        if (idx >= 0 && strcmp(t->sessions[idx].meta.name, name) == 0) {
+            if (out_slot) *out_slot = slot;
+            return idx;
+        }
+        slot = (slot + 1) % NAME_INDEX_SLOTS;
+    }
+    return -1;
+}
+
+static void name_index_insert(SessionTable *t, const char *name, int idx) {
+    uint32_t slot = name_hash(name) % NAME_INDEX_SLOTS;
+    while (t->name_index[slot] >= 0) slot = (slot + 1) % NAME_INDEX_SLOTS;
+    if (t->name_index[slot] == NAME_INDEX_TOMBSTONE) t->tombstones--;
+    t->name_index[slot] = idx;
+}
+
+static void name_index_remove(SessionTable *t, const char *name) {
+    uint32_t slot;
+    if (name_index_find(t, name, &slot) < 0) return;
+    t->name_index[slot] = NAME_INDEX_TOMBSTONE;
+    if (++t->tombstones > MAX_SESSIONS / 2) name_index_rebuild(t);
+}
+
+void node_sessions_init(void) {
+    if (tls_table) return;
+    SessionTable *t = calloc(1, sizeof(SessionTable));
+    if (!t) {
+        log_error("node_sessions_init: out of memory");
+        return;
+    }
+    t->sessions = calloc(MAX_SESSIONS, sizeof(NodeSession));
+    t->name_index = malloc(NAME_INDEX_SLOTS * sizeof(int));
+    t->free_slots = malloc(MAX_SESSIONS * sizeof(int));
+    if (!t->sessions || !t->name_index || !t->free_slots) {
+        log_error("node_sessions_init: out of memory");
+        free(t->sessions);
+        free(t->name_index);
+        free(t->free_slots);
+        free(t);
+        return;
+    }
+
+    int shard = shard_current();
     for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (!sessions[i].connected) return &sessions[i];
+        t->sessions[i].fd = -1;
+        t->sessions[i].shm_fd = -1;
+        t->sessions[i].shard = shard;
+        t->sessions[i].slot = i;
+        t->free_slots[MAX_SESSIONS - 1 - i] = i;
     }
-    return NULL;
+    t->free_top = MAX_SESSIONS;
+    name_index_rebuild(t);
+    arena_init(&t->msg_arena, 64 * 1024);
+    t->dispatcher = *node_manager_dispatcher();
+
+    tls_table = t;
+    if (shard >= 0 && shard < MAX_SHARDS) __atomic_store_n(&shard_tables[shard], t, __ATOMIC_RELEASE);
+    Reactor *r = shard_reactor(shard);
+    if (r) reactor_add_tick(r, HEARTBEAT_INTERVAL_MS, heartbeat_sweep, NULL);
+}
+
+static void session_lanes_reset(NodeSession *s) {
+    if (s->tx_lanes) lane_queue_clear(s->tx_lanes);
+    free(s->tx_lanes);
+    s->tx_lanes = NULL;
+    if (s->rx_lanes) lane_reassembly_free(s->rx_lanes);
+    free(s->rx_lanes);
+    s->rx_lanes = NULL;
+}
+
+static void session_reset(NodeSession *s) {
+    session_lanes_reset(s);
+    shm_channel_close(s->shm);
+    s->shm = NULL;
+    if (s->shm_fd >= 0) close(s->shm_fd);
+    s->shm_fd = -1;
+    s->fd = -1;
+    s->stream = NULL;
+    s->connected = 0;
+    s->last_seen = 0;
+    s->hb_seq = 0;
+    s->hb_at = 0;
+    telemetry_series_free(s->telemetry);
+    s->telemetry = NULL;
+    if (s->bases) result_bases_free(s->bases);
+    free(s->bases);
+    s->bases = NULL;
+    memset(&s->meta, 0, sizeof(Node));
+}
+
+static void gone_task(Reactor *r, void *arg) {
+    (void)r;
+    for (int i = 0; i < gone_sink_count; ++i) gone_sinks[i](arg);
+    free(arg);
+}
+
+static void session_release(SessionTable *t, NodeSession *s, int close_stream) {
+    if (s->relay) relay_post_update(s->meta.name, NULL, NULL, NULL, -1);
+    s->relay = 0;
+    name_index_remove(t, s->meta.name);
+    if (close_stream && s->stream) reactor_stream_close(s->stream);
+    session_reset(s);
+    t->free_slots[t->free_top++] = s->slot;
+    t->active--;
+}
+
+// A session that is over for good, not handed to a new binary.
+static void session_end(SessionTable *t, NodeSession *s, int close_stream) {
+    char *name = strdup(s->meta.name);
+    if (name && shard_post_front(gone_task, name) < 0) free(name);
+    session_release(t, s, close_stream);
 }
 
 NodeSession *node_session_add(const Node *node_meta, int fd) {
-    if (!node_meta || fd < 0) return NULL;
-    // try find by name
-    for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected && strcmp(sessions[i].meta.name, node_meta->name) == 0) {
-            // update existing session
-            if (sessions[i].fd != fd) {
-                close(sessions[i].fd);
-            }
-            sessions[i].fd = fd;
-            sessions[i].last_seen = time(NULL);
-            sessions[i].connected = 1;
-            strncpy(sessions[i].meta.address, node_meta->address, sizeof(sessions[i].meta.address)-1);
-            strncpy(sessions[i].meta.os, node_meta->os, sizeof(sessions[i].meta.os)-1);
-            log_info("Updated session for node %s (fd=%d)", node_meta->name, fd);
-            return &sessions[i];
+    SessionTable *t = tls_table;
+    Reactor *r = reactor_current();
+    if (!t || !r || !node_meta || fd < 0) return NULL;
+
+    int idx = name_index_find(t, node_meta->name, NULL);
+    if (idx >= 0) {
+        // reconnect under a known name: replace the old connection
+        NodeSession *s = &t->sessions[idx];
+        if (s->stream) reactor_stream_close(s->stream);
+        shm_channel_close(s->shm);
+        s->shm = NULL;
+        if (s->shm_fd >= 0) close(s->shm_fd);
+        s->shm_fd = -1;
+        if (s->relay) relay_post_update(s->meta.name, NULL, NULL, NULL, -1);
+        s->relay = 0;
+        session_lanes_reset(s);
+        s->stream = reactor_stream_open(r, fd, &session_ops, s);
+        if (!s->stream) {
+            session_end(t, s, 0);
+            return NULL;
         }
+        s->fd = fd;
+        s->last_seen = time(NULL);
+        // a new agent process counts its heartbeats from 1 again
+        s->hb_seq = 0;
+        s->hb_at = 0;
+        s->generation++;
+        snprintf(s->meta.address, sizeof(s->meta.address), "%s", node_meta->address);
+        snprintf(s->meta.os, sizeof(s->meta.os), "%s", node_meta->os);
+        s->meta.lanes = node_meta->lanes;
+        log_info("Updated session for node %s (fd=%d)", node_meta->name, fd);
+        return s;
     }
 
-    NodeSession *slot = find_free_slot();
-    if (!slot) {
+    if (t->free_top == 0) {
         log_error("Max sessions reached");
         return NULL;
     }
 
-    strncpy(slot->meta.name, node_meta->name, sizeof(slot->meta.name)-1);
-    strncpy(slot->meta.address, node_meta->address, sizeof(slot->meta.address)-1);
-    strncpy(slot->meta.os, node_meta->os, sizeof(slot->meta.os)-1);
+    NodeSession *slot = &t->sessions[t->free_slots[t->free_top - 1]];
+    slot->stream = reactor_stream_open(r, fd, &session_ops, slot);
+    if (!slot->stream) return NULL;
+    t->free_top--;
+    t->active++;
+
+    memset(&slot->meta, 0, sizeof(Node));
+    snprintf(slot->meta.name, sizeof(slot->meta.name), "%s", node_meta->name);
+    snprintf(slot->meta.address, sizeof(slot->meta.address), "%s", node_meta->address);
+    snprintf(slot->meta.os, sizeof(slot->meta.os), "%s", node_meta->os);
+    slot->meta.lanes = node_meta->lanes;
     slot->fd = fd;
     slot->last_seen = time(NULL);
     slot->connected = 1;
-    log_info("Added node session %s (fd=%d)", slot->meta.name, fd);
+    slot->generation++;
+    name_index_insert(t, slot->meta.name, slot->slot);
+    log_info("Added node session %s (fd=%d, shard=%d)", slot->meta.name, fd, slot->shard);
     return slot;
 }
 
-void node_session_remove_by_fd(int fd) {
-    if (fd < 0) return;
-    for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected && sessions[i].fd == fd) {
-            log_info("Removing session %s (fd=%d)", sessions[i].meta.name, fd);
-            close(sessions[i].fd);
-            sessions[i].fd = -1;
-            sessions[i].connected = 0;
-            memset(&sessions[i].meta, 0, sizeof(Node));
-            sessions[i].last_seen = 0;
-            return;
-        }
+NodeSession *node_session_adopt(const Node *node_meta, int fd, const char *pending, size_t pending_len,
+                                const char *unsent, size_t unsent_len) {
+    NodeSession *s = node_session_add(node_meta, fd);
+    if (!s) return NULL;
+    if (unsent_len > 0 && reactor_stream_write(s->stream, unsent, unsent_len) < 0) {
+        log_error("Lost the hello ack of %s", s->meta.name);
+    }
+    if (pending_len > 0) {
+        ipc_reader_feed(&s->stream->rx, pending, pending_len);
+        session_on_input(s->stream, s);
     }
+    return s;
 }
 
-void node_session_remove_by_name(const char *name) {
-    if (!name) return;
-    for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected && strcmp(sessions[i].meta.name, name) == 0) {
-            close(sessions[i].fd);
-            sessions[i].fd = -1;
-            sessions[i].connected = 0;
-            memset(&sessions[i].meta, 0, sizeof(Node));
-            sessions[i].last_seen = 0;
-            log_info("Removed session for node %s", name);
-            return;
+typedef struct {
+    NodeSessionImage img;
+    int shm_fd;
+    node_session_handover_fn fn;
+    void *arg;
+    // chunks of messages not complete yet, read again before the rest
+    char *partial;
+    size_t partial_len;
+} HandoverTicket;
+
+static void session_handed_over(int fd, const char *pending, size_t pending_len, const char *unsent,
+                                size_t unsent_len, void *ctx) {
+    HandoverTicket *t = ctx;
+    char *unread = NULL;
+    if (t->partial_len > 0 && (unread = malloc(t->partial_len + pending_len)) != NULL) {
+        memcpy(unread, t->partial, t->partial_len);
+        if (pending_len) memcpy(unread + t->partial_len, pending, pending_len);
+        pending = unread;
+        pending_len += t->partial_len;
+    }
+    t->img.unread = pending;
+    t->img.unread_len = pending_len;
+    t->img.unsent = unsent;
+    t->img.unsent_len = unsent_len;
+    t->fn(&t->img, fd, t->shm_fd, t->arg);
+    free(unread);
+    free(t->partial);
+    free(t);
+}
+
+int node_sessions_handover(node_session_handover_fn fn, void *arg) {
+    SessionTable *t = tls_table;
+    if (!t || !fn) return 0;
+    int started = 0;
+    for (int i = 0; i < MAX_SESSIONS && t->active > 0; ++i) {
+        NodeSession *s = &t->sessions[i];
+        if (!s->connected) continue;
+        HandoverTicket *ticket = calloc(1, sizeof(HandoverTicket));
+        if (ticket) {
+            ticket->img.meta = s->meta;
+            ticket->img.last_seen = s->last_seen;
+            ticket->img.relay = s->relay;
+            ticket->shm_fd = s->shm_fd;
+            ticket->fn = fn;
+            ticket->arg = arg;
+            if (s->rx_lanes) ticket->partial = lane_reassembly_save(s->rx_lanes, &ticket->partial_len);
+            // whatever waits in the lanes goes out with the unsent bytes
+            if (session_pump(s, SIZE_MAX) < 0) log_error("Lost queued output of %s", s->meta.name);
+        }
+        if (!ticket || !s->stream || reactor_stream_detach(s->stream, session_handed_over, ticket) < 0) {
+            log_error("Cannot hand over session %s, closing it", s->meta.name);
+            if (ticket) free(ticket->partial);
+            free(ticket);
+            session_end(t, s, 1);
+            continue;
         }
+        // the ring memfd and the routes below a relay go with the session
+        s->shm_fd = -1;
+        s->relay = 0;
+        s->stream = NULL;
+        session_release(t, s, 0);
+        started++;
     }
+    return started;
 }
 
-NodeSession *node_session_find_by_name(const char *name) {
-    if (!name) return NULL;
-    for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected && strcmp(sessions[i].meta.name, name) == 0) {
-            return &sessions[i];
+NodeSession *node_session_resume(const NodeSessionImage *img, int fd, int shm_fd) {
+    NodeSession *s = img ? node_session_add(&img->meta, fd) : NULL;
+    if (!s) {
+        if (shm_fd >= 0) close(shm_fd);
+        return NULL;
+    }
+    s->last_seen = img->last_seen;
+    s->relay = img->relay;
+    if (shm_fd >= 0) {
+        s->shm = shm_channel_attach(shm_fd, SHM_SIDE_CONTROLLER);
+        if (!s->shm) {
+            log_error("Lost shared rings of %s, closing session", s->meta.name);
+            close(shm_fd);
+            session_end(tls_table, s, 1);
+            return NULL;
         }
+        s->shm_fd = shm_fd;
     }
-    return NULL;
+    if (img->unsent_len > 0 && reactor_stream_write(s->stream, img->unsent, img->unsent_len) < 0) {
+        log_error("Lost output queued for %s", s->meta.name);
+    }
+    if (img->unread_len > 0) {
+        ipc_reader_feed(&s->stream->rx, img->unread, img->unread_len);
+        session_on_input(s->stream, s);
+    } else if (s->shm) {
+        // whatever the agent wrote to its ring meanwhile
+        session_drain_shm(s);
+    }
+    return s;
+}
+
+void node_session_remove_by_fd(int fd) {
+    SessionTable *t = tls_table;
+    if (!t || fd < 0) return;
+    NodeSession *s = node_session_find_by_fd(fd);
+    if (!s) return;
+    log_info("Removing session %s (fd=%d)", s->meta.name, fd);
+    session_end(t, s, 1);
+}
+
+void node_session_remove_by_name(const char *name) {
+    SessionTable *t = tls_table;
+    if (!t || !name) return;
+    int idx = name_index_find(t, name, NULL);
+    if (idx < 0) return;
+    session_end(t, &t->sessions[idx], 1);
+    log_info("Removed session for node %s", name);
+}
+
+NodeSession *node_session_find_by_name(const char *name) {
+    SessionTable *t = tls_table;
+    if (!t || !name) return NULL;
+    int idx = name_index_find(t, name, NULL);
+    return idx >= 0 ? &t->sessions[idx] : NULL;
 }
 
 NodeSession *node_session_find_by_fd(int fd) {
-    if (fd < 0) return NULL;
+    SessionTable *t = tls_table;
+    if (!t || fd < 0) return NULL;
     for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected && sessions[i].fd == fd) return &sessions[i];
+        if (t->sessions[i].connected && t->sessions[i].fd == fd) return &t->sessions[i];
     }
     return NULL;
 }
 
 int node_sessions_copy(NodeSession *out_array, int max_entries) {
-    if (!out_array || max_entries <= 0) return 0;
+    SessionTable *t = tls_table;
+    if (!t || !out_array || max_entries <= 0) return 0;
     int count = 0;
     for (int i = 0; i < MAX_SESSIONS && count < max_entries; ++i) {
-        if (sessions[i].connected) {
-            out_array[count++] = sessions[i];
+        if (t->sessions[i].connected) {
+            out_array[count++] = t->sessions[i];
         }
     }
     return count;
 }
 
+int node_sessions_count(void) {
+    return tls_table ? tls_table->active : 0;
+}
+
+// Moves queued messages to the socket, highest lane first by weighted
+// round-robin, until more than high_water bytes wait there. Long messages
+// go out in chunks if the agent takes them.
+static int session_pump(NodeSession *s, size_t high_water) {
+    LaneUnit u;
+    while (s->stream && s->tx_lanes && reactor_stream_pending(s->stream) < high_water &&
+           lane_queue_peek(s->tx_lanes, s->meta.lanes, &u)) {
+        if ((u.head_len > 0 && reactor_stream_write(s->stream, u.head, u.head_len) < 0) ||
+            reactor_stream_write(s->stream, u.body, u.body_len) < 0 || reactor_stream_write(s->stream, "\n", 1) < 0) {
+            return -1;
+        }
+        lane_queue_consume(s->tx_lanes, &u);
+    }
+    return 0;
+}
+
+static void session_on_drain(ReactorStream *stream, void *ctx) {
+    NodeSession *s = ctx;
+    if (s->stream == stream) session_pump(s, LANE_HIGH_WATER);
+}
+
 ssize_t node_session_send(NodeSession *s, const char *msg) {
-    if (!s || !msg) return -1;
-    return ipc_send_full(s->fd, msg, strlen(msg));
-}
-
-int node_sessions_fill_pollfds(struct pollfd *pfds, int max_fds) {
-    int idx = 0;
-    for (int i = 0; i < MAX_SESSIONS && idx < max_fds; ++i) {
-        if (sessions[i].connected) {
-            pfds[idx].fd = sessions[i].fd;
-            pfds[idx].events = POLLIN;
-            pfds[idx].revents = 0;
-            idx++;
+    if (!s || !msg || !s->stream) return -1;
+    size_t len = strlen(msg);
+    if (s->shm) {
+        size_t body = (len > 0 && msg[len - 1] == '\n') ? len - 1 : len;
+        int rc = shm_ring_write(&s->shm->tx, msg, body);
+        // ring the agent's doorbell only if it went to sleep on the ring
+        if (rc == 1 && reactor_stream_write(s->stream, "\n", 1) < 0) return -1;
+        if (rc >= 0) return (ssize_t)body;
+        // full or too big: the socket still works
+    }
+    // straight to the socket while nothing waits and the socket keeps up
+    if ((!s->tx_lanes || lane_queue_empty(s->tx_lanes)) && len <= LANE_CHUNK &&
+        reactor_stream_pending(s->stream) < LANE_HIGH_WATER) {
+        if (reactor_stream_write(s->stream, msg, len) < 0) return -1;
+        if (len == 0 || msg[len - 1] != '\n') {
+            if (reactor_stream_write(s->stream, "\n", 1) < 0) return -1;
+            len++;
         }
+        return (ssize_t)len;
+    }
+    if (!s->tx_lanes) {
+        s->tx_lanes = malloc(sizeof(LaneQueue));
+        if (!s->tx_lanes) return -1;
+        lane_queue_init(s->tx_lanes);
+    }
+    if (lane_queue_push(s->tx_lanes, lane_classify(msg, len), msg, len) < 0) return -1;
+    if (session_pump(s, LANE_HIGH_WATER) < 0) return -1;
+    return (ssize_t)len;
+}
+
+int node_sessions_send_if(int (*pick)(const char *name, void *arg), void *arg, const char *msg) {
+    SessionTable *t = tls_table;
+    if (!t || !pick || !msg) return 0;
+    int sent = 0;
+    for (int i = 0; i < MAX_SESSIONS && sent < t->active; ++i) {
+        NodeSession *s = &t->sessions[i];
+        if (!s->connected || !pick(s->meta.name, arg)) continue;
+        if (node_session_send(s, msg) < 0) log_error("Failed to send to %s", s->meta.name);
+        else sent++;
+    }
+    return sent;
+}
+
+static int pick_selected(const char *name, void *arg) {
+    return selector_match(arg, name);
+}
+
+int node_sessions_send_matching(const char *selector, const char *msg) {
+    return selector ? node_sessions_send_if(pick_selected, (void *)selector, msg) : 0;
+}
+
+void node_sessions_heartbeat(const Heartbeat *hb, int count) {
+    SessionTable *t = tls_table;
+    if (!t || !hb) return;
+    time_t now = time(NULL);
+    for (int i = 0; i < count; ++i) {
+        int idx = name_index_find(t, hb[i].name, NULL);
+        if (idx < 0) continue;
+        NodeSession *s = &t->sessions[idx];
+        // datagrams can arrive out of order; an older one says nothing new
+        if (s->hb_at && (int32_t)(hb[i].seq - s->hb_seq) <= 0) continue;
+        s->hb_seq = hb[i].seq;
+        s->hb_at = now;
+        s->last_seen = now;
+        s->load1 = hb[i].load1;
+        s->running = hb[i].running;
+        s->mem_used = hb[i].mem_used;
+    }
+}
+
+// Ends the sessions on this shard that stopped sending heartbeats and have
+// been silent on their stream as well; last_seen covers both.
+static void heartbeat_sweep(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    SessionTable *t = tls_table;
+    if (!t) return;
+    time_t now = time(NULL);
+    time_t limit = (time_t)HEARTBEAT_MISSED_LIMIT * HEARTBEAT_INTERVAL_MS / 1000;
+    int left = t->active;
+    for (int i = 0; i < MAX_SESSIONS && left > 0; ++i) {
+        NodeSession *s = &t->sessions[i];
+        if (!s->connected) continue;
+        left--;
+        if (!s->hb_at || now - s->hb_at < limit || now - s->last_seen < limit) continue;
+        log_error("No heartbeat from %s for %lds, ending its session", s->meta.name, (long)(now - s->hb_at));
+        session_end(t, s, 1);
+    }
+}
+
+void node_sessions_telemetry(const TelemetryFrame *tf, int count) {
+    SessionTable *t = tls_table;
+    if (!t || !tf) return;
+    for (int i = 0; i < count; ++i) {
+        int idx = name_index_find(t, tf[i].name, NULL);
+        if (idx < 0) continue;
+        NodeSession *s = &t->sessions[idx];
+        if (!s->telemetry) s->telemetry = telemetry_series_new();
+        // a gap is bridged by the next keyframe
+        if (s->telemetry) telemetry_series_add(s->telemetry, &tf[i]);
     }
-    return idx;
+}
+
+typedef struct {
+    char name[256];
+    char msg[];
+} NodeSend;
+
+static void send_to_task(Reactor *r, void *arg) {
+    (void)r;
+    NodeSend *m = arg;
+    NodeSession *s = node_session_find_by_name(m->name);
+    if (!s) log_info("Not sending to %s: not connected", m->name);
+    else if (node_session_send(s, m->msg) < 0) log_error("Failed to send to %s", m->name);
+    free(m);
+}
+
+int node_manager_send_to(const char *name, const char *msg) {
+    if (!name || !msg) return -1;
+    size_t len = strlen(msg);
+    NodeSend *m = malloc(sizeof(NodeSend) + len + 1);
+    if (!m) return -1;
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    memcpy(m->msg, msg, len + 1);
+    if (shard_post(shard_for_name(name), send_to_task, m) < 0) {
+        free(m);
+        return -1;
+    }
+    return 0;
 }
 
 void node_sessions_cleanup(void) {
+    SessionTable *t = tls_table;
+    if (!t) return;
     for (int i = 0; i < MAX_SESSIONS; ++i) {
-        if (sessions[i].connected) {
-            close(sessions[i].fd);
-            sessions[i].fd = -1;
-            sessions[i].connected = 0;
-            sessions[i].last_seen = 0;
+        if (t->sessions[i].connected) {
+            if (t->sessions[i].stream) reactor_stream_close(t->sessions[i].stream);
+            session_reset(&t->sessions[i]);
         }
     }
+    int shard = shard_current();
+    if (shard >= 0 && shard < MAX_SHARDS) __atomic_store_n(&shard_tables[shard], NULL, __ATOMIC_RELEASE);
+    arena_destroy(&t->msg_arena);
+    free(t->sessions);
+    free(t->name_index);
+    free(t->free_slots);
+    free(t);
+    tls_table = NULL;
 }
 
-// Very simple JSON-like parse for "hello" messages: {"type":"hello","name":"node1",...}
-// Only extracts name, address, os. Returns 0 on success, -1 on error.
+// Parses {"type":"hello","name":"node1","address":...,"os":...}. Only name is
+// required. Returns 0 on success, -1 on error.
 int parse_hello_message(const char *msg, Node *out_node) {
     if (!msg || !out_node) return -1;
-    const char *p = msg;
-    // naive parse: look for "name":"...","address":"...","os":"..."
-    // extract name
-    char tmp[256];
-    const char *found = strstr(p, "\"name\"");
-    if (found) {
-        const char *colon = strchr(found, ':');
-        if (!colon) return -1;
-        const char *first_quote = strchr(colon, '\"');
-        if (!first_quote) return -1;
-        const char *second_quote = strchr(first_quote + 1, '\"');
-        if (!second_quote) return -1;
-        size_t nlen = (size_t)(second_quote - (first_quote + 1));
-        if (nlen >= sizeof(tmp)) nlen = sizeof(tmp)-1;
-        memcpy(tmp, first_quote + 1, nlen);
-        tmp[nlen] = '\0';
-        strncpy(out_node->name, tmp, sizeof(out_node->name)-1);
-    } else {
-        return -1;
+    JsonMsg m;
+    if (json_msg_parse(&m, msg, strlen(msg)) < 0) return -1;
+    if (json_msg_copy(&m, "name", out_node->name, sizeof(out_node->name)) < 0) return -1;
+    if (out_node->name[0] == '\0') return -1;
+    if (json_msg_copy(&m, "address", out_node->address, sizeof(out_node->address)) < 0) {
+        out_node->address[0] = '\0';
     }
+    if (json_msg_copy(&m, "os", out_node->os, sizeof(out_node->os)) < 0) {
+        out_node->os[0] = '\0';
+    }
+    out_node->lanes = json_msg_int(&m, "lanes", 0) == 1;
+    char codecs[128] = "";
+    json_msg_copy(&m, "codecs", codecs, sizeof(codecs));
+    out_node->codec = codec_listed(codecs);
+    return 0;
+}
+
+static void on_pong(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    log_info("Received pong from %s", session->meta.name);
+}
 
-    found = strstr(p, "\"address\"");
-    if (found) {
-        const char *colon = strchr(found, ':');
-        if (!colon) return -1;
-        const char *first_quote = strchr(colon, '\"');
-        if (!first_quote) return -1;
-        const char *second_quote = strchr(first_quote + 1, '\"');
-        if (!second_quote) return -1;
-        size_t nlen = (size_t)(second_quote - (first_quote + 1));
-        if (nlen >= sizeof(tmp)) nlen = sizeof(tmp)-1;
-        memcpy(tmp, first_quote + 1, nlen);
-        tmp[nlen] = '\0';
-        strncpy(out_node->address, tmp, sizeof(out_node->address)-1);
+static void deliver_result(Reactor *r, void *arg) {
+    (void)r;
+    NodeResult *res = arg;
+    if (result_sink) result_sink(res);
+    free(res);
+}
+
+// stdout_text is the output when it is not in m itself (a delta).
+static NodeResult *result_build(const JsonMsg *m, Arena *a, const char *node, const char *stdout_text,
+                                size_t out_len) {
+    size_t err_len = 0;
+    char *id = json_msg_str(m, "id", a, NULL);
+    char *stderr_text = json_msg_str(m, "stderr", a, &err_len);
+    // relays send one result for every group of nodes that agreed
+    size_t nodes_len = 0;
+    char *nodes = json_msg_str(m, "nodes", a, &nodes_len);
+    long count = json_msg_int(m, "count", 1);
+
+    NodeResult *res = malloc(sizeof(NodeResult) + out_len + err_len + nodes_len + 3);
+    if (!res) return NULL;
+    if (nodes && nodes_len > 0) {
+        size_t first = strcspn(nodes, ",");
+        snprintf(res->node, sizeof(res->node), "%.*s", (int)first, nodes);
     } else {
-        out_node->address[0] = '\0';
+        snprintf(res->node, sizeof(res->node), "%s", node);
     }
+    snprintf(res->id, sizeof(res->id), "%s", id ? id : "unknown");
+    res->exit_code = (int)json_msg_int(m, "exit", -1);
+    if (json_msg_copy(m, "status", res->status, sizeof(res->status)) < 0) res->status[0] = '\0';
+    res->out = (char *)(res + 1);
+    res->out_len = out_len;
+    if (out_len) memcpy(res->out, stdout_text, out_len);
+    res->out[out_len] = '\0';
+    res->err = res->out + out_len + 1;
+    res->err_len = err_len;
+    if (err_len) memcpy(res->err, stderr_text, err_len);
+    res->err[err_len] = '\0';
+    res->count = count > 0 && count < INT32_MAX ? (int)count : 1;
+    res->nodes = NULL;
+    if (nodes && nodes_len > 0) {
+        res->nodes = res->err + err_len + 1;
+        memcpy(res->nodes, nodes, nodes_len + 1);
+    }
+    return res;
+}
 
-    found = strstr(p, "\"os\"");
-    if (found) {
-        const char *colon = strchr(found, ':');
-        if (!colon) return -1;
-        const char *first_quote = strchr(colon, '\"');
-        if (!first_quote) return -1;
-        const char *second_quote = strchr(first_quote + 1, '\"');
-        if (!second_quote) return -1;
-        size_t nlen = (size_t)(second_quote - (first_quote + 1));
-        if (nlen >= sizeof(tmp)) nlen = sizeof(tmp)-1;
-        memcpy(tmp, first_quote + 1, nlen);
-        tmp[nlen] = '\0';
-        strncpy(out_node->os, tmp, sizeof(out_node->os)-1);
+// The stdout of a result, inflated if it came compressed. NULL if it is
+// missing or damaged.
+static char *result_stdout(const JsonMsg *m, Arena *a, size_t *out_len) {
+    const JsonField *packed = json_msg_field(m, "stdout_z");
+    if (!packed) return json_msg_str(m, "stdout", a, out_len);
+    long raw = json_msg_int(m, "stdout_len", -1);
+    char *out = raw >= 0 ? codec_unpack(packed->val, packed->val_len, (size_t)raw, a) : NULL;
+    *out_len = out ? (size_t)raw : 0;
+    return out;
+}
+
+NodeResult *node_result_from_msg(const JsonMsg *m, Arena *a, const char *node) {
+    size_t out_len = 0;
+    char *stdout_text = result_stdout(m, a, &out_len);
+    return result_build(m, a, node, stdout_text, out_len);
+}
+
+void node_manager_post_result(NodeResult *res) {
+    if (!result_sink || shard_post_front(deliver_result, res) < 0) free(res);
+}
+
+void node_manager_deliver_result(const NodeResult *res) {
+    if (result_sink && res) result_sink(res);
+}
+
+int node_manager_seen_before(const char *node, const char *id, long seq) {
+    uint64_t key = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)node; *p; ++p) key = (key ^ *p) * 1099511628211ULL;
+    key = (key ^ '/') * 1099511628211ULL;
+    for (const unsigned char *p = (const unsigned char *)id; *p; ++p) key = (key ^ *p) * 1099511628211ULL;
+    key = (key ^ (uint64_t)seq) * 1099511628211ULL;
+    if (!key) key = 1;
+    uint64_t *slot = &tls_table->result_seen[key % RESULT_DEDUP_SLOTS];
+    if (*slot == key) return 1;
+    *slot = key;
+    return 0;
+}
+
+// The output of a delta result, rebuilt from the session's base for its
+// key into the arena. NULL if the base is missing or the CRCs disagree.
+static char *result_from_delta(NodeSession *session, const JsonMsg *m, Arena *a, uint64_t key, size_t *out_len) {
+    char base_crc[16] = "", crc[16] = "";
+    size_t delta_len = 0;
+    json_msg_copy(m, "base", base_crc, sizeof(base_crc));
+    json_msg_copy(m, "crc", crc, sizeof(crc));
+    char *delta = json_msg_str(m, "delta", a, &delta_len);
+    const ResultBase *base = session->bases ? result_bases_find(session->bases, key) : NULL;
+    if (!delta || !base || strtoul(base_crc, NULL, 16) != base->crc) return NULL;
+    char *out = result_delta_apply(base->text, base->len, delta, delta_len, out_len);
+    char *copy = out && crc32c(0, out, *out_len) == strtoul(crc, NULL, 16) ? arena_strndup(a, out, *out_len) : NULL;
+    free(out);
+    return copy;
+}
+
+static void on_result(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    long seq = json_msg_int(ctx->msg, "seq", 0);
+    // the output of a command seen before may come as a delta from the last
+    char key_hex[24] = "";
+    uint64_t key = json_msg_copy(ctx->msg, "key", key_hex, sizeof(key_hex)) == 0 ? strtoull(key_hex, NULL, 16) : 0;
+    size_t out_len = 0;
+    char *out = NULL;
+    if (key && json_msg_field(ctx->msg, "delta")) {
+        out = result_from_delta(session, ctx->msg, ctx->arena, key, &out_len);
+        if (!out) {
+            // not acked: the agent sends the whole result from its spool
+            char resend[64];
+            snprintf(resend, sizeof(resend), "{\"type\":\"result_resend\",\"seq\":%ld}", seq);
+            log_info("Cannot rebuild result seq %ld from %s; asking for all of it", seq, session->meta.name);
+            if (seq > 0) node_session_send(session, resend);
+            return;
+        }
     } else {
-        out_node->os[0] = '\0';
+        out = result_stdout(ctx->msg, ctx->arena, &out_len);
+        if (!out && json_msg_field(ctx->msg, "stdout_z")) {
+            log_error("Result seq %ld from %s does not inflate", seq, session->meta.name);
+            out = "";
+        }
     }
+    if (key && out) {
+        if (!session->bases && (session->bases = malloc(sizeof(ResultBases))) != NULL) {
+            result_bases_init(session->bases);
+        }
+        if (session->bases) result_bases_put(session->bases, key, out, out_len);
+    }
+    // a spooled result: ack it so the agent can drop it, even a duplicate
+    if (seq > 0) {
+        char ack[64];
+        snprintf(ack, sizeof(ack), "{\"type\":\"result_ack\",\"seq\":%ld}", seq);
+        node_session_send(session, ack);
+        char id[64] = "";
+        json_msg_copy(ctx->msg, "id", id, sizeof(id));
+        if (node_manager_seen_before(session->meta.name, id, seq)) {
+            log_info("Dropping result %s from %s: already delivered", id, session->meta.name);
+            return;
+        }
+    }
+    // one block, handed to the front thread which routes it to clients
+    NodeResult *res = result_build(ctx->msg, ctx->arena, session->meta.name, out, out_len);
+    if (!res) {
+        log_error("Dropping result from %s: out of memory", session->meta.name);
+        return;
+    }
+    log_info("Command result from %s (id=%s, exit=%d)", session->meta.name, res->id, res->exit_code);
+    node_manager_post_result(res);
+}
+
+static void on_unhandled(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    const JsonField *type = json_msg_field(ctx->msg, "type");
+    log_info("Unhandled message type '%.*s' from %s: %s",
+             (int)type->val_len, type->val, session->meta.name, ctx->raw);
+}
+
+static void register_node_handlers(void) {
+    dispatcher_init(&node_dispatcher, "controller");
+    dispatcher_register(&node_dispatcher, "pong", on_pong, NULL);
+    dispatcher_register(&node_dispatcher, "result", on_result, NULL);
+    dispatcher_set_fallback(&node_dispatcher, on_unhandled, NULL);
+}
+
+void node_manager_on_result(node_result_fn fn) {
+    result_sink = fn;
+}
 
+int node_manager_on_session_end(node_gone_fn fn) {
+    if (gone_sink_count == NODE_MANAGER_MAX_GONE_SINKS) return -1;
+    gone_sinks[gone_sink_count++] = fn;
     return 0;
 }
 
-static char *json_get_str(const char *json, const char *key) {
-    if (!json || !key) return NULL;
-    char needle[128];
-    snprintf(needle, sizeof(needle), "\"%s\"", key);
-    const char *pos = strstr(json, needle);
-    if (!pos) return NULL;
-    const char *colon = strchr(pos, ':');
-    if (!colon) return NULL;
-    const char *firstq = strchr(colon, '\"');
-    if (!firstq) return NULL;
-    const char *secondq = strchr(firstq + 1, '\"');
-    if (!secondq) return NULL;
-    size_t len = (size_t)(secondq - (firstq + 1));
-    char *out = malloc(len + 1);
-    if (!out) return NULL;
-    memcpy(out, firstq + 1, len);
-    out[len] = '\0';
-    return out;
+Dispatcher *node_manager_dispatcher(void) {
+    if (!node_dispatcher_ready) {
+        register_node_handlers();
+        node_dispatcher_ready = 1;
+    }
+    return &node_dispatcher;
 }
 
-static int json_get_int(const char *json, const char *key, int default_value) {
-    if (!json || !key) return default_value;
-    char needle[128];
-    snprintf(needle, sizeof(needle), "\"%s\"", key);
-    const char *pos = strstr(json, needle);
-    if (!pos) return default_value;
-    const char *colon = strchr(pos, ':');
-    if (!colon) return default_value;
-    char *endptr = NULL;
-    errno = 0;
-    long value = strtol(colon + 1, &endptr, 10);
-    if (endptr == colon + 1 || errno == ERANGE) return default_value;
-    return (int)value;
-}
-
-static char *json_unescape(const char *input) {
-    if (!input) return strdup("");
-    size_t len = strlen(input);
-    char *out = malloc(len + 1);
-    if (!out) return strdup("");
-    size_t o = 0;
-    for (size_t i = 0; i < len; ++i) {
-        if (input[i] == '\\' && i + 1 < len) {
-            char next = input[++i];
-            switch (next) {
-                case 'n': out[o++] = '\n'; break;
-                case 'r': out[o++] = '\r'; break;
-                case 't': out[o++] = '\t'; break;
-                case '\\': out[o++] = '\\'; break;
-                case '"': out[o++] = '"'; break;
-                default: out[o++] = next; break;
-            }
-        } else {
-            out[o++] = input[i];
-        }
+void node_manager_print_stats(FILE *out) {
+    // sum the per-shard counters; each shard only ever writes its own
+    Dispatcher total = *node_manager_dispatcher();
+    for (int id = 0; id < MSG_TYPE_MAX; ++id) {
+        total.slots[id].count = total.slots[id].bytes = 0;
+        total.slots[id].ns_total = total.slots[id].ns_max = 0;
     }
-    out[o] = '\0';
-    return out;
+    total.unknown = total.malformed = 0;
+    int active = 0;
+    for (int i = 0; i < MAX_SHARDS; ++i) {
+        SessionTable *t = __atomic_load_n(&shard_tables[i], __ATOMIC_ACQUIRE);
+        if (!t) continue;
+        active += __atomic_load_n(&t->active, __ATOMIC_RELAXED);
+        dispatcher_merge_stats(&total, &t->dispatcher);
+    }
+    fprintf(out, "Sessions: %d across %d shard(s)\n", active, shard_count());
+    dispatcher_print_stats(&total, out);
 }
 
-void handle_node_message(int fd, const char *msg, GlobalState *state) {
+static void handle_session_message(NodeSession *session, const char *msg, size_t len, GlobalState *state) {
     (void)state;
+    SessionTable *t = tls_table;
+    node_session_touch(session);
+    if (dispatcher_dispatch(&t->dispatcher, msg, len, &t->msg_arena, session) < 0) {
+        log_error("Malformed message from %s: %s", session->meta.name, msg);
+    }
+}
+
+void handle_node_message(int fd, const char *msg, GlobalState *state) {
     if (!msg) return;
 
     NodeSession *session = node_session_find_by_fd(fd);
@@ -300,51 +864,89 @@ void handle_node_message(int fd, const char *msg, GlobalState *state) {
         return;
     }
 
-    node_session_touch(session);
+    handle_session_message(session, msg, strlen(msg), state);
+}
 
-    char *type = json_get_str(msg, "type");
-    if (!type) {
-        log_error("Malformed message from %s: %s", session->meta.name, msg);
-        return;
+static void session_on_input(ReactorStream *stream, void *ctx) {
+    NodeSession *s = ctx;
+    size_t len = 0;
+    char *line;
+    // on a ring session the socket mostly carries empty doorbell lines
+    while (s->stream == stream && (line = ipc_reader_next_line(&stream->rx, &len)) != NULL) {
+        if (len == 0) continue;
+        if (line[0] == '@') {
+            // a chunk: the message is handled once its last chunk is in
+            if (!s->rx_lanes && (s->rx_lanes = malloc(sizeof(LaneReassembly))) != NULL) {
+                lane_reassembly_init(s->rx_lanes);
+            }
+            int rc = s->rx_lanes ? lane_reassembly_feed(s->rx_lanes, line, len, MAX_CHUNKED_MSG_LEN, &line, &len) : -1;
+            if (rc < 0) {
+                log_error("Bad chunk from %s, closing session", s->meta.name);
+                session_end(tls_table, s, 1);
+                return;
+            }
+            if (rc == 0) continue;
+        }
+        handle_session_message(s, line, len, shard_state());
     }
+    if (s->stream == stream && s->shm) session_drain_shm(s);
+}
 
-    if (strcmp(type, "pong") == 0) {
-        log_info("Received pong from %s", session->meta.name);
-    } else if (strcmp(type, "result") == 0) {
-        char *id = json_get_str(msg, "id");
-        char *stdout_raw = json_get_str(msg, "stdout");
-        char *stderr_raw = json_get_str(msg, "stderr");
-        int exit_code = json_get_int(msg, "exit", -1);
-
-        char *stdout_unesc = json_unescape(stdout_raw);
-        char *stderr_unesc = json_unescape(stderr_raw);
-
-        printf("\n[%s] command result (id=%s, exit=%d)\n",
-               session->meta.name,
-               id ? id : "unknown",
-               exit_code);
-        if (stdout_unesc && stdout_unesc[0] != '\0') {
-            printf("stdout:\n%s\n", stdout_unesc);
-        } else {
-            printf("stdout: <empty>\n");
+typedef struct {
+    NodeSession *session;
+    unsigned generation;
+} ShmDrainTicket;
+
+static void shm_drain_task(Reactor *r, void *arg) {
+    (void)r;
+    ShmDrainTicket *ticket = arg;
+    NodeSession *s = ticket->session;
+    if (s->connected && s->generation == ticket->generation && s->shm) session_drain_shm(s);
+    free(ticket);
+}
+
+// Handles what the agent wrote to its ring, in place, then flags the ring
+// as waiting so the next message rings the doorbell.
+static void session_drain_shm(NodeSession *s) {
+    int budget = SHM_DRAIN_BUDGET;
+    while (s->shm) {
+        size_t len = 0;
+        int corrupt = 0;
+        const char *msg;
+        while (budget > 0 && (msg = shm_ring_peek(&s->shm->rx, &len, &corrupt)) != NULL) {
+            if (len > 0) handle_session_message(s, msg, len, shard_state());
+            // the handler may have dropped the session
+            if (!s->shm) return;
+            shm_ring_consume(&s->shm->rx);
+            budget--;
         }
-        if (stderr_unesc && stderr_unesc[0] != '\0') {
-            printf("stderr:\n%s\n", stderr_unesc);
-        } else {
-            printf("stderr: <empty>\n");
+        if (corrupt) {
+            log_error("Corrupt shared ring from %s, closing session", s->meta.name);
+            session_end(tls_table, s, 1);
+            return;
         }
-        fflush(stdout);
-
-        log_info("Command result from %s (id=%s, exit=%d)", session->meta.name, id ? id : "unknown", exit_code);
-
-        free(id);
-        free(stdout_raw);
-        free(stderr_raw);
-        free(stdout_unesc);
-        free(stderr_unesc);
-    } else {
-        log_info("Unhandled message type '%s' from %s: %s", type, session->meta.name, msg);
+        if (budget == 0) {
+            // come back after the other ready connections had their turn
+            ShmDrainTicket *ticket = malloc(sizeof(ShmDrainTicket));
+            if (ticket) {
+                ticket->session = s;
+                ticket->generation = s->generation;
+                if (reactor_post(reactor_current(), shm_drain_task, ticket) == 0) return;
+                free(ticket);
+            }
+            budget = SHM_DRAIN_BUDGET;
+            continue;
+        }
+        if (shm_ring_prepare_wait(&s->shm->rx)) return;
     }
+}
 
-    free(type);
-}
\ No newline at end of file
+static void session_on_close(ReactorStream *stream, void *ctx) {
+    NodeSession *s = ctx;
+    SessionTable *t = tls_table;
+    if (!t || s->stream != stream) return;
+    log_info("Removing session %s (fd=%d)", s->meta.name, s->fd);
+    // the reactor closes the stream itself once this returns
+    s->stream = NULL;
+    session_end(t, s, 0);
+}
@@ -0,0 +1,495 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/cli.h"
+#include "../include/json_escape.h"
+#include "../include/logging.h"
+#include "../include/placement.h"
+#include "../include/requests.h"
+#include "../include/selector.h"
+#include "../include/shard.h"
+
+#define LOAD_BUCKETS 1024
+
+// What placement knows of a node: its submitted jobs only.
+typedef struct NodeLoad {
+    char name[256];
+    int running;
+    double avg_ms;      // moving average of how long its jobs took, 0 = none yet
+    unsigned long done;
+    struct NodeLoad *next;
+} NodeLoad;
+
+typedef struct Job {
+    char id[REQUEST_ID_LEN];
+    char attempt_id[REQUEST_ID_LEN];   // what the node answers to
+    unsigned long client_id;
+    char selector[SELECTOR_MAX_LEN + 1];
+    char node[256];     // where it runs, empty while queued
+    char avoid[256];    // the node it was lost on last
+    int attempts;
+    time_t queued_at;   // 0 until it first had to wait
+    long long started_ms;
+    struct Job *next;
+    char cmd[];
+} Job;
+
+// A connected node as the shards report it.
+typedef struct {
+    char name[256];
+    uint16_t load1;
+} Candidate;
+
+typedef struct {
+    Job *job;           // NULL: only the queue is placed
+    Candidate *list[MAX_SHARDS];
+    int counts[MAX_SHARDS];
+} Collect;
+
+static Reactor *placement_reactor = NULL;
+static NodeLoad *loads[LOAD_BUCKETS];
+static Job *running = NULL;
+static Job *queue_head = NULL;
+static Job *queue_tail = NULL;
+static int queue_len = 0;
+static int sweeping = 0;
+static unsigned int seed = 0;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static unsigned long name_hash(const char *s) {
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static NodeLoad *load_find(const char *name, int create) {
+    NodeLoad **b = &loads[name_hash(name) % LOAD_BUCKETS];
+    for (NodeLoad *l = *b; l; l = l->next) {
+        if (strcmp(l->name, name) == 0) return l;
+    }
+    if (!create) return NULL;
+    NodeLoad *l = calloc(1, sizeof(NodeLoad));
+    if (!l) return NULL;
+    snprintf(l->name, sizeof(l->name), "%s", name);
+    l->next = *b;
+    *b = l;
+    return l;
+}
+
+static int load_running(const char *name) {
+    NodeLoad *l = load_find(name, 0);
+    return l ? l->running : 0;
+}
+
+static void job_free(Job *j) {
+    free(j);
+}
+
+static void queue_push(Job *j) {
+    j->next = NULL;
+    if (!j->queued_at) j->queued_at = time(NULL);
+    if (queue_tail) queue_tail->next = j;
+    else queue_head = j;
+    queue_tail = j;
+    queue_len++;
+}
+
+static void queue_remove(Job *j) {
+    Job *prev = NULL;
+    for (Job *q = queue_head; q; prev = q, q = q->next) {
+        if (q != j) continue;
+        if (prev) prev->next = q->next;
+        else queue_head = q->next;
+        if (queue_tail == q) queue_tail = prev;
+        queue_len--;
+        j->next = NULL;
+        return;
+    }
+}
+
+static void running_remove(Job *j) {
+    for (Job **p = &running; *p; p = &(*p)->next) {
+        if (*p == j) {
+            *p = j->next;
+            j->next = NULL;
+            return;
+        }
+    }
+}
+
+static void job_fail(Job *j, const char *why) {
+    cli_reply(j->client_id, "Submit %s failed: %s", j->id, why);
+    request_forget(j->attempt_id);
+    job_free(j);
+}
+
+static void place(Job *j);
+
+// --- sending ---
+
+typedef struct {
+    char node[256];
+    char attempt_id[REQUEST_ID_LEN];
+    char payload[];
+} Dispatch;
+
+static void dispatch_failed(Reactor *r, void *arg);
+
+static void dispatch_task(Reactor *r, void *arg) {
+    (void)r;
+    Dispatch *d = arg;
+    NodeSession *s = node_session_find_by_name(d->node);
+    if (s && s->connected && node_session_send(s, d->payload) >= 0) {
+        s->last_seen = time(NULL);
+        free(d);
+        return;
+    }
+    log_error("Failed to send submitted job %s to %s", d->attempt_id, d->node);
+    if (shard_post_front(dispatch_failed, d) < 0) free(d);
+}
+
+// Lost before it started: the same as losing the node under it.
+static void job_lost(Job *j);
+
+static void dispatch_failed(Reactor *r, void *arg) {
+    (void)r;
+    Dispatch *d = arg;
+    for (Job *j = running; j; j = j->next) {
+        if (strcmp(j->attempt_id, d->attempt_id) == 0 && strcmp(j->node, d->node) == 0) {
+            job_lost(j);
+            break;
+        }
+    }
+    free(d);
+}
+
+static void dispatch(Job *j, const char *node) {
+    NodeLoad *l = load_find(node, 1);
+    char *escaped = json_escape(j->cmd);
+    size_t size = escaped ? strlen(escaped) + strlen(j->attempt_id) + 48 : 0;
+    Dispatch *d = escaped && l ? malloc(sizeof(Dispatch) + size) : NULL;
+    if (!d) {
+        free(escaped);
+        job_fail(j, "out of memory");
+        return;
+    }
+    snprintf(d->node, sizeof(d->node), "%s", node);
+    snprintf(d->attempt_id, sizeof(d->attempt_id), "%s", j->attempt_id);
+    snprintf(d->payload, size, "{\"type\":\"exec\",\"id\":\"%s\",\"cmd\":\"%s\"}", j->attempt_id, escaped);
+    free(escaped);
+
+    snprintf(j->node, sizeof(j->node), "%s", node);
+    j->started_ms = now_ms();
+    j->queued_at = 0;
+    j->next = running;
+    running = j;
+    l->running++;
+    cli_reply(j->client_id, "Submitted %s to %s", j->attempt_id, node);
+    if (shard_post(shard_for_name(node), dispatch_task, d) < 0) {
+        free(d);
+        job_lost(j);
+    }
+}
+
+// --- choosing ---
+
+static int usable(const Job *j, const Candidate *c) {
+    return strcmp(c->name, j->avoid) != 0 && selector_match(j->selector, c->name) &&
+           load_running(c->name) < PLACEMENT_PER_NODE;
+}
+
+// 1 if a is the better of the two.
+static int better(const Candidate *a, const Candidate *b) {
+    NodeLoad *la = load_find(a->name, 0), *lb = load_find(b->name, 0);
+    int ra = la ? la->running : 0, rb = lb ? lb->running : 0;
+    if (ra != rb) return ra < rb;
+    double ma = la ? la->avg_ms : 0, mb = lb ? lb->avg_ms : 0;
+    if (ma != mb) return ma < mb;
+    return a->load1 <= b->load1;
+}
+
+// Places j on the better of two usable candidates picked at random.
+// Returns 1 if it went out, 0 if no candidate may take it, -1 if none
+// matches at all.
+static int place_from(Collect *c, Job *j) {
+    int usable_count = 0, matching = 0;
+    for (int s = 0; s < MAX_SHARDS; ++s) {
+        for (int i = 0; i < c->counts[s]; ++i) {
+            if (selector_match(j->selector, c->list[s][i].name)) matching++;
+            if (usable(j, &c->list[s][i])) usable_count++;
+        }
+    }
+    if (usable_count == 0) return matching ? 0 : -1;
+
+    int pick[2] = { rand_r(&seed) % usable_count, rand_r(&seed) % usable_count };
+    const Candidate *chosen[2] = { NULL, NULL };
+    int seen = 0;
+    for (int s = 0; s < MAX_SHARDS; ++s) {
+        for (int i = 0; i < c->counts[s]; ++i) {
+            if (!usable(j, &c->list[s][i])) continue;
+            for (int k = 0; k < 2; ++k) {
+                if (pick[k] == seen) chosen[k] = &c->list[s][i];
+            }
+            seen++;
+        }
+    }
+    const Candidate *best = better(chosen[0], chosen[1]) ? chosen[0] : chosen[1];
+    dispatch(j, best->name);
+    return 1;
+}
+
+static void collect_candidates(int shard, void *arg) {
+    Collect *c = arg;
+    int count = node_sessions_count();
+    if (count == 0) return;
+    NodeSession *sessions = malloc((size_t)count * sizeof(NodeSession));
+    c->list[shard] = malloc((size_t)count * sizeof(Candidate));
+    if (!sessions || !c->list[shard]) {
+        free(sessions);
+        return;
+    }
+    // the queue may hold any selector, so a sweep takes every node
+    const char *selector = c->job ? c->job->selector : "*";
+    int n = node_sessions_copy(sessions, count);
+    for (int i = 0; i < n; ++i) {
+        if (sessions[i].connected && selector_match(selector, sessions[i].meta.name)) {
+            Candidate *cand = &c->list[shard][c->counts[shard]++];
+            memcpy(cand->name, sessions[i].meta.name, sizeof(cand->name));
+            cand->load1 = sessions[i].load1;
+        }
+    }
+    free(sessions);
+}
+
+static void candidates_ready(Reactor *r, void *arg) {
+    (void)r;
+    Collect *c = arg;
+    Job *j = c->job;
+    if (!placement_reactor) {
+        // shut down meanwhile; the job went with nothing holding it
+        free(j);
+    } else if (j) {
+        int placed = place_from(c, j);
+        if (placed < 0 && j->attempts == 0) {
+            cli_reply(j->client_id, "Submit %s: no connected nodes match %s", j->id, j->selector);
+            request_forget(j->attempt_id);
+            job_free(j);
+        } else if (placed <= 0) {
+            // a retry waits even for no match: its nodes may come back
+            if (queue_len >= PLACEMENT_QUEUE_MAX) {
+                job_fail(j, "queue full");
+            } else {
+                queue_push(j);
+                cli_reply(j->client_id, "Queued %s: no free slot on %s", j->id, j->selector);
+            }
+        }
+    } else {
+        sweeping = 0;
+        // nodes that joined or freed up take the oldest jobs first
+        Job *q = queue_head;
+        queue_head = queue_tail = NULL;
+        queue_len = 0;
+        while (q) {
+            Job *next = q->next;
+            if (place_from(c, q) <= 0) queue_push(q);
+            q = next;
+        }
+    }
+    for (int i = 0; i < MAX_SHARDS; ++i) free(c->list[i]);
+    free(c);
+}
+
+static void place(Job *j) {
+    Collect *c = calloc(1, sizeof(Collect));
+    if (!c) {
+        job_fail(j, "out of memory");
+        return;
+    }
+    c->job = j;
+    if (shard_broadcast(collect_candidates, c, candidates_ready) < 0) {
+        free(c);
+        job_fail(j, "could not reach the shards");
+    }
+}
+
+// A slot on node freed up: the oldest queued job that may run there takes it.
+static void queue_drain(const char *node) {
+    for (Job *q = queue_head; q && load_running(node) < PLACEMENT_PER_NODE;) {
+        Job *next = q->next;
+        if (strcmp(q->avoid, node) != 0 && selector_match(q->selector, node)) {
+            queue_remove(q);
+            dispatch(q, node);
+        }
+        q = next;
+    }
+}
+
+// --- results and lost nodes ---
+
+static void job_lost(Job *j) {
+    running_remove(j);
+    NodeLoad *l = load_find(j->node, 0);
+    if (l && l->running > 0) l->running--;
+    request_forget(j->attempt_id);
+    snprintf(j->avoid, sizeof(j->avoid), "%s", j->node);
+    j->node[0] = '\0';
+    if (++j->attempts >= PLACEMENT_MAX_ATTEMPTS) {
+        cli_reply(j->client_id, "Submit %s failed: lost %d node(s), last %s", j->id, j->attempts, j->avoid);
+        job_free(j);
+        return;
+    }
+    snprintf(j->attempt_id, sizeof(j->attempt_id), "%.*s~%d", REQUEST_ID_LEN - 16, j->id, j->attempts);
+    if (request_track(j->attempt_id, j->client_id, 1) < 0) {
+        log_error("Failed to track request %s", j->attempt_id);
+    }
+    cli_reply(j->client_id, "Submit %s: lost %s, placing again as %s", j->id, j->avoid, j->attempt_id);
+    place(j);
+}
+
+void placement_result(const NodeResult *res) {
+    if (!placement_reactor) return;
+    for (Job *j = running; j; j = j->next) {
+        if (strcmp(j->attempt_id, res->id) != 0 || strcmp(j->node, res->node) != 0) continue;
+        running_remove(j);
+        NodeLoad *l = load_find(j->node, 0);
+        if (l) {
+            if (l->running > 0) l->running--;
+            double took = (double)(now_ms() - j->started_ms);
+            l->avg_ms = l->done ? l->avg_ms * 0.8 + took * 0.2 : took;
+            l->done++;
+        }
+        char node[256];
+        snprintf(node, sizeof(node), "%s", j->node);
+        job_free(j);
+        queue_drain(node);
+        return;
+    }
+}
+
+int placement_cancel(const char *id, char *attempt, size_t attempt_size) {
+    for (Job *q = queue_head; q; q = q->next) {
+        if (strcmp(q->id, id) != 0) continue;
+        queue_remove(q);
+        cli_reply(q->client_id, "Submit %s cancelled while queued", q->id);
+        request_forget(q->attempt_id);
+        job_free(q);
+        return 1;
+    }
+    for (Job *j = running; j; j = j->next) {
+        if (strcmp(j->id, id) == 0) {
+            snprintf(attempt, attempt_size, "%s", j->attempt_id);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+void placement_node_gone(const char *node) {
+    if (!placement_reactor) return;
+    Job *j = running;
+    while (j) {
+        Job *next = j->next;
+        if (strcmp(j->node, node) == 0) job_lost(j);
+        j = next;
+    }
+}
+
+int placement_submit(unsigned long client_id, const char *selector, const char *cmd) {
+    if (!placement_reactor) return -1;
+    if (!selector_valid(selector)) {
+        cli_reply(client_id, "Invalid selector %s", selector);
+        return -1;
+    }
+    size_t len = strlen(cmd);
+    Job *j = calloc(1, sizeof(Job) + len + 1);
+    if (!j) {
+        cli_reply(client_id, "Failed to submit to %s", selector);
+        return -1;
+    }
+    request_new_id(j->id, sizeof(j->id));
+    snprintf(j->attempt_id, sizeof(j->attempt_id), "%s", j->id);
+    j->client_id = client_id;
+    snprintf(j->selector, sizeof(j->selector), "%s", selector);
+    memcpy(j->cmd, cmd, len + 1);
+    if (request_track(j->attempt_id, client_id, 1) < 0) {
+        log_error("Failed to track request %s", j->attempt_id);
+    }
+    place(j);
+    return 0;
+}
+
+static void placement_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    time_t now = time(NULL);
+    for (Job *q = queue_head; q;) {
+        Job *next = q->next;
+        if (now - q->queued_at > PLACEMENT_QUEUE_TIMEOUT_S) {
+            queue_remove(q);
+            job_fail(q, "no free slot in time");
+        }
+        q = next;
+    }
+    if (!queue_head || sweeping) return;
+    Collect *c = calloc(1, sizeof(Collect));
+    if (!c) return;
+    sweeping = 1;
+    if (shard_broadcast(collect_candidates, c, candidates_ready) < 0) {
+        free(c);
+        sweeping = 0;
+    }
+}
+
+void placement_print(FILE *out) {
+    int any = 0;
+    for (int b = 0; b < LOAD_BUCKETS; ++b) {
+        for (NodeLoad *l = loads[b]; l; l = l->next) {
+            if (!any) fprintf(out, "Placement:\n");
+            any = 1;
+            fprintf(out, "  - %s: %d/%d running, %lu done, avg %.0f ms\n", l->name, l->running,
+                    PLACEMENT_PER_NODE, l->done, l->avg_ms);
+        }
+    }
+    if (!any) fprintf(out, "Placement: <none>\n");
+    time_t now = time(NULL);
+    fprintf(out, "Queued: %d\n", queue_len);
+    for (Job *q = queue_head; q; q = q->next) {
+        fprintf(out, "  - %s on %s for %lds: %s\n", q->attempt_id, q->selector, (long)(now - q->queued_at), q->cmd);
+    }
+}
+
+void placement_init(Reactor *front) {
+    placement_reactor = front;
+    seed = (unsigned int)time(NULL);
+    node_manager_on_session_end(placement_node_gone);
+    reactor_add_tick(front, PLACEMENT_SWEEP_MS, placement_tick, NULL);
+}
+
+void placement_shutdown(void) {
+    while (running) {
+        Job *j = running;
+        running = j->next;
+        job_free(j);
+    }
+    while (queue_head) {
+        Job *j = queue_head;
+        queue_head = j->next;
+        job_free(j);
+    }
+    queue_tail = NULL;
+    queue_len = 0;
+    for (int b = 0; b < LOAD_BUCKETS; ++b) {
+        while (loads[b]) {
+            NodeLoad *l = loads[b];
+            loads[b] = l->next;
+            free(l);
+        }
+    }
+    placement_reactor = NULL;
+}
@@ -0,0 +1,1216 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// IORING_RECV_MULTISHOT (6.0 headers) implies provided buffer rings
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define REACTOR_HAVE_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#include "../include/logging.h"
+#include "../include/mpsc.h"
+#include "../include/reactor.h"
+
+#define MAX_TICKS 16
+#define EPOLL_BATCH 256
+
+enum { HANDLE_FD = 1, HANDLE_STREAM = 2, HANDLE_LISTENER = 3 };
+
+typedef struct Handle {
+    int kind;
+    int fd;
+    unsigned events;
+    reactor_fd_cb cb;
+    reactor_accept_cb accept_cb;
+    void *ctx;
+    ReactorStream *stream;
+    int slot;               // index in Reactor.handles
+    int dead;
+    struct Handle *next_dead;
+    reactor_detach_cb detach_cb;
+    void *detach_ctx;
+
+    // io_uring: the handle outlives its submitted operations
+    int inflight;
+    int armed;              // recv, poll or accept outstanding
+    int sends;              // linked sends outstanding
+    int send_failed;
+    int zombie;
+    IpcWriter sending;      // bytes owned by the in-flight sends
+} Handle;
+
+typedef struct {
+    MpscNode node;
+    reactor_task_fn fn;
+    void *arg;
+} ReactorTask;
+
+typedef struct {
+    int interval_ms;
+    long long next_due;
+    reactor_task_fn fn;
+    void *arg;
+} ReactorTick;
+
+#ifdef REACTOR_HAVE_URING
+#define URING_SQ_ENTRIES 4096
+#define URING_CQ_ENTRIES 16384
+#define URING_BUF_COUNT 512
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BUF_GROUP 0
+#define URING_SEND_CHUNK (64 * 1024)
+#define URING_MAX_LINKED_SENDS 16
+// pause after the kernel refused a submission and nothing was left to reap
+#define URING_BUSY_BACKOFF_NS 1000000
+
+typedef struct {
+    int fd;
+    void *ring;
+    size_t ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;
+
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    char *bufs;
+    unsigned short br_tail;
+
+    // cleared when the kernel rejects the multishot variants
+    int multishot_recv;
+    int multishot_accept;
+} Uring;
+#endif
+
+struct Reactor {
+    ReactorBackend backend;
+    int epfd;
+    Handle **handles;
+    int nhandles;
+    int cap;
+    Handle *dead;
+    int nzombies;
+    ReactorStream *failed;      // streams whose send failed, closed at end of iteration
+    struct pollfd *pfds;
+    Handle **pfd_handles;
+    int pfds_cap;
+#ifdef REACTOR_HAVE_URING
+    Uring *uring;
+#endif
+
+    MpscQueue tasks;
+    int wake_pending;
+    int wake_rd;
+    int wake_wr;
+    int stop;
+
+    ReactorTick ticks[MAX_TICKS];
+    int nticks;
+};
+
+static __thread Reactor *tls_reactor = NULL;
+
+static void stream_fail(ReactorStream *s);
+static void stream_close_on_error(ReactorStream *s);
+static void handle_finish(Reactor *r, Handle *h);
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Reactor *reactor_current(void) {
+    return tls_reactor;
+}
+
+const char *reactor_backend_name(const Reactor *r) {
+    if (!r) return "none";
+    switch (r->backend) {
+        case REACTOR_BACKEND_URING: return "io_uring";
+        case REACTOR_BACKEND_EPOLL: return "epoll";
+        case REACTOR_BACKEND_POLL: return "poll";
+        default: return "auto";
+    }
+}
+
+ReactorBackend reactor_backend_parse(const char *name) {
+    if (!name || !name[0] || strcmp(name, "auto") == 0) return REACTOR_BACKEND_AUTO;
+    if (strcmp(name, "io_uring") == 0 || strcmp(name, "uring") == 0) return REACTOR_BACKEND_URING;
+    if (strcmp(name, "epoll") == 0) return REACTOR_BACKEND_EPOLL;
+    if (strcmp(name, "poll") == 0) return REACTOR_BACKEND_POLL;
+    log_error("Unknown io_backend '%s', using auto", name);
+    return REACTOR_BACKEND_AUTO;
+}
+
+// --- io_uring ---
+//
+// Completion-based backend. Each stream keeps one multishot recv armed that
+// takes buffers from a provided buffer ring, so idle connections pin no
+// receive memory; the bytes are copied into the stream's IpcReader and the
+// buffer goes straight back to the ring. Queued output goes to the kernel
+// as a chain of linked sends. Plain fds use one-shot polls re-armed after
+// each callback, which keeps them level-triggered, and listeners use
+// multishot accept.
+
+#ifdef REACTOR_HAVE_URING
+
+enum { OP_IGNORE = 0, OP_POLL = 1, OP_RECV = 2, OP_SEND = 3, OP_ACCEPT = 4 };
+#define OP_MASK 7ULL
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+// Handles come from calloc, so the low bits of their address carry the op.
+static inline uint64_t op_tag(Handle *h, int op) {
+    return (uint64_t)(uintptr_t)h | (uint64_t)op;
+}
+
+static void uring_free(Uring *u) {
+    if (!u) return;
+    if (u->br) munmap(u->br, u->br_sz);
+    free(u->bufs);
+    if (u->sqes) munmap(u->sqes, u->sqes_sz);
+    if (u->ring) munmap(u->ring, u->ring_sz);
+    if (u->fd >= 0) close(u->fd);
+    free(u);
+}
+
+static int uring_probe(int fd) {
+    static const int needed[] = {
+        IORING_OP_POLL_ADD, IORING_OP_ACCEPT, IORING_OP_RECV,
+        IORING_OP_SEND, IORING_OP_ASYNC_CANCEL,
+    };
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    if (!probe) return -1;
+    int ok = sys_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        int op = needed[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+    }
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+static void uring_recycle_buffer(Uring *u, unsigned short bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static Uring *uring_create(void) {
+    Uring *u = calloc(1, sizeof(Uring));
+    if (!u) return NULL;
+    u->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = sys_uring_setup(URING_SQ_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        // older kernels know neither SUBMIT_ALL nor COOP_TASKRUN
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        u->fd = sys_uring_setup(URING_SQ_ENTRIES, &p);
+    }
+    if (u->fd < 0) {
+        log_error("io_uring_setup failed: %s", strerror(errno));
+        uring_free(u);
+        return NULL;
+    }
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need || uring_probe(u->fd) < 0) {
+        log_error("io_uring lacks required features (0x%x)", p.features);
+        uring_free(u);
+        return NULL;
+    }
+
+    // SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    u->ring = mmap(NULL, u->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        log_error("io_uring ring mmap failed: %s", strerror(errno));
+        u->ring = NULL;
+        uring_free(u);
+        return NULL;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        log_error("io_uring sqe mmap failed: %s", strerror(errno));
+        u->sqes = NULL;
+        uring_free(u);
+        return NULL;
+    }
+
+    char *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // one provided buffer ring shared by every recv on this reactor
+    u->br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) u->br = NULL;
+    u->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!u->br || !u->bufs) {
+        log_error("io_uring buffer ring allocation failed");
+        uring_free(u);
+        return NULL;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_error("io_uring buffer ring registration failed: %s", strerror(errno));
+        uring_free(u);
+        return NULL;
+    }
+    for (unsigned i = 0; i < URING_BUF_COUNT; ++i) uring_recycle_buffer(u, (unsigned short)i);
+
+    u->multishot_recv = 1;
+    u->multishot_accept = 1;
+    return u;
+}
+
+// Submits everything queued and, unless wait_ms is 0, waits up to wait_ms
+// for a completion. Returns -1 with errno set on failure.
+static int uring_enter(Uring *u, int wait_ms) {
+    int rc;
+    if (wait_ms != 0) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = wait_ms / 1000;
+        ts.tv_nsec = (long long)(wait_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        rc = sys_uring_enter(u->fd, u->unsubmitted, 1,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        if (u->unsubmitted == 0) return 0;
+        rc = sys_uring_enter(u->fd, u->unsubmitted, 0, 0, NULL, 0);
+    }
+    if (rc >= 0) {
+        u->unsubmitted -= (unsigned)rc < u->unsubmitted ? (unsigned)rc : u->unsubmitted;
+        return 0;
+    }
+    if (errno == ETIME || errno == EINTR) return 0;
+    return -1;
+}
+
+static struct io_uring_sqe *uring_sqe(Uring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0) < 0) {
+            log_error("io_uring submit failed: %s", strerror(errno));
+            return NULL;
+        }
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->unsubmitted++;
+    return sqe;
+}
+
+static int uring_arm_poll(Reactor *r, Handle *h) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = h->fd;
+    sqe->poll32_events = ((h->events & REACTOR_READ) ? POLLIN : 0) |
+                         ((h->events & REACTOR_WRITE) ? POLLOUT : 0);
+    sqe->user_data = op_tag(h, OP_POLL);
+    h->armed = 1;
+    h->inflight++;
+    return 0;
+}
+
+static int uring_arm_accept(Reactor *r, Handle *h) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = h->fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (r->uring->multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = op_tag(h, OP_ACCEPT);
+    h->armed = 1;
+    h->inflight++;
+    return 0;
+}
+
+static int uring_arm_recv(Reactor *r, Handle *h) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = h->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    if (r->uring->multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+    else sqe->len = URING_BUF_SIZE;
+    sqe->user_data = op_tag(h, OP_RECV);
+    h->armed = 1;
+    h->inflight++;
+    return 0;
+}
+
+// Hands the stream's queued bytes to the kernel as one chain of linked
+// sends, so the chunks go out in order without a round trip between them.
+// New writes queue up in s->tx meanwhile. A short or failed send breaks the
+// chain; whatever is left is resubmitted once every link has completed.
+static void uring_send_start(Reactor *r, Handle *h) {
+    ReactorStream *s = h->stream;
+    if (h->sends > 0 || s->closed) return;
+    if (h->sending.off == h->sending.len) {
+        if (s->tx.off == s->tx.len) return;
+        IpcWriter spare = h->sending;
+        h->sending = s->tx;
+        s->tx = spare;
+        s->tx.off = s->tx.len = 0;
+    }
+
+    size_t off = h->sending.off;
+    for (int i = 0; i < URING_MAX_LINKED_SENDS && off < h->sending.len; ++i) {
+        size_t len = h->sending.len - off;
+        if (len > URING_SEND_CHUNK) len = URING_SEND_CHUNK;
+        struct io_uring_sqe *sqe = uring_sqe(r->uring);
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = h->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(h->sending.buf + off);
+        sqe->len = (unsigned)len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = op_tag(h, OP_SEND);
+        off += len;
+        if (off < h->sending.len && i + 1 < URING_MAX_LINKED_SENDS) sqe->flags = IOSQE_IO_LINK;
+        h->sends++;
+        h->inflight++;
+    }
+    if (h->sends == 0) stream_fail(s);
+}
+
+static void uring_cancel(Reactor *r, Handle *h, int op) {
+    struct io_uring_sqe *sqe = uring_sqe(r->uring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op_tag(h, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = OP_IGNORE;
+}
+
+static void uring_on_recv(Reactor *r, Handle *h, const struct io_uring_cqe *cqe) {
+    Uring *u = r->uring;
+    ReactorStream *s = h->stream;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        h->armed = 0;
+        h->inflight--;
+    }
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        // a detached stream keeps collecting bytes for its next owner
+        int rc = ipc_reader_feed(&s->rx, u->bufs + (size_t)bid * URING_BUF_SIZE, (size_t)cqe->res);
+        uring_recycle_buffer(u, bid);
+        if (!h->dead) {
+            if (rc < 0) {
+                // what ipc_reader_fill() says on the readiness backends
+                log_error("Message on fd=%d exceeds %zu bytes, dropping connection", s->fd, s->rx.max);
+                stream_close_on_error(s);
+            } else {
+                s->ops->on_input(s, s->ctx);
+            }
+        }
+    } else if (cqe->res == -EINVAL && u->multishot_recv) {
+        log_error("io_uring: multishot recv unsupported, using one-shot recv");
+        u->multishot_recv = 0;
+    } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        if (!h->dead) stream_close_on_error(s);
+        return;
+    }
+
+    if (!h->dead && !h->armed) uring_arm_recv(r, h);
+}
+
+static void uring_on_send(Reactor *r, Handle *h, const struct io_uring_cqe *cqe) {
+    h->sends--;
+    h->inflight--;
+    if (cqe->res > 0) {
+        h->sending.off += (size_t)cqe->res;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        h->send_failed = 1;
+    }
+    if (h->sends > 0 || h->dead) return;
+    if (h->send_failed) {
+        stream_fail(h->stream);
+        return;
+    }
+    if (h->sending.off == h->sending.len) h->sending.off = h->sending.len = 0;
+    uring_send_start(r, h);
+    ReactorStream *s = h->stream;
+    if (h->sends == 0 && !s->closed && s->ops->on_drain && reactor_stream_pending(s) == 0) {
+        s->ops->on_drain(s, s->ctx);
+    }
+}
+
+static void uring_on_poll(Reactor *r, Handle *h, const struct io_uring_cqe *cqe) {
+    h->armed = 0;
+    h->inflight--;
+    if (h->dead) return;
+    if (cqe->res == -ECANCELED) {
+        // reactor_modify_fd() changed the events; poll for the new ones
+        uring_arm_poll(r, h);
+        return;
+    }
+    unsigned ev = 0;
+    if (cqe->res < 0) {
+        ev = REACTOR_ERROR;
+    } else {
+        if (cqe->res & POLLIN) ev |= REACTOR_READ;
+        if (cqe->res & POLLOUT) ev |= REACTOR_WRITE;
+        if (cqe->res & (POLLHUP | POLLERR | POLLNVAL)) ev |= REACTOR_ERROR;
+    }
+    h->cb(r, h->fd, ev, h->ctx);
+    if (!h->dead && !h->armed) uring_arm_poll(r, h);
+}
+
+static void uring_on_accept(Reactor *r, Handle *h, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        h->armed = 0;
+        h->inflight--;
+    }
+    if (cqe->res >= 0) {
+        if (h->dead) {
+            close(cqe->res);
+        } else {
+            log_info("Accepted connection fd=%d", cqe->res);
+            h->accept_cb(r, cqe->res, h->ctx);
+        }
+    } else if (cqe->res == -EINVAL && r->uring->multishot_accept) {
+        log_error("io_uring: multishot accept unsupported, using one-shot accept");
+        r->uring->multishot_accept = 0;
+    } else if (cqe->res != -ECANCELED) {
+        log_error("accept() failed: %s", strerror(-cqe->res));
+    }
+    if (!h->dead && !h->armed) uring_arm_accept(r, h);
+}
+
+static int uring_process(Reactor *r) {
+    Uring *u = r->uring;
+    unsigned head = *u->cq_head;
+    int handled = 0;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+        head++;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        handled++;
+
+        int op = (int)(cqe.user_data & OP_MASK);
+        Handle *h = (Handle *)(uintptr_t)(cqe.user_data & ~OP_MASK);
+        if (op == OP_IGNORE || !h) continue;
+        switch (op) {
+            case OP_RECV: uring_on_recv(r, h, &cqe); break;
+            case OP_SEND: uring_on_send(r, h, &cqe); break;
+            case OP_POLL: uring_on_poll(r, h, &cqe); break;
+            case OP_ACCEPT: uring_on_accept(r, h, &cqe); break;
+            default: break;
+        }
+        if (h->zombie && h->inflight == 0) {
+            r->nzombies--;
+            handle_finish(r, h);
+        }
+    }
+    return handled;
+}
+
+static int wait_uring(Reactor *r, int timeout) {
+    if (uring_enter(r->uring, timeout) < 0) {
+        if (errno != EBUSY && errno != EAGAIN) return -1;
+        // completions the kernel could not post yet (EBUSY) or no memory
+        // for the submission just now (EAGAIN): reap what is there; what
+        // is still unsubmitted goes in again next round
+        int handled = uring_process(r);
+        if (handled == 0) {
+            struct timespec ts = { 0, URING_BUSY_BACKOFF_NS };
+            nanosleep(&ts, NULL);
+        }
+        return handled;
+    }
+    return uring_process(r);
+}
+
+#endif
+
+// --- backend primitives ---
+
+#ifdef __linux__
+static unsigned to_epoll(unsigned events) {
+    unsigned e = 0;
+    if (events & REACTOR_READ) e |= EPOLLIN;
+    if (events & REACTOR_WRITE) e |= EPOLLOUT;
+    return e;
+}
+#endif
+
+static int backend_add(Reactor *r, Handle *h) {
+#ifdef REACTOR_HAVE_URING
+    if (r->backend == REACTOR_BACKEND_URING) {
+        switch (h->kind) {
+            case HANDLE_STREAM: return uring_arm_recv(r, h);
+            case HANDLE_LISTENER: return uring_arm_accept(r, h);
+            default: return uring_arm_poll(r, h);
+        }
+    }
+#endif
+#ifdef __linux__
+    if (r->backend == REACTOR_BACKEND_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = to_epoll(h->events);
+        ev.data.ptr = h;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+            log_error("epoll_ctl(ADD fd=%d) failed: %s", h->fd, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+    (void)r;
+    (void)h;
+    return 0;
+}
+
+static void backend_mod(Reactor *r, Handle *h) {
+#ifdef __linux__
+    if (r->backend == REACTOR_BACKEND_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = to_epoll(h->events);
+        ev.data.ptr = h;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, h->fd, &ev);
+    }
+#endif
+    (void)r;
+    (void)h;
+}
+
+static void backend_del(Reactor *r, Handle *h) {
+#ifdef REACTOR_HAVE_URING
+    if (r->backend == REACTOR_BACKEND_URING) {
+        if (h->armed) {
+            int op = h->kind == HANDLE_STREAM ? OP_RECV : h->kind == HANDLE_LISTENER ? OP_ACCEPT : OP_POLL;
+            uring_cancel(r, h, op);
+        }
+        if (h->sends > 0) uring_cancel(r, h, OP_SEND);
+        return;
+    }
+#endif
+#ifdef __linux__
+    if (r->backend == REACTOR_BACKEND_EPOLL) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+    }
+#endif
+    (void)r;
+    (void)h;
+}
+
+// --- handle registry ---
+
+static Handle *handle_new(Reactor *r, int kind, int fd, unsigned events, ReactorStream *stream) {
+    if (r->nhandles == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 64;
+        Handle **n = realloc(r->handles, (size_t)cap * sizeof(Handle *));
+        if (!n) return NULL;
+        r->handles = n;
+        r->cap = cap;
+    }
+    Handle *h = calloc(1, sizeof(Handle));
+    if (!h) return NULL;
+    h->kind = kind;
+    h->fd = fd;
+    h->events = events;
+    h->stream = stream;
+    ipc_writer_init(&h->sending);
+    if (backend_add(r, h) < 0) {
+        free(h);
+        return NULL;
+    }
+    h->slot = r->nhandles;
+    r->handles[r->nhandles++] = h;
+    return h;
+}
+
+static void handle_kill(Reactor *r, Handle *h) {
+    if (h->dead) return;
+    backend_del(r, h);
+    h->dead = 1;
+    int last = r->nhandles - 1;
+    r->handles[h->slot] = r->handles[last];
+    r->handles[h->slot]->slot = h->slot;
+    r->nhandles--;
+    h->next_dead = r->dead;
+    r->dead = h;
+}
+
+// Releases a dead handle once no kernel operation refers to it any more.
+static void handle_finish(Reactor *r, Handle *h) {
+    (void)r;
+    ReactorStream *s = h->stream;
+    if (h->detach_cb) {
+        size_t len = 0;
+        const char *pending = ipc_reader_pending(&s->rx, &len);
+        // sends cut short by the detach come first, then what was queued
+        IpcWriter *unsent = &s->tx;
+        if (ipc_writer_pending(&h->sending) > 0) {
+            unsent = &h->sending;
+            if (ipc_writer_pending(&s->tx) > 0 &&
+                ipc_writer_append(unsent, s->tx.buf + s->tx.off, ipc_writer_pending(&s->tx)) < 0) {
+                log_error("Lost output of detached fd=%d", h->fd);
+            }
+        }
+        h->detach_cb(h->fd, pending, len, unsent->buf ? unsent->buf + unsent->off : NULL,
+                     ipc_writer_pending(unsent), h->detach_ctx);
+    }
+    if (s) {
+        ipc_reader_free(&s->rx);
+        ipc_writer_free(&s->tx);
+        free(s);
+    }
+    ipc_writer_free(&h->sending);
+    free(h);
+}
+
+static void reap_dead(Reactor *r) {
+    while (r->failed) {
+        ReactorStream *s = r->failed;
+        r->failed = s->next_failed;
+        s->next_failed = NULL;
+        s->fail_pending = 0;
+        if (s->closed) continue;
+        stream_close_on_error(s);
+    }
+    while (r->dead) {
+        Handle *h = r->dead;
+        r->dead = h->next_dead;
+        if (h->inflight > 0) {
+            h->zombie = 1;
+            r->nzombies++;
+        } else {
+            handle_finish(r, h);
+        }
+    }
+}
+
+// --- wakeups and cross-thread tasks ---
+
+static void drain_tasks(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)fd;
+    (void)events;
+    (void)ctx;
+#ifdef __linux__
+    uint64_t v;
+    ssize_t n = read(r->wake_rd, &v, sizeof(v));
+    (void)n;
+#else
+    char buf[64];
+    while (read(r->wake_rd, buf, sizeof(buf)) > 0) {}
+#endif
+    // clear the flag before draining so a push racing with the drain
+    // always produces a fresh wakeup
+    __atomic_store_n(&r->wake_pending, 0, __ATOMIC_SEQ_CST);
+    MpscNode *node;
+    while ((node = mpsc_pop(&r->tasks)) != NULL) {
+        ReactorTask *t = (ReactorTask *)node;
+        t->fn(r, t->arg);
+        free(t);
+    }
+}
+
+static void wake(Reactor *r) {
+    if (__atomic_exchange_n(&r->wake_pending, 1, __ATOMIC_SEQ_CST)) return;
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = write(r->wake_wr, &one, sizeof(one));
+#else
+    char c = 1;
+    ssize_t n = write(r->wake_wr, &c, 1);
+#endif
+    (void)n;
+}
+
+int reactor_post(Reactor *r, reactor_task_fn fn, void *arg) {
+    if (!r || !fn) return -1;
+    ReactorTask *t = malloc(sizeof(ReactorTask));
+    if (!t) return -1;
+    t->fn = fn;
+    t->arg = arg;
+    mpsc_push(&r->tasks, &t->node);
+    wake(r);
+    return 0;
+}
+
+void reactor_stop(Reactor *r) {
+    if (!r) return;
+    __atomic_store_n(&r->stop, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->wake_pending, 0, __ATOMIC_SEQ_CST);
+    wake(r);
+}
+
+// --- lifecycle ---
+
+Reactor *reactor_create(ReactorBackend backend) {
+    Reactor *r = calloc(1, sizeof(Reactor));
+    if (!r) return NULL;
+    r->epfd = -1;
+    r->wake_rd = r->wake_wr = -1;
+    mpsc_init(&r->tasks);
+
+    // auto prefers io_uring, then epoll; each falls back to the next one
+    // when the kernel does not support it
+    int requested = backend;
+    if (backend == REACTOR_BACKEND_AUTO) {
+#ifdef __linux__
+        backend = REACTOR_BACKEND_URING;
+#else
+        backend = REACTOR_BACKEND_POLL;
+#endif
+    }
+#ifdef REACTOR_HAVE_URING
+    if (backend == REACTOR_BACKEND_URING) {
+        r->uring = uring_create();
+        if (!r->uring) backend = REACTOR_BACKEND_EPOLL;
+    }
+#else
+    if (backend == REACTOR_BACKEND_URING) backend = REACTOR_BACKEND_EPOLL;
+#endif
+#ifdef __linux__
+    if (backend == REACTOR_BACKEND_EPOLL) {
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            log_error("epoll_create1 failed (%s), falling back to poll", strerror(errno));
+            backend = REACTOR_BACKEND_POLL;
+        }
+    }
+#else
+    backend = REACTOR_BACKEND_POLL;
+#endif
+    r->backend = backend;
+    if (requested != REACTOR_BACKEND_AUTO && (int)backend != requested) {
+        log_error("io backend %s unavailable, using %s",
+                  requested == REACTOR_BACKEND_URING ? "io_uring" : "epoll", reactor_backend_name(r));
+    }
+
+#ifdef __linux__
+    r->wake_rd = r->wake_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_rd < 0) {
+        log_error("eventfd failed: %s", strerror(errno));
+        reactor_destroy(r);
+        return NULL;
+    }
+#else
+    int p[2];
+    if (pipe(p) < 0) {
+        log_error("pipe failed: %s", strerror(errno));
+        reactor_destroy(r);
+        return NULL;
+    }
+    set_nonblocking(p[0]);
+    set_nonblocking(p[1]);
+    r->wake_rd = p[0];
+    r->wake_wr = p[1];
+#endif
+    if (reactor_watch_fd(r, r->wake_rd, REACTOR_READ, drain_tasks, NULL) < 0) {
+        reactor_destroy(r);
+        return NULL;
+    }
+    return r;
+}
+
+void reactor_destroy(Reactor *r) {
+    if (!r) return;
+    while (r->nhandles > 0) {
+        Handle *h = r->handles[r->nhandles - 1];
+        if (h->kind == HANDLE_STREAM && h->stream && !h->stream->closed) {
+            reactor_stream_close(h->stream);
+        } else {
+            handle_kill(r, h);
+        }
+    }
+    reap_dead(r);
+#ifdef REACTOR_HAVE_URING
+    if (r->uring) {
+        // let the cancellations land so nothing is freed under the kernel
+        for (int i = 0; i < 50 && r->nzombies > 0; ++i) {
+            if (wait_uring(r, 20) < 0) break;
+        }
+        uring_free(r->uring);
+    }
+#endif
+    MpscNode *node;
+    while ((node = mpsc_pop(&r->tasks)) != NULL) free(node);
+    if (r->wake_wr >= 0 && r->wake_wr != r->wake_rd) close(r->wake_wr);
+    if (r->wake_rd >= 0) close(r->wake_rd);
+    if (r->epfd >= 0) close(r->epfd);
+    free(r->handles);
+    free(r->pfds);
+    free(r->pfd_handles);
+    free(r);
+}
+
+// --- plain fds ---
+
+int reactor_watch_fd(Reactor *r, int fd, unsigned events, reactor_fd_cb cb, void *ctx) {
+    if (!r || fd < 0 || !cb) return -1;
+    Handle *h = handle_new(r, HANDLE_FD, fd, events, NULL);
+    if (!h) return -1;
+    h->cb = cb;
+    h->ctx = ctx;
+    return 0;
+}
+
+int reactor_modify_fd(Reactor *r, int fd, unsigned events) {
+    if (!r) return -1;
+    for (int i = 0; i < r->nhandles; ++i) {
+        Handle *h = r->handles[i];
+        if (h->kind != HANDLE_FD || h->fd != fd) continue;
+        if (h->events == events) return 0;
+        h->events = events;
+#ifdef REACTOR_HAVE_URING
+        // an armed one-shot poll still waits for the old events; inside the
+        // fd's own callback it is not armed and gets re-armed afterwards
+        if (r->backend == REACTOR_BACKEND_URING) {
+            if (h->armed) uring_cancel(r, h, OP_POLL);
+            return 0;
+        }
+#endif
+        backend_mod(r, h);
+        return 0;
+    }
+    return -1;
+}
+
+void reactor_unwatch_fd(Reactor *r, int fd) {
+    if (!r) return;
+    for (int i = 0; i < r->nhandles; ++i) {
+        Handle *h = r->handles[i];
+        if ((h->kind == HANDLE_FD || h->kind == HANDLE_LISTENER) && h->fd == fd) {
+            handle_kill(r, h);
+            return;
+        }
+    }
+}
+
+// --- listeners ---
+
+int reactor_watch_listener(Reactor *r, int fd, reactor_accept_cb cb, void *ctx) {
+    if (!r || fd < 0 || !cb) return -1;
+    set_nonblocking(fd);
+    Handle *h = handle_new(r, HANDLE_LISTENER, fd, REACTOR_READ, NULL);
+    if (!h) return -1;
+    h->accept_cb = cb;
+    h->ctx = ctx;
+    return 0;
+}
+
+static void listener_on_ready(Reactor *r, Handle *h) {
+    // take everything in the backlog
+    while (!h->dead) {
+        int cfd = ipc_accept_connection(h->fd);
+        if (cfd < 0) break;
+        h->accept_cb(r, cfd, h->ctx);
+    }
+}
+
+// --- streams ---
+
+ReactorStream *reactor_stream_open(Reactor *r, int fd, const ReactorStreamOps *ops, void *ctx) {
+    if (!r || fd < 0 || !ops) return NULL;
+    ReactorStream *s = calloc(1, sizeof(ReactorStream));
+    if (!s) return NULL;
+    set_nonblocking(fd);
+    s->fd = fd;
+    s->ops = ops;
+    s->ctx = ctx;
+    s->owner = r;
+    ipc_reader_init(&s->rx);
+    ipc_writer_init(&s->tx);
+
+    Handle *h = handle_new(r, HANDLE_STREAM, fd, REACTOR_READ, s);
+    if (!h) {
+        free(s);
+        return NULL;
+    }
+    s->backend = h;
+    return s;
+}
+
+static void stream_fail(ReactorStream *s) {
+    if (s->closed || s->fail_pending) return;
+    Reactor *r = s->owner;
+    s->fail_pending = 1;
+    s->next_failed = r->failed;
+    r->failed = s;
+}
+
+static void stream_close_on_error(ReactorStream *s) {
+    if (s->ops && s->ops->on_close) s->ops->on_close(s, s->ctx);
+    reactor_stream_close(s);
+}
+
+static void stream_set_write(ReactorStream *s, int on) {
+    Handle *h = s->backend;
+    if (s->want_write == on || !h) return;
+    s->want_write = on;
+    h->events = on ? (REACTOR_READ | REACTOR_WRITE) : REACTOR_READ;
+    backend_mod(s->owner, h);
+}
+
+int reactor_stream_write(ReactorStream *s, const char *buf, size_t len) {
+    if (!s || s->closed) return -1;
+    if (ipc_writer_append(&s->tx, buf, len) < 0) {
+        log_error("Send queue overflow on fd=%d, closing", s->fd);
+        stream_fail(s);
+        return -1;
+    }
+#ifdef REACTOR_HAVE_URING
+    if (s->owner->backend == REACTOR_BACKEND_URING) {
+        uring_send_start(s->owner, s->backend);
+        return 0;
+    }
+#endif
+    if (s->want_write) return 0;
+    int rc = ipc_writer_flush(&s->tx, s->fd);
+    if (rc < 0) {
+        stream_fail(s);
+        return -1;
+    }
+    if (rc == 0) stream_set_write(s, 1);
+    return 0;
+}
+
+size_t reactor_stream_pending(const ReactorStream *s) {
+    if (!s || s->closed) return 0;
+    const Handle *h = s->backend;
+    return ipc_writer_pending(&s->tx) + (h ? ipc_writer_pending(&h->sending) : 0);
+}
+
+static void stream_release(ReactorStream *s) {
+    Handle *h = s->backend;
+    s->closed = 1;
+    if (h) handle_kill(s->owner, h);
+}
+
+void reactor_stream_close(ReactorStream *s) {
+    if (!s || s->closed) return;
+    int fd = s->fd;
+    stream_release(s);
+    close(fd);
+    s->fd = -1;
+}
+
+int reactor_stream_detach(ReactorStream *s, reactor_detach_cb cb, void *ctx) {
+    if (!s || s->closed || !cb) return -1;
+    Handle *h = s->backend;
+    h->detach_cb = cb;
+    h->detach_ctx = ctx;
+    stream_release(s);
+    return 0;
+}
+
+static void stream_on_ready(Reactor *r, ReactorStream *s, unsigned events) {
+    (void)r;
+    if (s->closed) return;
+
+    if (events & REACTOR_WRITE) {
+        int rc = ipc_writer_flush(&s->tx, s->fd);
+        if (rc < 0) {
+            stream_fail(s);
+            return;
+        }
+        if (rc == 1) {
+            stream_set_write(s, 0);
+            if (s->ops->on_drain) s->ops->on_drain(s, s->ctx);
+            if (s->closed) return;
+        }
+    }
+
+    if (events & (REACTOR_READ | REACTOR_ERROR)) {
+        ssize_t n = ipc_reader_fill(&s->rx, s->fd);
+        if (n > 0) {
+            s->ops->on_input(s, s->ctx);
+        } else if (n == 0 || n == -1) {
+            stream_close_on_error(s);
+        }
+    }
+}
+
+static void handle_ready(Reactor *r, Handle *h, unsigned events) {
+    if (h->dead) return;
+    switch (h->kind) {
+        case HANDLE_FD: h->cb(r, h->fd, events, h->ctx); break;
+        case HANDLE_LISTENER: listener_on_ready(r, h); break;
+        default: stream_on_ready(r, h->stream, events); break;
+    }
+}
+
+// --- ticks ---
+
+int reactor_add_tick(Reactor *r, int interval_ms, reactor_task_fn fn, void *arg) {
+    if (!r || !fn || interval_ms <= 0 || r->nticks >= MAX_TICKS) return -1;
+    ReactorTick *t = &r->ticks[r->nticks++];
+    t->interval_ms = interval_ms;
+    t->next_due = now_ms() + interval_ms;
+    t->fn = fn;
+    t->arg = arg;
+    return 0;
+}
+
+static int run_ticks(Reactor *r) {
+    long long now = now_ms();
+    int timeout = 1000;
+    for (int i = 0; i < r->nticks; ++i) {
+        ReactorTick *t = &r->ticks[i];
+        if (now >= t->next_due) {
+            t->fn(r, t->arg);
+            t->next_due = now + t->interval_ms;
+        }
+        long long left = t->next_due - now;
+        if (left < timeout) timeout = (int)(left > 0 ? left : 0);
+    }
+    return timeout;
+}
+
+// --- loop ---
+
+static int wait_poll(Reactor *r, int timeout) {
+    if (r->pfds_cap < r->nhandles) {
+        int cap = r->nhandles * 2;
+        struct pollfd *p = realloc(r->pfds, (size_t)cap * sizeof(struct pollfd));
+        if (!p) return -1;
+        r->pfds = p;
+        Handle **hs = realloc(r->pfd_handles, (size_t)cap * sizeof(Handle *));
+        if (!hs) return -1;
+        r->pfd_handles = hs;
+        r->pfds_cap = cap;
+    }
+    // handles can come and go while callbacks run, so work off a snapshot
+    int n = r->nhandles;
+    Handle **snapshot = r->pfd_handles;
+    for (int i = 0; i < n; ++i) {
+        Handle *h = r->handles[i];
+        snapshot[i] = h;
+        r->pfds[i].fd = h->fd;
+        r->pfds[i].events = (short)(((h->events & REACTOR_READ) ? POLLIN : 0) |
+                                    ((h->events & REACTOR_WRITE) ? POLLOUT : 0));
+        r->pfds[i].revents = 0;
+    }
+    int rc = poll(r->pfds, (nfds_t)n, timeout);
+    if (rc > 0) {
+        for (int i = 0; i < n; ++i) {
+            short re = r->pfds[i].revents;
+            if (!re) continue;
+            unsigned ev = 0;
+            if (re & POLLIN) ev |= REACTOR_READ;
+            if (re & POLLOUT) ev |= REACTOR_WRITE;
+            if (re & (POLLHUP | POLLERR | POLLNVAL)) ev |= REACTOR_ERROR;
+            handle_ready(r, snapshot[i], ev);
+        }
+    }
+    return rc;
+}
+
+#ifdef __linux__
+static int wait_epoll(Reactor *r, int timeout) {
+    struct epoll_event events[EPOLL_BATCH];
+    int rc = epoll_wait(r->epfd, events, EPOLL_BATCH, timeout);
+    for (int i = 0; i < rc; ++i) {
+        unsigned ev = 0;
+        if (events[i].events & EPOLLIN) ev |= REACTOR_READ;
+        if (events[i].events & EPOLLOUT) ev |= REACTOR_WRITE;
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) ev |= REACTOR_ERROR;
+        handle_ready(r, events[i].data.ptr, ev);
+    }
+    return rc;
+}
+#endif
+
+void reactor_run(Reactor *r) {
+    if (!r) return;
+    tls_reactor = r;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST)) {
+        int timeout = run_ticks(r);
+        int rc;
+        switch (r->backend) {
+#ifdef REACTOR_HAVE_URING
+            case REACTOR_BACKEND_URING: rc = wait_uring(r, timeout); break;
+#endif
+#ifdef __linux__
+            case REACTOR_BACKEND_EPOLL: rc = wait_epoll(r, timeout); break;
+#endif
+            default: rc = wait_poll(r, timeout); break;
+        }
+        if (rc < 0 && errno != EINTR) {
+            log_error("reactor wait failed: %s", strerror(errno));
+            break;
+        }
+        reap_dead(r);
+    }
+    tls_reactor = NULL;
+}
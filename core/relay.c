@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/dispatch.h"
+#include "../include/json_msg.h"
+#include "../include/node_manager.h"
+#include "../include/relay.h"
+#include "../include/selector.h"
+#include "../include/shard.h"
+
+#define ROUTE_BUCKETS 4096
+
+typedef struct Relay Relay;
+
+typedef struct Route {
+    char name[256];
+    char parent[256];
+    char os[64];
+    Relay *relay;
+    struct Route *hash_next;
+    struct Route *prev;         // in relay->routes
+    struct Route *next;
+} Route;
+
+struct Relay {
+    char name[256];
+    Route *routes;
+    int count;
+    Relay *next;
+};
+
+static Route *buckets[ROUTE_BUCKETS];
+static Relay *relays = NULL;
+static int total = 0;
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % ROUTE_BUCKETS;
+}
+
+static Route **route_slot(const char *name) {
+    Route **pp = &buckets[name_hash(name)];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->hash_next;
+    return pp;
+}
+
+static Relay *relay_find(const char *name, int create) {
+    for (Relay *r = relays; r; r = r->next) {
+        if (strcmp(r->name, name) == 0) return r;
+    }
+    if (!create) return NULL;
+    Relay *r = calloc(1, sizeof(Relay));
+    if (!r) return NULL;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->next = relays;
+    relays = r;
+    return r;
+}
+
+static void relay_free_if_empty(Relay *r) {
+    if (r->count > 0) return;
+    Relay **pp = &relays;
+    while (*pp && *pp != r) pp = &(*pp)->next;
+    if (*pp) *pp = r->next;
+    free(r);
+}
+
+static void route_unlink(Route **slot) {
+    Route *rt = *slot;
+    *slot = rt->hash_next;
+    Relay *r = rt->relay;
+    if (rt->prev) rt->prev->next = rt->next;
+    else r->routes = rt->next;
+    if (rt->next) rt->next->prev = rt->prev;
+    r->count--;
+    total--;
+    free(rt);
+}
+
+int relay_route_add(const char *relay, const char *name, const char *parent, const char *os) {
+    if (!relay || !name || !name[0] || strcmp(relay, name) == 0) return -1;
+    Route **slot = route_slot(name);
+    // a node that moved to another relay is only reachable through the new one
+    if (*slot) {
+        Relay *old = (*slot)->relay;
+        route_unlink(slot);
+        relay_free_if_empty(old);
+        slot = route_slot(name);
+    }
+    Relay *r = relay_find(relay, 1);
+    Route *rt = r ? calloc(1, sizeof(Route)) : NULL;
+    if (!rt) return -1;
+    snprintf(rt->name, sizeof(rt->name), "%s", name);
+    snprintf(rt->parent, sizeof(rt->parent), "%s", parent && parent[0] ? parent : relay);
+    snprintf(rt->os, sizeof(rt->os), "%s", os ? os : "");
+    rt->relay = r;
+    rt->hash_next = *slot;
+    *slot = rt;
+    rt->next = r->routes;
+    if (r->routes) r->routes->prev = rt;
+    r->routes = rt;
+    r->count++;
+    total++;
+    return 0;
+}
+
+void relay_route_remove(const char *relay, const char *name) {
+    if (!relay || !name) return;
+    Route **slot = route_slot(name);
+    // a leave from a relay the node already moved away from is stale
+    if (!*slot || strcmp((*slot)->relay->name, relay) != 0) return;
+    Relay *r = (*slot)->relay;
+    route_unlink(slot);
+    relay_free_if_empty(r);
+}
+
+void relay_drop(const char *relay) {
+    Relay *r = relay ? relay_find(relay, 0) : NULL;
+    if (!r) return;
+    while (r->routes) route_unlink(route_slot(r->routes->name));
+    relay_free_if_empty(r);
+}
+
+const char *relay_route_find(const char *name) {
+    Route *rt = name ? *route_slot(name) : NULL;
+    return rt ? rt->relay->name : NULL;
+}
+
+int relay_match(const char *selector, void (*fn)(const char *relay, int matches, void *arg), void *arg) {
+    int sum = 0;
+    for (Relay *r = relays; r; r = r->next) {
+        int n = 0;
+        for (Route *rt = r->routes; rt; rt = rt->next) n += selector_match(selector, rt->name);
+        if (n > 0 && fn) fn(r->name, n, arg);
+        sum += n;
+    }
+    return sum;
+}
+
+int relay_size(const char *relay) {
+    Relay *r = relay ? relay_find(relay, 0) : NULL;
+    return r ? r->count : 0;
+}
+
+int relay_total(void) {
+    return total;
+}
+
+static int by_parent(const void *a, const void *b) {
+    const Route *x = *(const Route *const *)a;
+    const Route *y = *(const Route *const *)b;
+    int c = strcmp(x->parent, y->parent);
+    return c ? c : strcmp(x->name, y->name);
+}
+
+// Routes sorted by parent, so the children of a node are one run.
+static void print_children(FILE *out, Route **sorted, int n, const char *parent, const char *indent,
+                           int depth) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(sorted[mid]->parent, parent) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int i = lo; i < n && strcmp(sorted[i]->parent, parent) == 0; ++i) {
+        fprintf(out, "%s%*s- %s (os=%s)\n", indent, depth * 2, "", sorted[i]->name,
+                sorted[i]->os[0] ? sorted[i]->os : "unknown");
+        // a cycle reported by a confused relay must not recurse forever
+        if (depth < 32) print_children(out, sorted, n, sorted[i]->name, indent, depth + 1);
+    }
+}
+
+void relay_print_tree(FILE *out, const char *relay, const char *indent) {
+    Relay *r = relay ? relay_find(relay, 0) : NULL;
+    if (!r || r->count == 0) return;
+    Route **sorted = malloc((size_t)r->count * sizeof(Route *));
+    if (!sorted) return;
+    int n = 0;
+    for (Route *rt = r->routes; rt; rt = rt->next) sorted[n++] = rt;
+    qsort(sorted, (size_t)n, sizeof(Route *), by_parent);
+    print_children(out, sorted, n, r->name, indent, 0);
+    free(sorted);
+}
+
+void relay_route_each(void (*fn)(const char *relay, const char *name, const char *parent, const char *os,
+                                 void *arg),
+                      void *arg) {
+    if (!fn) return;
+    for (Relay *r = relays; r; r = r->next) {
+        for (Route *rt = r->routes; rt; rt = rt->next) fn(r->name, rt->name, rt->parent, rt->os, arg);
+    }
+}
+
+void relay_routes_clear(void) {
+    while (relays) relay_drop(relays->name);
+}
+
+// --- updates from the shards ---
+
+typedef struct {
+    char relay[256];
+    char name[256];
+    char parent[256];
+    char os[64];
+    int join;   // 1 join, 0 leave, -1 the relay itself went away
+} RouteUpdate;
+
+static void route_update_task(Reactor *r, void *arg) {
+    (void)r;
+    RouteUpdate *u = arg;
+    if (u->join > 0) relay_route_add(u->relay, u->name, u->parent, u->os);
+    else if (u->join == 0) relay_route_remove(u->relay, u->name);
+    else relay_drop(u->relay);
+    free(u);
+}
+
+void relay_post_update(const char *relay, const char *name, const char *parent, const char *os, int join) {
+    RouteUpdate *u = calloc(1, sizeof(RouteUpdate));
+    if (!u) return;
+    snprintf(u->relay, sizeof(u->relay), "%s", relay);
+    snprintf(u->name, sizeof(u->name), "%s", name ? name : "");
+    snprintf(u->parent, sizeof(u->parent), "%s", parent ? parent : "");
+    snprintf(u->os, sizeof(u->os), "%s", os ? os : "");
+    u->join = join;
+    if (shard_post_front(route_update_task, u) < 0) free(u);
+}
+
+// A relay reports a node joining or leaving the tree below it.
+static void relay_route_message(const MsgContext *ctx, int join) {
+    NodeSession *session = ctx->conn;
+    char name[256], parent[256] = "", os[64] = "";
+    if (json_msg_copy(ctx->msg, "name", name, sizeof(name)) < 0) return;
+    json_msg_copy(ctx->msg, "parent", parent, sizeof(parent));
+    json_msg_copy(ctx->msg, "os", os, sizeof(os));
+    session->relay = 1;
+    relay_post_update(session->meta.name, name, parent, os, join);
+}
+
+static void on_relay_join(const MsgContext *ctx, void *user) {
+    (void)user;
+    relay_route_message(ctx, 1);
+}
+
+static void on_relay_leave(const MsgContext *ctx, void *user) {
+    (void)user;
+    relay_route_message(ctx, 0);
+}
+
+void relay_init(void) {
+    Dispatcher *d = node_manager_dispatcher();
+    dispatcher_register(d, "relay_join", on_relay_join, NULL);
+    dispatcher_register(d, "relay_leave", on_relay_leave, NULL);
+}
@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/requests.h"
+
+#define REQUEST_BUCKETS 1024
+
+typedef struct Request {
+    char id[REQUEST_ID_LEN];
+    unsigned long client_id;
+    int expected;       // 0 while unknown
+    int seen;
+    time_t created;
+    struct Request *next;
+} Request;
+
+static Request *buckets[REQUEST_BUCKETS];
+
+static uint32_t id_hash(const char *id) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)id; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % REQUEST_BUCKETS;
+}
+
+void request_new_id(char *out, size_t size) {
+    static unsigned int counter = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long timestamp_ms = (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    counter++;
+    snprintf(out, size, "%lld_%u", timestamp_ms, counter);
+}
+
+int request_track(const char *id, unsigned long client_id, int expected) {
+    if (!id || expected < 0) return -1;
+    Request *r = calloc(1, sizeof(Request));
+    if (!r) return -1;
+    snprintf(r->id, sizeof(r->id), "%s", id);
+    r->client_id = client_id;
+    r->expected = expected;
+    r->created = time(NULL);
+    uint32_t b = id_hash(r->id);
+    r->next = buckets[b];
+    buckets[b] = r;
+    return 0;
+}
+
+static Request **request_slot(const char *id) {
+    Request **pp = &buckets[id_hash(id)];
+    while (*pp && strcmp((*pp)->id, id) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+unsigned long request_owner(const char *id) {
+    if (!id) return 0;
+    Request *r = *request_slot(id);
+    return r ? r->client_id : 0;
+}
+
+int request_progress(const char *id, int *expected, int *seen) {
+    Request *r = id ? *request_slot(id) : NULL;
+    if (!r) return -1;
+    *expected = r->expected;
+    *seen = r->seen;
+    return 0;
+}
+
+static void request_check_done(Request **pp) {
+    Request *r = *pp;
+    if (r->expected > 0 && r->seen >= r->expected) {
+        *pp = r->next;
+        free(r);
+    }
+}
+
+void request_expect(const char *id, int expected) {
+    if (!id || expected <= 0) return;
+    Request **pp = request_slot(id);
+    if (!*pp) return;
+    (*pp)->expected = expected;
+    request_check_done(pp);
+}
+
+void request_result_seen(const char *id, int count) {
+    if (!id) return;
+    Request **pp = request_slot(id);
+    if (!*pp) return;
+    (*pp)->seen += count > 0 ? count : 1;
+    request_check_done(pp);
+}
+
+void request_forget(const char *id) {
+    if (!id) return;
+    Request **pp = request_slot(id);
+    Request *r = *pp;
+    if (!r) return;
+    *pp = r->next;
+    free(r);
+}
+
+static void request_drop_if(int (*pred)(const Request *, const void *), const void *arg) {
+    for (int b = 0; b < REQUEST_BUCKETS; ++b) {
+        Request **pp = &buckets[b];
+        while (*pp) {
+            Request *r = *pp;
+            if (pred(r, arg)) {
+                *pp = r->next;
+                free(r);
+            } else {
+                pp = &r->next;
+            }
+        }
+    }
+}
+
+static int owned_by(const Request *r, const void *arg) {
+    return r->client_id == *(const unsigned long *)arg;
+}
+
+static int created_before(const Request *r, const void *arg) {
+    return r->created < *(const time_t *)arg;
+}
+
+void request_forget_client(unsigned long client_id) {
+    request_drop_if(owned_by, &client_id);
+}
+
+void request_expire(int max_age) {
+    time_t cutoff = time(NULL) - max_age;
+    request_drop_if(created_before, &cutoff);
+}
+
+void request_each(void (*fn)(const char *id, unsigned long client_id, int expected, int seen, time_t created,
+                             void *arg),
+                  void *arg) {
+    if (!fn) return;
+    for (int b = 0; b < REQUEST_BUCKETS; ++b) {
+        for (Request *r = buckets[b]; r; r = r->next) fn(r->id, r->client_id, r->expected, r->seen, r->created, arg);
+    }
+}
+
+int request_restore(const char *id, unsigned long client_id, int expected, int seen, time_t created) {
+    if (request_track(id, client_id, expected) < 0) return -1;
+    Request *r = *request_slot(id);
+    r->seen = seen;
+    r->created = created;
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/checksum.h"
+#include "../include/result_groups.h"
+
+struct ResultGroup {
+    uint32_t hash;
+    int exit_code;
+    char status[16];
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    int count;
+    char *nodes;        // comma-separated
+    size_t nodes_len;
+    size_t nodes_cap;
+    struct ResultGroup *next;
+};
+
+static uint32_t outcome_hash(const NodeResult *res) {
+    uint32_t h = crc32c((uint32_t)res->exit_code, res->status, strlen(res->status));
+    h = crc32c(h, res->out, res->out_len);
+    return crc32c(h, res->err, res->err_len);
+}
+
+static int same_outcome(const ResultGroup *grp, uint32_t hash, const NodeResult *res) {
+    return grp->hash == hash && grp->exit_code == res->exit_code && strcmp(grp->status, res->status) == 0 &&
+           grp->out_len == res->out_len && grp->err_len == res->err_len &&
+           memcmp(grp->out, res->out, res->out_len) == 0 && memcmp(grp->err, res->err, res->err_len) == 0;
+}
+
+static int nodes_append(ResultGroup *grp, const char *names) {
+    size_t len = strlen(names);
+    size_t need = grp->nodes_len + len + 2;
+    if (need > grp->nodes_cap) {
+        size_t cap = grp->nodes_cap ? grp->nodes_cap : 256;
+        while (cap < need) cap *= 2;
+        char *n = realloc(grp->nodes, cap);
+        if (!n) return -1;
+        grp->nodes = n;
+        grp->nodes_cap = cap;
+    }
+    if (grp->nodes_len) grp->nodes[grp->nodes_len++] = ',';
+    memcpy(grp->nodes + grp->nodes_len, names, len + 1);
+    grp->nodes_len += len;
+    return 0;
+}
+
+static void group_free(ResultGroup *grp) {
+    free(grp->out);
+    free(grp->nodes);
+    free(grp);
+}
+
+void result_groups_init(ResultGroups *g) {
+    memset(g, 0, sizeof(*g));
+}
+
+void result_groups_free(ResultGroups *g) {
+    for (int b = 0; b < RESULT_GROUP_BUCKETS; ++b) {
+        while (g->buckets[b]) {
+            ResultGroup *grp = g->buckets[b];
+            g->buckets[b] = grp->next;
+            group_free(grp);
+        }
+    }
+    result_groups_init(g);
+}
+
+int result_groups_add(ResultGroups *g, const NodeResult *res) {
+    uint32_t hash = outcome_hash(res);
+    // a relay's group lists its nodes; a lone result only has its own name
+    const char *names = res->nodes ? res->nodes : res->node;
+    int count = res->count > 0 ? res->count : 1;
+    ResultGroup **bucket = &g->buckets[hash % RESULT_GROUP_BUCKETS];
+    for (ResultGroup *grp = *bucket; grp; grp = grp->next) {
+        if (!same_outcome(grp, hash, res)) continue;
+        if (nodes_append(grp, names) < 0) return -1;
+        grp->count += count;
+        g->nodes += count;
+        return 0;
+    }
+
+    ResultGroup *grp = calloc(1, sizeof(ResultGroup));
+    // both outputs in one block
+    char *text = grp ? malloc(res->out_len + res->err_len + 2) : NULL;
+    if (!text || nodes_append(grp, names) < 0) {
+        free(text);
+        if (grp) free(grp->nodes);
+        free(grp);
+        return -1;
+    }
+    grp->hash = hash;
+    grp->exit_code = res->exit_code;
+    snprintf(grp->status, sizeof(grp->status), "%s", res->status);
+    grp->out = text;
+    grp->out_len = res->out_len;
+    memcpy(grp->out, res->out, res->out_len);
+    grp->out[res->out_len] = '\0';
+    grp->err = grp->out + res->out_len + 1;
+    grp->err_len = res->err_len;
+    memcpy(grp->err, res->err, res->err_len);
+    grp->err[res->err_len] = '\0';
+    grp->count = count;
+    grp->next = *bucket;
+    *bucket = grp;
+    g->groups++;
+    g->nodes += count;
+    return 1;
+}
+
+void result_groups_summary(const ResultGroups *g, char *out, size_t size) {
+    int largest = 0;
+    for (int b = 0; b < RESULT_GROUP_BUCKETS; ++b) {
+        for (const ResultGroup *grp = g->buckets[b]; grp; grp = grp->next) {
+            if (grp->count > largest) largest = grp->count;
+        }
+    }
+    if (g->groups == 0) snprintf(out, size, "no results");
+    else if (g->groups == 1) snprintf(out, size, "%d node%s: identical", largest, largest == 1 ? "" : "s");
+    else snprintf(out, size, "%d node%s: identical; %d node%s: %d variant%s", largest, largest == 1 ? "" : "s",
+                  g->nodes - largest, g->nodes - largest == 1 ? "" : "s", g->groups - 1,
+                  g->groups - 1 == 1 ? "" : "s");
+}
+
+static int by_count_desc(const void *a, const void *b) {
+    const ResultGroup *ga = *(const ResultGroup *const *)a;
+    const ResultGroup *gb = *(const ResultGroup *const *)b;
+    return (gb->count > ga->count) - (gb->count < ga->count);
+}
+
+void result_groups_each(const ResultGroups *g, void (*fn)(const NodeResult *group, void *arg), void *arg) {
+    if (g->groups == 0) return;
+    ResultGroup **order = malloc((size_t)g->groups * sizeof(*order));
+    if (!order) return;
+    int n = 0;
+    for (int b = 0; b < RESULT_GROUP_BUCKETS; ++b) {
+        for (ResultGroup *grp = g->buckets[b]; grp && n < g->groups; grp = grp->next) order[n++] = grp;
+    }
+    qsort(order, (size_t)n, sizeof(*order), by_count_desc);
+    for (int i = 0; i < n; ++i) {
+        const ResultGroup *grp = order[i];
+        NodeResult res;
+        memset(&res, 0, sizeof(res));
+        // the first node names the group, as for a relay's result
+        size_t first = strcspn(grp->nodes, ",");
+        snprintf(res.node, sizeof(res.node), "%.*s", (int)first, grp->nodes);
+        res.exit_code = grp->exit_code;
+        snprintf(res.status, sizeof(res.status), "%s", grp->status);
+        res.out = grp->out;
+        res.out_len = grp->out_len;
+        res.err = grp->err;
+        res.err_len = grp->err_len;
+        res.count = grp->count;
+        res.nodes = grp->nodes;
+        fn(&res, arg);
+    }
+    free(order);
+}
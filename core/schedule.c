@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../include/agent_schedule.h"
+#include "../include/base64.h"
+#include "../include/db.h"
+#include "../include/dispatch.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/schedule.h"
+
+int schedule_ingest(const char *node, const char *data, size_t data_len, size_t raw, Arena *a) {
+    if (!data || raw == 0 || raw > AGENT_SCHEDULE_BATCH_MAX + AGENT_SCHEDULE_MAX_OUTPUT * 8) return -1;
+    unsigned char *packed = arena_alloc(a, data_len / 4 * 3 + 3);
+    char *text = arena_alloc(a, raw + 1);
+    if (!packed || !text) return -1;
+    long packed_len = base64_decode(packed, data, data_len);
+    uLongf text_len = raw;
+    if (packed_len < 0 || uncompress((Bytef *)text, &text_len, packed, (uLong)packed_len) != Z_OK ||
+        text_len != raw) {
+        return -1;
+    }
+    text[raw] = '\0';
+
+    int lines = 0;
+    for (size_t i = 0; i < raw; ++i) lines += text[i] == '\n';
+    DbRow *rows = arena_alloc(a, sizeof(DbRow) * (size_t)(lines + 1));
+    if (!rows) return -1;
+    int count = 0;
+    for (char *line = text; *line;) {
+        char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        JsonMsg m;
+        DbRow *r = &rows[count];
+        if (json_msg_parse(&m, line, len) == 0 && (r->job = json_msg_str(&m, "job", a, NULL)) != NULL &&
+            (r->command = json_msg_str(&m, "cmd", a, NULL)) != NULL &&
+            (r->out = json_msg_str(&m, "out", a, &r->out_len)) != NULL) {
+            r->at = (time_t)json_msg_int(&m, "at", 0);
+            r->exit_code = (int)json_msg_int(&m, "exit", -1);
+            count++;
+        } else {
+            log_error("Skipping a malformed scheduled result from %s", node);
+        }
+        line += len + (end ? 1 : 0);
+    }
+    if (count == 0) return 0;
+    return db_store_batch(node, rows, count);
+}
+
+// Results of the jobs an agent runs by itself (agent_schedule.h). The batch
+// is acked even when it is a duplicate or damaged, so the agent moves on.
+static void on_sched_batch(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    long seq = json_msg_int(ctx->msg, "seq", 0);
+    char id[64] = "";
+    json_msg_copy(ctx->msg, "id", id, sizeof(id));
+    char ack[64];
+    snprintf(ack, sizeof(ack), "{\"type\":\"sched_ack\",\"seq\":%ld}", seq);
+    node_session_send(session, ack);
+    if (node_manager_seen_before(session->meta.name, id, seq)) {
+        log_info("Dropping job batch %s from %s: already stored", id, session->meta.name);
+        return;
+    }
+    size_t data_len = 0;
+    char *data = json_msg_str(ctx->msg, "data", ctx->arena, &data_len);
+    long raw = json_msg_int(ctx->msg, "raw", 0);
+    int stored = raw > 0 ? schedule_ingest(session->meta.name, data, data_len, (size_t)raw, ctx->arena) : -1;
+    if (stored < 0) {
+        log_error("Dropping damaged job batch %s from %s", id, session->meta.name);
+        return;
+    }
+    log_info("Stored %d scheduled result(s) from %s (batch of %zu bytes)", stored, session->meta.name, ctx->raw_len);
+}
+
+void schedule_init(void) {
+    dispatcher_register(node_manager_dispatcher(), "sched_batch", on_sched_batch, NULL);
+}
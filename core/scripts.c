@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../include/arena.h"
+#include "../include/dispatch.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/scripts.h"
+
+typedef struct {
+    char hash[SHA256_HEX_LEN + 1];
+    char *body;
+    size_t len;
+    unsigned long used;     // store clock at the last load or get
+} StoredScript;
+
+// loaded by the CLI on the front thread, read by shards on a cache miss
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static StoredScript store[SCRIPT_STORE_SLOTS];
+static unsigned long store_clock = 0;
+
+static StoredScript *store_find(const char *hash) {
+    for (int i = 0; i < SCRIPT_STORE_SLOTS; ++i) {
+        if (store[i].body && strcmp(store[i].hash, hash) == 0) return &store[i];
+    }
+    return NULL;
+}
+
+int script_store_load(const char *path, char hash[SHA256_HEX_LEN + 1], char *why, size_t why_size) {
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) < 0) {
+        snprintf(why, why_size, "cannot open %s: %s", path, strerror(errno));
+        if (f) fclose(f);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size > SCRIPT_MAX_LEN) {
+        snprintf(why, why_size, "%s is not a regular file of at most %d bytes", path, SCRIPT_MAX_LEN);
+        fclose(f);
+        return -1;
+    }
+    char *body = malloc((size_t)st.st_size + 1);
+    size_t len = body ? fread(body, 1, (size_t)st.st_size, f) : 0;
+    int failed = !body || ferror(f);
+    fclose(f);
+    if (failed) {
+        snprintf(why, why_size, "cannot read %s", path);
+        free(body);
+        return -1;
+    }
+    body[len] = '\0';
+    sha256_hex(body, len, hash);
+
+    pthread_mutex_lock(&store_lock);
+    StoredScript *s = store_find(hash);
+    if (s) {
+        free(body);
+    } else {
+        s = &store[0];
+        for (int i = 1; i < SCRIPT_STORE_SLOTS && s->body; ++i) {
+            if (!store[i].body || store[i].used < s->used) s = &store[i];
+        }
+        free(s->body);
+        memcpy(s->hash, hash, SHA256_HEX_LEN + 1);
+        s->body = body;
+        s->len = len;
+    }
+    s->used = ++store_clock;
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+char *script_store_get(const char *hash, size_t *len) {
+    char *copy = NULL;
+    pthread_mutex_lock(&store_lock);
+    StoredScript *s = store_find(hash);
+    if (s && (copy = malloc(s->len + 1)) != NULL) {
+        memcpy(copy, s->body, s->len + 1);
+        if (len) *len = s->len;
+        s->used = ++store_clock;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return copy;
+}
+
+void script_store_clear(void) {
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < SCRIPT_STORE_SLOTS; ++i) {
+        free(store[i].body);
+        store[i].body = NULL;
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+// An agent lacks the script an exec named: the exec goes out again with
+// the body, or fails here if the store has let the script go.
+static void on_script_miss(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    char id[64] = "", hash[SHA256_HEX_LEN + 1] = "";
+    size_t args_len = 0, body_len = 0;
+    json_msg_copy(ctx->msg, "id", id, sizeof(id));
+    json_msg_copy(ctx->msg, "script", hash, sizeof(hash));
+    char *args = json_msg_str(ctx->msg, "args", ctx->arena, &args_len);
+    char *body = script_store_get(hash, &body_len);
+    char *escaped_body = body ? json_escape(body) : NULL;
+    char *escaped_args = json_escape(args ? args : "");
+    char *exec = NULL;
+    if (escaped_body && escaped_args) {
+        size_t size = strlen(id) + strlen(hash) + strlen(escaped_args) + strlen(escaped_body) + 64;
+        exec = arena_alloc(ctx->arena, size);
+        if (exec) {
+            snprintf(exec, size, "{\"type\":\"exec\",\"id\":\"%s\",\"script\":\"%s\",\"args\":\"%s\",\"body\":\"%s\"}",
+                     id, hash, escaped_args, escaped_body);
+        }
+    }
+    free(body);
+    free(escaped_body);
+    free(escaped_args);
+    if (exec && node_session_send(session, exec) >= 0) {
+        log_info("Sent script %.12s to %s (%zu bytes)", hash, session->meta.name, body_len);
+        return;
+    }
+
+    static const char why[] = "script is no longer held by the controller; run it again";
+    NodeResult *res = malloc(sizeof(NodeResult) + sizeof(why) + 1);
+    if (!res) return;
+    snprintf(res->node, sizeof(res->node), "%s", session->meta.name);
+    snprintf(res->id, sizeof(res->id), "%s", id);
+    res->exit_code = -1;
+    res->status[0] = '\0';
+    res->out = (char *)(res + 1);
+    res->out[0] = '\0';
+    res->out_len = 0;
+    res->err = res->out + 1;
+    memcpy(res->err, why, sizeof(why));
+    res->err_len = sizeof(why) - 1;
+    res->count = 1;
+    res->nodes = NULL;
+    log_error("Script %.12s for %s is gone", hash, session->meta.name);
+    node_manager_post_result(res);
+}
+
+void script_store_init(void) {
+    dispatcher_register(node_manager_dispatcher(), "script_miss", on_script_miss, NULL);
+}
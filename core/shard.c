@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/shard.h"
+
+typedef struct {
+    int index;
+    Reactor *reactor;
+    pthread_t thread;
+    int started;
+} Shard;
+
+typedef struct {
+    shard_task_fn fn;
+    void *arg;
+    reactor_task_fn done;
+    int remaining;
+} Broadcast;
+
+typedef struct {
+    Broadcast *bc;
+    int shard;
+} BroadcastPart;
+
+typedef struct {
+    int fd;
+    Node meta;
+    size_t len;
+    size_t unsent_len;
+    char data[];        // len bytes received, then unsent_len to send
+} Adoption;
+
+static Shard shards[MAX_SHARDS];
+static int nshards = 0;
+static Reactor *front_reactor = NULL;
+static GlobalState *shared_state = NULL;
+static __thread int tls_shard = -1;
+
+static void *shard_main(void *arg) {
+    Shard *s = arg;
+    tls_shard = s->index;
+    node_sessions_init();
+    reactor_run(s->reactor);
+    node_sessions_cleanup();
+    return NULL;
+}
+
+int shards_start(GlobalState *state, int count, ReactorBackend backend, Reactor *front) {
+    if (nshards > 0) return -1;
+    if (count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+    if (count > MAX_SHARDS) count = MAX_SHARDS;
+
+    shared_state = state;
+    front_reactor = front;
+    // take the handler template before any shard copies it
+    node_manager_dispatcher();
+
+    for (int i = 0; i < count; ++i) {
+        Shard *s = &shards[i];
+        s->index = i;
+        s->reactor = reactor_create(backend);
+        if (!s->reactor) {
+            log_error("Failed to create reactor for shard %d", i);
+            break;
+        }
+        nshards = i + 1;
+        if (pthread_create(&s->thread, NULL, shard_main, s) != 0) {
+            log_error("Failed to start shard %d", i);
+            reactor_destroy(s->reactor);
+            s->reactor = NULL;
+            nshards = i;
+            break;
+        }
+        s->started = 1;
+    }
+    if (nshards == 0) return -1;
+    log_info("Started %d reactor shard(s) using %s", nshards, reactor_backend_name(shards[0].reactor));
+    return 0;
+}
+
+void shards_stop(void) {
+    for (int i = 0; i < nshards; ++i) {
+        if (shards[i].started) reactor_stop(shards[i].reactor);
+    }
+    for (int i = 0; i < nshards; ++i) {
+        if (shards[i].started) pthread_join(shards[i].thread, NULL);
+        reactor_destroy(shards[i].reactor);
+        memset(&shards[i], 0, sizeof(Shard));
+    }
+    nshards = 0;
+}
+
+int shard_count(void) {
+    return nshards;
+}
+
+int shard_current(void) {
+    return tls_shard;
+}
+
+int shard_for_name(const char *name) {
+    if (nshards <= 0 || !name) return 0;
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return (int)(h % (uint32_t)nshards);
+}
+
+Reactor *shard_reactor(int idx) {
+    if (idx < 0 || idx >= nshards) return NULL;
+    return shards[idx].reactor;
+}
+
+GlobalState *shard_state(void) {
+    return shared_state;
+}
+
+int shard_post(int idx, reactor_task_fn fn, void *arg) {
+    Reactor *r = shard_reactor(idx);
+    if (!r) return -1;
+    return reactor_post(r, fn, arg);
+}
+
+int shard_post_front(reactor_task_fn fn, void *arg) {
+    if (!front_reactor) return -1;
+    return reactor_post(front_reactor, fn, arg);
+}
+
+static void broadcast_part(Reactor *r, void *arg) {
+    (void)r;
+    BroadcastPart *part = arg;
+    Broadcast *bc = part->bc;
+    bc->fn(part->shard, bc->arg);
+    free(part);
+    if (__atomic_sub_fetch(&bc->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (bc->done && reactor_post(front_reactor, bc->done, bc->arg) < 0) {
+            log_error("Failed to post broadcast completion");
+        }
+        free(bc);
+    }
+}
+
+int shard_broadcast(shard_task_fn fn, void *arg, reactor_task_fn done) {
+    if (!fn || nshards <= 0) return -1;
+    Broadcast *bc = malloc(sizeof(Broadcast));
+    if (!bc) return -1;
+    bc->fn = fn;
+    bc->arg = arg;
+    bc->done = done;
+    bc->remaining = nshards;
+    for (int i = 0; i < nshards; ++i) {
+        BroadcastPart *part = malloc(sizeof(BroadcastPart));
+        if (part) {
+            part->bc = bc;
+            part->shard = i;
+        }
+        // a shard that cannot be reached still has to count down
+        if (!part || shard_post(i, broadcast_part, part) < 0) {
+            log_error("Failed to post broadcast to shard %d", i);
+            free(part);
+            if (__atomic_sub_fetch(&bc->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+                if (done) reactor_post(front_reactor, done, arg);
+                free(bc);
+            }
+        }
+    }
+    return 0;
+}
+
+static void adopt_task(Reactor *r, void *arg) {
+    (void)r;
+    Adoption *a = arg;
+    if (!node_session_adopt(&a->meta, a->fd, a->data, a->len, a->data + a->len, a->unsent_len)) {
+        log_error("Shard %d could not take connection for %s", tls_shard, a->meta.name);
+        close(a->fd);
+    }
+    free(a);
+}
+
+int shard_adopt(int idx, int fd, const Node *meta, const char *pending, size_t pending_len, const char *unsent,
+                size_t unsent_len) {
+    Adoption *a = malloc(sizeof(Adoption) + pending_len + unsent_len);
+    if (!a) {
+        close(fd);
+        return -1;
+    }
+    a->fd = fd;
+    a->meta = *meta;
+    a->len = pending_len;
+    a->unsent_len = unsent_len;
+    if (pending_len) memcpy(a->data, pending, pending_len);
+    if (unsent_len) memcpy(a->data + pending_len, unsent, unsent_len);
+    if (shard_post(idx, adopt_task, a) < 0) {
+        close(fd);
+        free(a);
+        return -1;
+    }
+    return 0;
+}
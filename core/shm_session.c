@@ -0,0 +1,45 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/dispatch.h"
+#include "../include/ipc.h"
+#include "../include/lanes.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/shm_ring.h"
+#include "../include/shm_session.h"
+
+// A local agent asks for shared-memory rings. The region goes out with the
+// reply as SCM_RIGHTS, which must not overtake bytes still queued on the
+// stream, so the upgrade is declined while anything is pending.
+static void on_shm_request(const MsgContext *ctx, void *user) {
+    (void)user;
+    NodeSession *session = ctx->conn;
+    if (session->shm) return;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(session->fd, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        addr.ss_family != AF_UNIX || reactor_stream_pending(session->stream) > 0 ||
+        (session->tx_lanes && !lane_queue_empty(session->tx_lanes))) {
+        node_session_send(session, "{\"type\":\"shm_declined\"}");
+        return;
+    }
+
+    int memfd = -1;
+    ShmChannel *ch = shm_channel_create(SHM_RING_SIZE, &memfd);
+    static const char ready[] = "{\"type\":\"shm_ready\"}\n";
+    if (!ch || ipc_send_fd(session->fd, ready, sizeof(ready) - 1, memfd) < 0) {
+        shm_channel_close(ch);
+        if (memfd >= 0) close(memfd);
+        node_session_send(session, "{\"type\":\"shm_declined\"}");
+        return;
+    }
+    session->shm = ch;
+    session->shm_fd = memfd;
+    log_info("Session %s switched to shared-memory rings", session->meta.name);
+}
+
+void shm_session_init(void) {
+    dispatcher_register(node_manager_dispatcher(), "shm_request", on_shm_request, NULL);
+}
@@ -1,11 +1,9 @@
-#include <stdlib.h>
 #include "../include/logging.h"
-#include "../include/env.h"
 #include "../include/shutdown.h"
 
-void shutdown_gracefully(void) {
+void shutdown_gracefully(Reactor *front) {
     log_info("Shutting down SimOS gracefully...");
-
-    log_info("Shutdown complete. Goodbye!");
-    exit(0);
+    // run_event_loop() stops the shards, flushes the command store and
+    // removes its sockets once the front reactor returns
+    if (front) reactor_stop(front);
 }
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/telemetry.h"
+
+typedef struct {
+    int step;       // seconds per point, 0 for every sample
+    int slots;
+    int head;       // next slot written
+    int count;
+    TelemetrySample *ring;
+    // the point being averaged
+    uint32_t bucket;
+    uint64_t sum[TELEMETRY_FIELDS];
+    uint32_t n;
+} TelemetryTier;
+
+struct TelemetrySeries {
+    TelemetryTier tiers[TELEMETRY_TIERS];
+    TelemetrySample last;
+    uint32_t last_seq;
+    int have_last;
+};
+
+static const int tier_steps[TELEMETRY_TIERS] = TELEMETRY_TIER_STEPS;
+static const int tier_slots[TELEMETRY_TIERS] = TELEMETRY_TIER_SLOTS;
+static const char *const tier_names[TELEMETRY_TIERS] = { "raw", "1m", "15m" };
+
+TelemetrySeries *telemetry_series_new(void) {
+    size_t total = 0;
+    for (int i = 0; i < TELEMETRY_TIERS; ++i) total += (size_t)tier_slots[i];
+    // the series and every ring in one block: fixed memory per node
+    TelemetrySeries *s = calloc(1, sizeof(TelemetrySeries) + total * sizeof(TelemetrySample));
+    if (!s) return NULL;
+    TelemetrySample *ring = (TelemetrySample *)(s + 1);
+    for (int i = 0; i < TELEMETRY_TIERS; ++i) {
+        s->tiers[i].step = tier_steps[i];
+        s->tiers[i].slots = tier_slots[i];
+        s->tiers[i].ring = ring;
+        ring += tier_slots[i];
+    }
+    return s;
+}
+
+void telemetry_series_free(TelemetrySeries *s) {
+    free(s);
+}
+
+static void tier_push(TelemetryTier *t, const TelemetrySample *p) {
+    t->ring[t->head] = *p;
+    t->head = (t->head + 1) % t->slots;
+    if (t->count < t->slots) t->count++;
+}
+
+// Closes the point being averaged once a sample falls into a later one.
+static void tier_add(TelemetryTier *t, const TelemetrySample *p) {
+    if (t->step == 0) {
+        tier_push(t, p);
+        return;
+    }
+    uint32_t bucket = p->at / (uint32_t)t->step;
+    if (t->n > 0 && bucket != t->bucket) {
+        TelemetrySample avg;
+        avg.at = t->bucket * (uint32_t)t->step;
+        for (int i = 0; i < TELEMETRY_FIELDS; ++i) avg.v[i] = (uint32_t)(t->sum[i] / t->n);
+        tier_push(t, &avg);
+        memset(t->sum, 0, sizeof(t->sum));
+        t->n = 0;
+    }
+    t->bucket = bucket;
+    for (int i = 0; i < TELEMETRY_FIELDS; ++i) t->sum[i] += p->v[i];
+    t->n++;
+}
+
+int telemetry_series_add(TelemetrySeries *s, const TelemetryFrame *f) {
+    if (!s || !f) return -1;
+    TelemetrySample p;
+    if (f->key) {
+        p.at = (uint32_t)f->at;
+        for (int i = 0; i < TELEMETRY_FIELDS; ++i) p.v[i] = (uint32_t)f->v[i];
+    } else {
+        if (!s->have_last || f->seq != s->last_seq + 1) return -1;
+        p.at = (uint32_t)(s->last.at + f->at);
+        for (int i = 0; i < TELEMETRY_FIELDS; ++i) p.v[i] = (uint32_t)(s->last.v[i] + f->v[i]);
+    }
+    s->last = p;
+    s->last_seq = f->seq;
+    s->have_last = 1;
+    for (int i = 0; i < TELEMETRY_TIERS; ++i) tier_add(&s->tiers[i], &p);
+    return 0;
+}
+
+int telemetry_tier_parse(const char *name) {
+    for (int i = 0; name && i < TELEMETRY_TIERS; ++i) {
+        if (strcmp(name, tier_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void telemetry_series_print(const TelemetrySeries *s, int tier, FILE *out) {
+    if (!s || tier < 0 || tier >= TELEMETRY_TIERS || !out) return;
+    const TelemetryTier *t = &s->tiers[tier];
+    fprintf(out, "%d point(s), %s\n", t->count, t->step ? "averages" : "as sampled");
+    if (t->count == 0) return;
+    fprintf(out, "  %-8s %6s %6s %4s %15s %15s %13s\n", "time", "cpu%", "load", "run", "mem MB", "disk MB",
+            "net KB/s");
+    for (int i = 0; i < t->count; ++i) {
+        const TelemetrySample *p = &t->ring[(t->head - t->count + i + t->slots) % t->slots];
+        time_t at = (time_t)p->at;
+        struct tm tm;
+        char when[16];
+        localtime_r(&at, &tm);
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        char mem[32], disk[32], net[32];
+        snprintf(mem, sizeof(mem), "%u/%u", p->v[TM_MEM_USED], p->v[TM_MEM_TOTAL]);
+        snprintf(disk, sizeof(disk), "%u/%u", p->v[TM_DISK_USED], p->v[TM_DISK_TOTAL]);
+        snprintf(net, sizeof(net), "%u/%u", p->v[TM_NET_RX], p->v[TM_NET_TX]);
+        fprintf(out, "  %-8s %4u.%u %3u.%02u %4u %15s %15s %13s\n", when, p->v[TM_CPU] / 10, p->v[TM_CPU] % 10,
+                p->v[TM_LOAD1] / 100, p->v[TM_LOAD1] % 100, p->v[TM_RUNNING], mem, disk, net);
+    }
+}
@@ -0,0 +1,651 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/arena.h"
+#include "../include/checksum.h"
+#include "../include/cli.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/requests.h"
+#include "../include/selector.h"
+#include "../include/shard.h"
+#include "../include/transfer.h"
+
+#define TRANSFER_TICK_MS 20
+// A target that gets this much from one writable event yields to the next,
+// so every receiver keeps moving instead of one draining at a time.
+#define TRANSFER_SLICE (256 * 1024)
+#define TRANSFER_DEFAULT_PARALLEL 32
+// An agent that has not connected back is offered the file again.
+#define TRANSFER_REOFFER_MS 5000
+// A target that has made no progress for this long has failed; progress
+// includes (re)connecting, so a node that comes back in time resumes.
+#define TRANSFER_STALL_MS 90000
+#define TRANSFER_MAX_ATTEMPTS 5
+#define TRANSFER_CHECK_MS 500
+
+typedef enum {
+    TARGET_QUEUED,
+    TARGET_OFFERED,     // offer sent, waiting for the data connection
+    TARGET_SENDING,
+    TARGET_FINISHING,   // end marker sent, waiting for push_done
+    TARGET_DONE,
+    TARGET_FAILED
+} TargetState;
+
+typedef struct PushJob PushJob;
+
+typedef struct {
+    PushJob *job;
+    char name[256];
+    TargetState state;
+    int fd;                     // data connection, -1 while there is none
+    uint64_t offset;            // next file byte to send
+    uint64_t chunk_end;
+    unsigned char hdr[PUSH_HEADER_LEN];
+    size_t hdr_off;             // header bytes sent; PUSH_HEADER_LEN when none is due
+    int end_queued;
+    int throttled;
+    int attempts;
+    long long offered_ms;
+    long long progress_ms;
+    IpcReader rx;               // the agent's push_done line
+} PushTarget;
+
+struct PushJob {
+    char id[REQUEST_ID_LEN];
+    unsigned long client_id;
+    char path[PATH_MAX];
+    char dest[PATH_MAX];
+    char selector[SELECTOR_MAX_LEN + 1];
+    char fingerprint[17];
+    int file_fd;
+    uint64_t size;
+    uint32_t *crcs;             // per chunk, worked out when first sent
+    unsigned char *crc_ready;
+    PushTarget *targets;
+    int ntargets;
+    int next_queued;
+    int active;
+    int done;
+    int failed;
+    uint64_t bytes_sent;
+    long long started_ms;
+    PushJob *next;
+};
+
+// Connected node names matching a selector, gathered per shard.
+typedef struct {
+    PushJob *job;
+    char (*names[MAX_SHARDS])[256];
+    int counts[MAX_SHARDS];
+} TargetCollect;
+
+typedef struct {
+    char id[REQUEST_ID_LEN];
+    char name[256];
+    uint64_t offset;
+} DataHello;
+
+// An offer on its way to the shard holding the target's session.
+typedef struct {
+    char name[256];
+    char msg[];         // without its closing brace
+} OfferSend;
+
+static Reactor *transfer_reactor = NULL;
+static PushJob *jobs = NULL;
+static int data_port = 0;           // listen_port, where data connections come in
+static int max_parallel = TRANSFER_DEFAULT_PARALLEL;
+// token bucket shared by every push; rate 0 = unlimited
+static uint64_t rate_bytes_per_ms = 0;
+static int64_t tokens = 0;
+static int64_t burst = 0;
+static long long last_refill_ms = 0;
+static long long last_check_ms = 0;
+static int throttled_count = 0;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// The checksum is taken over bytes read with pread(), not a mapping of the
+// file: a file cut short meanwhile makes the read come up short instead
+// of faulting. Returns -1 then.
+static int chunk_crc(PushJob *job, uint64_t idx, uint32_t len, uint32_t *crc) {
+    static unsigned char buf[PUSH_CHUNK_SIZE];
+    if (!job->crc_ready[idx]) {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(job->file_fd, buf + got, len - got, (off_t)(idx * PUSH_CHUNK_SIZE + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            got += (size_t)n;
+        }
+        job->crcs[idx] = crc32c(0, buf, len);
+        job->crc_ready[idx] = 1;
+    }
+    *crc = job->crcs[idx];
+    return 0;
+}
+
+static PushJob *job_find(const char *id) {
+    for (PushJob *j = jobs; j; j = j->next) {
+        if (strcmp(j->id, id) == 0) return j;
+    }
+    return NULL;
+}
+
+static PushTarget *target_find(PushJob *job, const char *name) {
+    for (int i = 0; i < job->ntargets; ++i) {
+        if (strcmp(job->targets[i].name, name) == 0) return &job->targets[i];
+    }
+    return NULL;
+}
+
+static void job_free(PushJob *job) {
+    for (int i = 0; i < job->ntargets; ++i) ipc_reader_free(&job->targets[i].rx);
+    if (job->file_fd >= 0) close(job->file_fd);
+    free(job->crcs);
+    free(job->crc_ready);
+    free(job->targets);
+    free(job);
+}
+
+static void job_unlink(PushJob *job) {
+    PushJob **pp = &jobs;
+    while (*pp && *pp != job) pp = &(*pp)->next;
+    if (*pp) *pp = job->next;
+}
+
+static void target_drop_conn(PushTarget *t) {
+    if (t->fd < 0) return;
+    reactor_unwatch_fd(transfer_reactor, t->fd);
+    close(t->fd);
+    t->fd = -1;
+    if (t->throttled) throttled_count--;
+    t->throttled = 0;
+    ipc_reader_free(&t->rx);
+    ipc_reader_init(&t->rx);
+}
+
+// Runs on the session's shard. The offer says where to connect back: the
+// address the node reached us at on this session, with the listening port.
+// The node's own idea of the peer is no use when the controller dialed it
+// (that is an ephemeral port) or when something sits in between. A local
+// socket session says nothing and the agent connects back the same way.
+static void offer_task(Reactor *r, void *arg) {
+    (void)r;
+    OfferSend *o = arg;
+    NodeSession *s = node_session_find_by_name(o->name);
+    if (!s) {
+        log_info("Push offer not sent to %s: not connected", o->name);
+        free(o);
+        return;
+    }
+    char data[64] = "";
+    struct sockaddr_in self;
+    socklen_t self_len = sizeof(self);
+    char host[INET_ADDRSTRLEN];
+    if (data_port > 0 && getsockname(s->fd, (struct sockaddr *)&self, &self_len) == 0 &&
+        self.sin_family == AF_INET && inet_ntop(AF_INET, &self.sin_addr, host, sizeof(host))) {
+        snprintf(data, sizeof(data), ",\"data\":\"%s:%d\"", host, data_port);
+    }
+    size_t len = strlen(o->msg);
+    char *msg = malloc(len + strlen(data) + 2);
+    if (msg) {
+        memcpy(msg, o->msg, len);
+        snprintf(msg + len, strlen(data) + 2, "%s}", data);
+        if (node_session_send(s, msg) < 0) log_error("Failed to send push offer to %s", o->name);
+    }
+    free(msg);
+    free(o);
+}
+
+static void send_offer(PushTarget *t) {
+    PushJob *job = t->job;
+    char *path = json_escape(job->dest);
+    if (!path) return;
+    char msg[PATH_MAX * 2 + 256];
+    int n = snprintf(msg, sizeof(msg),
+                     "{\"type\":\"push\",\"transfer\":\"%s\",\"path\":\"%s\",\"size\":%llu,"
+                     "\"chunk\":%d,\"fingerprint\":\"%s\"",
+                     job->id, path, (unsigned long long)job->size, PUSH_CHUNK_SIZE, job->fingerprint);
+    free(path);
+    if (n < 0 || (size_t)n >= sizeof(msg)) return;
+    t->state = TARGET_OFFERED;
+    t->offered_ms = now_ms();
+    OfferSend *o = malloc(sizeof(OfferSend) + (size_t)n + 1);
+    if (!o) return;
+    snprintf(o->name, sizeof(o->name), "%s", t->name);
+    memcpy(o->msg, msg, (size_t)n + 1);
+    if (shard_post(shard_for_name(t->name), offer_task, o) < 0) free(o);
+}
+
+static int job_pump(PushJob *job);
+
+// Returns 1 if that was the job's last target and the job is gone.
+static int target_finish(PushTarget *t, int ok, const char *why) {
+    PushJob *job = t->job;
+    target_drop_conn(t);
+    t->state = ok ? TARGET_DONE : TARGET_FAILED;
+    job->active--;
+    if (ok) {
+        job->done++;
+    } else {
+        job->failed++;
+        cli_reply(job->client_id, "Push %s: %s failed: %s", job->id, t->name, why);
+    }
+    return job_pump(job);
+}
+
+// The data connection went away or the agent asked for a retry: offer the
+// file again and let the agent resume from what it has verified.
+static int target_retry(PushTarget *t, const char *why) {
+    target_drop_conn(t);
+    if (++t->attempts >= TRANSFER_MAX_ATTEMPTS) return target_finish(t, 0, why);
+    log_info("Push %s to %s interrupted (%s), offering again", t->job->id, t->name, why);
+    send_offer(t);
+    return 0;
+}
+
+// Starts queued targets while the window has room and reports the job once
+// every target has finished. Returns 1 once the job is gone.
+static int job_pump(PushJob *job) {
+    while (job->active < max_parallel && job->next_queued < job->ntargets) {
+        PushTarget *t = &job->targets[job->next_queued++];
+        t->progress_ms = now_ms();
+        job->active++;
+        send_offer(t);
+    }
+    if (job->done + job->failed < job->ntargets) return 0;
+
+    double secs = (double)(now_ms() - job->started_ms) / 1000.0;
+    double mb = (double)job->bytes_sent / (1024.0 * 1024.0);
+    cli_reply(job->client_id, "Push %s finished: %d/%d nodes ok, %.1f MB sent in %.1fs (%.1f MB/s)",
+              job->id, job->done, job->ntargets, mb, secs, secs > 0 ? mb / secs : mb);
+    job_unlink(job);
+    job_free(job);
+    return 1;
+}
+
+// Returns -1 if the file no longer holds the chunk.
+static int start_chunk(PushTarget *t) {
+    PushJob *job = t->job;
+    PushChunkHeader h = { PUSH_CHUNK_MAGIC, 0, t->offset, 0, 0 };
+    if (t->offset >= job->size) {
+        t->end_queued = 1;
+    } else {
+        uint64_t left = job->size - t->offset;
+        h.len = left < PUSH_CHUNK_SIZE ? (uint32_t)left : PUSH_CHUNK_SIZE;
+        if (chunk_crc(job, t->offset / PUSH_CHUNK_SIZE, h.len, &h.crc) < 0) return -1;
+    }
+    t->chunk_end = t->offset + h.len;
+    push_header_encode(&h, t->hdr);
+    t->hdr_off = 0;
+    return 0;
+}
+
+static void target_throttle(PushTarget *t) {
+    if (t->throttled) return;
+    t->throttled = 1;
+    throttled_count++;
+    reactor_modify_fd(transfer_reactor, t->fd, REACTOR_READ);
+}
+
+// Writes up to one slice of the file to a writable data connection.
+static void target_send(PushTarget *t) {
+    PushJob *job = t->job;
+    size_t budget = TRANSFER_SLICE;
+    if (rate_bytes_per_ms) {
+        if (tokens <= 0) {
+            target_throttle(t);
+            return;
+        }
+        if ((uint64_t)tokens < budget) budget = (size_t)tokens;
+    }
+
+    size_t sent = 0;
+    while (sent < budget) {
+        if (t->hdr_off == PUSH_HEADER_LEN && t->offset == t->chunk_end) {
+            if (t->end_queued) {
+                t->state = TARGET_FINISHING;
+                reactor_modify_fd(transfer_reactor, t->fd, REACTOR_READ);
+                break;
+            }
+            if (start_chunk(t) < 0) {
+                target_finish(t, 0, "file shrank while sending");
+                return;
+            }
+        }
+        ssize_t n;
+        if (t->hdr_off < PUSH_HEADER_LEN) {
+            n = send(t->fd, t->hdr + t->hdr_off, PUSH_HEADER_LEN - t->hdr_off, MSG_NOSIGNAL | MSG_MORE);
+            if (n > 0) t->hdr_off += (size_t)n;
+        } else {
+            // straight from the page cache; the file is never copied here
+            off_t off = (off_t)t->offset;
+            size_t want = t->chunk_end - t->offset;
+            if (want > budget - sent) want = budget - sent;
+            n = sendfile(t->fd, job->file_fd, &off, want);
+            if (n > 0) {
+                t->offset += (uint64_t)n;
+                sent += (size_t)n;
+            } else if (n == 0) {
+                target_finish(t, 0, "file shrank while sending");
+                return;
+            }
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            target_retry(t, strerror(errno));
+            return;
+        }
+    }
+    if (sent > 0) {
+        job->bytes_sent += sent;
+        t->progress_ms = now_ms();
+        if (rate_bytes_per_ms) tokens -= (int64_t)sent;
+    }
+}
+
+// Reads the agent's push_done. Returns 1 if that finished the job's last
+// target and the job, t included, is gone.
+static int target_read_status(PushTarget *t) {
+    ssize_t n = ipc_reader_fill(&t->rx, t->fd);
+    if (n == -2) return 0;
+    size_t len = 0;
+    char *line = ipc_reader_next_line(&t->rx, &len);
+    if (!line) return n <= 0 ? target_retry(t, "connection lost") : 0;
+
+    JsonMsg m;
+    char err[256] = "unknown error";
+    if (json_msg_parse(&m, line, len) < 0 || !json_msg_str_eq(&m, "type", "push_done")) {
+        return target_retry(t, "unexpected reply");
+    }
+    json_msg_copy(&m, "error", err, sizeof(err));
+    if (json_msg_str_eq(&m, "status", "ok")) {
+        if (t->state != TARGET_FINISHING) return target_retry(t, "early completion");
+        return target_finish(t, 1, NULL);
+    }
+    if (json_msg_int(&m, "retry", 0)) return target_retry(t, err);
+    return target_finish(t, 0, err);
+}
+
+static void target_io(Reactor *r, int fd, unsigned events, void *ctx) {
+    (void)r;
+    (void)fd;
+    PushTarget *t = ctx;
+    // the agent only talks after the end marker or to report a failure
+    if (events & (REACTOR_READ | REACTOR_ERROR)) {
+        if (target_read_status(t) || t->fd < 0) return;
+    }
+    if ((events & REACTOR_WRITE) && t->state == TARGET_SENDING) target_send(t);
+}
+
+static void data_handoff(int fd, const char *pending, size_t pending_len, const char *unsent, size_t unsent_len,
+                         void *ctx) {
+    (void)unsent;
+    (void)unsent_len;
+    (void)pending;
+    (void)pending_len;
+    DataHello *dh = ctx;
+    PushJob *job = job_find(dh->id);
+    PushTarget *t = job ? target_find(job, dh->name) : NULL;
+    if (!t || t->state == TARGET_QUEUED || t->state == TARGET_DONE || t->state == TARGET_FAILED) {
+        log_info("Data connection for unknown push %s from %s, closed", dh->id, dh->name);
+        close(fd);
+        free(dh);
+        return;
+    }
+    // a resume point is where a verified chunk ended
+    if (dh->offset > job->size || (dh->offset % PUSH_CHUNK_SIZE && dh->offset != job->size)) {
+        log_error("Bad resume offset %llu from %s", (unsigned long long)dh->offset, dh->name);
+        close(fd);
+        free(dh);
+        return;
+    }
+    // a newer connection replaces a stale one
+    target_drop_conn(t);
+    t->fd = fd;
+    t->offset = dh->offset;
+    t->chunk_end = dh->offset;
+    t->hdr_off = PUSH_HEADER_LEN;
+    t->end_queued = 0;
+    t->state = TARGET_SENDING;
+    t->progress_ms = now_ms();
+    if (reactor_watch_fd(transfer_reactor, fd, REACTOR_READ | REACTOR_WRITE, target_io, t) < 0) {
+        t->fd = -1;
+        close(fd);
+        target_retry(t, "cannot watch data connection");
+    } else if (dh->offset > 0) {
+        log_info("Push %s to %s resumes at %llu", job->id, t->name, (unsigned long long)dh->offset);
+    }
+    free(dh);
+}
+
+int transfer_accept(ReactorStream *stream, const char *line, size_t len) {
+    JsonMsg m;
+    if (json_msg_parse(&m, line, len) < 0 || !json_msg_str_eq(&m, "type", "data")) return 0;
+
+    DataHello *dh = calloc(1, sizeof(DataHello));
+    long offset = json_msg_int(&m, "offset", -1);
+    if (!dh || json_msg_copy(&m, "transfer", dh->id, sizeof(dh->id)) < 0 ||
+        json_msg_copy(&m, "name", dh->name, sizeof(dh->name)) < 0 || offset < 0) {
+        log_error("Invalid data hello: %s", line);
+        free(dh);
+        reactor_stream_close(stream);
+        return 1;
+    }
+    dh->offset = (uint64_t)offset;
+    if (reactor_stream_detach(stream, data_handoff, dh) < 0) {
+        free(dh);
+        reactor_stream_close(stream);
+    }
+    return 1;
+}
+
+static void transfer_tick(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    long long now = now_ms();
+    if (rate_bytes_per_ms) {
+        tokens += (int64_t)(rate_bytes_per_ms * (uint64_t)(now - last_refill_ms));
+        if (tokens > burst) tokens = burst;
+    }
+    last_refill_ms = now;
+
+    int check = now - last_check_ms >= TRANSFER_CHECK_MS;
+    if (check) last_check_ms = now;
+    // without a cap (it may just have been lifted) nothing stays throttled
+    int open = !rate_bytes_per_ms || tokens > 0;
+    if (!check && (throttled_count == 0 || !open)) return;
+
+    PushJob *job = jobs;
+    while (job) {
+        PushJob *next = job->next;  // finishing the last target frees job
+        for (int i = 0; i < job->ntargets; ++i) {
+            PushTarget *t = &job->targets[i];
+            if (t->throttled && open) {
+                t->throttled = 0;
+                throttled_count--;
+                reactor_modify_fd(transfer_reactor, t->fd, REACTOR_READ | REACTOR_WRITE);
+            }
+            if (!check || t->state == TARGET_QUEUED || t->state == TARGET_DONE ||
+                t->state == TARGET_FAILED) {
+                continue;
+            }
+            if (now - t->progress_ms >= TRANSFER_STALL_MS) {
+                if (target_finish(t, 0, "no progress")) break;
+            } else if (t->state == TARGET_OFFERED && now - t->offered_ms >= TRANSFER_REOFFER_MS) {
+                send_offer(t);
+            }
+        }
+        job = next;
+    }
+}
+
+static void collect_targets(int shard, void *arg) {
+    TargetCollect *tc = arg;
+    int count = node_sessions_count();
+    if (count == 0) return;
+    NodeSession *sessions = malloc((size_t)count * sizeof(NodeSession));
+    tc->names[shard] = malloc((size_t)count * sizeof(*tc->names[shard]));
+    if (!sessions || !tc->names[shard]) {
+        free(sessions);
+        return;
+    }
+    int n = node_sessions_copy(sessions, count);
+    for (int i = 0; i < n; ++i) {
+        if (sessions[i].connected && selector_match(tc->job->selector, sessions[i].meta.name)) {
+            memcpy(tc->names[shard][tc->counts[shard]++], sessions[i].meta.name, 256);
+        }
+    }
+    free(sessions);
+}
+
+static void targets_ready(Reactor *r, void *arg) {
+    (void)r;
+    TargetCollect *tc = arg;
+    PushJob *job = tc->job;
+    int total = 0;
+    for (int i = 0; i < MAX_SHARDS; ++i) total += tc->counts[i];
+    job->targets = total ? calloc((size_t)total, sizeof(PushTarget)) : NULL;
+    for (int i = 0; i < MAX_SHARDS; ++i) {
+        for (int j = 0; job->targets && j < tc->counts[i]; ++j) {
+            PushTarget *t = &job->targets[job->ntargets++];
+            t->job = job;
+            memcpy(t->name, tc->names[i][j], sizeof(t->name));
+            t->fd = -1;
+            t->hdr_off = PUSH_HEADER_LEN;
+            ipc_reader_init(&t->rx);
+        }
+        free(tc->names[i]);
+    }
+    free(tc);
+
+    if (job->ntargets == 0) {
+        cli_reply(job->client_id, "Push %s: no connected nodes match %s", job->id, job->selector);
+        job_free(job);
+        return;
+    }
+    cli_reply(job->client_id, "Push %s: %s (%llu bytes) to %s on %d node(s)", job->id, job->path,
+              (unsigned long long)job->size, job->dest, job->ntargets);
+    job->started_ms = now_ms();
+    job->next = jobs;
+    jobs = job;
+    job_pump(job);
+}
+
+int transfer_push(unsigned long client_id, const char *local_file, const char *selector,
+                  const char *dest_path) {
+    if (!transfer_reactor) return -1;
+    if (!selector_valid(selector) || !dest_path[0] || strlen(dest_path) >= PATH_MAX) {
+        cli_reply(client_id, "Invalid push target %s:%s", selector, dest_path);
+        return -1;
+    }
+    int fd = open(local_file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        cli_reply(client_id, "Cannot push %s: %s", local_file, fd < 0 ? strerror(errno) : "not a regular file");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    PushJob *job = calloc(1, sizeof(PushJob));
+    TargetCollect *tc = calloc(1, sizeof(TargetCollect));
+    uint64_t nchunks = ((uint64_t)st.st_size + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE;
+    if (!job || !tc) goto fail;
+    job->file_fd = fd;
+    job->size = (uint64_t)st.st_size;
+    job->client_id = client_id;
+    snprintf(job->path, sizeof(job->path), "%s", local_file);
+    snprintf(job->dest, sizeof(job->dest), "%s", dest_path);
+    snprintf(job->selector, sizeof(job->selector), "%s", selector);
+    request_new_id(job->id, sizeof(job->id));
+    // identifies this version of the file, so a partial copy of an older
+    // one is never resumed
+    uint64_t ident[4] = { job->size, (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec,
+                          (uint64_t)st.st_ino, (uint64_t)st.st_dev };
+    snprintf(job->fingerprint, sizeof(job->fingerprint), "%08x%08x",
+             crc32c(0, ident, 2 * sizeof(uint64_t)), crc32c(0, ident + 2, 2 * sizeof(uint64_t)));
+
+    if (job->size > 0) {
+        job->crcs = calloc(nchunks, sizeof(uint32_t));
+        job->crc_ready = calloc(nchunks, 1);
+        if (!job->crcs || !job->crc_ready) goto fail;
+    }
+
+    tc->job = job;
+    if (shard_broadcast(collect_targets, tc, targets_ready) < 0) goto fail;
+    return 0;
+
+fail:
+    cli_reply(client_id, "Failed to start push of %s", local_file);
+    if (job) job_free(job);
+    else close(fd);
+    free(tc);
+    return -1;
+}
+
+void transfer_print(FILE *out) {
+    if (!jobs) {
+        fprintf(out, "Transfers: <none>\n");
+        return;
+    }
+    fprintf(out, "Transfers:\n");
+    for (PushJob *j = jobs; j; j = j->next) {
+        fprintf(out, "  - %s %s -> %s: %d/%d done, %d failed, %d active, %.1f MB sent\n", j->id, j->path,
+                j->dest, j->done, j->ntargets, j->failed, j->active,
+                (double)j->bytes_sent / (1024.0 * 1024.0));
+    }
+}
+
+void transfer_configure(const Config *config) {
+    max_parallel = config->push_parallel > 0 ? config->push_parallel : TRANSFER_DEFAULT_PARALLEL;
+    // megabits per second -> bytes per millisecond
+    rate_bytes_per_ms = config->push_bandwidth_mbps > 0 ? (uint64_t)config->push_bandwidth_mbps * 125 : 0;
+    burst = rate_bytes_per_ms ? (int64_t)(rate_bytes_per_ms * 50) : 0;
+    if (burst && burst < TRANSFER_SLICE) burst = TRANSFER_SLICE;
+    if (tokens > burst) tokens = burst;
+    // a wider window starts queued targets now rather than as others finish
+    PushJob *job = jobs;
+    while (job) {
+        PushJob *next = job->next;
+        job_pump(job);
+        job = next;
+    }
+}
+
+void transfer_init(Reactor *front, const Config *config) {
+    transfer_reactor = front;
+    data_port = config->listen_port;
+    transfer_configure(config);
+    last_refill_ms = now_ms();
+    reactor_add_tick(front, TRANSFER_TICK_MS, transfer_tick, NULL);
+}
+
+void transfer_shutdown(void) {
+    while (jobs) {
+        PushJob *job = jobs;
+        jobs = job->next;
+        for (int i = 0; i < job->ntargets; ++i) target_drop_conn(&job->targets[i]);
+        job_free(job);
+    }
+    transfer_reactor = NULL;
+}
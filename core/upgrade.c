@@ -0,0 +1,465 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/admin.h"
+#include "../include/arena.h"
+#include "../include/cli.h"
+#include "../include/ipc.h"
+#include "../include/json_escape.h"
+#include "../include/json_msg.h"
+#include "../include/logging.h"
+#include "../include/node_manager.h"
+#include "../include/relay.h"
+#include "../include/requests.h"
+#include "../include/shard.h"
+#include "../include/upgrade.h"
+
+#define UPGRADE_SWEEP_MS 50
+// a record holds at most a session's unsent output, escaped
+#define UPGRADE_MAX_RECORD (4u * IPC_MAX_PENDING)
+
+typedef enum {
+    UPGRADE_IDLE,
+    UPGRADE_WAIT_HELLOS,    // no new nodes; connections mid-hello finish first
+    UPGRADE_SESSIONS,       // shards are detaching their sessions
+    UPGRADE_CLIENTS,        // front state and admin clients
+    UPGRADE_DONE
+} UpgradeStage;
+
+static Reactor *front_reactor = NULL;
+static UpgradeHooks hooks;
+static int listen_fd = -1;
+static char listen_path[256];
+static UpgradeStage stage = UPGRADE_IDLE;
+
+// the successor; records come from the front and the shard threads
+static int conn_fd = -1;
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static int send_failed = 0;
+static int outstanding = 0;
+static int sessions_sent = 0;
+
+// --- records ---
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} Record;
+
+// Room for n more bytes at the end of the record, or NULL.
+static char *rec_reserve(Record *r, size_t n) {
+    if (r->failed) return NULL;
+    if (r->len + n > r->cap) {
+        size_t cap = r->cap ? r->cap : 512;
+        while (cap < r->len + n) cap *= 2;
+        char *b = realloc(r->buf, cap);
+        if (!b) {
+            r->failed = 1;
+            return NULL;
+        }
+        r->buf = b;
+        r->cap = cap;
+    }
+    return r->buf + r->len;
+}
+
+static void rec_raw(Record *r, const char *s, size_t n) {
+    char *p = rec_reserve(r, n);
+    if (!p) return;
+    memcpy(p, s, n);
+    r->len += n;
+}
+
+static void rec_begin(Record *r, const char *type) {
+    memset(r, 0, sizeof(*r));
+    rec_raw(r, "{\"type\":\"", 9);
+    rec_raw(r, type, strlen(type));
+    rec_raw(r, "\"", 1);
+}
+
+static void rec_str(Record *r, const char *key, const char *val, size_t len) {
+    char head[80];
+    int n = snprintf(head, sizeof(head), ",\"%s\":\"", key);
+    rec_raw(r, head, (size_t)n);
+    size_t esc = val ? json_escaped_len(val, len) : 0;
+    char *p = rec_reserve(r, esc);
+    if (p && esc > 0) {
+        json_escape_to(p, val, len);
+        r->len += esc;
+    }
+    rec_raw(r, "\"", 1);
+}
+
+static void rec_int(Record *r, const char *key, long long v) {
+    char field[96];
+    int n = snprintf(field, sizeof(field), ",\"%s\":%lld", key, v);
+    rec_raw(r, field, (size_t)n);
+}
+
+// Closes the record, sends it with its fds and frees it. The fds stay
+// open; the caller closes its copies.
+static int rec_send(Record *r, const int *fds, int nfds) {
+    rec_raw(r, "}\n", 2);
+    int rc = -1;
+    if (!r->failed) {
+        uint32_t len = (uint32_t)r->len;
+        pthread_mutex_lock(&send_lock);
+        if (!send_failed) {
+            if (ipc_send_fds(conn_fd, (const char *)&len, sizeof(len), fds, nfds) == 0 &&
+                ipc_send_full(conn_fd, r->buf, r->len) == (ssize_t)r->len) {
+                rc = 0;
+            } else {
+                send_failed = 1;
+            }
+        }
+        pthread_mutex_unlock(&send_lock);
+    }
+    free(r->buf);
+    r->buf = NULL;
+    return rc;
+}
+
+// --- old binary ---
+
+static void stage_advance(Reactor *r, void *arg);
+
+// Every detach still to report, plus one for whoever started the stage.
+static void part_done(void) {
+    if (__atomic_sub_fetch(&outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (shard_post_front(stage_advance, NULL) < 0) log_error("Hand-over stalled");
+    }
+}
+
+static void send_listener(const char *kind, int fd) {
+    if (fd < 0) return;
+    Record r;
+    rec_begin(&r, "listener");
+    rec_str(&r, "kind", kind, strlen(kind));
+    rec_send(&r, &fd, 1);
+}
+
+static void send_session(const NodeSessionImage *img, int fd, int shm_fd, void *arg) {
+    (void)arg;
+    Record r;
+    rec_begin(&r, "session");
+    rec_str(&r, "name", img->meta.name, strlen(img->meta.name));
+    rec_str(&r, "address", img->meta.address, strlen(img->meta.address));
+    rec_str(&r, "os", img->meta.os, strlen(img->meta.os));
+    rec_int(&r, "lanes", img->meta.lanes);
+    rec_int(&r, "last_seen", (long long)img->last_seen);
+    rec_int(&r, "relay", img->relay);
+    rec_str(&r, "unread", img->unread, img->unread_len);
+    rec_str(&r, "unsent", img->unsent, img->unsent_len);
+    int fds[2] = { fd, shm_fd };
+    if (rec_send(&r, fds, shm_fd >= 0 ? 2 : 1) == 0) __atomic_add_fetch(&sessions_sent, 1, __ATOMIC_RELAXED);
+    else log_error("Failed to hand over session %s", img->meta.name);
+    close(fd);
+    if (shm_fd >= 0) close(shm_fd);
+    part_done();
+}
+
+static void shard_handover(int shard, void *arg) {
+    (void)shard;
+    (void)arg;
+    // the detaches complete after this returns, so counting now is safe
+    int n = node_sessions_handover(send_session, NULL);
+    __atomic_add_fetch(&outstanding, n, __ATOMIC_ACQ_REL);
+}
+
+static void shards_handed_over(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    part_done();
+}
+
+static void send_route(const char *relay, const char *name, const char *parent, const char *os, void *arg) {
+    (void)arg;
+    Record r;
+    rec_begin(&r, "route");
+    rec_str(&r, "relay", relay, strlen(relay));
+    rec_str(&r, "name", name, strlen(name));
+    rec_str(&r, "parent", parent, strlen(parent));
+    rec_str(&r, "os", os, strlen(os));
+    rec_send(&r, NULL, 0);
+}
+
+static void send_request(const char *id, unsigned long client_id, int expected, int seen, time_t created,
+                         void *arg) {
+    (void)arg;
+    Record r;
+    rec_begin(&r, "request");
+    rec_str(&r, "id", id, strlen(id));
+    rec_int(&r, "client", (long long)client_id);
+    rec_int(&r, "expected", expected);
+    rec_int(&r, "seen", seen);
+    rec_int(&r, "created", (long long)created);
+    rec_send(&r, NULL, 0);
+}
+
+static void send_client(int fd, const char *client, const char *unread, size_t unread_len, const char *unsent,
+                        size_t unsent_len, void *arg) {
+    (void)arg;
+    Record r;
+    rec_begin(&r, "client");
+    rec_raw(&r, ",", 1);
+    rec_raw(&r, client, strlen(client));
+    rec_str(&r, "unread", unread, unread_len);
+    rec_str(&r, "unsent", unsent, unsent_len);
+    rec_send(&r, &fd, 1);
+    close(fd);
+    part_done();
+}
+
+static void begin_sessions(void) {
+    stage = UPGRADE_SESSIONS;
+    send_listener("tcp", hooks.listeners.tcp_fd);
+    send_listener("local", hooks.listeners.local_fd);
+    send_listener("admin", admin_listen_fd());
+    // routes and results keep reaching the front until every session is
+    // detached, so the front state goes after them
+    __atomic_store_n(&outstanding, 1, __ATOMIC_RELEASE);
+    if (shard_broadcast(shard_handover, NULL, shards_handed_over) < 0) part_done();
+}
+
+static void stage_advance(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    if (stage == UPGRADE_SESSIONS) {
+        stage = UPGRADE_CLIENTS;
+        relay_route_each(send_route, NULL);
+        request_each(send_request, NULL);
+        Record rec;
+        rec_begin(&rec, "cli");
+        rec_int(&rec, "next_client", (long long)cli_next_client_id());
+        rec_send(&rec, NULL, 0);
+        __atomic_store_n(&outstanding, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&outstanding, admin_handover(send_client, NULL), __ATOMIC_ACQ_REL);
+        part_done();
+        return;
+    }
+    if (stage != UPGRADE_CLIENTS) return;
+    Record rec;
+    rec_begin(&rec, "done");
+    rec_int(&rec, "sessions", __atomic_load_n(&sessions_sent, __ATOMIC_RELAXED));
+    rec_send(&rec, NULL, 0);
+    if (send_failed) log_error("Hand-over to the new binary failed part way; its connections are lost");
+    else log_info("Handed %d session(s) over to the new binary", sessions_sent);
+    close(conn_fd);
+    conn_fd = -1;
+    stage = UPGRADE_DONE;
+    if (hooks.done) hooks.done();
+}
+
+static void check_hellos(Reactor *r, void *arg) {
+    (void)r;
+    (void)arg;
+    // the hello sweep closes slow connections, so this does not wait long
+    if (stage == UPGRADE_WAIT_HELLOS && (!hooks.idle || hooks.idle())) begin_sessions();
+}
+
+static void on_successor(Reactor *r, int fd, void *ctx) {
+    (void)r;
+    (void)ctx;
+    if (stage != UPGRADE_IDLE) {
+        log_error("A hand-over is already under way, refusing another");
+        close(fd);
+        return;
+    }
+    // records are written whole from several threads
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    conn_fd = fd;
+    stage = UPGRADE_WAIT_HELLOS;
+    log_info("New binary connected, handing over");
+    if (hooks.pause) hooks.pause();
+}
+
+int upgrade_init(Reactor *front, const Config *cfg, const UpgradeHooks *h) {
+    if (!front || !cfg || !h || !cfg->upgrade_socket[0]) return 0;
+    int fd = ipc_unix_listen(cfg->upgrade_socket, 0600);
+    if (fd < 0) return -1;
+    if (reactor_watch_listener(front, fd, on_successor, NULL) < 0) {
+        log_error("Failed to watch upgrade socket %s", cfg->upgrade_socket);
+        close(fd);
+        unlink(cfg->upgrade_socket);
+        return -1;
+    }
+    reactor_add_tick(front, UPGRADE_SWEEP_MS, check_hellos, NULL);
+    front_reactor = front;
+    hooks = *h;
+    listen_fd = fd;
+    snprintf(listen_path, sizeof(listen_path), "%s", cfg->upgrade_socket);
+    return 0;
+}
+
+void upgrade_shutdown(void) {
+    if (conn_fd >= 0) close(conn_fd);
+    conn_fd = -1;
+    if (listen_fd < 0) return;
+    reactor_unwatch_fd(front_reactor, listen_fd);
+    close(listen_fd);
+    // the successor listens on the same path by now
+    if (stage != UPGRADE_DONE) unlink(listen_path);
+    listen_fd = -1;
+    front_reactor = NULL;
+}
+
+int upgrade_handed_over(void) {
+    return stage == UPGRADE_DONE;
+}
+
+// --- new binary ---
+
+typedef struct {
+    NodeSessionImage img;
+    int fd;
+    int shm_fd;
+    char data[];
+} Resume;
+
+static void resume_task(Reactor *r, void *arg) {
+    (void)r;
+    Resume *res = arg;
+    if (!node_session_resume(&res->img, res->fd, res->shm_fd)) {
+        log_error("Shard %d could not resume session %s", shard_current(), res->img.meta.name);
+    }
+    free(res);
+}
+
+static int resume_session(const JsonMsg *m, Arena *a, const int *fds, int nfds) {
+    size_t unread_len = 0, unsent_len = 0;
+    char *unread = json_msg_str(m, "unread", a, &unread_len);
+    char *unsent = json_msg_str(m, "unsent", a, &unsent_len);
+    Resume *res = nfds > 0 ? malloc(sizeof(Resume) + unread_len + unsent_len) : NULL;
+    if (!res) return -1;
+    memset(&res->img, 0, sizeof(res->img));
+    json_msg_copy(m, "name", res->img.meta.name, sizeof(res->img.meta.name));
+    json_msg_copy(m, "address", res->img.meta.address, sizeof(res->img.meta.address));
+    json_msg_copy(m, "os", res->img.meta.os, sizeof(res->img.meta.os));
+    res->img.meta.lanes = (int)json_msg_int(m, "lanes", 0);
+    res->img.last_seen = (time_t)json_msg_int(m, "last_seen", 0);
+    res->img.relay = (int)json_msg_int(m, "relay", 0);
+    res->img.unread = res->data;
+    res->img.unread_len = unread_len;
+    if (unread_len) memcpy(res->data, unread, unread_len);
+    res->img.unsent = res->data + unread_len;
+    res->img.unsent_len = unsent_len;
+    if (unsent_len) memcpy(res->data + unread_len, unsent, unsent_len);
+    res->fd = fds[0];
+    res->shm_fd = nfds > 1 ? fds[1] : -1;
+    if (!res->img.meta.name[0] || shard_post(shard_for_name(res->img.meta.name), resume_task, res) < 0) {
+        free(res);
+        return -1;
+    }
+    return 0;
+}
+
+static int connect_predecessor(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int upgrade_takeover(Reactor *front, const Config *cfg, UpgradeListeners *out) {
+    out->tcp_fd = -1;
+    out->local_fd = -1;
+    if (!cfg->upgrade_socket[0]) {
+        log_error("--takeover needs upgrade_socket in the config");
+        return -1;
+    }
+    int sock = connect_predecessor(cfg->upgrade_socket);
+    if (sock < 0) {
+        log_error("No controller to take over at %s: %s", cfg->upgrade_socket, strerror(errno));
+        return -1;
+    }
+    log_info("Taking over from the controller at %s", cfg->upgrade_socket);
+
+    Arena a;
+    arena_init(&a, 64 * 1024);
+    char *line = NULL;
+    int sessions = 0, clients = 0, done = 0;
+    while (!done) {
+        uint32_t len = 0;
+        int fds[IPC_MAX_PASS_FDS];
+        int nfds = ipc_recv_fds(sock, (char *)&len, sizeof(len), fds, IPC_MAX_PASS_FDS);
+        if (nfds < 0) break;
+        char *grown = len > 0 && len <= UPGRADE_MAX_RECORD ? realloc(line, len) : NULL;
+        if (!grown || ipc_recv_fds(sock, grown, len, NULL, 0) < 0) {
+            line = grown ? grown : line;
+            for (int i = 0; i < nfds; ++i) close(fds[i]);
+            break;
+        }
+        line = grown;
+        arena_reset(&a);
+        JsonMsg m;
+        int used = 0;
+        if (json_msg_parse(&m, line, len - 1) < 0) {
+            log_error("Bad hand-over record");
+        } else if (json_msg_str_eq(&m, "type", "listener") && nfds > 0) {
+            used = 1;
+            if (json_msg_str_eq(&m, "kind", "tcp")) out->tcp_fd = fds[0];
+            else if (json_msg_str_eq(&m, "kind", "local")) out->local_fd = fds[0];
+            else if (json_msg_str_eq(&m, "kind", "admin")) admin_start_fd(front, fds[0], cfg->admin_socket);
+            else used = 0;
+        } else if (json_msg_str_eq(&m, "type", "session")) {
+            used = resume_session(&m, &a, fds, nfds) == 0 ? nfds : 0;
+            sessions += used > 0;
+        } else if (json_msg_str_eq(&m, "type", "client") && nfds > 0) {
+            // admin_adopt() takes the fd even when it fails
+            used = 1;
+            size_t unread_len = 0, unsent_len = 0;
+            char *unread = json_msg_str(&m, "unread", &a, &unread_len);
+            char *unsent = json_msg_str(&m, "unsent", &a, &unsent_len);
+            clients += admin_adopt(fds[0], &m, &a, unread, unread_len, unsent, unsent_len) == 0;
+        } else if (json_msg_str_eq(&m, "type", "route")) {
+            char relay[256], name[256], parent[256], os[64];
+            if (json_msg_copy(&m, "relay", relay, sizeof(relay)) == 0 &&
+                json_msg_copy(&m, "name", name, sizeof(name)) == 0 &&
+                json_msg_copy(&m, "parent", parent, sizeof(parent)) == 0 &&
+                json_msg_copy(&m, "os", os, sizeof(os)) == 0) {
+                relay_route_add(relay, name, parent, os);
+            }
+        } else if (json_msg_str_eq(&m, "type", "request")) {
+            char id[REQUEST_ID_LEN];
+            if (json_msg_copy(&m, "id", id, sizeof(id)) == 0) {
+                request_restore(id, (unsigned long)json_msg_int(&m, "client", 0),
+                                (int)json_msg_int(&m, "expected", 0), (int)json_msg_int(&m, "seen", 0),
+                                (time_t)json_msg_int(&m, "created", 0));
+            }
+        } else if (json_msg_str_eq(&m, "type", "cli")) {
+            cli_set_next_client_id((unsigned long)json_msg_int(&m, "next_client", 0));
+        } else if (json_msg_str_eq(&m, "type", "done")) {
+            done = 1;
+        }
+        for (int i = used; i < nfds; ++i) close(fds[i]);
+    }
+    free(line);
+    arena_destroy(&a);
+    close(sock);
+
+    if (!done) {
+        log_error("Hand-over cut short after %d session(s)", sessions);
+        return -1;
+    }
+    log_info("Took over %d session(s) and %d admin client(s)", sessions, clients);
+    return sessions;
+}
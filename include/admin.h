@@ -0,0 +1,35 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "arena.h"
+#include "json_msg.h"
+#include "reactor.h"
+
+// Unix socket for CLI clients. Each connection speaks the console verbs,
+// one command per line, and gets its replies and results on the same
+// socket, e.g. `socat - UNIX-CONNECT:./simos.sock`.
+int admin_start(Reactor *front, const char *path);
+
+// Closes the listener and every client connection, and removes the socket
+// file.
+void admin_stop(void);
+
+// Restart hand-over (see upgrade.h). The listening socket, or -1.
+int admin_listen_fd(void);
+
+typedef void (*admin_handover_fn)(int fd, const char *client, const char *unread, size_t unread_len,
+                                  const char *unsent, size_t unsent_len, void *arg);
+
+// Stops listening, leaving the socket file to the successor, and detaches
+// every client. fn gets each one's fd, its CLI state (cli_client_save())
+// and the bytes still pending either way, on the front thread. Returns how
+// many calls of fn are coming.
+int admin_handover(admin_handover_fn fn, void *arg);
+
+// The successor's side: serve the listening socket it was handed, and a
+// client connection with its saved state.
+int admin_start_fd(Reactor *front, int fd, const char *path);
+int admin_adopt(int fd, const JsonMsg *client, Arena *a, const char *unread, size_t unread_len, const char *unsent,
+                size_t unsent_len);
+
+#endif
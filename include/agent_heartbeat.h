@@ -0,0 +1,16 @@
+#ifndef AGENT_HEARTBEAT_H
+#define AGENT_HEARTBEAT_H
+
+#include <netinet/in.h>
+
+// Agent side of the UDP heartbeats (see heartbeat.h). A thread sends one
+// datagram with this host's load every HEARTBEAT_INTERVAL_MS to the
+// controller the session is with, and a telemetry frame (telemetry.h)
+// every TELEMETRY_INTERVAL_MS.
+
+// Points the heartbeats at addr for node name, starting the thread on first
+// use; NULL pauses them while there is no session.
+void agent_heartbeat_target(const char *name, const struct sockaddr_in *addr);
+void agent_heartbeat_stop(void);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef AGENT_PUSH_H
+#define AGENT_PUSH_H
+
+#include "dispatch.h"
+
+// Agent side of file distribution (see transfer.h). A push offer starts a
+// receiver thread that connects back to the controller, resumes after the
+// last verified chunk of an earlier partial copy, and writes each chunk to
+// <path>.part once its checksum matches. The finished file is renamed into
+// place, so <path> never holds a partial copy.
+
+// Registers the "push" handler. The MsgContext conn must be an AgentConn.
+void agent_push_register(Dispatcher *d);
+
+#endif
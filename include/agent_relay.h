@@ -0,0 +1,47 @@
+#ifndef AGENT_RELAY_H
+#define AGENT_RELAY_H
+
+#include "arena.h"
+#include "json_msg.h"
+#include "node_agent.h"
+
+// Relay mode. A relay is an agent that also accepts child agents (which
+// may be relays in turn) and stands in for the controller towards them: it
+// acks their hello, reports every node below it upstream (relay_join /
+// relay_leave), and forwards exec requests that carry a "select" selector
+// to the children reaching matching nodes, with the command's deadline;
+// a cancel goes to every child. Results coming back are grouped by
+// identical exit code, status and output and sent upstream once per group,
+// with the count and names of the nodes in it, when every expected node
+// has answered or the request's deadline passes. Nodes that never answered
+// are reported as one more group.
+//
+// Groups go upstream through this agent's spool and stay there until the
+// controller acks them; a child's result is acked to it only once the
+// group holding it is spooled, so a relay that dies in between loses
+// nothing: the child sends it again when it reconnects.
+//
+// The relay runs on its own thread; everything it sends upstream goes
+// through node_agent_send().
+
+// Makes this agent a relay for children connecting to listen_fd, a
+// listening socket. Call before node_agent_run_loop().
+int agent_relay_enable(int listen_fd);
+
+// Started and stopped by node_agent_run_loop() around its session.
+int agent_relay_start(AgentConn *upstream);
+void agent_relay_stop(void);
+
+// Reports the nodes below again after the session moved to another
+// controller.
+void agent_relay_resync(void);
+
+// Hands an exec with a "select" field to the relay thread. Returns -1 if
+// this agent is not a relay.
+int agent_relay_forward(const JsonMsg *m, Arena *a);
+
+// Passes a cancel of id on to every child. Returns -1 if this agent is
+// not a relay.
+int agent_relay_cancel(const char *id);
+
+#endif
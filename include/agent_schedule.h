@@ -0,0 +1,53 @@
+#ifndef AGENT_SCHEDULE_H
+#define AGENT_SCHEDULE_H
+
+#include "dispatch.h"
+#include "node_agent.h"
+
+// Recurring jobs the agent runs by itself, so a periodic command costs
+// the controller one message per batch instead of an exec round trip per
+// node and run. The controller sends
+//
+//   {"type":"schedule","name":"df","every_ms":60000,"jitter_ms":5000,
+//    "keep_s":3600,"cmd":"df -h"}
+//
+// ("name" again replaces the job) and {"type":"unschedule","name":"df"}
+// ("*" for all). A thread turns a timer wheel of AGENT_SCHEDULE_TICK_MS
+// slots and runs due jobs one at a time, each next run every_ms plus up
+// to jitter_ms later. Results pile up as JSON lines until there are
+// AGENT_SCHEDULE_BATCH_BYTES of them or the oldest is
+// AGENT_SCHEDULE_BATCH_MS old, then go out deflated as one message:
+//
+//   {"type":"sched_batch","id":"...","seq":N,"count":C,"raw":R,"data":"<base64>"}
+//
+// One batch is in flight at a time, until {"type":"sched_ack","seq":N};
+// it goes out again after every registration. While there is no
+// controller a result is kept for its job's keep_s, and for no more than
+// AGENT_SCHEDULE_MAX_PENDING bytes in all, oldest dropped first. Jobs live
+// in memory: they outlast reconnects, not the agent.
+
+#define AGENT_SCHEDULE_TICK_MS 100
+#define AGENT_SCHEDULE_WHEEL_SLOTS 512
+#define AGENT_SCHEDULE_MAX_JOBS 256
+#define AGENT_SCHEDULE_MIN_EVERY_MS 1000
+#define AGENT_SCHEDULE_BATCH_BYTES (64 * 1024)
+#define AGENT_SCHEDULE_BATCH_MS 30000
+// raw bytes per batch; deflated and base64'd it stays under MAX_MSG_LEN
+#define AGENT_SCHEDULE_BATCH_MAX (128 * 1024)
+// stdout and stderr of one run, together
+#define AGENT_SCHEDULE_MAX_OUTPUT (32 * 1024)
+#define AGENT_SCHEDULE_MAX_PENDING (4 * 1024 * 1024)
+#define AGENT_SCHEDULE_DEFAULT_KEEP_S 3600
+
+// Registers the "schedule", "unschedule" and "sched_ack" handlers. The
+// MsgContext conn must be an AgentConn.
+void agent_schedule_register(Dispatcher *d);
+
+// Starts the job thread, which sends through conn.
+void agent_schedule_start(AgentConn *conn);
+void agent_schedule_stop(void);
+
+// A new session: the batch in flight goes out again.
+void agent_schedule_resync(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef AGENT_SCRIPTS_H
+#define AGENT_SCRIPTS_H
+
+#include <stddef.h>
+
+// Agent side of scripts run by hash (scripts.h). Scripts live in a
+// directory, one file per script named by its SHA-256, and the least
+// recently run ones are deleted once the directory holds more than the
+// limits below. A file's mtime is its last run, so the order survives
+// restarts. Run loop thread only.
+
+#define AGENT_SCRIPT_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define AGENT_SCRIPT_CACHE_MAX_FILES 256
+
+// Creates the cache directory if needed.
+int agent_scripts_open(const char *dir);
+
+// 0 with the script's path in path if it is cached (and marks it used),
+// -1 if not.
+int agent_scripts_lookup(const char *hash, char *path, size_t path_size);
+
+// Checks body against hash and caches it, making room first. Returns 0
+// with its path, -1 if the body does not match or cannot be written.
+int agent_scripts_store(const char *hash, const char *body, size_t len, char *path, size_t path_size);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef AGENT_SPOOL_H
+#define AGENT_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Results this agent finished, kept on disk until the controller has
+// acknowledged them, so none is lost when the controller goes away while a
+// command runs or the agent itself restarts. The spool is one mmap'd file:
+// a header, then records appended at the end, each holding a whole result
+// message. Acked records are trimmed from the front; once every record is
+// acked the file starts over.
+//
+// Each result carries the sequence number of its record ("seq") and the
+// controller answers {"type":"result_ack","seq":N}. After registering
+// again the agent sends every record still unacked, one per request id.
+// Run loop thread only.
+
+#define AGENT_SPOOL_INITIAL (1024 * 1024)
+#define AGENT_SPOOL_MAX (256 * 1024 * 1024)
+
+// Maps the spool at path, creating it if needed. Records left unacked by
+// an earlier run are kept for agent_spool_replay().
+int agent_spool_open(const char *path);
+void agent_spool_close(void);
+
+// Room for a message of up to len bytes for request id (or another key
+// naming what the record answers); *seq is its sequence number, which the
+// message should carry. The message is written there and appended with
+// agent_spool_commit(), given its final length.
+// NULL if the spool is not open or cannot grow; the result then goes out
+// unspooled.
+char *agent_spool_reserve(const char *id, size_t len, uint64_t *seq);
+void agent_spool_commit(size_t len);
+
+// Drops the record with that sequence number.
+void agent_spool_ack(uint64_t seq);
+
+// Calls fn with every unacked record, oldest first. Of several records for
+// one id or key only the first is sent; the rest are dropped. So is a record
+// longer than max_len, which this controller would never take.
+int agent_spool_replay(size_t max_len, void (*fn)(const char *msg, size_t len, void *arg), void *arg);
+
+// Calls fn with the unacked record seq. Returns -1 if there is none.
+int agent_spool_resend(uint64_t seq, void (*fn)(const char *msg, size_t len, void *arg), void *arg);
+
+// Unacked records.
+int agent_spool_pending(void);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef AGENT_TELEMETRY_H
+#define AGENT_TELEMETRY_H
+
+#include <stddef.h>
+
+// Agent side of telemetry (see telemetry.h): samples /proc and statvfs()
+// without spawning anything and encodes the sample as the next frame for
+// node name. Returns the frame length, or -1. One caller thread only.
+int agent_telemetry_frame(const char *name, unsigned char *out, size_t size);
+
+// Makes the next frame a keyframe, e.g. after switching controllers.
+void agent_telemetry_reset(void);
+
+#endif
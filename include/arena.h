@@ -0,0 +1,42 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump-pointer arena for per-message / per-request scratch memory. Reset
+// keeps the memory: after the first few messages the arena settles on a
+// single block large enough for the biggest message seen (up to a limit,
+// see arena_reset()), and from then on message handling never touches the
+// global heap.
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t block_size;
+    void *last;         // most recent allocation, for arena_grow()
+    size_t last_size;
+} Arena;
+
+void arena_init(Arena *a, size_t block_size);
+void arena_destroy(Arena *a);
+
+// Frees everything allocated since the last reset. If the arena had to
+// chain blocks, they are coalesced into one block of the combined size;
+// past ARENA_MAX_RETAINED_BLOCKS block sizes (arena.c) it drops back to a
+// single block of block_size.
+void arena_reset(Arena *a);
+
+// 16-byte aligned, uninitialised. Returns NULL only when malloc fails.
+void *arena_alloc(Arena *a, size_t size);
+
+// Resizes p (allocated from a with old_size bytes). Grows in place when p
+// is the most recent allocation and the block has room, otherwise copies.
+void *arena_grow(Arena *a, void *p, size_t old_size, size_t new_size);
+
+char *arena_strndup(Arena *a, const char *s, size_t n);
+
+// Bytes currently reserved by the arena across all blocks.
+size_t arena_capacity(const Arena *a);
+
+#endif
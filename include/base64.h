@@ -0,0 +1,18 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <stddef.h>
+
+// Standard base64 with padding, for binary data inside string values of
+// the line protocol.
+
+#define BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+
+// Writes BASE64_ENCODED_LEN(len) bytes to out. Does not NUL-terminate.
+size_t base64_encode(char *out, const void *in, size_t len);
+
+// Decodes in[0..len) into out, which must hold len / 4 * 3 bytes. Returns
+// the number of bytes written, or -1 if in is not valid base64.
+long base64_decode(void *out, const char *in, size_t len);
+
+#endif
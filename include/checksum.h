@@ -0,0 +1,27 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), used to verify file chunks end to end. Uses the
+// SSE4.2 crc32 instruction when the CPU has it, a table otherwise; the
+// kernel is picked once at runtime.
+
+// Continues crc over buf; start with crc = 0.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+const char *crc32c_kernel_name(void);
+
+// SHA-256, naming scripts by their content (scripts.h).
+#define SHA256_LEN 32
+#define SHA256_HEX_LEN (2 * SHA256_LEN)
+
+void sha256(const void *buf, size_t len, unsigned char out[SHA256_LEN]);
+// The digest as lowercase hex, NUL-terminated.
+void sha256_hex(const void *buf, size_t len, char out[SHA256_HEX_LEN + 1]);
+// HMAC-SHA256 of msg under key, as hex; authenticates controller peer
+// links (cluster.h). Returns -1 if out of memory.
+int hmac_sha256_hex(const void *key, size_t key_len, const void *msg, size_t len, char out[SHA256_HEX_LEN + 1]);
+
+#endif
@@ -1,11 +1,83 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include <stddef.h>
+
+#include "arena.h"
+#include "json_msg.h"
+#include "node_manager.h"
+#include "reactor.h"
+
 typedef struct {
     const char *config;
+    int takeover;   // --takeover: start from a running controller's state
 } CliArgs;
 
 CliArgs parse_cli_args(int argc, char **argv);
+
+// Anyone issuing CLI verbs: the console (stdin/stdout) or an admin socket
+// connection. Clients live on the front reactor thread; other threads
+// refer to them by id. Output is buffered and written as the terminal or
+// socket accepts it, so a slow client never blocks the loop; a client that
+// falls too far behind loses results rather than stalling everyone.
+typedef struct CliClient CliClient;
+
+// Wires the CLI to the front reactor and subscribes it to node results.
+void cli_init(Reactor *front);
+
+// Flushes the console and drops every client.
+void cli_shutdown(void);
+
+CliClient *cli_console(void);
+
+// A client writing to stream. Admin clients only see results of their own
+// requests until they subscribe to more.
+CliClient *cli_client_new(ReactorStream *stream);
+void cli_client_free(CliClient *c);
+
+// Output of a client with no stream of its own goes here instead: write
+// gets its replies, result the results of its requests, and closed is
+// called when the client is freed. Used for clients of another controller
+// whose verbs run here (see cluster.h).
+typedef struct {
+    void (*write)(void *ctx, const char *data, size_t len);
+    void (*result)(void *ctx, const NodeResult *res);
+    void (*closed)(void *ctx);
+} CliSink;
+
+CliClient *cli_client_new_sink(const CliSink *sink, void *ctx);
+unsigned long cli_client_id(const CliClient *c);
+
+// A client's id and subscriptions as JSON object fields (malloc'd), to
+// carry it over to a new binary (see upgrade.h), and the client rebuilt
+// from them there on stream.
+char *cli_client_save(const CliClient *c);
+CliClient *cli_client_restore(ReactorStream *stream, const JsonMsg *m, Arena *a);
+
+// The id the next client gets; a new binary continues from the old one's,
+// so ids of clients it took over and their requests never repeat.
+unsigned long cli_next_client_id(void);
+void cli_set_next_client_id(unsigned long id);
+
+// Runs one command line. Returns -1 when the client asked to disconnect.
+int cli_execute(CliClient *c, const char *line);
+
+// Runs a line another controller forwarded. An exec takes request_id
+// instead of a new id, so its results go back under the id the client
+// there knows; nothing is forwarded again.
+int cli_execute_forwarded(CliClient *c, const char *line, const char *request_id);
+
+void cli_write(CliClient *c, const char *data, size_t len);
+void cli_printf(CliClient *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Writes to the client with that id if it is still there. Front reactor
+// thread only.
+void cli_write_to(unsigned long client_id, const char *data, size_t len);
+
+// Sends a line to a client from any thread; dropped if it has gone away.
+void cli_reply(unsigned long client_id, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Runs a console command line.
 void parse_cli_command(const char *input_line);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,69 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "env.h"
+#include "node_manager.h"
+#include "reactor.h"
+
+// Several controllers can split the nodes between them. Every controller
+// lists all of them (controllers: name, address host:port) and names itself
+// (controller_name). Node names are placed on a consistent-hash ring with
+// CLUSTER_VNODES points per controller, so adding one moves about 1/N of
+// the nodes. An agent saying hello to the wrong controller is redirected to
+// the owner; while the owner is unreachable the next controller on the ring
+// takes its nodes.
+//
+// Each controller keeps a peer link to every other one. CLI verbs that name
+// nodes held elsewhere are forwarded over it and run there for the client
+// that issued them: a single node goes to its owner, a selector and `nodes`
+// go to every peer. Text replies and results come back over the link, so
+// results of a fan-out arrive merged in the client's stream.
+//
+// Links are authenticated with cluster_secret, which every controller has
+// the same: each end answers a nonce from the other with an HMAC under it
+// before the link carries anything, so a client that merely knows a
+// controller's name cannot link in and run commands. Without a secret the
+// controller runs alone. The links themselves are not encrypted.
+// Front reactor thread only.
+
+#define CLUSTER_VNODES 128
+
+// Reads the controller list and starts dialing the peers. Without a list
+// (or with a single entry, or no cluster_secret) the controller runs on its
+// own and the calls below treat every node as local.
+int cluster_init(Reactor *front, const Config *cfg);
+void cluster_shutdown(void);
+
+int cluster_enabled(void);
+const char *cluster_self(void);
+
+// The peer that currently owns name, or -1 if this controller does.
+int cluster_owner(const char *name);
+const char *cluster_peer_name(int peer);
+
+// Fills msg with the redirect to send an agent named name in reply to its
+// hello. Returns its length, or 0 if the node belongs here.
+int cluster_redirect(const char *name, char *msg, size_t size);
+
+// Takes over a connection whose first line is a peer hello. Returns 0 if
+// line is something else.
+int cluster_accept(ReactorStream *stream, const char *line, size_t len);
+
+// Sends a CLI line to run on a peer for client_id. request_id is the id an
+// exec there must use ("" for verbs without one). Returns -1 if the link is
+// down.
+int cluster_forward(int peer, unsigned long client_id, const char *request_id, const char *line);
+
+// cluster_forward() to every peer that is up. Returns how many it reached.
+int cluster_forward_all(unsigned long client_id, const char *request_id, const char *line);
+
+// Tells the peers a client went away, so they drop its state.
+void cluster_client_gone(unsigned long client_id);
+
+// One line per controller with its link state.
+void cluster_print(FILE *out);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+// Compressed command output. The hello lists the codecs an agent can
+// produce ("codecs":"deflate/1") and the controller's ack names the one to
+// use ("codec":"deflate/1"). An agent then sends a stdout of at least
+// CODEC_MIN_LEN and at most CODEC_MAX_RAW bytes as
+//
+//   {"type":"result",...,"stdout_len":N,"stdout_z":"<base64>"}
+//
+// instead of "stdout", and the spool keeps it that way. deflate/1 is raw
+// deflate primed with a dictionary of text common in command output
+// (listings, df, ps, log lines); the /1 is its version, so both ends
+// always agree on the dictionary. The level follows the link: the better
+// the agent's writes go, the less time it spends squeezing.
+
+#define CODEC_NAME "deflate/1"
+#define CODEC_MIN_LEN 2048
+// inflated output accepted from an agent
+#define CODEC_MAX_RAW (16 * 1024 * 1024)
+
+// 1 if the comma-separated list names CODEC_NAME.
+int codec_listed(const char *list);
+
+// The level for a link moving bytes_per_sec (0 if not measured yet).
+int codec_level(double bytes_per_sec);
+
+// in[0..len) deflated and base64-encoded, malloc'd and NUL-terminated;
+// NULL on failure.
+char *codec_pack(const char *in, size_t len, int level, size_t *out_len);
+
+// The raw_len bytes packed in b64, NUL-terminated in the arena; NULL if
+// they are damaged or not that long.
+char *codec_unpack(const char *b64, size_t b64_len, size_t raw_len, Arena *a);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef CONFIG_RELOAD_H
+#define CONFIG_RELOAD_H
+
+#include "env.h"
+#include "reactor.h"
+
+// Picks up changes to the config file without a restart. The directory
+// holding the file is watched with inotify, so an editor that writes a new
+// file and renames it over the old one is seen as well as one that writes
+// in place; a burst of changes is read once, CONFIG_RELOAD_SETTLE_MS after
+// the last of them.
+//
+// The file is parsed into a new Config and compared with the live one.
+// log_path, the push limits, the nodes list and dial_nodes (dialer.h) are
+// applied on the spot; settings that need new sockets or threads (ports,
+// sockets, reactor threads, db_path, controllers, cluster_secret) are
+// reported and keep their running value until a restart. Sessions are not
+// touched. A file that does not parse leaves the live config as it is.
+//
+// The new Config is complete before it replaces the old one with a single
+// pointer store in state->config, so a reader sees one or the other and
+// never a mix. Config is read on the front reactor thread, which is also
+// where the swap happens, so the old one is freed right after.
+
+#define CONFIG_RELOAD_SETTLE_MS 200
+// nodes list changes logged one by one before only the totals are
+#define CONFIG_RELOAD_LOG_NODES 20
+
+// Watches state->config_path (none = no reloads). Front reactor thread.
+int config_reload_start(Reactor *front, GlobalState *state);
+void config_reload_stop(void);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef DB_H
+#define DB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+// The command store: an append-only text file of command runs, one line
+// each, every field quoted and JSON-escaped. Safe from any thread: callers
+// format their rows and hand them to one writer thread, which holds the
+// file open, so no shard waits on the disk.
+
+// Rows queued for the writer beyond this are dropped, not buffered.
+#define DB_MAX_QUEUED (64 * 1024 * 1024)
+
+// Opens the store and starts its writer.
+bool db_init(const char *db_path);
+// Writes out what is queued and stops the writer.
+void db_shutdown(void);
+bool db_store_command(const char *node_name, const char *command, const char *result);
+void db_list_commands(void);
+
+// One run of a scheduled job (agent_schedule.h).
+typedef struct {
+    time_t at;
+    const char *job;
+    const char *command;
+    int exit_code;
+    const char *out;
+    size_t out_len;
+} DbRow;
+
+// Queues rows from node to be appended in one write. Returns the number of
+// rows queued, or -1.
+int db_store_batch(const char *node_name, const DbRow *rows, int count);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef DIALER_H
+#define DIALER_H
+
+#include <stdio.h>
+
+#include "env.h"
+#include "reactor.h"
+
+// Connections the controller opens itself (dial_nodes: 1). Every entry of
+// the nodes list (address host or host:port, DEFAULT_NODE_PORT if none)
+// is dialed with a non-blocking connect(), all of them at once up to
+// DIALER_MAX_CONNECTING in flight, so a controller that restarts with
+// thousands of configured nodes has them back within a few round trips.
+// The agent there waits for it (node_agent_await()) and sends its hello as
+// if it had dialed; from the hello on the connection goes the same way as
+// an accepted one.
+//
+// A connect that fails or takes longer than DIALER_CONNECT_TIMEOUT_MS, or a
+// connection that brings no hello, is tried again after a backoff with
+// decorrelated jitter between DIALER_BACKOFF_BASE_MS and
+// DIALER_BACKOFF_CAP_MS. Such a node is shown as configured but
+// unreachable in `nodes` until a session for it starts, however it came
+// in. A node with a session is not dialed until that session ends, and one
+// that another controller owns (cluster.h) is left to it.
+//
+// Addresses must be numeric IPv4; names are not resolved on the front
+// reactor. Front reactor thread only.
+
+#define DIALER_TICK_MS 100
+#define DIALER_CONNECT_TIMEOUT_MS 3000
+// from a finished connect to the hello handing the node its session
+#define DIALER_HELLO_TIMEOUT_MS 3000
+#define DIALER_BACKOFF_BASE_MS 1000
+#define DIALER_BACKOFF_CAP_MS 60000
+// connects in flight at once; lowered to a quarter of RLIMIT_NOFILE
+#define DIALER_MAX_CONNECTING 1024
+
+// Starts dialing the nodes of cfg if cfg->dial_nodes is set. A connection
+// that is up goes to adopt, like one accepted on the listening socket.
+int dialer_init(Reactor *front, const Config *cfg, reactor_accept_cb adopt);
+void dialer_shutdown(void);
+
+// Takes the nodes list and dial_nodes of a reloaded config. Nodes still
+// listed at the same address keep their state.
+void dialer_configure(const Config *cfg);
+
+// The hello of name arrived and its session is starting.
+void dialer_session_up(const char *name);
+
+// Counts by state and the configured nodes that cannot be reached, for
+// `nodes`. Prints nothing unless dialing is on.
+void dialer_print(FILE *out);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "json_msg.h"
+
+// Message types are interned to small integer ids once, at startup; the
+// tokenizer resolves the "type" field of every message to its id while
+// parsing, and a Dispatcher routes the message through a table indexed by
+// that id. Modules add message types by registering a handler, without
+// touching the receive loops.
+
+#define MSG_TYPE_MAX 64
+#define MSG_TYPE_UNKNOWN 0
+
+// Returns the id for name, registering it if needed; -1 if the table is
+// full. Call during startup, before messages are being parsed.
+int msg_type_intern(const char *name);
+
+// Id of a registered type, or MSG_TYPE_UNKNOWN. Safe from any thread.
+int msg_type_lookup(const char *name, size_t len);
+
+const char *msg_type_name(int id);
+
+typedef struct {
+    const JsonMsg *msg;
+    const char *raw;       // the whole line, NUL-terminated
+    size_t raw_len;
+    Arena *arena;          // per-message scratch, reset after the handler
+    void *conn;            // the connection the message arrived on
+} MsgContext;
+
+typedef void (*msg_handler_fn)(const MsgContext *ctx, void *user);
+
+typedef struct {
+    msg_handler_fn fn;
+    void *user;
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long ns_total;
+    unsigned long long ns_max;
+} MsgHandlerSlot;
+
+typedef struct {
+    const char *name;
+    MsgHandlerSlot slots[MSG_TYPE_MAX];
+    msg_handler_fn fallback;   // optional, for unregistered types
+    void *fallback_user;
+    unsigned long long unknown;
+    unsigned long long malformed;
+} Dispatcher;
+
+void dispatcher_init(Dispatcher *d, const char *name);
+
+// Registers fn for a message type, interning the type. Returns the type id
+// or -1 on error. Registering a type again replaces its handler.
+int dispatcher_register(Dispatcher *d, const char *type, msg_handler_fn fn, void *user);
+
+void dispatcher_set_fallback(Dispatcher *d, msg_handler_fn fn, void *user);
+
+// Parses one line and runs its handler, then resets the arena. Returns the
+// type id handled, MSG_TYPE_UNKNOWN when no handler matched, or -1 when the
+// line is not a protocol message.
+int dispatcher_dispatch(Dispatcher *d, const char *line, size_t len, Arena *arena, void *conn);
+
+void dispatcher_print_stats(const Dispatcher *d, FILE *out);
+
+// Adds the counters of src to dst, e.g. to report over per-thread copies.
+void dispatcher_merge_stats(Dispatcher *dst, const Dispatcher *src);
+
+#endif
@@ -2,25 +2,44 @@
 #define ENV_H
 
 #define DEFAULT_CONFIG_PATH "config.yaml"
-#define MAX_NODES 10
+// first allocation of the nodes and controllers lists, which then double
+#define CONFIG_NODES_INITIAL 16
 #define DEFAULT_NODE_PORT 8080
 
 typedef struct {
     char name[256];
     char address[256];
     char os[64];
+    int lanes;      // the agent takes chunked lanes (lanes.h)
+    int codec;      // the agent compresses output (codec.h)
 } Node;
 
 typedef struct {
     char db_path[256];
     char log_path[256];
     int listen_port;
+    int reactor_threads;   // 0 = one per CPU
+    char io_backend[16];   // auto, io_uring, epoll or poll
+    char admin_socket[256]; // unix socket for CLI clients, empty = none
+    char local_socket[256]; // unix socket for agents on this host, empty = none
+    char upgrade_socket[256]; // where a new binary takes over, empty = none
+    int heartbeat_port;     // UDP port for agent heartbeats, 0 = none
+    int push_bandwidth_mbps; // cap on all pushes together, 0 = none
+    int push_parallel;      // nodes receiving a push at once, 0 = default
+    int dial_nodes;         // connect to the nodes list ourselves (dialer.h)
     Node *nodes;
     int node_count;
+    // controllers sharing the nodes (name and host:port), this one included
+    char controller_name[256];
+    char cluster_secret[256];   // shared by the controllers, signs their links
+    Node *controllers;
+    int controller_count;
 } Config;
 
 typedef struct {
-    Config *config;
+    Config *config;         // replaced whole on a reload (config_reload.h)
+    const char *config_path;
+    int takeover;   // start from a running controller's connections
 } GlobalState;
 
 GlobalState init_global_state(void);
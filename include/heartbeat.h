@@ -0,0 +1,55 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "env.h"
+#include "reactor.h"
+
+// Liveness without round trips. Every agent sends a small UDP datagram to
+// the controller's heartbeat_port every few seconds; the controller reads
+// them in batches with recvmmsg() on the front reactor and hands each
+// shard the ones for its nodes, which refresh last_seen and the load
+// summary of the session. The session's TCP stream carries only commands
+// and results. The port is announced in the hello ack.
+//
+// A datagram is a fixed header, all fields little-endian, followed by the
+// node name. Datagrams for nodes without a session, older than the last
+// one seen (seq), or not in this format are dropped. Telemetry frames
+// (telemetry.h) come in on the same port and go the same way.
+
+#define HEARTBEAT_MAGIC 0x31424853u  // "SHB1"
+#define HEARTBEAT_HEADER_LEN 14
+#define HEARTBEAT_MAX_LEN (HEARTBEAT_HEADER_LEN + 255)
+#define HEARTBEAT_INTERVAL_MS 2000
+// A session whose heartbeats stopped this many intervals ago, with nothing
+// else from it since either, is ended: its agent is gone or cut off, and
+// one that is still alive connects again. Sessions that never sent a
+// heartbeat are left alone.
+#define HEARTBEAT_MISSED_LIMIT 5
+// datagrams read per recvmmsg() call
+#define HEARTBEAT_BATCH 64
+
+typedef struct {
+    uint32_t seq;           // per agent process, from 1
+    uint16_t load1;         // 1-minute load average in hundredths
+    uint16_t running;       // runnable tasks
+    uint8_t mem_used;       // percent of memory in use
+    char name[256];
+} Heartbeat;
+
+// Returns the datagram length, or -1 if the name does not fit.
+int heartbeat_encode(const Heartbeat *hb, unsigned char out[HEARTBEAT_MAX_LEN]);
+int heartbeat_decode(const unsigned char *in, size_t len, Heartbeat *hb);
+
+// Binds cfg->heartbeat_port (0 = none) and receives on front. The socket
+// uses SO_REUSEPORT so a binary taking over (upgrade.h) can bind it while
+// the old one is still running.
+int heartbeat_start(Reactor *front, const Config *cfg);
+void heartbeat_stop(void);
+
+// The bound port, or 0.
+int heartbeat_port(void);
+
+#endif
@@ -9,12 +9,98 @@
 
 int ipc_server_start(GlobalState *state);
 
+// Serves a listening socket handed over by a previous binary instead.
+int ipc_server_adopt(int fd);
+
 int ipc_server_stop(void);
 
+// Listening Unix-domain socket at path with the given mode; a stale socket
+// file is replaced. Returns the non-blocking fd or -1.
+int ipc_unix_listen(const char *path, mode_t mode);
+
 int ipc_accept_connection(int listen_fd);
 
+// Sends all of buf plus a newline, waiting for a full socket to drain.
+// For the agent's threads; a reactor thread queues on its stream
+// (reactor_stream_write()) instead, so no other connection waits on it.
 ssize_t ipc_send_full(int fd, const char *buf, size_t len);
 
 char *ipc_recv_line(int fd, int timeout_ms);
 
+// Sends buf with pass_fd attached as SCM_RIGHTS on a Unix socket. All of
+// buf must go out in one call; returns 0 or -1.
+int ipc_send_fd(int sock, const char *buf, size_t len, int pass_fd);
+
+#define IPC_MAX_PASS_FDS 4
+
+// ipc_send_fd() with nfds (up to IPC_MAX_PASS_FDS, possibly none) fds.
+int ipc_send_fds(int sock, const char *buf, size_t len, const int *fds, int nfds);
+
+// Reads exactly len bytes from a blocking Unix socket. Fds attached to
+// them are stored in fds (up to max_fds, the rest are closed). Returns the
+// number of fds, or -1 on EOF or error. A sender that writes the fds with
+// a short header of known length lets the reader tell exactly which
+// message they came with.
+int ipc_recv_fds(int sock, char *buf, size_t len, int *fds, int max_fds);
+
+// Per-connection receive buffer. Bytes are read in bulk and complete lines
+// are handed out in place, so a steady stream of messages needs no
+// allocation once the buffer has grown to the largest message seen.
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t start;   // first unconsumed byte
+    size_t end;     // one past the last received byte
+    size_t scanned; // bytes after start already known to hold no newline
+    size_t max;     // longest line taken; MAX_MSG_LEN unless a link raises it
+} IpcReader;
+
+void ipc_reader_init(IpcReader *r);
+void ipc_reader_free(IpcReader *r);
+
+// One recv() into the buffer. Returns the byte count, 0 on EOF, -1 on
+// error or when the pending line exceeds r->max, and -2 when a
+// non-blocking fd has nothing to read.
+ssize_t ipc_reader_fill(IpcReader *r, int fd);
+
+// ipc_reader_fill() for a Unix socket that may carry SCM_RIGHTS. A received
+// fd is stored in *passed_fd if that is -1, and closed otherwise.
+ssize_t ipc_reader_fill_fd(IpcReader *r, int fd, int *passed_fd);
+
+// Appends bytes that arrived by other means (e.g. a completion-based
+// backend). Returns -1 if the pending line would exceed r->max.
+int ipc_reader_feed(IpcReader *r, const char *data, size_t len);
+
+// Unconsumed bytes (start of buffer, *out_len bytes), e.g. to hand a
+// connection to another reader after the first lines were taken.
+const char *ipc_reader_pending(const IpcReader *r, size_t *out_len);
+
+// Next complete line, NUL-terminated in place without its newline, or NULL
+// if none is buffered. Valid until the next ipc_reader_fill().
+char *ipc_reader_next_line(IpcReader *r, size_t *out_len);
+
+// Per-connection send queue for non-blocking sockets. Messages are copied
+// in and written out as the socket accepts them, so a slow peer never
+// blocks the thread that produced the message.
+#define IPC_MAX_PENDING (64 * 1024 * 1024)
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t off;     // first unsent byte
+    size_t len;     // one past the last queued byte
+} IpcWriter;
+
+void ipc_writer_init(IpcWriter *w);
+void ipc_writer_free(IpcWriter *w);
+
+// Returns -1 if the queue would exceed IPC_MAX_PENDING.
+int ipc_writer_append(IpcWriter *w, const char *data, size_t len);
+
+// Writes as much as the socket takes. Returns 1 when the queue is empty,
+// 0 when data is still pending, -1 on a socket error.
+int ipc_writer_flush(IpcWriter *w, int fd);
+
+size_t ipc_writer_pending(const IpcWriter *w);
+
 #endif 
@@ -0,0 +1,36 @@
+#ifndef JSON_ESCAPE_H
+#define JSON_ESCAPE_H
+
+#include <stddef.h>
+
+// Escaping of string values for the line protocol. The hot loops scan
+// 16 (SSE2) or 32 (AVX2) bytes at a time for bytes that need escaping and
+// copy clean runs in bulk; the kernel is picked once at runtime.
+
+// Exact size of the escaped form of in[0..len), excluding the terminator.
+size_t json_escaped_len(const char *in, size_t len);
+
+// Writes the escaped form of in[0..len) to out, which must hold
+// json_escaped_len(in, len) bytes. Returns the number of bytes written.
+// Does not NUL-terminate.
+size_t json_escape_to(char *out, const char *in, size_t len);
+
+// Returns a malloc'd, NUL-terminated escaped copy of in ("" for NULL).
+char *json_escape(const char *in);
+
+// Unescapes in[0..len) into out, which must hold len bytes (unescaping
+// never grows). Returns the number of bytes written. Does not NUL-terminate.
+size_t json_unescape_to(char *out, const char *in, size_t len);
+
+// Returns a malloc'd, NUL-terminated unescaped copy of in ("" for NULL).
+char *json_unescape(const char *in);
+
+// Returns the first '"', '\\' or control byte in [p, end), or end. This is
+// the raw scan the escaper runs; the message tokenizer uses it to find the
+// end of string values.
+const char *json_scan_special(const char *p, const char *end);
+
+// Name of the kernel selected at runtime ("avx2", "sse2" or "scalar").
+const char *json_escape_kernel_name(void);
+
+#endif
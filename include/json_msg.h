@@ -0,0 +1,48 @@
+#ifndef JSON_MSG_H
+#define JSON_MSG_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+// Single-pass tokenizer for the flat JSON objects of the line protocol.
+// Parsing records key/value spans into the original line and allocates
+// nothing; string values are unescaped on demand into an arena.
+
+#define JSON_MSG_MAX_FIELDS 24
+
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *val;      // string values: between the quotes, still escaped
+    size_t val_len;       // other values: the raw token ({...}, [...], 42, true)
+    int is_string;
+    int has_escapes;
+} JsonField;
+
+typedef struct {
+    JsonField fields[JSON_MSG_MAX_FIELDS];
+    int count;
+    int type_id;    // interned "type" (see dispatch.h), 0 when unknown
+} JsonMsg;
+
+// Returns 0 on success, -1 if line is not a JSON object. Fields past
+// JSON_MSG_MAX_FIELDS are skipped.
+int json_msg_parse(JsonMsg *m, const char *line, size_t len);
+
+const JsonField *json_msg_field(const JsonMsg *m, const char *key);
+
+// Unescaped, NUL-terminated copy of a string field, or NULL when the field
+// is missing or not a string. out_len (optional) receives its length.
+char *json_msg_str(const JsonMsg *m, const char *key, Arena *a, size_t *out_len);
+
+// Copies an unescaped string field into a fixed buffer, truncating.
+// Returns 0 on success, -1 when the field is missing or not a string.
+int json_msg_copy(const JsonMsg *m, const char *key, char *out, size_t out_size);
+
+long json_msg_int(const JsonMsg *m, const char *key, long default_value);
+
+// Non-zero when the string field equals literal. Does not allocate.
+int json_msg_str_eq(const JsonMsg *m, const char *key, const char *literal);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Priority lanes on one session stream. Outgoing messages wait in one FIFO
+// per class and go out by weighted round-robin, LANE_WEIGHTS units per
+// round, so a big result no longer holds up the pings and small execs
+// queued behind it. A message longer than LANE_CHUNK is cut into chunk
+// lines when the peer understands them ("lanes":1 in the hello and its
+// ack), and chunks of different lanes interleave on the wire:
+//
+//   @<id>+<piece>\n     more of message id follows
+//   @<id>.<piece>\n     last piece of message id
+//
+// Messages are JSON objects, so a line starting with '@' is always a
+// chunk. Within a lane messages keep their order, so a receiver has at
+// most one unfinished message per lane.
+
+typedef enum {
+    LANE_CONTROL,       // pings, acks, redirects: small and urgent
+    LANE_INTERACTIVE,   // commands and small results
+    LANE_BULK,          // anything over one chunk
+    LANE_COUNT
+} Lane;
+
+#define LANE_WEIGHTS { 8, 4, 1 }
+#define LANE_CHUNK (16 * 1024)
+// a sender keeps at most this much in the socket's own queue, so a message
+// from a higher lane waits for no more than that
+#define LANE_HIGH_WATER (2 * LANE_CHUNK)
+
+// The lane msg travels in, from its type and size.
+Lane lane_classify(const char *msg, size_t len);
+
+typedef struct LaneMsg LaneMsg;
+
+typedef struct {
+    LaneMsg *head[LANE_COUNT];
+    LaneMsg *tail[LANE_COUNT];
+    int credit[LANE_COUNT];
+    uint32_t next_id;
+    size_t bytes;       // queued, not handed out yet
+} LaneQueue;
+
+// What to write next: head (possibly empty), body, then a newline.
+typedef struct {
+    Lane lane;
+    char head[16];
+    size_t head_len;
+    const char *body;
+    size_t body_len;
+} LaneUnit;
+
+void lane_queue_init(LaneQueue *q);
+// Drops everything queued.
+void lane_queue_clear(LaneQueue *q);
+// Copies msg (a trailing newline is dropped) to the end of its lane.
+int lane_queue_push(LaneQueue *q, Lane lane, const char *msg, size_t len);
+int lane_queue_empty(const LaneQueue *q);
+
+// The next unit by weighted round-robin; chunked says whether long
+// messages may be cut. Returns 0 if nothing is queued. The unit stays
+// valid until lane_queue_consume(), which must follow before the next
+// peek.
+int lane_queue_peek(LaneQueue *q, int chunked, LaneUnit *u);
+void lane_queue_consume(LaneQueue *q, const LaneUnit *u);
+
+// Receiving side: puts chunks back together.
+typedef struct {
+    struct {
+        int used;
+        uint32_t id;
+        char *buf;
+        size_t len;
+        size_t cap;
+    } slot[LANE_COUNT];
+    char *done;     // the last message put together
+} LaneReassembly;
+
+void lane_reassembly_init(LaneReassembly *r);
+void lane_reassembly_free(LaneReassembly *r);
+
+// Feeds one received line (without its newline). Returns 1 with a whole
+// message in *msg - the line itself, or a NUL-terminated buffer valid until
+// the next call - 0 if the line was a chunk of an unfinished message, and
+// -1 for a malformed chunk or a message over max_len.
+int lane_reassembly_feed(LaneReassembly *r, char *line, size_t len, size_t max_len, char **msg,
+                         size_t *msg_len);
+
+// The unfinished messages as chunk lines, so another reader can go on
+// where this one stopped. NULL if there are none.
+char *lane_reassembly_save(const LaneReassembly *r, size_t *len);
+
+#endif
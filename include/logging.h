@@ -4,6 +4,8 @@
 #include <stdbool.h>
 
 bool log_init(const char *path);
+// Moves logging to path; the old file is kept if path cannot be opened.
+bool log_reopen(const char *path);
 void log_close();
 void log_info(const char *fmt, ...);
 void log_error(const char *fmt, ...);
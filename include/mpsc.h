@@ -0,0 +1,26 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+// Intrusive lock-free multi-producer / single-consumer queue (Vyukov).
+// Any thread may push; only the owning thread pops. Embed an MpscNode in
+// the item and recover the item from the node the consumer gets back.
+
+typedef struct MpscNode {
+    struct MpscNode *next;
+} MpscNode;
+
+typedef struct {
+    MpscNode *head;     // producers swap themselves in here
+    MpscNode *tail;     // consumer side
+    MpscNode stub;
+} MpscQueue;
+
+void mpsc_init(MpscQueue *q);
+
+void mpsc_push(MpscQueue *q, MpscNode *n);
+
+// Returns the oldest node or NULL. May return NULL while a producer is in
+// the middle of a push; that producer's wakeup will bring the consumer back.
+MpscNode *mpsc_pop(MpscQueue *q);
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef NODE_AGENT_H
+#define NODE_AGENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "dispatch.h"
+#include "requests.h"
+#include "shm_ring.h"
+
+// How a command ended; one stopped early reports what it wrote so far.
+typedef enum {
+    EXEC_FINISHED,
+    EXEC_TIMED_OUT,     // its deadline passed
+    EXEC_CANCELLED,     // the controller sent "cancel" for it
+} ExecStatus;
+
+typedef struct {
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    int exit_code;
+    ExecStatus status;
+    size_t dropped;     // output bytes left out (NODE_AGENT_MAX_OUTPUT, result size)
+} CommandOutput;
+
+// The connection a controller -> agent message arrived on (MsgContext.conn).
+typedef struct {
+    int sock;
+    const char *name;   // this node's name
+    ShmChannel *shm;    // rings shared with a controller on this host
+    int passed_fd;      // fd received with the last message, or -1
+    // held while writing to the controller; relay and job threads send too
+    pthread_mutex_t send_lock;
+    char redirect[256]; // host:port the controller moved this node to
+} AgentConn;
+
+// Sends one message (newline optional) to the controller, through the
+// shared ring when there is one and it has room. Safe from any thread.
+void node_agent_send(AgentConn *conn, const char *msg, size_t len);
+
+// Sends a result message that did not come from an exec here (a relay's
+// result group) the way this agent's own results go: kept in the spool
+// under key until the controller acks it. msg is a JSON object; its "seq"
+// is added here. Safe from any thread.
+void node_agent_send_spooled(AgentConn *conn, const char *key, const char *msg, size_t len);
+
+int node_agent_connect(const char *controller_host, int controller_port);
+
+// Connects to the controller's local_socket. Agents on this host then ask
+// for shared-memory rings in node_agent_run_loop().
+int node_agent_connect_unix(const char *path);
+int node_agent_register(int sock, const char *node_name, const char *osstr);
+
+// Connects and registers, following the redirects of controllers that
+// share their nodes (see cluster.h) to the one owning node_name. Returns
+// the registered socket or -1.
+#define NODE_AGENT_MAX_REDIRECTS 4
+int node_agent_join(const char *controller_host, int controller_port, const char *node_name,
+                    const char *osstr);
+// Waits on the listening socket listen_fd for a controller to dial this
+// node (dial_nodes, see dialer.h) and registers over that connection,
+// following a redirect to the controller that owns the node. Only
+// connections from controllers, a comma-separated list of numeric IPv4
+// addresses, are taken; any other is closed before a byte is read or sent.
+// The run loop then waits on listen_fd again whenever the session is lost
+// rather than dialing out. Returns the registered socket or -1.
+#define NODE_AGENT_MAX_CONTROLLERS 16
+int node_agent_await(int listen_fd, const char *controllers, const char *node_name, const char *osstr);
+
+// Runs the session until it ends for good. When the controller goes away
+// the loop dials it again (see the backoff below) and registers anew;
+// finished results are spooled on disk (agent_spool.h) until acked and sent
+// again after every registration.
+#define NODE_AGENT_BACKOFF_BASE_MS 200
+#define NODE_AGENT_BACKOFF_CAP_MS 30000
+void node_agent_run_loop(int sock, const char *node_name);
+
+// Result spool file; defaults to ./simos-<node_name>.spool, "" turns the
+// spool off. Call before node_agent_run_loop().
+void node_agent_set_spool(const char *path);
+
+// Directory of the script cache (agent_scripts.h); defaults to
+// ./simos-<node_name>.scripts. Call before node_agent_run_loop().
+void node_agent_set_script_cache(const char *dir);
+
+// Runs cmd through /bin/sh, capturing stdout/stderr into the arena. Each
+// output keeps its first NODE_AGENT_MAX_OUTPUT bytes; the rest is read so
+// the command does not block, and dropped. A result that would still be
+// longer than the controller takes (MAX_CHUNKED_MSG_LEN with lanes,
+// MAX_MSG_LEN without) is cut to fit. Either way it says "truncated".
+#define NODE_AGENT_MAX_OUTPUT (32 * 1024 * 1024)
+int execute_system_command_fork(const char *cmd, Arena *arena, CommandOutput *res);
+
+// Commands run in a process group of their own. One that passes its
+// deadline or is stopped gets SIGTERM, then SIGKILL NODE_AGENT_KILL_GRACE_MS
+// later if its output is still open; a group that holds on to it even then
+// is left behind.
+#define NODE_AGENT_KILL_GRACE_MS 2000
+// how often a running command looks at its deadline and stop flag
+#define NODE_AGENT_EXEC_TICK_MS 100
+
+typedef struct {
+    long long deadline_ms;  // CLOCK_MONOTONIC, 0 for none
+    int stop;               // set (atomically) to an ExecStatus to stop it
+} ExecControl;
+
+// execute_system_command_fork() bounded by ctl.
+int execute_command_bounded(const char *cmd, Arena *arena, CommandOutput *res, ExecControl *ctl);
+
+// Execs run on threads of their own, so the run loop keeps reading and a
+// {"type":"cancel","id":...} reaches a command while it runs. Past this
+// many at once the loop waits for one to finish.
+#define NODE_AGENT_MAX_EXECS 64
+// Longest exec or cancel id taken, in bytes: what the controller and the
+// relay keep. A longer one is refused rather than cut short, so a result
+// never names another request.
+#define NODE_AGENT_MAX_ID (REQUEST_ID_LEN - 1)
+
+// Handlers for controller -> agent message types; other modules can
+// register additional types on it before the run loop starts.
+Dispatcher *node_agent_dispatcher(void);
+
+#endif
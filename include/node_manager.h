@@ -1,30 +1,175 @@
 #pragma once
-#include <poll.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <time.h>
 
 #include "env.h"
+#include "dispatch.h"
+#include "heartbeat.h"
+#include "telemetry.h"
+#include "ipc.h"
+#include "lanes.h"
+#include "result_delta.h"
+#include "reactor.h"
+#include "shm_ring.h"
 
-#define MAX_SESSIONS 128
+// Per reactor shard; a controller with N shards holds N * MAX_SESSIONS.
+#define MAX_SESSIONS 16384
 #define MAX_MSG_LEN (256 * 1024)
+// A message that comes in lane chunks (lanes.h) is put back together up to
+// this length, and peer links take lines this long: that is how the
+// results of commands with megabytes of output travel.
+#define MAX_CHUNKED_MSG_LEN (64 * 1024 * 1024)
 
+// Sessions live in the table of the shard that owns the connection and are
+// only touched from that shard's thread. The functions below act on the
+// calling thread's table.
 typedef struct {
     Node meta;
     int fd;
     time_t last_seen;
     int connected;
+    ReactorStream *stream;
+    int shard;
+    int slot;
+    unsigned generation;
+    // shared-memory rings of a local agent, NULL on plain sockets
+    ShmChannel *shm;
+    int shm_fd;     // their memfd, kept to hand over on a restart
+    int relay;      // has reported nodes below it
+    // last UDP heartbeat (see heartbeat.h); hb_at is 0 until one arrives
+    uint32_t hb_seq;
+    time_t hb_at;
+    uint16_t load1;
+    uint16_t running;
+    uint8_t mem_used;
+    TelemetrySeries *telemetry;     // NULL until a frame arrives
+    // messages waiting for the socket by priority, and chunks of messages
+    // still coming in (lanes.h); NULL until first needed
+    LaneQueue *tx_lanes;
+    LaneReassembly *rx_lanes;
+    ResultBases *bases;             // last output per command, for deltas
 } NodeSession;
 
 void node_sessions_init(void);
 NodeSession *node_session_add(const Node *node_meta, int fd);
+
+// Like node_session_add, for a connection handed over by another thread:
+// pending holds bytes that were already read past the hello line, unsent
+// bytes that go out before anything else.
+NodeSession *node_session_adopt(const Node *node_meta, int fd, const char *pending, size_t pending_len,
+                                const char *unsent, size_t unsent_len);
 void node_session_remove_by_name(const char *name);
 void node_session_remove_by_fd(int fd);
 NodeSession *node_session_find_by_name(const char *name);
 NodeSession *node_session_find_by_fd(int fd);
 int node_sessions_copy(NodeSession *out_array, int max_entries);
+int node_sessions_count(void);
+
+// Queues msg (plus a newline if it has none) on the session's stream, or
+// writes it to the agent's ring when the session has one. On the stream,
+// messages that cannot go out right away wait in their priority lane.
 ssize_t node_session_send(NodeSession *s, const char *msg);
-int node_sessions_fill_pollfds(struct pollfd *pfds, int max_fds);
+// Sends msg to every session on the calling shard whose name matches
+// selector. Returns how many it went to.
+int node_sessions_send_matching(const char *selector, const char *msg);
+// The same for the sessions pick() returns non-zero for.
+int node_sessions_send_if(int (*pick)(const char *name, void *arg), void *arg, const char *msg);
+
+// Applies heartbeats for nodes on the calling shard: refreshes last_seen
+// and the load summary of each named session. Each shard also ends the
+// sessions whose heartbeats stopped (HEARTBEAT_MISSED_LIMIT).
+void node_sessions_heartbeat(const Heartbeat *hb, int count);
+
+// Adds telemetry frames to the series of the sessions they name.
+void node_sessions_telemetry(const TelemetryFrame *tf, int count);
+
+// Sends msg to the named node from any thread, on the shard that owns it.
+// Returns -1 if it could not be queued; a node that is not connected is
+// only logged.
+int node_manager_send_to(const char *name, const char *msg);
+
+// A session as it passes to a new controller binary (see upgrade.h),
+// besides its socket and, for a ring session, the ring memfd.
+typedef struct {
+    Node meta;
+    time_t last_seen;
+    int relay;
+    const char *unread;     // received, not handled yet
+    size_t unread_len;
+    const char *unsent;     // queued for the agent, not written yet
+    size_t unsent_len;
+} NodeSessionImage;
+
+typedef void (*node_session_handover_fn)(const NodeSessionImage *img, int fd, int shm_fd, void *arg);
+
+// Detaches every session of the calling shard. Once a session has no I/O
+// in flight, fn gets its image and fds (its own to close) on this thread.
+// The relay routes of the sessions stay in place. Returns how many calls
+// of fn are coming.
+int node_sessions_handover(node_session_handover_fn fn, void *arg);
+
+// Recreates a session handed over by the previous binary on the calling
+// shard. Takes ownership of fd and shm_fd (-1 for none).
+NodeSession *node_session_resume(const NodeSessionImage *img, int fd, int shm_fd);
 void node_sessions_cleanup(void);
 void handle_node_message(int fd, const char *msg, GlobalState *state);
 
+// Handlers for node -> controller message types. The core ones (pong,
+// result) live here; a module adds its own types from its init function,
+// which must run before shards_start(): each shard runs a copy taken in
+// node_sessions_init().
+Dispatcher *node_manager_dispatcher(void);
+
+// Session count and message stats summed over all shards.
+void node_manager_print_stats(FILE *out);
+
+// A command result as it reaches the front thread.
+typedef struct {
+    char node[256];
+    char id[64];
+    int exit_code;
+    // "timeout" or "cancelled" for a command stopped before it finished,
+    // which then has the output it wrote so far; else ""
+    char status[16];
+    char *out;      // NUL-terminated, out_len bytes
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    // nodes with this same result, aggregated by a relay: count of them and
+    // their comma-separated names (possibly cut short), else 1 and NULL
+    int count;
+    char *nodes;
+} NodeResult;
+
+typedef void (*node_result_fn)(const NodeResult *res);
+
+// Sets the function results are delivered to, on the front reactor thread.
+// Set it before the shards start.
+void node_manager_on_result(node_result_fn fn);
+
+typedef void (*node_gone_fn)(const char *name);
+
+// Adds a function told, on the front reactor thread, about every session
+// that ends (not one handed to a new binary). Front reactor thread only.
+#define NODE_MANAGER_MAX_GONE_SINKS 4
+int node_manager_on_session_end(node_gone_fn fn);
+
+// A result message as a NodeResult in one allocation (free() it); node
+// names the sender when the message lists no nodes of its own.
+NodeResult *node_result_from_msg(const JsonMsg *m, Arena *a, const char *node);
+
+// Hands a result that arrived some other way to that function. Front
+// reactor thread only.
+void node_manager_deliver_result(const NodeResult *res);
+
+// The same from a shard thread: res (one allocation) goes to the front
+// thread, which delivers and frees it.
+void node_manager_post_result(NodeResult *res);
+
+// 1 if node already sent the spooled message seq for id; records it
+// otherwise. Sessions of one node always land on the same shard, so this
+// is per shard; calling shard's thread only.
+int node_manager_seen_before(const char *node, const char *id, long seq);
+
 int parse_hello_message(const char *msg, Node *out_node);
\ No newline at end of file
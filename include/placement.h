@@ -0,0 +1,54 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdio.h>
+
+#include "node_manager.h"
+#include "reactor.h"
+
+// Commands that may run on any node of a class ("submit"). The controller
+// keeps, per node, how many submitted jobs are running there and an
+// average of how long they took, and places each job by the power of two
+// choices: of two matching nodes picked at random the one with fewer jobs
+// running, then the quicker one, then the one with the lower load wins.
+// A node runs at most PLACEMENT_PER_NODE submitted jobs at once; when
+// every matching node is full the job waits in a queue and takes the
+// first slot that frees up on a node it may use. A job whose node goes
+// away before it answers is placed again elsewhere, up to
+// PLACEMENT_MAX_ATTEMPTS times, under a new request id ("<id>~<attempt>")
+// so a late answer from the old node is not taken for the new one.
+//
+// Submitted jobs run on the direct sessions of this controller. Front
+// reactor thread only.
+
+#define PLACEMENT_PER_NODE 4
+#define PLACEMENT_MAX_ATTEMPTS 3
+#define PLACEMENT_QUEUE_MAX 4096
+// queued jobs are placed afresh this often, so nodes that joined since
+// are used and ones that left are given up on
+#define PLACEMENT_SWEEP_MS 2000
+// a job queued longer than this fails
+#define PLACEMENT_QUEUE_TIMEOUT_S 600
+
+void placement_init(Reactor *front);
+void placement_shutdown(void);
+
+// Places cmd on one connected node matching selector, or queues it.
+// Progress and the result go to client_id.
+int placement_submit(unsigned long client_id, const char *selector, const char *cmd);
+
+// Every result passes through here; ones for submitted jobs free their slot.
+void placement_result(const NodeResult *res);
+
+// A "cancel" for submitted job id: a queued one is dropped here (1), a
+// running one must be cancelled on its node under the id written to
+// attempt (2). 0 if id is no submitted job.
+int placement_cancel(const char *id, char *attempt, size_t attempt_size);
+
+// The session of node ended; its jobs move elsewhere.
+void placement_node_gone(const char *node);
+
+// Node loads and queued jobs, for the CLI.
+void placement_print(FILE *out);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+
+#include "ipc.h"
+
+// Single-threaded event loop. A Reactor is owned by the thread that calls
+// reactor_run(); every fd and stream registered on it must only be touched
+// from that thread. Other threads talk to it with reactor_post(), which goes
+// through a lock-free MPSC queue plus a wakeup fd.
+//
+// Plain fds get readiness callbacks. Connections are registered as streams:
+// the reactor does the socket I/O itself, so the same code runs on the
+// readiness backends (epoll, poll) and on io_uring, and the owner only sees
+// bytes in stream->rx and queues output with reactor_stream_write().
+
+typedef enum {
+    REACTOR_BACKEND_AUTO = 0,   // io_uring, else epoll, else poll
+    REACTOR_BACKEND_URING,
+    REACTOR_BACKEND_EPOLL,
+    REACTOR_BACKEND_POLL
+} ReactorBackend;
+
+#define REACTOR_READ  0x1
+#define REACTOR_WRITE 0x2
+#define REACTOR_ERROR 0x4
+
+typedef struct Reactor Reactor;
+typedef struct ReactorStream ReactorStream;
+
+typedef void (*reactor_fd_cb)(Reactor *r, int fd, unsigned events, void *ctx);
+typedef void (*reactor_task_fn)(Reactor *r, void *arg);
+typedef void (*reactor_accept_cb)(Reactor *r, int fd, void *ctx);
+typedef void (*reactor_detach_cb)(int fd, const char *pending, size_t pending_len, const char *unsent,
+                                  size_t unsent_len, void *ctx);
+
+typedef struct {
+    // new bytes were appended to s->rx
+    void (*on_input)(ReactorStream *s, void *ctx);
+    // the peer closed or the socket failed; the stream is closed right after
+    void (*on_close)(ReactorStream *s, void *ctx);
+    // optional: everything queued has reached the socket
+    void (*on_drain)(ReactorStream *s, void *ctx);
+} ReactorStreamOps;
+
+struct ReactorStream {
+    int fd;
+    IpcReader rx;
+    IpcWriter tx;
+    const ReactorStreamOps *ops;
+    void *ctx;
+    Reactor *owner;
+    int closed;
+    // backend bookkeeping
+    int want_write;
+    int fail_pending;
+    void *backend;
+    ReactorStream *next_failed;
+};
+
+Reactor *reactor_create(ReactorBackend backend);
+void reactor_destroy(Reactor *r);
+const char *reactor_backend_name(const Reactor *r);
+ReactorBackend reactor_backend_parse(const char *name);
+
+// The reactor running on the calling thread, or NULL.
+Reactor *reactor_current(void);
+
+int reactor_watch_fd(Reactor *r, int fd, unsigned events, reactor_fd_cb cb, void *ctx);
+void reactor_unwatch_fd(Reactor *r, int fd);
+
+// Changes the events a fd registered with reactor_watch_fd() waits for.
+int reactor_modify_fd(Reactor *r, int fd, unsigned events);
+
+// Calls cb with every connection accepted on the listening socket fd (made
+// non-blocking). Remove it with reactor_unwatch_fd().
+int reactor_watch_listener(Reactor *r, int fd, reactor_accept_cb cb, void *ctx);
+
+// Takes ownership of fd (made non-blocking). Returns NULL on failure, in
+// which case fd is left open.
+ReactorStream *reactor_stream_open(Reactor *r, int fd, const ReactorStreamOps *ops, void *ctx);
+
+// Queues len bytes and writes what the socket takes right away. Returns -1
+// if the stream is closed or its send queue is over IPC_MAX_PENDING.
+int reactor_stream_write(ReactorStream *s, const char *buf, size_t len);
+
+// Bytes queued on the stream that the kernel has not taken yet.
+size_t reactor_stream_pending(const ReactorStream *s);
+
+// Closes the fd and releases the stream after the current callback
+// returns. Idempotent; on_close is not called.
+void reactor_stream_close(ReactorStream *s);
+
+// Unregisters the stream without closing its fd, e.g. to hand the
+// connection to another reactor. Once no I/O is in flight on it any more,
+// cb gets the fd, the bytes received but not yet consumed from rx, and the
+// bytes queued for sending that never reached the socket.
+int reactor_stream_detach(ReactorStream *s, reactor_detach_cb cb, void *ctx);
+
+// Runs fn(r, arg) on the reactor's thread. Safe from any thread.
+int reactor_post(Reactor *r, reactor_task_fn fn, void *arg);
+
+// Calls fn roughly every interval_ms on the reactor's thread.
+int reactor_add_tick(Reactor *r, int interval_ms, reactor_task_fn fn, void *arg);
+
+void reactor_run(Reactor *r);
+
+// Makes reactor_run() return after the current iteration. Safe from any
+// thread.
+void reactor_stop(Reactor *r);
+
+#endif
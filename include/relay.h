@@ -0,0 +1,50 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdio.h>
+
+// Nodes reached through relays. An agent running as a relay accepts child
+// agents (which may be relays themselves) and reports every node below it
+// with relay_join / relay_leave. This table maps each such node to the
+// relay that holds a direct session with the controller, which is where
+// commands for it are sent, and to its parent, for the topology view.
+// Front reactor thread only.
+
+int relay_route_add(const char *relay, const char *name, const char *parent, const char *os);
+void relay_route_remove(const char *relay, const char *name);
+
+// Forgets everything below a relay whose session went away.
+void relay_drop(const char *relay);
+
+// The directly connected relay that reaches name, or NULL.
+const char *relay_route_find(const char *name);
+
+// Calls fn once per relay with the number of nodes below it matching
+// selector, for relays with at least one. Returns the total.
+int relay_match(const char *selector, void (*fn)(const char *relay, int matches, void *arg), void *arg);
+
+// Nodes below relay, 0 if it is not one.
+int relay_size(const char *relay);
+int relay_total(void);
+
+// Writes the tree below relay, one node per line, indented under indent.
+void relay_print_tree(FILE *out, const char *relay, const char *indent);
+
+// Calls fn with every route, e.g. to carry the table over to a new binary.
+void relay_route_each(void (*fn)(const char *relay, const char *name, const char *parent, const char *os,
+                                 void *arg),
+                      void *arg);
+
+void relay_routes_clear(void);
+
+// Takes the relay_join / relay_leave messages of relay sessions. Call it
+// before the shards start.
+void relay_init(void);
+
+// From a shard thread: queues a route change for the front thread, in the
+// order this shard saw them, so a relay that reconnects is dropped before
+// its nodes join again. join is 1 to add name, 0 to remove it and -1 when
+// the relay's own session went away.
+void relay_post_update(const char *relay, const char *name, const char *parent, const char *os, int join);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef REQUESTS_H
+#define REQUESTS_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Outstanding request ids and the CLI client that issued each one, so
+// results can be routed back to whoever asked. Front reactor thread only.
+
+#define REQUEST_ID_LEN 64
+
+// Writes a new unique request id to out.
+void request_new_id(char *out, size_t size);
+
+// Remembers that client_id issued id and expects `expected` results, or
+// an unknown number for now if expected is 0 (see request_expect()).
+int request_track(const char *id, unsigned long client_id, int expected);
+
+// Sets how many results id expects in total, once a fan-out knows.
+void request_expect(const char *id, int expected);
+
+// The issuing client, or 0 if the id is unknown.
+unsigned long request_owner(const char *id);
+
+// How many results id expects (0 while unknown) and has had. Returns -1
+// if id is not outstanding.
+int request_progress(const char *id, int *expected, int *seen);
+
+// Counts results for id (count > 1 for results aggregated by a relay);
+// the entry is dropped after the last one.
+void request_result_seen(const char *id, int count);
+
+// Drops a request that will get no results after all.
+void request_forget(const char *id);
+
+// Drops every request of a client that went away.
+void request_forget_client(unsigned long client_id);
+
+// Drops requests older than max_age seconds that never completed.
+void request_expire(int max_age);
+
+// Calls fn with every outstanding request, e.g. to carry the table over
+// to a new binary, which re-creates each one with request_restore().
+void request_each(void (*fn)(const char *id, unsigned long client_id, int expected, int seen, time_t created,
+                             void *arg),
+                  void *arg);
+int request_restore(const char *id, unsigned long client_id, int expected, int seen, time_t created);
+
+#endif
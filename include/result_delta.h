@@ -0,0 +1,71 @@
+#ifndef RESULT_DELTA_H
+#define RESULT_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Results of recurring commands as deltas. Both ends remember the last
+// stdout of each command (its key, a hash of the command text); when the
+// controller says it takes deltas ("deltas":1 in the hello ack) an agent
+// sends a spooled result as the difference from the previous output
+// instead of the whole text:
+//
+//   {"type":"result",...,"key":"<hex>","base":"<crc>","crc":"<crc>","delta":"..."}
+//
+// base and crc are the CRC-32C of the previous and the new output. Every
+// result with a key, whole or not, becomes the new base at both ends. A
+// controller that cannot rebuild the output (it lost the base, or the CRC
+// disagrees) answers {"type":"result_resend","seq":N} and the agent sends
+// the whole result from its spool. An agent forgets which bases the
+// controller has with every new session.
+//
+// A delta is a list of line operations on the base, in order:
+//   =N\n      copy the next N lines of the base
+//   -N\n      skip the next N lines of the base
+//   +LEN\n    then LEN bytes to insert
+// where a line includes its newline.
+
+// outputs larger than this are never kept as bases
+#define RESULT_DELTA_MAX_BASE (256 * 1024)
+// commands remembered per session
+#define RESULT_BASE_SLOTS 32
+
+uint64_t result_delta_key(const char *cmd);
+
+// The delta from base to out, malloc'd, or NULL if it is no shorter than
+// limit bytes or memory runs out.
+char *result_delta_encode(const char *base, size_t base_len, const char *out, size_t out_len, size_t limit,
+                          size_t *delta_len);
+
+// Rebuilds the output from base and delta into a malloc'd, NUL-terminated
+// buffer. NULL if the delta is malformed or does not fit the base.
+char *result_delta_apply(const char *base, size_t base_len, const char *delta, size_t delta_len,
+                         size_t *out_len);
+
+// The last output of each recent command; the least recently used command
+// is forgotten first.
+typedef struct {
+    uint64_t key;
+    char *text;
+    size_t len;
+    uint32_t crc;
+    unsigned long used;
+    unsigned gen;
+} ResultBase;
+
+typedef struct {
+    ResultBase slot[RESULT_BASE_SLOTS];
+    unsigned long clock;
+    unsigned gen;
+} ResultBases;
+
+void result_bases_init(ResultBases *b);
+void result_bases_free(ResultBases *b);
+// NULL unless the key was stored since the last result_bases_forget().
+const ResultBase *result_bases_find(ResultBases *b, uint64_t key);
+// Keeps a copy of text as the base for key.
+void result_bases_put(ResultBases *b, uint64_t key, const char *text, size_t len);
+// Marks every base unknown without freeing them.
+void result_bases_forget(ResultBases *b);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef RESULT_GROUPS_H
+#define RESULT_GROUPS_H
+
+#include <stddef.h>
+
+#include "node_manager.h"
+
+// Results of one fan-out grouped by content, in the manner of dshbak -c:
+// each distinct outcome (exit code, status, stdout and stderr) is kept
+// once with the names of the nodes that produced it, so memory grows with
+// the number of different answers rather than the number of nodes. A
+// result a relay already aggregated adds all of its nodes at once.
+
+#define RESULT_GROUP_BUCKETS 256
+
+typedef struct ResultGroup ResultGroup;
+
+typedef struct {
+    ResultGroup *buckets[RESULT_GROUP_BUCKETS];
+    int groups;
+    int nodes;
+} ResultGroups;
+
+void result_groups_init(ResultGroups *g);
+void result_groups_free(ResultGroups *g);
+
+// Adds res. Returns 1 if it opened a new group, 0 if it joined one, -1
+// if memory ran out.
+int result_groups_add(ResultGroups *g, const NodeResult *res);
+
+// "290 nodes: identical; 10 nodes: 3 variants" - the largest group
+// against the rest - into out.
+void result_groups_summary(const ResultGroups *g, char *out, size_t size);
+
+// Calls fn with every group as a result of count nodes, nodes naming them
+// all, largest group first. The result is only valid during the call.
+void result_groups_each(const ResultGroups *g, void (*fn)(const NodeResult *group, void *arg), void *arg);
+
+#endif
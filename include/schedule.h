@@ -0,0 +1,22 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+// Controller side of recurring jobs (agent_schedule.h). The "schedule"
+// verb hands nodes a job definition once; from then on each agent runs it
+// by itself and uploads the results in deflated batches, which land here
+// and go straight into the command store (db.h), one row per run.
+
+// Inflates the base64 data of a sched_batch from node (raw bytes once
+// inflated) and stores its rows. Returns the number stored, or -1 if the
+// batch is damaged.
+int schedule_ingest(const char *node, const char *data, size_t data_len, size_t raw, Arena *a);
+
+// Takes the sched_batch messages agents upload. Call it before the shards
+// start.
+void schedule_init(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SCRIPTS_H
+#define SCRIPTS_H
+
+#include <stddef.h>
+
+#include "checksum.h"
+
+// Scripts run by content hash. The "script" verb reads a local file, keeps
+// it here under its SHA-256 and sends the nodes an exec naming only the
+// hash and the arguments:
+//
+//   {"type":"exec","id":...,"script":"<sha256>","args":"..."}
+//
+// An agent runs the script from its on-disk cache (agent_scripts.h). On a
+// miss it answers {"type":"script_miss","id":...,"script":...,"args":...}
+// and the controller sends the exec again with the body added ("body"),
+// so the body crosses the wire once per node, not once per run.
+
+#define SCRIPT_MAX_LEN (64 * 1024)
+// scripts held at once; the least recently used one goes first
+#define SCRIPT_STORE_SLOTS 32
+
+// Reads path and keeps its contents, filling hash. Returns -1 (with a
+// reason in why) if the file cannot be read or is too large.
+int script_store_load(const char *path, char hash[SHA256_HEX_LEN + 1], char *why, size_t why_size);
+
+// A malloc'd, NUL-terminated copy of the script, or NULL if it is not held
+// any more. Safe from any thread.
+char *script_store_get(const char *hash, size_t *len);
+
+// Takes the script_miss messages of agents. Call it before the shards
+// start.
+void script_store_init(void);
+void script_store_clear(void);
+
+#endif
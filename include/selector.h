@@ -0,0 +1,16 @@
+#ifndef SELECTOR_H
+#define SELECTOR_H
+
+// Node selectors pick nodes by name: a comma-separated list of shell globs,
+// e.g. "web*,db1" or "*" for every node.
+
+#define SELECTOR_MAX_LEN 256
+
+// 1 if name matches any pattern in selector, 0 otherwise.
+int selector_match(const char *selector, const char *name);
+
+// 1 for a non-empty selector of at most SELECTOR_MAX_LEN bytes with no
+// empty patterns.
+int selector_valid(const char *selector);
+
+#endif
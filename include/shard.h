@@ -0,0 +1,51 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#include "env.h"
+#include "reactor.h"
+
+// The controller runs one front reactor (stdin, the listener, hellos) and
+// a fixed set of shard reactors, each on its own thread. A node is owned by
+// the shard its name hashes to; everything that touches its session is
+// posted to that shard as a task, so session state needs no locks.
+
+#define MAX_SHARDS 64
+
+typedef void (*shard_task_fn)(int shard, void *arg);
+
+// Starts count shard threads (0 = one per online CPU). front is the reactor
+// broadcast completions are posted back to. Returns -1 on failure.
+int shards_start(GlobalState *state, int count, ReactorBackend backend, Reactor *front);
+
+// Stops and joins all shards, closing their sessions.
+void shards_stop(void);
+
+int shard_count(void);
+
+// Index of the shard running on the calling thread, or -1.
+int shard_current(void);
+
+int shard_for_name(const char *name);
+Reactor *shard_reactor(int idx);
+GlobalState *shard_state(void);
+
+// Runs fn on shard idx's thread.
+int shard_post(int idx, reactor_task_fn fn, void *arg);
+
+// Runs fn on the front reactor.
+int shard_post_front(reactor_task_fn fn, void *arg);
+
+// Runs fn(shard, arg) on every shard, then done(front, arg) on the front
+// reactor once all of them have finished.
+int shard_broadcast(shard_task_fn fn, void *arg, reactor_task_fn done);
+
+// Hands an accepted connection whose hello was already read to shard idx.
+// pending holds bytes received after the hello, unsent bytes queued for the
+// agent (its hello ack) that the socket has not taken yet. Takes ownership
+// of fd.
+int shard_adopt(int idx, int fd, const Node *meta, const char *pending, size_t pending_len, const char *unsent,
+                size_t unsent_len);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A pair of single-producer single-consumer message rings in one memfd,
+// shared by the controller and an agent on the same host. The controller
+// creates the region and passes the fd over the agent's Unix socket; from
+// then on messages are written straight into the peer's ring and read in
+// place, with no syscall per message.
+//
+// The socket stays open as a doorbell: a consumer that runs out of work
+// flags its ring as waiting before it blocks, and the producer that next
+// publishes into it sends one "\n" on the socket. A busy consumer is never
+// woken, so a burst of messages costs one syscall at most.
+//
+// Messages are NUL-terminated records of up to a quarter of the ring
+// (SHM_RING_MAX_MSG for the default size). A message that does not fit
+// goes over the socket instead; protocol
+// messages are independent, so the two paths need no common order.
+
+#define SHM_RING_SIZE (4 * 1024 * 1024)
+#define SHM_RING_MAX_MSG (SHM_RING_SIZE / 4)
+
+typedef enum {
+    SHM_SIDE_CONTROLLER,
+    SHM_SIDE_AGENT
+} ShmSide;
+
+typedef struct ShmRingHeader ShmRingHeader;
+
+typedef struct {
+    ShmRingHeader *hdr;
+    char *data;
+    uint64_t size;
+    // the open reservation (producer) or the peeked record (consumer)
+    uint64_t cur_pos;
+    uint64_t cur_len;
+} ShmRing;
+
+typedef struct {
+    void *base;
+    size_t map_len;
+    ShmRing tx;     // messages this side sends
+    ShmRing rx;     // messages this side receives
+} ShmChannel;
+
+// Creates a region with rings of ring_size bytes (a power of two) and maps
+// it. *out_fd is the memfd to hand to the agent; the caller closes it.
+ShmChannel *shm_channel_create(size_t ring_size, int *out_fd);
+
+// Maps a region received from the controller. Does not take fd.
+ShmChannel *shm_channel_attach(int fd, ShmSide side);
+
+void shm_channel_close(ShmChannel *ch);
+
+// Room for a len-byte message, or NULL if it does not fit right now. The
+// message is written there and published with shm_ring_commit().
+char *shm_ring_reserve(ShmRing *r, size_t len);
+
+// Publishes the reserved message. Returns 1 if the consumer was waiting
+// and must be woken through the socket, 0 otherwise.
+int shm_ring_commit(ShmRing *r);
+
+// Copies msg into the ring. Returns 1 if the consumer must be woken, 0 if
+// not and -1 if the message did not fit.
+int shm_ring_write(ShmRing *r, const char *msg, size_t len);
+
+// Next message, NUL-terminated in place, or NULL if the ring is empty. It
+// stays valid until shm_ring_consume(). Returns NULL and sets *corrupt if
+// the peer wrote an impossible record.
+const char *shm_ring_peek(ShmRing *r, size_t *len, int *corrupt);
+void shm_ring_consume(ShmRing *r);
+
+// Called by the consumer before it blocks. Returns 1 if the ring is empty
+// and the producer will ring the doorbell, 0 if messages arrived in the
+// meantime and should be read first.
+int shm_ring_prepare_wait(ShmRing *r);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SHM_SESSION_H
+#define SHM_SESSION_H
+
+// Controller side of the shared-memory rings (shm_ring.h). An agent on the
+// local socket sends {"type":"shm_request"}; the controller answers with
+// shm_ready and the ring memfd, or shm_declined, and the session then reads
+// and writes through the rings.
+
+// Takes the shm_request messages of local agents. Call it before the
+// shards start.
+void shm_session_init(void);
+
+#endif
@@ -1,3 +1,7 @@
 #pragma once
 
-void shutdown_gracefully(void);
\ No newline at end of file
+#include "reactor.h"
+
+// Ends the controller from a command: the front reactor stops after the
+// current iteration and run_event_loop() tears down and returns.
+void shutdown_gracefully(Reactor *front);
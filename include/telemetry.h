@@ -0,0 +1,76 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Host telemetry. Agents sample /proc every TELEMETRY_INTERVAL_MS and send
+// a frame over the heartbeat port (heartbeat.h): the magic, the node name,
+// then varints - the frame's seq, a keyframe flag, and either the absolute
+// time and values (keyframe) or the zigzagged differences to the previous
+// frame. Every TELEMETRY_KEYFRAME_EVERY-th frame is a keyframe, so a lost
+// datagram costs at most that many frames; delta frames that do not follow
+// the last frame received are dropped.
+//
+// The shard owning the node keeps its samples in a fixed-size ring per
+// tier: every sample, then averages over TELEMETRY_TIER_STEPS seconds.
+
+#define TELEMETRY_MAGIC 0x314d5453u  // "STM1"
+#define TELEMETRY_INTERVAL_MS 10000
+#define TELEMETRY_KEYFRAME_EVERY 6
+#define TELEMETRY_MAX_LEN 512
+
+enum {
+    TM_CPU,         // busy, permille of all CPUs since the last sample
+    TM_LOAD1,       // 1-minute load average in hundredths
+    TM_RUNNING,     // runnable tasks
+    TM_MEM_USED,    // MB
+    TM_MEM_TOTAL,
+    TM_DISK_USED,   // MB on /
+    TM_DISK_TOTAL,
+    TM_NET_RX,      // KB/s over all interfaces but lo
+    TM_NET_TX,
+    TELEMETRY_FIELDS
+};
+
+typedef struct {
+    uint32_t at;    // unix time
+    uint32_t v[TELEMETRY_FIELDS];
+} TelemetrySample;
+
+// A frame as decoded; values are differences unless key is set.
+typedef struct {
+    char name[256];
+    uint32_t seq;
+    int key;
+    int64_t at;
+    int64_t v[TELEMETRY_FIELDS];
+} TelemetryFrame;
+
+// prev NULL makes a keyframe. Returns the frame length, or -1.
+int telemetry_encode(const char *name, uint32_t seq, const TelemetrySample *cur, const TelemetrySample *prev,
+                     unsigned char *out, size_t size);
+int telemetry_decode(const unsigned char *in, size_t len, TelemetryFrame *f);
+
+// --- controller side, on the shard that owns the node ---
+
+#define TELEMETRY_TIERS 3
+// seconds per point in each tier; tier 0 holds the samples as they came
+#define TELEMETRY_TIER_STEPS { 0, 60, 900 }
+#define TELEMETRY_TIER_SLOTS { 60, 60, 96 }
+
+typedef struct TelemetrySeries TelemetrySeries;
+
+TelemetrySeries *telemetry_series_new(void);
+void telemetry_series_free(TelemetrySeries *s);
+
+// Adds the sample f describes. Returns -1 if a delta frame does not follow
+// the last frame added.
+int telemetry_series_add(TelemetrySeries *s, const TelemetryFrame *f);
+
+// Tier index for "raw", "1m" or "15m"; -1 for anything else.
+int telemetry_tier_parse(const char *name);
+void telemetry_series_print(const TelemetrySeries *s, int tier, FILE *out);
+
+#endif
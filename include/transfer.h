@@ -0,0 +1,61 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "env.h"
+#include "reactor.h"
+
+// File distribution ("push"). The controller offers a file to every
+// selected node over its session; each agent then opens a separate data
+// connection to the controller at the address named in the offer (the one
+// the session reached, with listen_port), says how much of the file it
+// already has, and receives the rest as checksummed chunks that the
+// controller streams with sendfile() straight from the page cache. A
+// dropped connection or a bad chunk just means another offer, and the
+// agent resumes after its last verified chunk.
+//
+// All push jobs run on the front reactor. A fixed number of nodes receive
+// at once and a token bucket caps the combined rate, so a large fan-out
+// keeps the uplink busy without starving the sessions.
+
+#define PUSH_CHUNK_SIZE (1024 * 1024)
+
+// Every chunk on a data connection is preceded by this header, all fields
+// little-endian. A header with len 0 and offset == file size ends the file.
+#define PUSH_CHUNK_MAGIC 0x4b435053u  // "SPCK"
+#define PUSH_HEADER_LEN 24
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t offset;
+    uint32_t crc;       // crc32c of the chunk
+    uint32_t flags;     // reserved, 0
+} PushChunkHeader;
+
+void push_header_encode(const PushChunkHeader *h, unsigned char out[PUSH_HEADER_LEN]);
+int push_header_decode(const unsigned char in[PUSH_HEADER_LEN], PushChunkHeader *h);
+
+// Controller side, front reactor thread only.
+void transfer_init(Reactor *front, const Config *config);
+// Applies push_parallel and push_bandwidth_mbps again, to running pushes too.
+void transfer_configure(const Config *config);
+void transfer_shutdown(void);
+
+// Starts pushing local_file to dest_path on every connected node matching
+// selector. Progress and the outcome are reported to client_id.
+int transfer_push(unsigned long client_id, const char *local_file, const char *selector,
+                  const char *dest_path);
+
+// Takes over a fresh connection whose first line is a data hello. Returns
+// 1 if it did (the stream is no longer the caller's), 0 if line is not a
+// data hello.
+int transfer_accept(ReactorStream *stream, const char *line, size_t len);
+
+// Writes one line per running push to out.
+void transfer_print(FILE *out);
+
+#endif
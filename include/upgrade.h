@@ -0,0 +1,54 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "env.h"
+#include "reactor.h"
+
+// Zero-downtime restart. A new binary started with --takeover connects to
+// the running controller's upgrade_socket and is handed, as SCM_RIGHTS,
+// the listening sockets and every connection with the state that goes
+// with it: node sessions (metadata, bytes read but not handled yet, bytes
+// queued but not written yet, the ring memfd of a local agent), relay
+// routes, outstanding requests, and admin clients with their
+// subscriptions. Agents keep their connections and never notice; the old
+// binary exits once the last record is out.
+//
+// A record is a 4-byte length, sent alone with the record's fds attached
+// so the receiver knows exactly which record they belong to, followed by
+// that many bytes of JSON line.
+//
+// Push transfers and links to other controllers are not carried over: a
+// push in progress fails and the peers dial the new binary.
+
+typedef struct {
+    int tcp_fd;     // -1 if none
+    int local_fd;
+} UpgradeListeners;
+
+typedef struct {
+    UpgradeListeners listeners;
+    // stop accepting node connections
+    void (*pause)(void);
+    // 1 once no accepted connection is still waiting for its hello
+    int (*idle)(void);
+    // everything went to the successor; the process should exit
+    void (*done)(void);
+} UpgradeHooks;
+
+// Waits for successors on cfg->upgrade_socket (if set). Front reactor
+// thread only, after the shards and the admin socket are up.
+int upgrade_init(Reactor *front, const Config *cfg, const UpgradeHooks *hooks);
+void upgrade_shutdown(void);
+
+// 1 once the sockets belong to a successor, which also took over the
+// socket files.
+int upgrade_handed_over(void);
+
+// The successor's side: takes everything over from the controller on
+// cfg->upgrade_socket before front starts running. The shards must be
+// running. Fills out with the node listeners; the admin listener and its
+// clients are set up directly. Returns the number of sessions, or -1 if
+// the hand-over did not complete.
+int upgrade_takeover(Reactor *front, const Config *cfg, UpgradeListeners *out);
+
+#endif
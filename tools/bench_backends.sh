@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs the same loadgen workload against each controller I/O backend.
+#
+#   tools/bench_backends.sh [agents] [mode] [payload_bytes] [duration_s]
+#
+# Each run writes a temporary copy of the config with io_backend set, and
+# reports loadgen's numbers plus the CPU time the controller used.
+# Thousands of agents need a matching open-files limit (ulimit -n).
+set -eu
+
+AGENTS=${1:-10000}
+MODE=${2:-flood}
+PAYLOAD=${3:-256}
+DURATION=${4:-15}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CONFIG=${CONFIG:-$ROOT/config.yaml}
+case $CONFIG in /*) ;; *) CONFIG=$(pwd)/$CONFIG ;; esac
+BACKENDS=${BACKENDS:-"io_uring epoll poll"}
+THREADS=${THREADS:-1}
+PORT=${PORT:-$(awk '/^listen_port:/ {print $2}' "$CONFIG")}
+
+cd "$ROOT"
+make simos tools >/dev/null
+
+WORKDIR=$(mktemp -d)
+CONTROLLER_PID=
+cleanup() {
+    [ -n "$CONTROLLER_PID" ] && kill "$CONTROLLER_PID" 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+for BACKEND in $BACKENDS; do
+    grep -v -e '^io_backend:' -e '^reactor_threads:' "$CONFIG" > "$WORKDIR/config.yaml"
+    printf 'io_backend: "%s"\nreactor_threads: %s\n' "$BACKEND" "$THREADS" >> "$WORKDIR/config.yaml"
+    rm -f "$WORKDIR/stdin"
+    mkfifo "$WORKDIR/stdin"
+
+    ./simos --config "$WORKDIR/config.yaml" < "$WORKDIR/stdin" > /dev/null &
+    CONTROLLER_PID=$!
+    exec 3> "$WORKDIR/stdin"
+    sleep 0.5
+
+    echo "== $BACKEND ($THREADS shard(s), $AGENTS agents, $MODE)"
+    tools/loadgen --port "$PORT" --agents "$AGENTS" --mode "$MODE" \
+        --payload "$PAYLOAD" --duration "$DURATION" --ramp 5000
+    TICKS=$(awk '{print $14 + $15}' "/proc/$CONTROLLER_PID/stat")
+    echo "controller cpu: $((TICKS * 1000 / $(getconf CLK_TCK))) ms"
+
+    exec 3>&-
+    wait "$CONTROLLER_PID" || true
+    CONTROLLER_PID=
+done
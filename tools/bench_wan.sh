@@ -0,0 +1,79 @@
+#!/bin/sh
+# Runs the controller behind netem_proxy and drives it with loadgen.
+#
+#   tools/bench_wan.sh [latency_ms] [agents] [mode] [payload_bytes] [duration_s]
+#
+# The default 50 ms one-way latency gives the 100 ms RTT we see between
+# regions. Extra impairments can be passed through PROXY_OPTS, e.g.
+#   PROXY_OPTS="--jitter 10 --bandwidth 20000 --stall-prob 0.01" tools/bench_wan.sh
+#
+# In echo mode the controller sends `exec lg-* deadline=EXEC_DEADLINE ...`
+# EXEC_RATE times a second for the whole run, and the script reports how
+# many of those requests got results back through the proxy.
+set -eu
+
+LATENCY=${1:-50}
+AGENTS=${2:-200}
+MODE=${3:-flood}
+PAYLOAD=${4:-4096}
+DURATION=${5:-10}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+# a relative CONFIG names a file in the caller's directory, not the repo's
+CONFIG=${CONFIG:-$ROOT/config.yaml}
+case $CONFIG in /*) ;; *) CONFIG=$(pwd)/$CONFIG ;; esac
+CONTROLLER_PORT=${CONTROLLER_PORT:-$(awk '/^listen_port:/ {print $2}' "$CONFIG")}
+PROXY_PORT=${PROXY_PORT:-19000}
+PROXY_OPTS=${PROXY_OPTS:-}
+EXEC_RATE=${EXEC_RATE:-5}
+EXEC_DEADLINE=${EXEC_DEADLINE:-2}
+
+cd "$ROOT"
+make simos tools >/dev/null
+
+WORKDIR=$(mktemp -d)
+mkfifo "$WORKDIR/stdin"
+EXEC_PID=
+cleanup() {
+    [ -n "$EXEC_PID" ] && kill "$EXEC_PID" 2>/dev/null || true
+    kill "$PROXY_PID" "$CONTROLLER_PID" 2>/dev/null || true
+    exec 3>&- 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+./simos --config "$CONFIG" < "$WORKDIR/stdin" > "$WORKDIR/controller.out" &
+CONTROLLER_PID=$!
+exec 3> "$WORKDIR/stdin"
+
+# shellcheck disable=SC2086
+tools/netem_proxy --listen "127.0.0.1:$PROXY_PORT" --upstream "127.0.0.1:$CONTROLLER_PORT" \
+    --latency "$LATENCY" $PROXY_OPTS &
+PROXY_PID=$!
+sleep 0.5
+
+if [ "$MODE" = echo ]; then
+    # work for the agents, through the controller's stdin, until the run ends
+    (
+        PERIOD=$(awk -v r="$EXEC_RATE" 'BEGIN { printf "%.3f", 1 / r }')
+        END=$(($(date +%s) + DURATION))
+        sleep 1
+        while [ "$(date +%s)" -lt "$END" ]; do
+            echo "exec lg-* deadline=$EXEC_DEADLINE echo wan" >&3
+            sleep "$PERIOD"
+        done
+    ) &
+    EXEC_PID=$!
+fi
+
+tools/loadgen --port "$PROXY_PORT" --agents "$AGENTS" --mode "$MODE" \
+    --payload "$PAYLOAD" --duration "$DURATION"
+
+if [ "$MODE" = echo ]; then
+    wait "$EXEC_PID" 2>/dev/null || true
+    EXEC_PID=
+    sleep "$EXEC_DEADLINE"
+    SENT=$(grep -c '^Sent command' "$WORKDIR/controller.out" || true)
+    ANSWERED=$(grep -o 'command result (id=[^,]*' "$WORKDIR/controller.out" | sort -u | wc -l)
+    PARTIAL=$(grep -c 'answered)' "$WORKDIR/controller.out" || true)
+    echo "execs: sent=$SENT answered=$ANSWERED partly_answered=$PARTIAL (deadline ${EXEC_DEADLINE}s)"
+fi
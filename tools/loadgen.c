@@ -0,0 +1,491 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// loadgen: simulates a fleet of node agents against a controller (directly or
+// through tools/netem_proxy). Each simulated agent speaks the same line
+// protocol as core/node_agent.c: it sends hello, waits for the controller's
+// ack (following redirects to another controller), answers ping with pong
+// and answers exec with a result of a configurable size. In flood mode agents
+// also push results continuously so the controller's ingest rate can be
+// measured from the outside.
+
+#define RX_CAP (16 * 1024)
+// same limit as NODE_AGENT_MAX_REDIRECTS
+#define MAX_REDIRECTS 4
+
+typedef enum {
+    AGENT_IDLE = 0,
+    AGENT_CONNECTING,
+    AGENT_HELLO,  // hello sent, waiting for the ack
+    AGENT_RUNNING,
+    AGENT_DEAD
+} AgentState;
+
+typedef struct {
+    int fd;
+    int index;
+    int redirects;
+    AgentState state;
+    uint64_t connect_start_us;
+    char rx[RX_CAP];
+    size_t rx_len;
+    char *tx;
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_cap;
+    unsigned long seq;
+} Agent;
+
+typedef enum {
+    MODE_IDLE = 0,
+    MODE_ECHO,
+    MODE_FLOOD
+} Mode;
+
+static struct {
+    const char *host;
+    int port;
+    int agents;
+    Mode mode;
+    size_t payload;
+    int duration_s;
+    int ramp_per_s;
+    const char *prefix;
+} opts = {
+    .host = "127.0.0.1",
+    .port = 9000,
+    .agents = 100,
+    .mode = MODE_ECHO,
+    .payload = 256,
+    .duration_s = 10,
+    .ramp_per_s = 1000,
+    .prefix = "lg",
+};
+
+static struct {
+    unsigned long connected;
+    unsigned long failed;
+    unsigned long disconnects;
+    unsigned long redirects;
+    unsigned long execs;
+    unsigned long pings;
+    unsigned long results_sent;
+    unsigned long long bytes_out;
+} stats;
+
+static uint64_t *handshake_us;
+static size_t handshake_count;
+static char *payload_text;
+static volatile sig_atomic_t stop_requested = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int tx_append(Agent *a, const char *data, size_t len) {
+    if (a->tx_off == a->tx_len) {
+        a->tx_off = 0;
+        a->tx_len = 0;
+    }
+    if (a->tx_len + len > a->tx_cap) {
+        size_t cap = a->tx_cap ? a->tx_cap : 4096;
+        while (cap < a->tx_len + len) cap *= 2;
+        char *n = realloc(a->tx, cap);
+        if (!n) return -1;
+        a->tx = n;
+        a->tx_cap = cap;
+    }
+    memcpy(a->tx + a->tx_len, data, len);
+    a->tx_len += len;
+    return 0;
+}
+
+static void queue_result(Agent *a, const char *id) {
+    size_t cap = opts.payload + 256;
+    char *msg = malloc(cap);
+    if (!msg) return;
+    int n = snprintf(msg, cap,
+                     "{\"type\":\"result\",\"id\":\"%s\",\"exit\":0,\"stdout\":\"%s\",\"stderr\":\"\"}\n",
+                     id, payload_text);
+    if (n > 0 && (size_t)n < cap) {
+        tx_append(a, msg, (size_t)n);
+        stats.results_sent++;
+    }
+    free(msg);
+}
+
+static void agent_close(Agent *a, bool counted) {
+    if (a->fd >= 0) close(a->fd);
+    a->fd = -1;
+    // a connection lost before the ack never came up
+    if (counted) {
+        if (a->state == AGENT_RUNNING) stats.disconnects++;
+        else stats.failed++;
+    }
+    a->state = AGENT_DEAD;
+    a->tx_len = a->tx_off = 0;
+    a->rx_len = 0;
+}
+
+static void agent_start(Agent *a, int index, const struct sockaddr_in *addr) {
+    a->index = index;
+    a->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (a->fd < 0) {
+        stats.failed++;
+        a->state = AGENT_DEAD;
+        return;
+    }
+    int flags = fcntl(a->fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(a->fd, F_SETFL, flags | O_NONBLOCK);
+
+    a->connect_start_us = now_us();
+    if (connect(a->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        stats.failed++;
+        agent_close(a, false);
+        return;
+    }
+
+    char hello[256];
+    int n = snprintf(hello, sizeof(hello),
+                     "{\"type\":\"hello\",\"name\":\"%s-%05d\",\"os\":\"loadgen\",\"address\":\"127.0.0.1\"}\n",
+                     opts.prefix, index);
+    tx_append(a, hello, (size_t)n);
+    a->state = AGENT_CONNECTING;
+}
+
+// Reconnects to the controller named in a redirect, as the agent would.
+static void agent_redirect(Agent *a, const char *line) {
+    char host[64];
+    int port = 0;
+    const char *p = strstr(line, "\"address\":\"");
+    const char *colon = p ? strchr(p + 11, ':') : NULL;
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    if (colon && (size_t)(colon - (p + 11)) < sizeof(host)) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - (p + 11)), p + 11);
+        port = atoi(colon + 1);
+    }
+    stats.redirects++;
+    if (port <= 0 || inet_pton(AF_INET, host, &to.sin_addr) != 1 || ++a->redirects > MAX_REDIRECTS) {
+        agent_close(a, true);
+        return;
+    }
+    to.sin_port = htons((uint16_t)port);
+    if (a->fd >= 0) close(a->fd);
+    a->fd = -1;
+    a->tx_len = a->tx_off = 0;
+    a->rx_len = 0;
+    // the handshake is timed from the first connect
+    uint64_t first_start = a->connect_start_us;
+    agent_start(a, a->index, &to);
+    a->connect_start_us = first_start;
+}
+
+static void agent_handle_line(Agent *a, char *line) {
+    if (a->state == AGENT_HELLO) {
+        if (strstr(line, "\"type\":\"redirect\"")) {
+            agent_redirect(a, line);
+        } else if (strstr(line, "\"type\":\"ack\"") && strstr(line, "\"status\":\"ok\"")) {
+            // the controller took the session: handshake done
+            a->state = AGENT_RUNNING;
+            stats.connected++;
+            handshake_us[handshake_count++] = now_us() - a->connect_start_us;
+        } else {
+            agent_close(a, true);
+        }
+        return;
+    }
+    if (strstr(line, "\"type\":\"exec\"")) {
+        stats.execs++;
+        char id[64] = "unknown";
+        const char *p = strstr(line, "\"id\":\"");
+        if (p) {
+            p += 6;
+            const char *q = strchr(p, '"');
+            if (q && (size_t)(q - p) < sizeof(id)) {
+                memcpy(id, p, (size_t)(q - p));
+                id[q - p] = '\0';
+            }
+        }
+        queue_result(a, id);
+    } else if (strstr(line, "\"type\":\"ping\"")) {
+        stats.pings++;
+        const char *pong = "{\"type\":\"pong\"}\n";
+        tx_append(a, pong, strlen(pong));
+    }
+}
+
+static void agent_on_readable(Agent *a) {
+    while (1) {
+        if (a->rx_len == RX_CAP) a->rx_len = 0;  // oversized line, drop it
+        ssize_t r = recv(a->fd, a->rx + a->rx_len, RX_CAP - a->rx_len, 0);
+        if (r == 0) {
+            agent_close(a, true);
+            return;
+        }
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            agent_close(a, true);
+            return;
+        }
+        a->rx_len += (size_t)r;
+
+        size_t start = 0;
+        for (size_t i = 0; i < a->rx_len; ++i) {
+            if (a->rx[i] == '\n') {
+                a->rx[i] = '\0';
+                agent_handle_line(a, a->rx + start);
+                // a redirect reconnects, a bad ack closes: the rest is stale
+                if (a->state != AGENT_RUNNING) return;
+                start = i + 1;
+            }
+        }
+        memmove(a->rx, a->rx + start, a->rx_len - start);
+        a->rx_len -= start;
+    }
+}
+
+static void agent_on_writable(Agent *a) {
+    if (a->state == AGENT_CONNECTING) {
+        int soerr = 0;
+        socklen_t slen = sizeof(soerr);
+        getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &soerr, &slen);
+        if (soerr != 0) {
+            stats.failed++;
+            agent_close(a, false);
+            return;
+        }
+    }
+
+    while (a->tx_off < a->tx_len) {
+        ssize_t w = send(a->fd, a->tx + a->tx_off, a->tx_len - a->tx_off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            agent_close(a, true);
+            return;
+        }
+        a->tx_off += (size_t)w;
+        stats.bytes_out += (unsigned long long)w;
+    }
+
+    // hello fully written; the handshake ends with the controller's ack
+    if (a->state == AGENT_CONNECTING) a->state = AGENT_HELLO;
+
+    if (a->state == AGENT_RUNNING && opts.mode == MODE_FLOOD) {
+        char id[64];
+        snprintf(id, sizeof(id), "flood_%lu", a->seq++);
+        queue_result(a, id);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_summary(double elapsed_s) {
+    printf("\n=== loadgen summary ===\n");
+    printf("agents=%d connected=%lu failed=%lu disconnects=%lu redirects=%lu\n",
+           opts.agents, stats.connected, stats.failed, stats.disconnects, stats.redirects);
+    printf("execs=%lu pings=%lu results_sent=%lu\n", stats.execs, stats.pings, stats.results_sent);
+    printf("bytes_out=%llu (%.2f MB/s), results/s=%.0f\n",
+           stats.bytes_out, (double)stats.bytes_out / elapsed_s / 1e6,
+           (double)stats.results_sent / elapsed_s);
+    if (handshake_count > 0) {
+        qsort(handshake_us, handshake_count, sizeof(uint64_t), cmp_u64);
+        printf("handshake_ms p50=%.2f p99=%.2f max=%.2f\n",
+               (double)handshake_us[handshake_count / 2] / 1000.0,
+               (double)handshake_us[(handshake_count * 99) / 100] / 1000.0,
+               (double)handshake_us[handshake_count - 1] / 1000.0);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host ADDR         controller (or proxy) address (default 127.0.0.1)\n"
+            "  --port N            controller (or proxy) port (default 9000)\n"
+            "  --agents N          number of simulated agents (default 100)\n"
+            "  --mode M            idle | echo | flood (default echo)\n"
+            "  --payload BYTES     stdout size of each result (default 256)\n"
+            "  --duration S        run time in seconds, 0 = until SIGINT (default 10)\n"
+            "  --ramp N            new connections per second (default 1000)\n"
+            "  --prefix NAME       node name prefix (default lg)\n",
+            argv0);
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0) return -1;
+        if (!v) return -1;
+        if (strcmp(a, "--host") == 0) opts.host = v;
+        else if (strcmp(a, "--port") == 0) opts.port = atoi(v);
+        else if (strcmp(a, "--agents") == 0) opts.agents = atoi(v);
+        else if (strcmp(a, "--payload") == 0) opts.payload = (size_t)atol(v);
+        else if (strcmp(a, "--duration") == 0) opts.duration_s = atoi(v);
+        else if (strcmp(a, "--ramp") == 0) opts.ramp_per_s = atoi(v);
+        else if (strcmp(a, "--prefix") == 0) opts.prefix = v;
+        else if (strcmp(a, "--mode") == 0) {
+            if (strcmp(v, "idle") == 0) opts.mode = MODE_IDLE;
+            else if (strcmp(v, "echo") == 0) opts.mode = MODE_ECHO;
+            else if (strcmp(v, "flood") == 0) opts.mode = MODE_FLOOD;
+            else return -1;
+        } else {
+            fprintf(stderr, "loadgen: unknown option %s\n", a);
+            return -1;
+        }
+        i++;
+    }
+    if (opts.agents <= 0 || opts.port <= 0 || opts.ramp_per_s <= 0) return -1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    raise_fd_limit();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)opts.port);
+    if (inet_pton(AF_INET, opts.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: invalid host %s\n", opts.host);
+        return EXIT_FAILURE;
+    }
+
+    // payload is pre-escaped: 'x' runs broken by literal \n escapes, so the
+    // controller exercises both the scan and the unescape paths
+    payload_text = malloc(opts.payload + 1);
+    Agent *agents = calloc((size_t)opts.agents, sizeof(Agent));
+    struct pollfd *pfds = calloc((size_t)opts.agents, sizeof(struct pollfd));
+    int *pfd_agent = calloc((size_t)opts.agents, sizeof(int));
+    handshake_us = calloc((size_t)opts.agents, sizeof(uint64_t));
+    if (!payload_text || !agents || !pfds || !pfd_agent || !handshake_us) {
+        fprintf(stderr, "loadgen: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < opts.payload; ++i) {
+        payload_text[i] = (i % 64 == 62) ? '\\' : (i % 64 == 63) ? 'n' : 'x';
+    }
+    if (opts.payload > 0 && payload_text[opts.payload - 1] == '\\') payload_text[opts.payload - 1] = 'x';
+    payload_text[opts.payload] = '\0';
+    for (int i = 0; i < opts.agents; ++i) agents[i].fd = -1;
+
+    uint64_t start = now_us();
+    uint64_t last_report = start;
+    unsigned long last_results = 0;
+    int started = 0;
+
+    while (!stop_requested) {
+        uint64_t now = now_us();
+        double elapsed = (double)(now - start) / 1e6;
+        if (opts.duration_s > 0 && elapsed >= opts.duration_s) break;
+
+        int target = (int)(elapsed * opts.ramp_per_s) + 1;
+        if (target > opts.agents) target = opts.agents;
+        while (started < target) {
+            agent_start(&agents[started], started, &addr);
+            started++;
+        }
+
+        int nfds = 0;
+        for (int i = 0; i < started; ++i) {
+            Agent *a = &agents[i];
+            if (a->state == AGENT_DEAD || a->fd < 0) continue;
+            pfds[nfds].fd = a->fd;
+            pfds[nfds].events = POLLIN;
+            if (a->state == AGENT_CONNECTING || a->tx_off < a->tx_len ||
+                (a->state == AGENT_RUNNING && opts.mode == MODE_FLOOD)) {
+                pfds[nfds].events |= POLLOUT;
+            }
+            pfds[nfds].revents = 0;
+            pfd_agent[nfds] = i;
+            nfds++;
+        }
+
+        int rc = poll(pfds, (nfds_t)nfds, 100);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int p = 0; p < nfds; ++p) {
+            Agent *a = &agents[pfd_agent[p]];
+            if (pfds[p].revents & POLLOUT) agent_on_writable(a);
+            if (a->state == AGENT_DEAD) continue;
+            if (pfds[p].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if ((a->state == AGENT_CONNECTING || a->state == AGENT_HELLO) &&
+                    (pfds[p].revents & (POLLHUP | POLLERR)) && !(pfds[p].revents & POLLIN)) {
+                    stats.failed++;
+                    agent_close(a, false);
+                    continue;
+                }
+                agent_on_readable(a);
+            }
+        }
+
+        if (now - last_report >= 1000000ULL) {
+            printf("[%6.1fs] connected=%lu failed=%lu results/s=%lu MB_out=%.1f\n",
+                   elapsed, stats.connected, stats.failed,
+                   stats.results_sent - last_results, (double)stats.bytes_out / 1e6);
+            fflush(stdout);
+            last_results = stats.results_sent;
+            last_report = now;
+        }
+    }
+
+    print_summary((double)(now_us() - start) / 1e6);
+
+    for (int i = 0; i < opts.agents; ++i) {
+        if (agents[i].fd >= 0) close(agents[i].fd);
+        free(agents[i].tx);
+    }
+    free(agents);
+    free(pfds);
+    free(pfd_agent);
+    free(handshake_us);
+    free(payload_text);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,523 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// netem_proxy: a local TCP impairment proxy. Every accepted connection is
+// paired with a fresh connection to the upstream, and bytes are forwarded in
+// both directions through a delay queue that applies latency, jitter, a
+// bandwidth cap, stalls (how packet loss looks to a TCP application) and
+// random connection resets. Ordering is preserved within a direction, just
+// like a real TCP stream.
+
+#define MAX_LINKS 16384
+#define READ_CHUNK (16 * 1024)
+#define MAX_QUEUED (4 * 1024 * 1024)
+
+typedef struct Chunk {
+    struct Chunk *next;
+    uint64_t due_ms;
+    size_t len;
+    size_t off;
+    char data[];
+} Chunk;
+
+typedef struct {
+    int from_fd;
+    int to_fd;
+    Chunk *head;
+    Chunk *tail;
+    size_t queued;
+    uint64_t last_due;
+    double tokens;
+    uint64_t last_refill;
+    bool eof;
+    bool shut;
+} Pipe;
+
+typedef struct {
+    int client_fd;
+    int upstream_fd;
+    bool connecting;
+    bool used;
+    Pipe up;    // client -> upstream
+    Pipe down;  // upstream -> client
+} Link;
+
+typedef struct {
+    const char *listen_spec;
+    const char *upstream_spec;
+    int latency_ms;
+    int jitter_ms;
+    long bandwidth_kbps;
+    double stall_prob;
+    int stall_ms;
+    double reset_prob;
+    unsigned int seed;
+} ProxyOptions;
+
+static ProxyOptions opts = {
+    .listen_spec = NULL,
+    .upstream_spec = NULL,
+    .latency_ms = 0,
+    .jitter_ms = 0,
+    .bandwidth_kbps = 0,
+    .stall_prob = 0.0,
+    .stall_ms = 200,
+    .reset_prob = 0.0,
+    .seed = 0,
+};
+
+static Link links[MAX_LINKS];
+static struct sockaddr_storage upstream_addr;
+static socklen_t upstream_addrlen;
+static volatile sig_atomic_t stop_requested = 0;
+
+static struct {
+    unsigned long accepted;
+    unsigned long closed;
+    unsigned long resets;
+    unsigned long stalls;
+    unsigned long long bytes_up;
+    unsigned long long bytes_down;
+} stats;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+static double rand_unit(void) {
+    return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int resolve(const char *spec, int passive, struct sockaddr_storage *out, socklen_t *outlen) {
+    char host[256] = {0};
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    if (colon) {
+        size_t hlen = (size_t)(colon - spec);
+        if (hlen >= sizeof(host)) return -1;
+        memcpy(host, spec, hlen);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *res = NULL;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (rc != 0 || !res) {
+        fprintf(stderr, "netem_proxy: cannot resolve %s: %s\n", spec, gai_strerror(rc));
+        return -1;
+    }
+    memcpy(out, res->ai_addr, res->ai_addrlen);
+    *outlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int open_listener(const char *spec) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = 0;
+    if (resolve(spec, 1, &addr, &addrlen) < 0) return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+static void pipe_init(Pipe *p, int from_fd, int to_fd) {
+    memset(p, 0, sizeof(*p));
+    p->from_fd = from_fd;
+    p->to_fd = to_fd;
+    p->last_refill = now_ms();
+    p->tokens = 0.0;
+}
+
+static void pipe_free(Pipe *p) {
+    Chunk *c = p->head;
+    while (c) {
+        Chunk *n = c->next;
+        free(c);
+        c = n;
+    }
+    p->head = p->tail = NULL;
+    p->queued = 0;
+}
+
+static void link_close(Link *l, bool reset) {
+    if (!l->used) return;
+    if (reset) {
+        // SO_LINGER with a zero timeout turns close() into an RST
+        struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(l->client_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        setsockopt(l->upstream_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        stats.resets++;
+    }
+    close(l->client_fd);
+    close(l->upstream_fd);
+    pipe_free(&l->up);
+    pipe_free(&l->down);
+    l->used = false;
+    stats.closed++;
+}
+
+static Link *link_alloc(void) {
+    for (int i = 0; i < MAX_LINKS; ++i) {
+        if (!links[i].used) return &links[i];
+    }
+    return NULL;
+}
+
+static void accept_links(int listen_fd) {
+    while (1) {
+        int cfd = accept(listen_fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            return;
+        }
+        Link *l = link_alloc();
+        if (!l) {
+            fprintf(stderr, "netem_proxy: link table full, dropping connection\n");
+            close(cfd);
+            continue;
+        }
+        int ufd = socket(AF_INET, SOCK_STREAM, 0);
+        if (ufd < 0) {
+            perror("socket");
+            close(cfd);
+            continue;
+        }
+        set_nonblocking(cfd);
+        set_nonblocking(ufd);
+        if (connect(ufd, (struct sockaddr *)&upstream_addr, upstream_addrlen) < 0 && errno != EINPROGRESS) {
+            perror("connect upstream");
+            close(cfd);
+            close(ufd);
+            continue;
+        }
+        memset(l, 0, sizeof(*l));
+        l->used = true;
+        l->connecting = true;
+        l->client_fd = cfd;
+        l->upstream_fd = ufd;
+        pipe_init(&l->up, cfd, ufd);
+        pipe_init(&l->down, ufd, cfd);
+        stats.accepted++;
+    }
+}
+
+// Reads whatever is available on the source side and queues it with its
+// delivery deadline. Returns -1 when the link should be torn down.
+static int pipe_read(Link *l, Pipe *p, unsigned long long *counter) {
+    char buf[READ_CHUNK];
+    while (p->queued < MAX_QUEUED) {
+        ssize_t r = recv(p->from_fd, buf, sizeof(buf), 0);
+        if (r <= 0) {
+            if (r == 0) {
+                p->eof = true;
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+            return -1;
+        }
+
+        if (opts.reset_prob > 0.0 && rand_unit() < opts.reset_prob) {
+            link_close(l, true);
+            return -1;
+        }
+        // sized to what was read: many small lines queue up behind a delay
+        Chunk *c = malloc(sizeof(Chunk) + (size_t)r);
+        if (!c) return -1;
+        memcpy(c->data, buf, (size_t)r);
+
+        uint64_t now = now_ms();
+        int64_t delay = opts.latency_ms;
+        if (opts.jitter_ms > 0) {
+            delay += (int64_t)(rand_unit() * (2.0 * opts.jitter_ms + 1.0)) - opts.jitter_ms;
+            if (delay < 0) delay = 0;
+        }
+        if (opts.stall_prob > 0.0 && rand_unit() < opts.stall_prob) {
+            delay += opts.stall_ms;
+            stats.stalls++;
+        }
+        uint64_t due = now + (uint64_t)delay;
+        if (due < p->last_due) due = p->last_due;
+        p->last_due = due;
+
+        c->next = NULL;
+        c->due_ms = due;
+        c->len = (size_t)r;
+        c->off = 0;
+        if (p->tail) p->tail->next = c;
+        else p->head = c;
+        p->tail = c;
+        p->queued += (size_t)r;
+        *counter += (unsigned long long)r;
+    }
+    return 0;
+}
+
+static void pipe_refill(Pipe *p, uint64_t now) {
+    if (opts.bandwidth_kbps <= 0) return;
+    double rate = (double)opts.bandwidth_kbps * 1000.0 / 8.0 / 1000.0;  // bytes per ms
+    double burst = rate * 20.0;
+    if (burst < READ_CHUNK) burst = READ_CHUNK;
+    p->tokens += rate * (double)(now - p->last_refill);
+    if (p->tokens > burst) p->tokens = burst;
+    p->last_refill = now;
+}
+
+// Writes every chunk that is due and fits in the token bucket. Returns the
+// number of milliseconds until the pipe next has something to do (or -1).
+static int pipe_write(Pipe *p, bool *want_out, int *err) {
+    uint64_t now = now_ms();
+    pipe_refill(p, now);
+    *want_out = false;
+
+    while (p->head) {
+        Chunk *c = p->head;
+        if (c->due_ms > now) return (int)(c->due_ms - now);
+
+        size_t n = c->len - c->off;
+        if (opts.bandwidth_kbps > 0) {
+            if (p->tokens < 1.0) return 1;
+            if ((double)n > p->tokens) n = (size_t)p->tokens;
+        }
+        ssize_t w = send(p->to_fd, c->data + c->off, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                *want_out = true;
+                return -1;
+            }
+            if (errno == EINTR) continue;
+            *err = 1;
+            return -1;
+        }
+        if (opts.bandwidth_kbps > 0) p->tokens -= (double)w;
+        c->off += (size_t)w;
+        p->queued -= (size_t)w;
+        if (c->off == c->len) {
+            p->head = c->next;
+            if (!p->head) p->tail = NULL;
+            free(c);
+        }
+    }
+
+    if (p->eof && !p->shut) {
+        shutdown(p->to_fd, SHUT_WR);
+        p->shut = true;
+    }
+    return -1;
+}
+
+static int min_timeout(int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s --listen [host:]port --upstream host:port [options]\n"
+            "  --latency MS        one-way delay added in each direction\n"
+            "  --jitter MS         uniform +/- jitter around the latency\n"
+            "  --bandwidth KBPS    per-direction rate cap in kilobits/s\n"
+            "  --stall-prob P      probability a chunk is held back (loss)\n"
+            "  --stall-ms MS       how long a stalled chunk is held (default 200)\n"
+            "  --reset-prob P      probability a chunk resets the connection\n"
+            "  --seed N            random seed (default: time based)\n",
+            argv0);
+}
+
+static int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0) return -1;
+        if (!v) {
+            fprintf(stderr, "netem_proxy: missing value for %s\n", a);
+            return -1;
+        }
+        if (strcmp(a, "--listen") == 0) opts.listen_spec = v;
+        else if (strcmp(a, "--upstream") == 0) opts.upstream_spec = v;
+        else if (strcmp(a, "--latency") == 0) opts.latency_ms = atoi(v);
+        else if (strcmp(a, "--jitter") == 0) opts.jitter_ms = atoi(v);
+        else if (strcmp(a, "--bandwidth") == 0) opts.bandwidth_kbps = atol(v);
+        else if (strcmp(a, "--stall-prob") == 0) opts.stall_prob = atof(v);
+        else if (strcmp(a, "--stall-ms") == 0) opts.stall_ms = atoi(v);
+        else if (strcmp(a, "--reset-prob") == 0) opts.reset_prob = atof(v);
+        else if (strcmp(a, "--seed") == 0) opts.seed = (unsigned int)strtoul(v, NULL, 10);
+        else {
+            fprintf(stderr, "netem_proxy: unknown option %s\n", a);
+            return -1;
+        }
+        i++;
+    }
+    if (!opts.listen_spec || !opts.upstream_spec) return -1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(opts.seed ? opts.seed : (unsigned int)time(NULL));
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (resolve(opts.upstream_spec, 0, &upstream_addr, &upstream_addrlen) < 0) return EXIT_FAILURE;
+    int listen_fd = open_listener(opts.listen_spec);
+    if (listen_fd < 0) return EXIT_FAILURE;
+
+    fprintf(stderr, "netem_proxy: %s -> %s latency=%dms jitter=%dms bw=%ldkbps stall=%.3f/%dms reset=%.4f\n",
+            opts.listen_spec, opts.upstream_spec, opts.latency_ms, opts.jitter_ms,
+            opts.bandwidth_kbps, opts.stall_prob, opts.stall_ms, opts.reset_prob);
+
+    struct pollfd *pfds = calloc(1 + 2 * MAX_LINKS, sizeof(struct pollfd));
+    int *pfd_link = calloc(1 + 2 * MAX_LINKS, sizeof(int));
+    if (!pfds || !pfd_link) {
+        fprintf(stderr, "netem_proxy: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    while (!stop_requested) {
+        int nfds = 0;
+        int timeout = -1;
+
+        pfds[nfds].fd = listen_fd;
+        pfds[nfds].events = POLLIN;
+        pfd_link[nfds] = -1;
+        nfds++;
+
+        for (int i = 0; i < MAX_LINKS; ++i) {
+            Link *l = &links[i];
+            if (!l->used) continue;
+
+            short cev = 0;
+            short uev = 0;
+            if (l->connecting) {
+                uev |= POLLOUT;
+            } else {
+                bool up_out = false;
+                bool down_out = false;
+                int err = 0;
+                timeout = min_timeout(timeout, pipe_write(&l->up, &up_out, &err));
+                timeout = min_timeout(timeout, pipe_write(&l->down, &down_out, &err));
+                if (err) {
+                    link_close(l, false);
+                    continue;
+                }
+                if (l->up.shut && l->down.shut) {
+                    link_close(l, false);
+                    continue;
+                }
+                if (!l->up.eof && l->up.queued < MAX_QUEUED) cev |= POLLIN;
+                if (!l->down.eof && l->down.queued < MAX_QUEUED) uev |= POLLIN;
+                if (up_out) uev |= POLLOUT;
+                if (down_out) cev |= POLLOUT;
+            }
+
+            pfds[nfds].fd = l->client_fd;
+            pfds[nfds].events = cev;
+            pfd_link[nfds] = i;
+            nfds++;
+            pfds[nfds].fd = l->upstream_fd;
+            pfds[nfds].events = uev;
+            pfd_link[nfds] = i;
+            nfds++;
+        }
+
+        int rc = poll(pfds, (nfds_t)nfds, timeout);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) accept_links(listen_fd);
+
+        for (int p = 1; p < nfds; ++p) {
+            if (!pfds[p].revents) continue;
+            Link *l = &links[pfd_link[p]];
+            if (!l->used) continue;
+            int fd = pfds[p].fd;
+
+            if (fd == l->upstream_fd && l->connecting) {
+                int soerr = 0;
+                socklen_t slen = sizeof(soerr);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &slen);
+                if (soerr != 0) {
+                    fprintf(stderr, "netem_proxy: upstream connect failed: %s\n", strerror(soerr));
+                    link_close(l, true);
+                    continue;
+                }
+                l->connecting = false;
+                continue;
+            }
+
+            if (pfds[p].revents & (POLLIN | POLLHUP | POLLERR)) {
+                Pipe *src = (fd == l->client_fd) ? &l->up : &l->down;
+                unsigned long long *counter = (fd == l->client_fd) ? &stats.bytes_up : &stats.bytes_down;
+                if (!src->eof && pipe_read(l, src, counter) < 0) {
+                    link_close(l, false);
+                    continue;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_LINKS; ++i) link_close(&links[i], false);
+    close(listen_fd);
+    free(pfds);
+    free(pfd_link);
+
+    fprintf(stderr, "netem_proxy: accepted=%lu closed=%lu resets=%lu stalls=%lu up=%llu down=%llu bytes\n",
+            stats.accepted, stats.closed, stats.resets, stats.stalls, stats.bytes_up, stats.bytes_down);
+    return EXIT_SUCCESS;
+}